@@ -0,0 +1,415 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fakefuse.h"
+
+/* the size of the buffer file descriptors are copied through */
+#define COPY_BUF_SIZE (64 * 1024)
+
+/* the number of seconds to wait for a reply */
+#define REPLY_TIMEOUT 10
+
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reply_cond = PTHREAD_COND_INITIALIZER;
+
+void fake_req_init(struct fuse_req *req,
+                   void *userdata,
+                   char *buf,
+                   const size_t len)
+{
+	/* luufs serves only requests made by root */
+	req->userdata = userdata;
+	req->ctx.uid = 0;
+	req->ctx.gid = 0;
+	req->ctx.pid = getpid();
+	req->ctx.umask = 022;
+	req->reply.type = FAKE_NONE;
+	req->buf = buf;
+	req->len = len;
+	req->replies = 0;
+}
+
+unsigned int fake_req_wait(struct fuse_req *req)
+{
+	struct timespec deadline;
+	unsigned int replies;
+
+	(void) clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += REPLY_TIMEOUT;
+
+	(void) pthread_mutex_lock(&reply_lock);
+	while (0 == req->replies) {
+		if (0 != pthread_cond_timedwait(&reply_cond, &reply_lock, &deadline))
+			break;
+	}
+	replies = req->replies;
+	(void) pthread_mutex_unlock(&reply_lock);
+
+	return replies;
+}
+
+/* the reply is recorded before it's counted, so it's complete once seen */
+static int replied(fuse_req_t req)
+{
+	(void) pthread_mutex_lock(&reply_lock);
+	++req->replies;
+	(void) pthread_cond_broadcast(&reply_cond);
+	(void) pthread_mutex_unlock(&reply_lock);
+
+	return 0;
+}
+
+size_t fake_dirent_next(const char *buf,
+                        const size_t len,
+                        const int plus,
+                        const struct fake_dirent **ent,
+                        fuse_ino_t *nodeid)
+{
+	size_t head;
+	size_t size;
+
+	head = (1 == plus) ? FAKE_DIRENT_PLUS_SIZE(0) - FAKE_DIRENT_SIZE(0) : 0;
+	if (head + offsetof(struct fake_dirent, name) > len)
+		return 0;
+
+	*ent = (const struct fake_dirent *) (buf + head);
+	size = head + FAKE_DIRENT_SIZE((*ent)->namelen);
+	if (size > len)
+		return 0;
+
+	*nodeid = 0;
+	if (1 == plus)
+		memcpy(nodeid, buf, sizeof(*nodeid));
+
+	return size;
+}
+
+void *fuse_req_userdata(fuse_req_t req)
+{
+	return req->userdata;
+}
+
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req)
+{
+	return &req->ctx;
+}
+
+int fuse_reply_err(fuse_req_t req, int err)
+{
+	req->reply.type = FAKE_ERR;
+	req->reply.err = err;
+	return replied(req);
+}
+
+void fuse_reply_none(fuse_req_t req)
+{
+	req->reply.type = FAKE_NONE;
+	(void) replied(req);
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+	req->reply.type = FAKE_ENTRY;
+	req->reply.entry = *e;
+	return replied(req);
+}
+
+int fuse_reply_create(fuse_req_t req,
+                      const struct fuse_entry_param *e,
+                      const struct fuse_file_info *fi)
+{
+	req->reply.type = FAKE_CREATE;
+	req->reply.entry = *e;
+	req->reply.fi = *fi;
+	return replied(req);
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double timeout)
+{
+	req->reply.type = FAKE_ATTR;
+	req->reply.attr = *attr;
+	return replied(req);
+}
+
+int fuse_reply_readlink(fuse_req_t req, const char *link)
+{
+	size_t len;
+
+	len = strlen(link);
+	req->reply.type = FAKE_READLINK;
+	req->reply.size = len;
+	if (len < req->len)
+		memcpy(req->buf, link, len + 1);
+
+	return replied(req);
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+	req->reply.type = FAKE_OPEN;
+	req->reply.fi = *fi;
+	return replied(req);
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count)
+{
+	req->reply.type = FAKE_WRITE;
+	req->reply.size = count;
+	return replied(req);
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+	req->reply.type = FAKE_BUF;
+	req->reply.size = size;
+	if (0 != size)
+		memcpy(req->buf, buf, (size < req->len) ? size : req->len);
+
+	return replied(req);
+}
+
+int fuse_reply_data(fuse_req_t req,
+                    struct fuse_bufvec *bufv,
+                    enum fuse_buf_copy_flags flags)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(req->len);
+	ssize_t out;
+
+	dst.buf[0].mem = req->buf;
+	out = fuse_buf_copy(&dst, bufv, flags);
+	if (0 > out)
+		return fuse_reply_err(req, (int) -out);
+
+	req->reply.type = FAKE_BUF;
+	req->reply.size = (size_t) out;
+	return replied(req);
+}
+
+int fuse_reply_lseek(fuse_req_t req, off_t off)
+{
+	req->reply.type = FAKE_LSEEK;
+	req->reply.off = off;
+	return replied(req);
+}
+
+static size_t add_direntry(char *buf,
+                           const size_t bufsize,
+                           const size_t head,
+                           const fuse_ino_t nodeid,
+                           const char *name,
+                           const struct stat *stbuf,
+                           const off_t off)
+{
+	struct fake_dirent *ent;
+	size_t namelen;
+	size_t size;
+
+	namelen = strlen(name);
+	size = head + FAKE_DIRENT_SIZE(namelen);
+	if ((NULL == buf) || (size > bufsize))
+		return size;
+
+	memset(buf, 0, size);
+	if (0 != head)
+		memcpy(buf, &nodeid, sizeof(nodeid));
+
+	ent = (struct fake_dirent *) (buf + head);
+	ent->ino = (uint64_t) stbuf->st_ino;
+	ent->off = (int64_t) off;
+	ent->namelen = (uint32_t) namelen;
+	ent->type = (uint32_t) (stbuf->st_mode & S_IFMT) >> 12;
+	memcpy(ent->name, name, namelen);
+
+	return size;
+}
+
+size_t fuse_add_direntry(fuse_req_t req,
+                         char *buf,
+                         size_t bufsize,
+                         const char *name,
+                         const struct stat *stbuf,
+                         off_t off)
+{
+	return add_direntry(buf, bufsize, 0, 0, name, stbuf, off);
+}
+
+size_t fuse_add_direntry_plus(fuse_req_t req,
+                              char *buf,
+                              size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e,
+                              off_t off)
+{
+	return add_direntry(buf,
+	                    bufsize,
+	                    FAKE_DIRENT_PLUS_SIZE(0) - FAKE_DIRENT_SIZE(0),
+	                    e->ino,
+	                    name,
+	                    &e->attr,
+	                    off);
+}
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv)
+{
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; bufv->count > i; ++i)
+		size += bufv->buf[i].size;
+
+	return size;
+}
+
+static ssize_t buf_read(const struct fuse_buf *buf,
+                        const size_t off,
+                        char *dest,
+                        const size_t len)
+{
+	if (0 == (FUSE_BUF_IS_FD & buf->flags)) {
+		memcpy(dest, (const char *) buf->mem + off, len);
+		return (ssize_t) len;
+	}
+
+	if (0 != (FUSE_BUF_FD_SEEK & buf->flags))
+		return pread(buf->fd, dest, len, buf->pos + (off_t) off);
+
+	return read(buf->fd, dest, len);
+}
+
+static ssize_t buf_write(const struct fuse_buf *buf,
+                         const size_t off,
+                         const char *src,
+                         const size_t len)
+{
+	if (0 == (FUSE_BUF_IS_FD & buf->flags)) {
+		memcpy((char *) buf->mem + off, src, len);
+		return (ssize_t) len;
+	}
+
+	if (0 != (FUSE_BUF_FD_SEEK & buf->flags))
+		return pwrite(buf->fd, src, len, buf->pos + (off_t) off);
+
+	return write(buf->fd, src, len);
+}
+
+/* only single-buffer vectors are passed by luufs; copies between file
+ * descriptors go through a bounce buffer instead of a pipe */
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst,
+                      struct fuse_bufvec *src,
+                      enum fuse_buf_copy_flags flags)
+{
+	char bounce[COPY_BUF_SIZE];
+	const struct fuse_buf *in;
+	const struct fuse_buf *out;
+	size_t len;
+	size_t done = 0;
+	size_t chunk;
+	ssize_t got;
+	ssize_t put;
+
+	if ((src->count <= src->idx) || (dst->count <= dst->idx))
+		return 0;
+
+	in = &src->buf[src->idx];
+	out = &dst->buf[dst->idx];
+	len = in->size - src->off;
+	if (out->size - dst->off < len)
+		len = out->size - dst->off;
+
+	if (0 == (FUSE_BUF_IS_FD & out->flags)) {
+		got = buf_read(in, src->off, (char *) out->mem + dst->off, len);
+		if (-1 == got)
+			return -errno;
+
+		src->off += (size_t) got;
+		dst->off += (size_t) got;
+		return got;
+	}
+
+	while (len > done) {
+		chunk = len - done;
+		if (sizeof(bounce) < chunk)
+			chunk = sizeof(bounce);
+
+		got = buf_read(in, src->off + done, bounce, chunk);
+		if (-1 == got)
+			return (0 == done) ? -errno : (ssize_t) done;
+		if (0 == got)
+			break;
+
+		put = buf_write(out, dst->off + done, bounce, (size_t) got);
+		if (-1 == put)
+			return (0 == done) ? -errno : (ssize_t) done;
+
+		done += (size_t) put;
+		if (put < got)
+			break;
+	}
+
+	src->off += done;
+	dst->off += done;
+	return (ssize_t) done;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_session *se,
+                                     fuse_ino_t ino,
+                                     off_t off,
+                                     off_t len)
+{
+	return 0;
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_session *se,
+                                     fuse_ino_t parent,
+                                     const char *name,
+                                     size_t namelen)
+{
+	return 0;
+}
+
+void fuse_apply_conn_info_opts(struct fuse_conn_info_opts *opts,
+                               struct fuse_conn_info *conn)
+{
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+
+int fuse_passthrough_open(fuse_req_t req, int fd)
+{
+	return 0;
+}
+
+int fuse_passthrough_close(fuse_req_t req, int backing_id)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _FAKEFUSE_H_INCLUDED
+#	define _FAKEFUSE_H_INCLUDED
+
+#	include <stdint.h>
+#	include <stddef.h>
+
+#	include "driver.h"
+
+/* a stand-in for the parts of libfuse the handlers call: requests carry the
+ * credentials of the caller and the last reply is recorded in them */
+
+enum fake_reply_type {
+	FAKE_NONE,
+	FAKE_ERR,
+	FAKE_ENTRY,
+	FAKE_CREATE,
+	FAKE_ATTR,
+	FAKE_OPEN,
+	FAKE_BUF,
+	FAKE_WRITE,
+	FAKE_READLINK,
+	FAKE_LSEEK
+};
+
+struct fake_reply {
+	enum fake_reply_type type;
+	int err;
+	struct fuse_entry_param entry;
+	struct stat attr;
+	struct fuse_file_info fi;
+	size_t size;
+	off_t off;
+};
+
+/* buffers, file data and link targets are copied to buf; replies counts the
+ * replies, which may be sent by another thread */
+struct fuse_req {
+	void *userdata;
+	struct fuse_ctx ctx;
+	struct fake_reply reply;
+	char *buf;
+	size_t len;
+	unsigned int replies;
+};
+
+/* the layout of entries added by fuse_add_direntry() */
+struct fake_dirent {
+	uint64_t ino;
+	int64_t off;
+	uint32_t namelen;
+	uint32_t type;
+	char name[];
+};
+
+#	define FAKE_DIRENT_SIZE(namelen) \
+	((offsetof(struct fake_dirent, name) + (namelen) + 7) & ~((size_t) 7))
+
+/* readdirplus entries are preceded by the node ID and room for attributes,
+ * like fuse_entry_out */
+#	define FAKE_DIRENT_PLUS_SIZE(namelen) (128 + FAKE_DIRENT_SIZE(namelen))
+
+void fake_req_init(struct fuse_req *req,
+                   void *userdata,
+                   char *buf,
+                   const size_t len);
+
+/* waits up to a few seconds for a reply to a request; returns the number of
+ * replies */
+unsigned int fake_req_wait(struct fuse_req *req);
+
+/* returns the size of the next entry in a readdir reply, or 0 at its end */
+size_t fake_dirent_next(const char *buf,
+                        const size_t len,
+                        const int plus,
+                        const struct fake_dirent **ent,
+                        fuse_ino_t *nodeid);
+
+#endif
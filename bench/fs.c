@@ -0,0 +1,908 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+
+/* a benchmark of a mounted union: it creates synthetic read-only and
+ * writeable trees plus a plain directory with their merged contents, mounts
+ * luufs and a bind mount of the plain directory and runs each workload
+ * against both, at each thread count; results are written as tab-separated
+ * values, one line per target, workload and thread count */
+
+#define MAX_THREADS 64
+
+/* the size of sequential I/O requests */
+#define SEQ_SIZE (1024 * 1024)
+
+/* the size of random I/O requests */
+#define RAND_SIZE 4096
+
+struct bench_opts {
+	unsigned int width;
+	unsigned int depth;
+	unsigned int overlap;
+	size_t file_size;
+	size_t data_size;
+	unsigned long ops;
+	unsigned int threads[MAX_THREADS];
+	unsigned int nthreads;
+	const char *luufs;
+	const char *luufs_opts;
+	const char *out;
+};
+
+/* the relative paths of all files and directories in the union */
+struct tree {
+	char **files;
+	size_t nfiles;
+	size_t files_size;
+	char **dirs;
+	size_t ndirs;
+	size_t dirs_size;
+};
+
+struct job;
+
+struct worker {
+	pthread_t thread;
+	struct job *job;
+	char *buf;
+	uint64_t *lat;
+	uint64_t bytes;
+	unsigned int id;
+	unsigned int seed;
+	int fd;
+	int ret;
+};
+
+struct workload {
+	const char *name;
+	int (*setup)(struct worker *);
+	ssize_t (*op)(struct worker *, const unsigned long);
+	void (*teardown)(struct worker *);
+	size_t size;
+};
+
+struct job {
+	const struct workload *workload;
+	const struct bench_opts *opts;
+	const struct tree *tree;
+	const char *root;
+	unsigned long ops;
+	pthread_barrier_t barrier;
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+static int tree_add(char ***list, size_t *len, size_t *size, const char *path)
+{
+	char **nlist;
+	size_t nsize;
+
+	if (*len == *size) {
+		nsize = (0 == *size) ? 256 : *size * 2;
+		nlist = realloc(*list, sizeof(**list) * nsize);
+		if (NULL == nlist)
+			return -1;
+
+		*list = nlist;
+		*size = nsize;
+	}
+
+	(*list)[*len] = strdup(path);
+	if (NULL == (*list)[*len])
+		return -1;
+
+	++*len;
+	return 0;
+}
+
+static void tree_free(struct tree *tree)
+{
+	size_t i;
+
+	for (i = 0; tree->nfiles > i; ++i)
+		free(tree->files[i]);
+	for (i = 0; tree->ndirs > i; ++i)
+		free(tree->dirs[i]);
+
+	free(tree->files);
+	free(tree->dirs);
+}
+
+static int write_file(const char *path, const char *buf, const size_t size)
+{
+	size_t done;
+	ssize_t out;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (-1 == fd)
+		return -1;
+
+	for (done = 0; size > done; done += (size_t) out) {
+		out = write(fd, &buf[done], size - done);
+		if (-1 == out) {
+			(void) close(fd);
+			return -1;
+		}
+	}
+
+	return close(fd);
+}
+
+/* creates a file under a layer and its copy under the plain directory */
+static int make_file(const char *base,
+                     const char *layer,
+                     const char *rel,
+                     const char *buf,
+                     const size_t size)
+{
+	char path[PATH_MAX];
+
+	(void) snprintf(path, sizeof(path), "%s/%s/%s", base, layer, rel);
+	if (-1 == write_file(path, buf, size))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/plain/%s", base, rel);
+	return write_file(path, buf, size);
+}
+
+/* creates a directory and its parents */
+static int make_dir(const char *base, const char *layer, const char *rel)
+{
+	char path[PATH_MAX];
+	char *pos;
+	size_t len;
+
+	len = (size_t) snprintf(path, sizeof(path), "%s/%s/", base, layer);
+	(void) snprintf(&path[len], sizeof(path) - len, "%s", rel);
+
+	for (pos = strchr(&path[len], '/'); ; pos = strchr(pos + 1, '/')) {
+		if (NULL != pos)
+			*pos = '\0';
+
+		if ((-1 == mkdir(path, 0755)) && (EEXIST != errno))
+			return -1;
+
+		if (NULL == pos)
+			return 0;
+
+		*pos = '/';
+	}
+}
+
+/* creates a directory under the read-only directory with width files and
+ * subdirectories; a share of the directories, set by the overlap ratio, exist
+ * under the writeable directory too, with width files of their own */
+static int make_tree(const char *base,
+                     const struct bench_opts *opts,
+                     struct tree *tree,
+                     const char *rel,
+                     const unsigned int level,
+                     const char *buf,
+                     unsigned int *seed)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+
+	if ((-1 == make_dir(base, "ro", rel)) ||
+	    (-1 == make_dir(base, "plain", rel)) ||
+	    (-1 == tree_add(&tree->dirs, &tree->ndirs, &tree->dirs_size, rel)))
+		return -1;
+
+	for (i = 0; opts->width > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/f%u", rel, i);
+		if ((-1 == make_file(base, "ro", path, buf, opts->file_size)) ||
+		    (-1 == tree_add(&tree->files,
+		                    &tree->nfiles,
+		                    &tree->files_size,
+		                    path)))
+			return -1;
+	}
+
+	if ((unsigned int) (rand_r(seed) % 100) < opts->overlap) {
+		if (-1 == make_dir(base, "rw", rel))
+			return -1;
+
+		for (i = 0; opts->width > i; ++i) {
+			(void) snprintf(path, sizeof(path), "%s/w%u", rel, i);
+			if ((-1 == make_file(base, "rw", path, buf, opts->file_size)) ||
+			    (-1 == tree_add(&tree->files,
+			                    &tree->nfiles,
+			                    &tree->files_size,
+			                    path)))
+				return -1;
+		}
+	}
+
+	if (opts->depth == level)
+		return 0;
+
+	for (i = 0; opts->width > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/d%u", rel, i);
+		if (-1 == make_tree(base, opts, tree, path, level + 1, buf, seed))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int remove_path(const char *path,
+                       const struct stat *stbuf,
+                       int type,
+                       struct FTW *ftw)
+{
+	if (FTW_DP == type)
+		return rmdir(path);
+
+	return unlink(path);
+}
+
+static void path_of(const struct worker *worker,
+                    char *path,
+                    const char *rel)
+{
+	(void) snprintf(path, PATH_MAX, "%s/%s", worker->job->root, rel);
+}
+
+static const char *random_file(struct worker *worker)
+{
+	const struct tree *tree = worker->job->tree;
+
+	return tree->files[(size_t) rand_r(&worker->seed) % tree->nfiles];
+}
+
+static ssize_t op_stat(struct worker *worker, const unsigned long i)
+{
+	char path[PATH_MAX];
+	struct stat stbuf;
+
+	path_of(worker, path, random_file(worker));
+	return lstat(path, &stbuf);
+}
+
+static ssize_t op_open(struct worker *worker, const unsigned long i)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	path_of(worker, path, random_file(worker));
+	fd = open(path, O_RDONLY);
+	if (-1 == fd)
+		return -1;
+
+	return close(fd);
+}
+
+static ssize_t op_readdir(struct worker *worker, const unsigned long i)
+{
+	char path[PATH_MAX];
+	const struct tree *tree = worker->job->tree;
+	DIR *dir;
+
+	path_of(worker,
+	        path,
+	        tree->dirs[(size_t) rand_r(&worker->seed) % tree->ndirs]);
+	dir = opendir(path);
+	if (NULL == dir)
+		return -1;
+
+	while (NULL != readdir(dir));
+
+	return closedir(dir);
+}
+
+static ssize_t op_create(struct worker *worker, const unsigned long i)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	(void) snprintf(path,
+	                sizeof(path),
+	                "%s/c.%u.%lu",
+	                worker->job->root,
+	                worker->id,
+	                i);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (-1 == fd)
+		return -1;
+
+	return close(fd);
+}
+
+static ssize_t op_unlink(struct worker *worker, const unsigned long i)
+{
+	char path[PATH_MAX];
+
+	(void) snprintf(path,
+	                sizeof(path),
+	                "%s/c.%u.%lu",
+	                worker->job->root,
+	                worker->id,
+	                i);
+	return unlink(path);
+}
+
+/* each thread reads its own file under the read-only directory */
+static int open_data(struct worker *worker)
+{
+	char path[PATH_MAX];
+
+	worker->buf = malloc(worker->job->workload->size);
+	if (NULL == worker->buf)
+		return -1;
+
+	(void) snprintf(path,
+	                sizeof(path),
+	                "%s/data.%u",
+	                worker->job->root,
+	                worker->id);
+	worker->fd = open(path, O_RDONLY);
+	return (-1 == worker->fd) ? -1 : 0;
+}
+
+/* each thread writes its own, new file */
+static int create_data(struct worker *worker)
+{
+	char path[PATH_MAX];
+
+	worker->buf = malloc(worker->job->workload->size);
+	if (NULL == worker->buf)
+		return -1;
+	memset(worker->buf, 'x', worker->job->workload->size);
+
+	(void) snprintf(path,
+	                sizeof(path),
+	                "%s/out.%u",
+	                worker->job->root,
+	                worker->id);
+	worker->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (-1 == worker->fd)
+		return -1;
+
+	return ftruncate(worker->fd, (off_t) worker->job->opts->data_size);
+}
+
+static void close_data(struct worker *worker)
+{
+	if (-1 != worker->fd)
+		(void) close(worker->fd);
+	free(worker->buf);
+}
+
+static void remove_data(struct worker *worker)
+{
+	char path[PATH_MAX];
+
+	close_data(worker);
+	(void) snprintf(path,
+	                sizeof(path),
+	                "%s/out.%u",
+	                worker->job->root,
+	                worker->id);
+	(void) unlink(path);
+}
+
+static off_t seq_off(const struct worker *worker, const unsigned long i)
+{
+	return (off_t) ((i * SEQ_SIZE) % worker->job->opts->data_size);
+}
+
+static off_t rand_off(struct worker *worker)
+{
+	size_t blocks = worker->job->opts->data_size / RAND_SIZE;
+
+	return (off_t) (((size_t) rand_r(&worker->seed) % blocks) * RAND_SIZE);
+}
+
+static ssize_t op_seq_read(struct worker *worker, const unsigned long i)
+{
+	return pread(worker->fd, worker->buf, SEQ_SIZE, seq_off(worker, i));
+}
+
+static ssize_t op_rand_read(struct worker *worker, const unsigned long i)
+{
+	return pread(worker->fd, worker->buf, RAND_SIZE, rand_off(worker));
+}
+
+static ssize_t op_seq_write(struct worker *worker, const unsigned long i)
+{
+	return pwrite(worker->fd, worker->buf, SEQ_SIZE, seq_off(worker, i));
+}
+
+static ssize_t op_rand_write(struct worker *worker, const unsigned long i)
+{
+	return pwrite(worker->fd, worker->buf, RAND_SIZE, rand_off(worker));
+}
+
+/* create must run before unlink, which removes the files it creates; data
+ * workloads transfer the size of a data file in requests of the given size */
+static const struct workload workloads[] = {
+	{"stat", NULL, op_stat, NULL, 0},
+	{"open", NULL, op_open, NULL, 0},
+	{"readdir", NULL, op_readdir, NULL, 0},
+	{"create", NULL, op_create, NULL, 0},
+	{"unlink", NULL, op_unlink, NULL, 0},
+	{"seq_read", open_data, op_seq_read, close_data, SEQ_SIZE},
+	{"rand_read", open_data, op_rand_read, close_data, RAND_SIZE},
+	{"seq_write", create_data, op_seq_write, remove_data, SEQ_SIZE},
+	{"rand_write", create_data, op_rand_write, remove_data, RAND_SIZE}
+};
+
+static void *run_worker(void *arg)
+{
+	struct worker *worker = (struct worker *) arg;
+	const struct workload *workload = worker->job->workload;
+	uint64_t start;
+	unsigned long i;
+	ssize_t ret;
+
+	worker->ret = 0;
+	if ((NULL != workload->setup) && (-1 == workload->setup(worker)))
+		worker->ret = -1;
+
+	(void) pthread_barrier_wait(&worker->job->barrier);
+
+	for (i = 0; (0 == worker->ret) && (worker->job->ops > i); ++i) {
+		start = now();
+		ret = workload->op(worker, i);
+		worker->lat[i] = now() - start;
+
+		if (-1 == ret)
+			worker->ret = -1;
+		else
+			worker->bytes += (uint64_t) ret;
+	}
+
+	(void) pthread_barrier_wait(&worker->job->barrier);
+
+	if (NULL != workload->teardown)
+		workload->teardown(worker);
+
+	return NULL;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *) a;
+	uint64_t lb = *(const uint64_t *) b;
+
+	if (la < lb)
+		return -1;
+
+	return (la > lb) ? 1 : 0;
+}
+
+/* runs a workload with a number of threads and prints its results */
+static int run_job(FILE *out,
+                   const char *target,
+                   const char *root,
+                   const struct bench_opts *opts,
+                   const struct tree *tree,
+                   const struct workload *workload,
+                   const unsigned int nthreads)
+{
+	struct worker workers[MAX_THREADS];
+	struct job job;
+	uint64_t *lat;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t bytes;
+	size_t count;
+	unsigned int i;
+	int ret;
+
+	job.workload = workload;
+	job.opts = opts;
+	job.tree = tree;
+	job.root = root;
+	job.ops = opts->ops;
+	if (0 != workload->size)
+		job.ops = opts->data_size / workload->size;
+
+	count = job.ops * nthreads;
+	lat = malloc(sizeof(*lat) * count);
+	if (NULL == lat)
+		return -1;
+
+	if (0 != pthread_barrier_init(&job.barrier, NULL, nthreads + 1)) {
+		free(lat);
+		return -1;
+	}
+
+	for (i = 0; nthreads > i; ++i) {
+		workers[i].job = &job;
+		workers[i].buf = NULL;
+		workers[i].lat = &lat[i * job.ops];
+		workers[i].bytes = 0;
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].fd = -1;
+		if (0 != pthread_create(&workers[i].thread,
+		                        NULL,
+		                        run_worker,
+		                        &workers[i])) {
+			(void) fprintf(stderr, "failed to create a thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* measure the time from the moment all threads are ready to the moment
+	 * all are done */
+	(void) pthread_barrier_wait(&job.barrier);
+	start = now();
+	(void) pthread_barrier_wait(&job.barrier);
+	elapsed = now() - start;
+
+	ret = 0;
+	bytes = 0;
+	for (i = 0; nthreads > i; ++i) {
+		(void) pthread_join(workers[i].thread, NULL);
+		if (-1 == workers[i].ret)
+			ret = -1;
+		bytes += workers[i].bytes;
+	}
+
+	(void) pthread_barrier_destroy(&job.barrier);
+
+	if (0 == ret) {
+		qsort(lat, count, sizeof(*lat), cmp_lat);
+		(void) fprintf(out,
+		               "%s\t%s\t%u\t%zu\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+		               target,
+		               workload->name,
+		               nthreads,
+		               count,
+		               (double) count * 1000000000.0 / (double) elapsed,
+		               (0 != workload->size) ?
+		                   ((double) bytes * 1000000000.0 /
+		                    (double) elapsed /
+		                    (1024.0 * 1024.0)) : 0.0,
+		               (double) lat[count / 2] / 1000.0,
+		               (double) lat[(count * 90) / 100] / 1000.0,
+		               (double) lat[(count * 99) / 100] / 1000.0,
+		               (double) lat[count - 1] / 1000.0);
+		(void) fflush(out);
+	}
+	else
+		(void) fprintf(stderr,
+		               "%s: %s with %u threads failed\n",
+		               target,
+		               workload->name,
+		               nthreads);
+
+	free(lat);
+	return ret;
+}
+
+/* mounts the union and waits until it appears */
+static int mount_luufs(const struct bench_opts *opts, const char *base)
+{
+	char ro[PATH_MAX];
+	char rw[PATH_MAX];
+	char target[PATH_MAX];
+	struct stat parent;
+	struct stat stbuf;
+	pid_t pid;
+	int status;
+	int i;
+
+	(void) snprintf(ro, sizeof(ro), "%s/ro", base);
+	(void) snprintf(rw, sizeof(rw), "%s/rw", base);
+	(void) snprintf(target, sizeof(target), "%s/union", base);
+
+	pid = fork();
+	if (-1 == pid)
+		return -1;
+
+	if (0 == pid) {
+		if (NULL == opts->luufs_opts)
+			(void) execl(opts->luufs, opts->luufs, ro, rw, target, NULL);
+		else
+			(void) execl(opts->luufs,
+			             opts->luufs,
+			             "-o",
+			             opts->luufs_opts,
+			             ro,
+			             rw,
+			             target,
+			             NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	if ((pid != waitpid(pid, &status, 0)) ||
+	    !WIFEXITED(status) ||
+	    (EXIT_SUCCESS != WEXITSTATUS(status)))
+		return -1;
+
+	if (-1 == stat(base, &parent))
+		return -1;
+
+	for (i = 0; 50 > i; ++i) {
+		if ((0 == stat(target, &stbuf)) && (stbuf.st_dev != parent.st_dev))
+			return 0;
+
+		(void) usleep(100000);
+	}
+
+	return -1;
+}
+
+static int parse_threads(struct bench_opts *opts, char *arg)
+{
+	char *tok;
+	char *pos;
+	char *end;
+	unsigned long n;
+
+	opts->nthreads = 0;
+	for (tok = strtok_r(arg, ",", &pos);
+	     NULL != tok;
+	     tok = strtok_r(NULL, ",", &pos)) {
+		n = strtoul(tok, &end, 10);
+		if (('\0' != *end) ||
+		    (0 == n) ||
+		    (MAX_THREADS < n) ||
+		    (MAX_THREADS == opts->nthreads))
+			return -1;
+
+		opts->threads[opts->nthreads] = (unsigned int) n;
+		++opts->nthreads;
+	}
+
+	return (0 == opts->nthreads) ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	(void) fprintf(stderr,
+	               "Usage: %s [-w WIDTH] [-d DEPTH] [-r OVERLAP%%] "
+	               "[-s FILE_SIZE] [-D DATA_SIZE]\n"
+	               "       [-n OPS] [-t THREADS,...] [-l LUUFS] "
+	               "[-o LUUFS_OPTIONS] [-O OUTPUT]\n",
+	               prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *dirs[] = {"ro", "rw", "plain", "union", "bind"};
+	char base[] = "/tmp/luufs-bench.XXXXXX";
+	char path[PATH_MAX];
+	char root[PATH_MAX];
+	struct bench_opts opts;
+	struct tree tree;
+	FILE *out;
+	char *buf;
+	const char *target;
+	unsigned int seed;
+	unsigned int max;
+	unsigned int i;
+	unsigned int j;
+	unsigned int t;
+	int opt;
+	int ret;
+
+	opts.width = 10;
+	opts.depth = 3;
+	opts.overlap = 50;
+	opts.file_size = 4096;
+	opts.data_size = 64 * 1024 * 1024;
+	opts.ops = 10000;
+	opts.threads[0] = 1;
+	opts.threads[1] = 4;
+	opts.threads[2] = 16;
+	opts.nthreads = 3;
+	opts.luufs = "./luufs";
+	opts.luufs_opts = NULL;
+	opts.out = NULL;
+
+	while (-1 != (opt = getopt(argc, argv, "w:d:r:s:D:n:t:l:o:O:"))) {
+		switch (opt) {
+			case 'w':
+				opts.width = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+
+			case 'd':
+				opts.depth = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+
+			case 'r':
+				opts.overlap = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+
+			case 's':
+				opts.file_size = (size_t) strtoul(optarg, NULL, 10);
+				break;
+
+			case 'D':
+				opts.data_size = (size_t) strtoul(optarg, NULL, 10);
+				break;
+
+			case 'n':
+				opts.ops = strtoul(optarg, NULL, 10);
+				break;
+
+			case 't':
+				if (-1 == parse_threads(&opts, optarg)) {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'l':
+				opts.luufs = optarg;
+				break;
+
+			case 'o':
+				opts.luufs_opts = optarg;
+				break;
+
+			case 'O':
+				opts.out = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if ((0 == opts.width) ||
+	    (0 == opts.ops) ||
+	    (100 < opts.overlap) ||
+	    (SEQ_SIZE > opts.data_size)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	opts.data_size -= opts.data_size % SEQ_SIZE;
+
+	if (0 != geteuid()) {
+		(void) fprintf(stderr, "%s: must run as root\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	out = stdout;
+	if (NULL != opts.out) {
+		out = fopen(opts.out, "w");
+		if (NULL == out) {
+			perror(opts.out);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (NULL == mkdtemp(base)) {
+		perror(base);
+		return EXIT_FAILURE;
+	}
+
+	ret = EXIT_FAILURE;
+	memset(&tree, 0, sizeof(tree));
+
+	buf = malloc(opts.data_size);
+	if (NULL == buf)
+		goto remove_base;
+	memset(buf, 'x', opts.data_size);
+
+	(void) fprintf(stderr, "creating the trees under %s\n", base);
+
+	for (i = 0; sizeof(dirs) / sizeof(dirs[0]) > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/%s", base, dirs[i]);
+		if (-1 == mkdir(path, 0755))
+			goto free_buf;
+	}
+
+	seed = 1;
+	if (-1 == make_tree(base, &opts, &tree, ".", 0, buf, &seed))
+		goto free_tree;
+
+	/* each thread gets its own data file */
+	max = 0;
+	for (t = 0; opts.nthreads > t; ++t) {
+		if (opts.threads[t] > max)
+			max = opts.threads[t];
+	}
+
+	for (i = 0; max > i; ++i) {
+		(void) snprintf(path, sizeof(path), "data.%u", i);
+		if (-1 == make_file(base, "ro", path, buf, opts.data_size))
+			goto free_tree;
+	}
+
+	if (-1 == mount_luufs(&opts, base)) {
+		(void) fprintf(stderr, "%s: failed to mount luufs\n", argv[0]);
+		goto free_tree;
+	}
+
+	(void) snprintf(path, sizeof(path), "%s/plain", base);
+	(void) snprintf(root, sizeof(root), "%s/bind", base);
+	if (-1 == mount(path, root, NULL, MS_BIND, NULL)) {
+		perror(root);
+		goto unmount_union;
+	}
+
+	(void) fprintf(out,
+	               "target\tworkload\tthreads\tops\tops_per_sec\tmib_per_sec\t"
+	               "p50_us\tp90_us\tp99_us\tmax_us\n");
+
+	ret = EXIT_SUCCESS;
+	for (t = 0; opts.nthreads > t; ++t) {
+		for (i = 0; sizeof(workloads) / sizeof(workloads[0]) > i; ++i) {
+			for (j = 0; 2 > j; ++j) {
+				target = (0 == j) ? "union" : "bind";
+				(void) snprintf(root, sizeof(root), "%s/%s", base, target);
+				if (-1 == run_job(out,
+				                  (0 == j) ? "luufs" : "bind",
+				                  root,
+				                  &opts,
+				                  &tree,
+				                  &workloads[i],
+				                  opts.threads[t]))
+					ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	(void) snprintf(root, sizeof(root), "%s/bind", base);
+	(void) umount2(root, MNT_DETACH);
+
+unmount_union:
+	(void) snprintf(root, sizeof(root), "%s/union", base);
+	(void) umount2(root, MNT_DETACH);
+
+free_tree:
+	tree_free(&tree);
+
+free_buf:
+	free(buf);
+
+remove_base:
+	(void) nftw(base, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+
+	if (stdout != out)
+		(void) fclose(out);
+
+	return ret;
+}
@@ -0,0 +1,1189 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "roindex.h"
+#include "fakefuse.h"
+
+/* a fuzz target for sequences of requests: each input is decoded into
+ * operations against an in-process union of small read-only and writeable
+ * trees, and luufs must reply to each request exactly once, with a sane
+ * reply; the first byte of an input selects the features the union is set up
+ * with; with HAVE_LIBFUZZER, this is a libFuzzer target, and otherwise, it
+ * runs the inputs it's given or random ones */
+
+/* the number of inodes and handles an input may keep */
+#define MAX_INODES 16
+#define MAX_HANDLES 8
+
+/* the size of reads, writes and readdir replies */
+#define IO_SIZE (64 * 1024)
+
+/* the largest error number a reply may carry */
+#define MAX_ERRNO 4095
+
+/* features selected by the first byte of an input */
+#define WITH_EXCLUSIVE_RW (1 << 0)
+#define WITH_INDEX (1 << 1)
+#define WITH_URING (1 << 2)
+#define WITH_MAX_HANDLES (1 << 3)
+#define WITH_RAM_RW (1 << 4)
+
+/* the number of handles of inodes kept open with WITH_MAX_HANDLES */
+#define FEW_HANDLES 4
+
+/* the size of the in-memory writeable directory with WITH_RAM_RW, small
+ * enough to fill up */
+#define RAM_RW_SIZE (256 * 1024)
+
+enum op {
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_GETATTR,
+	OP_SETATTR,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_CREATE,
+	OP_MKNOD,
+	OP_UNLINK,
+	OP_RENAME,
+	OP_SYMLINK,
+	OP_READLINK,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_FSYNC,
+	OP_FALLOCATE,
+	OP_LSEEK,
+	OP_COPY,
+	OP_RELEASE,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_RELEASEDIR,
+	OP_ACCESS,
+	OP_COUNT
+};
+
+struct inode {
+	fuse_ino_t ino;
+	mode_t type;
+	uint64_t nlookup;
+};
+
+struct handle {
+	fuse_ino_t ino;
+	struct fuse_file_info fi;
+	int dir;
+	off_t off;
+};
+
+struct input {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+};
+
+struct fuzz {
+	/* entries are read in place, so the reply buffer comes first */
+	char reply[IO_SIZE];
+	struct luufs_ctx *ctx;
+	const struct fuse_lowlevel_ops *ops;
+	struct fuse_req req;
+	struct fuse_req other;
+	struct inode inodes[MAX_INODES];
+	unsigned int ninodes;
+	struct handle handles[MAX_HANDLES];
+	unsigned int nhandles;
+	char data[IO_SIZE];
+};
+
+struct file {
+	const char *path;
+	mode_t type;
+	size_t size;
+};
+
+/* names under the writeable directory hide some under the read-only one,
+ * including a directory hidden by a file; regular files under the read-only
+ * one are copied up by the calling thread or by another one, by size */
+static const struct file ro_files[] = {
+	{"a", S_IFREG, 4096},
+	{"b", S_IFREG, 4096},
+	{"d", S_IFDIR, 0},
+	{"d/a", S_IFREG, 1024},
+	{"d/e", S_IFDIR, 0},
+	{"e", S_IFDIR, 0},
+	{"l", S_IFLNK, 0},
+	{"x", S_IFREG, 1024}
+};
+
+static const struct file rw_files[] = {
+	{"b", S_IFREG, 4096},
+	{"c", S_IFREG, 4096},
+	{"d", S_IFDIR, 0},
+	{"d/b", S_IFREG, 4096},
+	{"d/e", S_IFREG, 4096}
+};
+
+static const char *names[] = {
+	"a", "b", "c", "d", "e", "l", "x", "y"
+};
+
+static struct fuzz fuzz;
+static char base[] = "/tmp/luufs-fuzz.XXXXXX";
+static char ro[PATH_MAX];
+static char rw[PATH_MAX];
+static char index_path[PATH_MAX];
+static const char *crash = NULL;
+static const struct input *current = NULL;
+
+/* reports a violation and keeps the input that caused it */
+static void fail(const struct fuzz *f, const char *what)
+{
+	FILE *fp;
+
+	(void) fprintf(stderr,
+	               "%s: reply %d, error %d\n",
+	               what,
+	               (int) f->req.reply.type,
+	               f->req.reply.err);
+
+	if ((NULL != crash) && (NULL != current)) {
+		fp = fopen(crash, "wb");
+		if (NULL != fp) {
+			(void) fwrite(current->data, 1, current->size, fp);
+			(void) fclose(fp);
+			(void) fprintf(stderr, "the input was saved to %s\n", crash);
+		}
+	}
+
+	abort();
+}
+
+static uint8_t next(struct input *in)
+{
+	if (in->size == in->pos)
+		return 0;
+
+	return in->data[in->pos++];
+}
+
+static struct fuse_req *request(struct fuzz *f)
+{
+	fake_req_init(&f->req, f->ctx, f->reply, sizeof(f->reply));
+	return &f->req;
+}
+
+/* checks that a request was replied to exactly once, possibly by another
+ * thread; returns 0 if the reply is of the expected type, or -1 if it's an
+ * error */
+static int check_req(struct fuzz *f,
+                     struct fuse_req *req,
+                     const enum fake_reply_type type)
+{
+	switch (fake_req_wait(req)) {
+		case 0:
+			fail(f, "no reply");
+
+		case 1:
+			break;
+
+		default:
+			fail(f, "more than one reply");
+	}
+
+	if (FAKE_ERR == req->reply.type) {
+		if ((0 > req->reply.err) || (MAX_ERRNO < req->reply.err))
+			fail(f, "bad error number");
+
+		/* requests answered by fuse_reply_err() alone succeed with 0 */
+		if (FAKE_ERR == type)
+			return (0 == req->reply.err) ? 0 : -1;
+
+		if (0 == req->reply.err)
+			fail(f, "success without a reply");
+
+		return -1;
+	}
+
+	if (type != req->reply.type)
+		fail(f, "unexpected reply");
+
+	return 0;
+}
+
+static int check(struct fuzz *f, const enum fake_reply_type type)
+{
+	return check_req(f, &f->req, type);
+}
+
+/* inodes the table has no room for are never forgotten */
+static void add_inode(struct fuzz *f, const fuse_ino_t ino, const mode_t mode)
+{
+	unsigned int i;
+
+	if (0 == ino)
+		fail(f, "an entry without an inode");
+
+	for (i = 0; f->ninodes > i; ++i) {
+		if (ino == f->inodes[i].ino) {
+			++f->inodes[i].nlookup;
+			return;
+		}
+	}
+
+	if (MAX_INODES == f->ninodes)
+		return;
+
+	f->inodes[f->ninodes].ino = ino;
+	f->inodes[f->ninodes].type = mode & S_IFMT;
+	f->inodes[f->ninodes].nlookup = 1;
+	++f->ninodes;
+}
+
+/* picks an inode of a given type, or of any type if it's 0, so requests are
+ * made only for inodes the kernel would make them for */
+static fuse_ino_t pick_inode(struct fuzz *f,
+                             struct input *in,
+                             const mode_t type)
+{
+	unsigned int first;
+	unsigned int i;
+
+	first = next(in) % f->ninodes;
+	for (i = 0; f->ninodes > i; ++i) {
+		if ((0 == type) ||
+		    (type == f->inodes[(first + i) % f->ninodes].type))
+			return f->inodes[(first + i) % f->ninodes].ino;
+	}
+
+	return 0;
+}
+
+static const char *pick_name(struct input *in)
+{
+	return names[next(in) % (sizeof(names) / sizeof(names[0]))];
+}
+
+static struct handle *pick_handle(struct fuzz *f,
+                                  struct input *in,
+                                  const int dir)
+{
+	struct handle *h;
+
+	if (0 == f->nhandles)
+		return NULL;
+
+	h = &f->handles[next(in) % f->nhandles];
+	return (dir == h->dir) ? h : NULL;
+}
+
+static void drop_handle(struct fuzz *f, struct handle *h)
+{
+	--f->nhandles;
+	*h = f->handles[f->nhandles];
+}
+
+static fuse_ino_t lookup(struct fuzz *f,
+                         const fuse_ino_t parent,
+                         const char *name)
+{
+	f->ops->lookup(request(f), parent, name);
+	if (-1 == check(f, FAKE_ENTRY))
+		return 0;
+
+	/* the kernel caches a negative entry as a missing name */
+	return f->req.reply.entry.ino;
+}
+
+/* returns the inode number of the file behind a name, or 0 */
+static ino_t file_of(struct fuzz *f,
+                     const fuse_ino_t parent,
+                     const char *name)
+{
+	fuse_ino_t found;
+	ino_t ino;
+
+	found = lookup(f, parent, name);
+	if (0 == found)
+		return 0;
+
+	ino = f->req.reply.entry.attr.st_ino;
+	f->ops->forget(request(f), found, 1);
+	(void) check(f, FAKE_NONE);
+
+	return ino;
+}
+
+/* checks that a new entry can be looked up */
+static void entry_of(struct fuzz *f,
+                     const fuse_ino_t parent,
+                     const char *name,
+                     const mode_t type)
+{
+	fuse_ino_t ino;
+
+	if (type != (f->req.reply.entry.attr.st_mode & S_IFMT))
+		fail(f, "an entry of the wrong type");
+
+	ino = f->req.reply.entry.ino;
+	if (ino != lookup(f, parent, name))
+		fail(f, "a new entry cannot be looked up");
+
+	add_inode(f, ino, type);
+	add_inode(f, ino, type);
+}
+
+/* a removed name may still refer to a file under a lower directory, but not
+ * to the removed one */
+static void check_removed(struct fuzz *f,
+                          const fuse_ino_t parent,
+                          const char *name,
+                          const ino_t ino)
+{
+	if ((0 != ino) && (ino == file_of(f, parent, name)))
+		fail(f, "a removed name can be looked up");
+}
+
+static void do_forget(struct fuzz *f, struct input *in)
+{
+	struct inode *inode;
+	uint64_t n;
+	unsigned int i;
+
+	if (1 == f->ninodes)
+		return;
+
+	inode = &f->inodes[1 + (next(in) % (f->ninodes - 1))];
+	n = 1 + (next(in) % inode->nlookup);
+
+	/* the kernel keeps open inodes */
+	for (i = 0; f->nhandles > i; ++i) {
+		if (inode->ino != f->handles[i].ino)
+			continue;
+
+		if (1 == inode->nlookup)
+			return;
+
+		if (n == inode->nlookup)
+			--n;
+		break;
+	}
+
+	f->ops->forget(request(f), inode->ino, n);
+	check(f, FAKE_NONE);
+
+	inode->nlookup -= n;
+	if (0 == inode->nlookup) {
+		--f->ninodes;
+		*inode = f->inodes[f->ninodes];
+	}
+}
+
+static void do_setattr(struct fuzz *f, struct input *in)
+{
+	struct stat stbuf;
+	fuse_ino_t ino;
+	int to_set = 0;
+	uint8_t what;
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	what = next(in);
+	ino = pick_inode(f, in, (0 == (what & 2)) ? 0 : S_IFREG);
+	if (0 == ino)
+		return;
+
+	if (0 != (what & 1)) {
+		to_set |= FUSE_SET_ATTR_MODE;
+		stbuf.st_mode = 0600 | (next(in) & 077);
+	}
+	if (0 != (what & 2)) {
+		to_set |= FUSE_SET_ATTR_SIZE;
+		stbuf.st_size = (off_t) next(in) * 512;
+	}
+	if (0 != (what & 4))
+		to_set |= FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+
+	f->ops->setattr(request(f), ino, &stbuf, to_set, NULL);
+	if ((0 == check(f, FAKE_ATTR)) &&
+	    (0 != (to_set & FUSE_SET_ATTR_SIZE)) &&
+	    (stbuf.st_size != f->req.reply.attr.st_size))
+		fail(f, "truncate did not change the size");
+}
+
+static void do_remove(struct fuzz *f, struct input *in, const int dir)
+{
+	fuse_ino_t parent;
+	const char *name;
+	ino_t ino;
+
+	parent = pick_inode(f, in, S_IFDIR);
+	name = pick_name(in);
+	ino = file_of(f, parent, name);
+
+	if (1 == dir)
+		f->ops->rmdir(request(f), parent, name);
+	else
+		f->ops->unlink(request(f), parent, name);
+	if (0 == check(f, FAKE_ERR))
+		check_removed(f, parent, name, ino);
+}
+
+static void do_rename(struct fuzz *f, struct input *in)
+{
+	fuse_ino_t parent;
+	fuse_ino_t newparent;
+	const char *name;
+	const char *newname;
+	unsigned int flags;
+	ino_t ino;
+
+	parent = pick_inode(f, in, S_IFDIR);
+	name = pick_name(in);
+	newparent = pick_inode(f, in, S_IFDIR);
+	newname = pick_name(in);
+	flags = (0 == (next(in) & 1)) ? 0 : RENAME_NOREPLACE;
+	ino = file_of(f, parent, name);
+
+	f->ops->rename(request(f), parent, name, newparent, newname, flags);
+	if ((-1 == check(f, FAKE_ERR)) ||
+	    ((parent == newparent) && (0 == strcmp(name, newname))))
+		return;
+
+	if ((0 != ino) && (ino != file_of(f, newparent, newname)))
+		fail(f, "a renamed file cannot be looked up");
+
+	check_removed(f, parent, name, ino);
+}
+
+static void do_open(struct fuzz *f, struct input *in, const int dir)
+{
+	static const int flags[] = {O_RDONLY, O_WRONLY, O_RDWR, O_RDWR | O_TRUNC};
+	struct handle *h;
+	struct handle *twin;
+	uint8_t what;
+
+	if (MAX_HANDLES == f->nhandles)
+		return;
+
+	h = &f->handles[f->nhandles];
+	memset(h, 0, sizeof(*h));
+	h->ino = pick_inode(f, in, (1 == dir) ? S_IFDIR : S_IFREG);
+	h->dir = dir;
+	if (0 == h->ino)
+		return;
+
+	if (1 == dir) {
+		f->ops->opendir(request(f), h->ino, &h->fi);
+		if (0 == check(f, FAKE_OPEN))
+			++f->nhandles;
+		return;
+	}
+
+	what = next(in);
+	h->fi.flags = flags[what % (sizeof(flags) / sizeof(flags[0]))];
+	f->ops->open(request(f), h->ino, &h->fi);
+
+	/* another open made before the first is replied to may wait for the same
+	 * copy-up */
+	twin = NULL;
+	if ((0 != (what & 4)) && (MAX_HANDLES > f->nhandles + 1)) {
+		twin = &f->handles[f->nhandles + 1];
+		*twin = *h;
+		fake_req_init(&f->other, f->ctx, NULL, 0);
+		f->ops->open(&f->other, twin->ino, &twin->fi);
+	}
+
+	/* a request resumed after a copy-up is replied to with a copy of fi */
+	if (0 == check(f, FAKE_OPEN)) {
+		h->fi = f->req.reply.fi;
+		++f->nhandles;
+	}
+
+	if ((NULL != twin) && (0 == check_req(f, &f->other, FAKE_OPEN))) {
+		twin->fi = f->other.reply.fi;
+		f->handles[f->nhandles] = *twin;
+		++f->nhandles;
+	}
+}
+
+static void do_create(struct fuzz *f, struct input *in)
+{
+	struct handle *h;
+	fuse_ino_t parent;
+	const char *name;
+
+	if (MAX_HANDLES == f->nhandles)
+		return;
+
+	parent = pick_inode(f, in, S_IFDIR);
+	name = pick_name(in);
+	h = &f->handles[f->nhandles];
+	memset(h, 0, sizeof(*h));
+	h->fi.flags = O_RDWR;
+
+	f->ops->create(request(f), parent, name, 0644, &h->fi);
+	if (-1 == check(f, FAKE_CREATE))
+		return;
+
+	h->ino = f->req.reply.entry.ino;
+	++f->nhandles;
+	entry_of(f, parent, name, S_IFREG);
+}
+
+static void do_read(struct fuzz *f, struct input *in)
+{
+	struct handle *h;
+	size_t size;
+
+	h = pick_handle(f, in, 0);
+	if (NULL == h)
+		return;
+
+	size = 1 + ((size_t) next(in) * 256);
+	f->ops->read(request(f),
+	             h->ino,
+	             size,
+	             (off_t) next(in) * 512,
+	             &h->fi);
+	if ((0 == check(f, FAKE_BUF)) && (size < f->req.reply.size))
+		fail(f, "a read returned too much");
+}
+
+static void do_write(struct fuzz *f, struct input *in)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+	struct handle *h;
+	size_t size;
+
+	h = pick_handle(f, in, 0);
+	if (NULL == h)
+		return;
+
+	size = 1 + ((size_t) next(in) * 256);
+	bufv.buf[0].size = size;
+	bufv.buf[0].mem = f->data;
+	f->ops->write_buf(request(f),
+	                  h->ino,
+	                  &bufv,
+	                  (off_t) next(in) * 512,
+	                  &h->fi);
+
+	if ((0 == check(f, FAKE_WRITE)) && (size < f->req.reply.size))
+		fail(f, "a write wrote too much");
+}
+
+static void do_fsync(struct fuzz *f, struct input *in)
+{
+	struct handle *h;
+
+	h = pick_handle(f, in, 0);
+	if (NULL == h)
+		return;
+
+	f->ops->fsync(request(f), h->ino, next(in) & 1, &h->fi);
+	(void) check(f, FAKE_ERR);
+}
+
+static void do_fallocate(struct fuzz *f, struct input *in)
+{
+	struct handle *h;
+	int mode;
+
+	h = pick_handle(f, in, 0);
+	if (NULL == h)
+		return;
+
+	mode = (0 == (next(in) & 1)) ? 0
+	                             : FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE;
+	f->ops->fallocate(request(f),
+	                  h->ino,
+	                  mode,
+	                  (off_t) next(in) * 512,
+	                  1 + ((off_t) next(in) * 512),
+	                  &h->fi);
+	(void) check(f, FAKE_ERR);
+}
+
+static void do_lseek(struct fuzz *f, struct input *in)
+{
+	static const int whences[] = {SEEK_SET, SEEK_CUR, SEEK_END, SEEK_DATA,
+	                              SEEK_HOLE};
+	struct handle *h;
+
+	h = pick_handle(f, in, 0);
+	if (NULL == h)
+		return;
+
+	f->ops->lseek(request(f),
+	              h->ino,
+	              (off_t) next(in) * 512,
+	              whences[next(in) % (sizeof(whences) / sizeof(whences[0]))],
+	              &h->fi);
+	if ((0 == check(f, FAKE_LSEEK)) && (0 > f->req.reply.off))
+		fail(f, "a negative offset");
+}
+
+static void do_copy(struct fuzz *f, struct input *in)
+{
+	struct handle *in_h;
+	struct handle *out_h;
+	size_t len;
+
+	in_h = pick_handle(f, in, 0);
+	out_h = pick_handle(f, in, 0);
+	if ((NULL == in_h) || (NULL == out_h))
+		return;
+
+	len = 1 + ((size_t) next(in) * 512);
+	f->ops->copy_file_range(request(f),
+	                        in_h->ino,
+	                        (off_t) next(in) * 512,
+	                        &in_h->fi,
+	                        out_h->ino,
+	                        (off_t) next(in) * 512,
+	                        &out_h->fi,
+	                        len,
+	                        0);
+	if ((0 == check(f, FAKE_WRITE)) && (len < f->req.reply.size))
+		fail(f, "a copy copied too much");
+}
+
+static void do_release(struct fuzz *f, struct input *in, const int dir)
+{
+	struct handle *h;
+
+	h = pick_handle(f, in, dir);
+	if (NULL == h)
+		return;
+
+	if (1 == dir)
+		f->ops->releasedir(request(f), h->ino, &h->fi);
+	else
+		f->ops->release(request(f), h->ino, &h->fi);
+	if (-1 == check(f, FAKE_ERR))
+		fail(f, "release failed");
+
+	drop_handle(f, h);
+}
+
+/* reads a directory from the offset the handle is at, checking that names
+ * are not repeated, so the listing ends */
+static void do_readdir(struct fuzz *f, struct input *in)
+{
+	char seen[IO_SIZE];
+	const struct fake_dirent *ent;
+	struct handle *h;
+	fuse_ino_t nodeid;
+	size_t seen_len = 0;
+	size_t len;
+	size_t pos;
+	size_t size;
+	size_t i;
+	int plus;
+
+	h = pick_handle(f, in, 1);
+	if (NULL == h)
+		return;
+
+	plus = next(in) & 1;
+	if (0 == (next(in) & 3))
+		h->off = 0;
+
+	do {
+		if (1 == plus)
+			f->ops->readdirplus(request(f), h->ino, IO_SIZE, h->off, &h->fi);
+		else
+			f->ops->readdir(request(f), h->ino, IO_SIZE, h->off, &h->fi);
+		if (-1 == check(f, FAKE_BUF))
+			return;
+
+		len = f->req.reply.size;
+		if (IO_SIZE < len)
+			fail(f, "a listing larger than the buffer");
+
+		for (pos = 0; len > pos; pos += size) {
+			size = fake_dirent_next(&f->reply[pos],
+			                        len - pos,
+			                        plus,
+			                        &ent,
+			                        &nodeid);
+			if (0 == size)
+				fail(f, "a truncated entry");
+
+			/* offsets need not grow, but 0 is the start */
+			if (0 >= ent->off)
+				fail(f, "a bad directory offset");
+			h->off = (off_t) ent->off;
+
+			for (i = 0; seen_len > i; i += strlen(&seen[i]) + 1) {
+				if ((ent->namelen == strlen(&seen[i])) &&
+				    (0 == memcmp(&seen[i], ent->name, ent->namelen)))
+					fail(f, "a name listed twice");
+			}
+
+			if (seen_len + ent->namelen + 1 <= sizeof(seen)) {
+				memcpy(&seen[seen_len], ent->name, ent->namelen);
+				seen_len += ent->namelen;
+				seen[seen_len++] = '\0';
+			}
+
+			if (0 != nodeid)
+				add_inode(f, nodeid, (mode_t) ent->type << 12);
+		}
+	} while (0 != len);
+}
+
+static void run_op(struct fuzz *f, struct input *in)
+{
+	fuse_ino_t parent;
+	fuse_ino_t ino;
+	const char *name;
+
+	switch (next(in) % OP_COUNT) {
+		case OP_LOOKUP:
+			ino = lookup(f, pick_inode(f, in, S_IFDIR), pick_name(in));
+			if (0 != ino)
+				add_inode(f, ino, f->req.reply.entry.attr.st_mode);
+			break;
+
+		case OP_FORGET:
+			do_forget(f, in);
+			break;
+
+		case OP_GETATTR:
+			f->ops->getattr(request(f), pick_inode(f, in, 0), NULL);
+			(void) check(f, FAKE_ATTR);
+			break;
+
+		case OP_SETATTR:
+			do_setattr(f, in);
+			break;
+
+		case OP_MKDIR:
+			parent = pick_inode(f, in, S_IFDIR);
+			name = pick_name(in);
+			f->ops->mkdir(request(f), parent, name, 0755);
+			if (0 == check(f, FAKE_ENTRY))
+				entry_of(f, parent, name, S_IFDIR);
+			break;
+
+		case OP_RMDIR:
+			do_remove(f, in, 1);
+			break;
+
+		case OP_CREATE:
+			do_create(f, in);
+			break;
+
+		case OP_MKNOD:
+			parent = pick_inode(f, in, S_IFDIR);
+			name = pick_name(in);
+			f->ops->mknod(request(f), parent, name, S_IFIFO | 0644, 0);
+			if (0 == check(f, FAKE_ENTRY))
+				entry_of(f, parent, name, S_IFIFO);
+			break;
+
+		case OP_UNLINK:
+			do_remove(f, in, 0);
+			break;
+
+		case OP_RENAME:
+			do_rename(f, in);
+			break;
+
+		case OP_SYMLINK:
+			parent = pick_inode(f, in, S_IFDIR);
+			name = pick_name(in);
+			f->ops->symlink(request(f), pick_name(in), parent, name);
+			if (0 == check(f, FAKE_ENTRY))
+				entry_of(f, parent, name, S_IFLNK);
+			break;
+
+		case OP_READLINK:
+			ino = pick_inode(f, in, S_IFLNK);
+			if (0 == ino)
+				break;
+
+			f->ops->readlink(request(f), ino);
+			(void) check(f, FAKE_READLINK);
+			break;
+
+		case OP_OPEN:
+			do_open(f, in, 0);
+			break;
+
+		case OP_READ:
+			do_read(f, in);
+			break;
+
+		case OP_WRITE:
+			do_write(f, in);
+			break;
+
+		case OP_FSYNC:
+			do_fsync(f, in);
+			break;
+
+		case OP_FALLOCATE:
+			do_fallocate(f, in);
+			break;
+
+		case OP_LSEEK:
+			do_lseek(f, in);
+			break;
+
+		case OP_COPY:
+			do_copy(f, in);
+			break;
+
+		case OP_RELEASE:
+			do_release(f, in, 0);
+			break;
+
+		case OP_OPENDIR:
+			do_open(f, in, 1);
+			break;
+
+		case OP_READDIR:
+			do_readdir(f, in);
+			break;
+
+		case OP_RELEASEDIR:
+			do_release(f, in, 1);
+			break;
+
+		case OP_ACCESS:
+			f->ops->access(request(f), pick_inode(f, in, 0), next(in) & 7);
+			(void) check(f, FAKE_ERR);
+			break;
+	}
+}
+
+static int create_files(const char *root,
+                        const struct file *files,
+                        const size_t nfiles,
+                        const char *data)
+{
+	char path[PATH_MAX];
+	size_t i;
+	int fd;
+	int ret;
+
+	for (i = 0; nfiles > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/%s", root, files[i].path);
+
+		switch (files[i].type) {
+			case S_IFDIR:
+				ret = mkdir(path, 0755);
+				break;
+
+			case S_IFLNK:
+				ret = symlink("a", path);
+				break;
+
+			default:
+				fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+				if (-1 == fd)
+					return -1;
+
+				ret = ((ssize_t) files[i].size ==
+				       write(fd, data, files[i].size)) ? 0 : -1;
+				(void) close(fd);
+		}
+
+		if (-1 == ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int remove_path(const char *path,
+                       const struct stat *stbuf,
+                       int type,
+                       struct FTW *ftw)
+{
+	if (FTW_DP == type)
+		return rmdir(path);
+
+	return unlink(path);
+}
+
+static void remove_base(void)
+{
+	(void) nftw(base, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* creates the read-only directory once, since it never changes */
+static int setup(void)
+{
+	int fd;
+	int ret;
+
+	if (0 != geteuid()) {
+		(void) fprintf(stderr, "must run as root\n");
+		return -1;
+	}
+
+	if (NULL == mkdtemp(base)) {
+		perror(base);
+		return -1;
+	}
+	(void) atexit(remove_base);
+
+	memset(fuzz.data, 'x', sizeof(fuzz.data));
+	(void) snprintf(ro, sizeof(ro), "%s/ro", base);
+	(void) snprintf(rw, sizeof(rw), "%s/rw", base);
+	(void) snprintf(index_path, sizeof(index_path), "%s/index", base);
+
+	if ((-1 == mkdir(ro, 0755)) ||
+	    (-1 == create_files(ro,
+	                        ro_files,
+	                        sizeof(ro_files) / sizeof(ro_files[0]),
+	                        fuzz.data))) {
+		perror(ro);
+		return -1;
+	}
+
+	/* the read-only directory never changes, so its index stays valid */
+	fd = open(ro, O_DIRECTORY);
+	if (-1 == fd) {
+		perror(ro);
+		return -1;
+	}
+
+	ret = roindex_write(fd, index_path);
+	(void) close(fd);
+	if (-1 == ret) {
+		perror(index_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void run(const uint8_t *data, const size_t size)
+{
+	struct luufs_driver_opts opts;
+	struct input in;
+	struct fuzz *f = &fuzz;
+	unsigned int i;
+	uint8_t with;
+
+	/* each input starts with the same writeable directory */
+	(void) nftw(rw, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+	if ((-1 == mkdir(rw, 0755)) ||
+	    (-1 == create_files(rw,
+	                        rw_files,
+	                        sizeof(rw_files) / sizeof(rw_files[0]),
+	                        f->data))) {
+		perror(rw);
+		exit(EXIT_FAILURE);
+	}
+
+	/* caches are kept small, so they fill up, and nothing runs in the
+	 * background but copies of large files */
+	luufs_driver_defaults(&opts);
+	opts.ro = ro;
+	opts.rw = rw;
+	opts.ro_cache = 4;
+	opts.immutable_ro = 1;
+	opts.copy_up = 1;
+	opts.copy_async = 2048;
+	opts.dir_cache = 4096;
+	opts.readahead = 0;
+
+	in.data = data;
+	in.size = size;
+	in.pos = 0;
+
+	with = next(&in);
+	opts.exclusive_rw = (0 != (WITH_EXCLUSIVE_RW & with)) ? 1 : 0;
+	if (0 != (WITH_INDEX & with))
+		opts.index = index_path;
+	opts.uring = (0 != (WITH_URING & with)) ? 1 : 0;
+	if (0 != (WITH_MAX_HANDLES & with))
+		opts.max_handles = FEW_HANDLES;
+
+	/* mounting the tmpfs requires root */
+	if ((0 != (WITH_RAM_RW & with)) && (0 == geteuid()))
+		opts.ram_rw = RAM_RW_SIZE;
+
+	f->ctx = luufs_driver_new(&opts);
+	if (NULL == f->ctx) {
+		perror(base);
+		exit(EXIT_FAILURE);
+	}
+	f->ops = luufs_driver_ops(f->ctx);
+
+	f->inodes[0].ino = FUSE_ROOT_ID;
+	f->inodes[0].type = S_IFDIR;
+	f->inodes[0].nlookup = 0;
+	f->ninodes = 1;
+	f->nhandles = 0;
+
+	current = &in;
+
+	while (in.size > in.pos)
+		run_op(f, &in);
+
+	for (i = 0; f->nhandles > i; ++i) {
+		if (1 == f->handles[i].dir)
+			f->ops->releasedir(request(f),
+			                   f->handles[i].ino,
+			                   &f->handles[i].fi);
+		else
+			f->ops->release(request(f),
+			                f->handles[i].ino,
+			                &f->handles[i].fi);
+	}
+
+	for (i = 1; f->ninodes > i; ++i)
+		f->ops->forget(request(f), f->inodes[i].ino, f->inodes[i].nlookup);
+
+	current = NULL;
+	luufs_driver_free(f->ctx);
+}
+
+#ifdef HAVE_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	if (-1 == setup())
+		exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	run(data, size);
+	return 0;
+}
+
+#else
+
+/* the size of random inputs */
+#define RANDOM_INPUT_SIZE 512
+
+static int run_file(const char *path)
+{
+	uint8_t buf[64 * 1024];
+	FILE *fp;
+	size_t len;
+
+	fp = fopen(path, "rb");
+	if (NULL == fp) {
+		perror(path);
+		return -1;
+	}
+
+	len = fread(buf, 1, sizeof(buf), fp);
+	(void) fclose(fp);
+
+	run(buf, len);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	(void) fprintf(stderr,
+	               "Usage: %s [-n RUNS] [-s SEED] [-o CRASH] [INPUT...]\n",
+	               prog);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[RANDOM_INPUT_SIZE];
+	unsigned long runs = 10000;
+	unsigned long i;
+	size_t len;
+	size_t j;
+	unsigned int seed;
+	int opt;
+
+	seed = (unsigned int) time(NULL);
+
+	while (-1 != (opt = getopt(argc, argv, "n:s:o:"))) {
+		switch (opt) {
+			case 'n':
+				runs = strtoul(optarg, NULL, 10);
+				break;
+
+			case 's':
+				seed = (unsigned int) strtoul(optarg, NULL, 10);
+				break;
+
+			case 'o':
+				crash = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (-1 == setup())
+		return EXIT_FAILURE;
+
+	/* inputs given on the command line are replayed */
+	if (argc > optind) {
+		for (; argc > optind; ++optind) {
+			if (-1 == run_file(argv[optind]))
+				return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	(void) fprintf(stderr, "running %lu inputs, seed %u\n", runs, seed);
+	if (NULL == crash)
+		crash = "fuzz-crash";
+
+	for (i = 0; runs > i; ++i) {
+		len = (size_t) rand_r(&seed) % sizeof(buf);
+		for (j = 0; len > j; ++j)
+			buf[j] = (uint8_t) rand_r(&seed);
+
+		run(buf, len);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif
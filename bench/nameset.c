@@ -0,0 +1,98 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nameset.h"
+
+/* a microbenchmark of the directory listing merge: it fills a set with the
+ * names under the read-only directory, then checks an equal number of names
+ * under the writeable one, half of which are duplicates; the time per entry
+ * should stay flat as the number of entries grows */
+
+#define MAX_ENTRIES 1000000
+
+static double now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + ((double) ts.tv_nsec / 1000000000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	char name[32];
+	struct nameset set;
+	double start;
+	double elapsed;
+	size_t entries;
+	size_t dups;
+	size_t i;
+
+	nameset_init(&set);
+
+	(void) printf("entries\ttotal_ms\tns_per_entry\n");
+
+	for (entries = 1000; MAX_ENTRIES >= entries; entries *= 10) {
+		/* the set is cleared and reused, like the one of a directory handle */
+		nameset_clear(&set);
+		dups = 0;
+
+		start = now();
+
+		for (i = 0; entries > i; ++i) {
+			(void) snprintf(name, sizeof(name), "lib%zu.so.%zu", i, i % 7);
+			if (-1 == nameset_add(&set, name, 0)) {
+				(void) fprintf(stderr, "%s: out of memory\n", argv[0]);
+				nameset_free(&set);
+				return EXIT_FAILURE;
+			}
+		}
+
+		for (i = entries / 2; entries + (entries / 2) > i; ++i) {
+			(void) snprintf(name, sizeof(name), "lib%zu.so.%zu", i, i % 7);
+			dups += (size_t) nameset_contains(&set, name);
+		}
+
+		elapsed = now() - start;
+
+		if (entries / 2 != dups) {
+			(void) fprintf(stderr, "%s: found %zu duplicates\n", argv[0], dups);
+			nameset_free(&set);
+			return EXIT_FAILURE;
+		}
+
+		(void) printf("%zu\t%.3f\t%.1f\n",
+		              entries * 2,
+		              elapsed * 1000.0,
+		              (elapsed * 1000000000.0) / (double) (entries * 2));
+	}
+
+	nameset_free(&set);
+
+	return EXIT_SUCCESS;
+}
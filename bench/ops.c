@@ -0,0 +1,665 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "roindex.h"
+#include "fakefuse.h"
+
+/* a microbenchmark of the handlers: it creates small read-only and writeable
+ * trees and calls each handler of an in-process union in a loop, without a
+ * mount or the kernel in between; results are written as tab-separated
+ * values, one line per operation, with the number of allocations made by
+ * luufs and libc per operation */
+
+/* the number of files under the read-only and the writeable directory */
+#define RO_FILES 1000
+#define RW_FILES 100
+
+/* the size of the file read from */
+#define DATA_SIZE (1024 * 1024)
+
+/* the size of reads and writes */
+#define IO_SIZE 4096
+
+/* the size of reply buffers, like the largest kernel request */
+#define REPLY_SIZE (128 * 1024)
+
+struct bench {
+	/* entries are read in place, so the reply buffer comes first */
+	char reply[REPLY_SIZE];
+	struct luufs_ctx *ctx;
+	const struct fuse_lowlevel_ops *ops;
+	struct fuse_req req;
+	char data[IO_SIZE];
+	char names[RO_FILES][16];
+	fuse_ino_t files[RO_FILES];
+	fuse_ino_t dir;
+	fuse_ino_t big;
+	fuse_ino_t rw;
+	fuse_ino_t link;
+	struct fuse_file_info big_fi;
+	struct fuse_file_info rw_fi;
+};
+
+struct workload {
+	const char *name;
+	int (*op)(struct bench *, const unsigned long);
+	unsigned long scale;
+};
+
+/* libc calls malloc() through the PLT, so allocations it makes on behalf of
+ * luufs are counted too */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long allocs = 0;
+
+void *malloc(size_t size)
+{
+	++allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	++allocs;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	++allocs;
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+static struct fuse_req *request(struct bench *b)
+{
+	fake_req_init(&b->req, b->ctx, b->reply, sizeof(b->reply));
+	return &b->req;
+}
+
+static int replied(const struct bench *b, const enum fake_reply_type type)
+{
+	return (type == b->req.reply.type) ? 0 : -1;
+}
+
+static fuse_ino_t lookup(struct bench *b,
+                         const fuse_ino_t parent,
+                         const char *name)
+{
+	b->ops->lookup(request(b), parent, name);
+	if (-1 == replied(b, FAKE_ENTRY))
+		return 0;
+
+	return b->req.reply.entry.ino;
+}
+
+static void forget(struct bench *b, const fuse_ino_t ino, const uint64_t n)
+{
+	b->ops->forget(request(b), ino, n);
+}
+
+static int do_lookup(struct bench *b, const unsigned long i)
+{
+	fuse_ino_t ino;
+
+	ino = lookup(b, b->dir, b->names[i % RO_FILES]);
+	if (0 == ino)
+		return -1;
+
+	forget(b, ino, 1);
+	return 0;
+}
+
+static int do_lookup_missing(struct bench *b, const unsigned long i)
+{
+	b->ops->lookup(request(b), b->dir, "missing");
+	if ((-1 == replied(b, FAKE_ERR)) && (-1 == replied(b, FAKE_ENTRY)))
+		return -1;
+
+	return 0;
+}
+
+static int do_getattr(struct bench *b, const unsigned long i)
+{
+	b->ops->getattr(request(b), b->files[i % RO_FILES], NULL);
+	return replied(b, FAKE_ATTR);
+}
+
+static int do_open(struct bench *b, const unsigned long i)
+{
+	struct fuse_file_info fi;
+	fuse_ino_t ino;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	ino = b->files[i % RO_FILES];
+
+	b->ops->open(request(b), ino, &fi);
+	if (-1 == replied(b, FAKE_OPEN))
+		return -1;
+
+	b->ops->release(request(b), ino, &fi);
+	return replied(b, FAKE_ERR);
+}
+
+static int do_read(struct bench *b, const unsigned long i)
+{
+	b->ops->read(request(b),
+	             b->big,
+	             IO_SIZE,
+	             (off_t) ((i * IO_SIZE) % DATA_SIZE),
+	             &b->big_fi);
+	return replied(b, FAKE_BUF);
+}
+
+static int do_write(struct bench *b, const unsigned long i)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(IO_SIZE);
+
+	bufv.buf[0].mem = b->data;
+	b->ops->write_buf(request(b),
+	                  b->rw,
+	                  &bufv,
+	                  (off_t) ((i * IO_SIZE) % DATA_SIZE),
+	                  &b->rw_fi);
+	return replied(b, FAKE_WRITE);
+}
+
+static int do_create(struct bench *b, const unsigned long i)
+{
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+
+	b->ops->create(request(b), b->dir, "new", 0644, &fi);
+	if (-1 == replied(b, FAKE_CREATE))
+		return -1;
+
+	b->ops->release(request(b), b->req.reply.entry.ino, &fi);
+	forget(b, b->req.reply.entry.ino, 1);
+
+	b->ops->unlink(request(b), b->dir, "new");
+	return replied(b, FAKE_ERR);
+}
+
+static int do_mkdir(struct bench *b, const unsigned long i)
+{
+	b->ops->mkdir(request(b), b->dir, "newdir", 0755);
+	if (-1 == replied(b, FAKE_ENTRY))
+		return -1;
+
+	forget(b, b->req.reply.entry.ino, 1);
+
+	b->ops->rmdir(request(b), b->dir, "newdir");
+	return replied(b, FAKE_ERR);
+}
+
+static int list(struct bench *b, const int plus)
+{
+	struct fuse_file_info fi;
+	const struct fake_dirent *ent;
+	fuse_ino_t nodeid;
+	size_t len;
+	size_t pos;
+	size_t size;
+	off_t off = 0;
+	int ret = -1;
+
+	memset(&fi, 0, sizeof(fi));
+	b->ops->opendir(request(b), b->dir, &fi);
+	if (-1 == replied(b, FAKE_OPEN))
+		return -1;
+
+	do {
+		if (1 == plus)
+			b->ops->readdirplus(request(b), b->dir, REPLY_SIZE, off, &fi);
+		else
+			b->ops->readdir(request(b), b->dir, REPLY_SIZE, off, &fi);
+		if (-1 == replied(b, FAKE_BUF))
+			goto close_dir;
+
+		len = b->req.reply.size;
+		for (pos = 0; len > pos; pos += size) {
+			size = fake_dirent_next(&b->reply[pos],
+			                        len - pos,
+			                        plus,
+			                        &ent,
+			                        &nodeid);
+			if (0 == size)
+				goto close_dir;
+
+			off = (off_t) ent->off;
+
+			/* entries returned by readdirplus are looked up */
+			if (0 != nodeid)
+				forget(b, nodeid, 1);
+		}
+	} while (0 != len);
+
+	ret = 0;
+
+close_dir:
+	b->ops->releasedir(request(b), b->dir, &fi);
+	return ret;
+}
+
+static int do_readdir(struct bench *b, const unsigned long i)
+{
+	return list(b, 0);
+}
+
+static int do_readdirplus(struct bench *b, const unsigned long i)
+{
+	return list(b, 1);
+}
+
+static int do_rename(struct bench *b, const unsigned long i)
+{
+	static const char *names[] = {"moved0", "moved1"};
+
+	b->ops->rename(request(b),
+	               b->dir,
+	               names[i % 2],
+	               b->dir,
+	               names[(i + 1) % 2],
+	               0);
+	return replied(b, FAKE_ERR);
+}
+
+static int do_setattr(struct bench *b, const unsigned long i)
+{
+	struct stat stbuf;
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_mode = (0 == i % 2) ? 0600 : 0644;
+	b->ops->setattr(request(b), b->rw, &stbuf, FUSE_SET_ATTR_MODE, NULL);
+	return replied(b, FAKE_ATTR);
+}
+
+static int do_readlink(struct bench *b, const unsigned long i)
+{
+	b->ops->readlink(request(b), b->link);
+	return replied(b, FAKE_READLINK);
+}
+
+static const struct workload workloads[] = {
+	{"lookup", do_lookup, 1},
+	{"lookup_missing", do_lookup_missing, 1},
+	{"getattr", do_getattr, 1},
+	{"open_release", do_open, 1},
+	{"read", do_read, 1},
+	{"write", do_write, 1},
+	{"create_unlink", do_create, 1},
+	{"mkdir_rmdir", do_mkdir, 1},
+	{"readdir", do_readdir, RO_FILES},
+	{"readdirplus", do_readdirplus, RO_FILES},
+	{"rename", do_rename, 1},
+	{"setattr", do_setattr, 1},
+	{"readlink", do_readlink, 1}
+};
+
+/* fills a file with size bytes, IO_SIZE bytes of data at a time */
+static int create_file(const char *path, const char *data, const size_t size)
+{
+	size_t done;
+	int fd;
+	int ret = -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (-1 == fd)
+		return -1;
+
+	for (done = 0; size > done; done += IO_SIZE) {
+		if (IO_SIZE != write(fd, data, IO_SIZE))
+			goto close_fd;
+	}
+
+	ret = 0;
+
+close_fd:
+	(void) close(fd);
+	return ret;
+}
+
+static int create_trees(const char *base, const char *data)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+
+	(void) snprintf(path, sizeof(path), "%s/ro", base);
+	if (-1 == mkdir(path, 0755))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/rw", base);
+	if (-1 == mkdir(path, 0755))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/ro/d", base);
+	if (-1 == mkdir(path, 0755))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/rw/d", base);
+	if (-1 == mkdir(path, 0755))
+		return -1;
+
+	for (i = 0; RO_FILES > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/ro/d/f%u", base, i);
+		if (-1 == create_file(path, NULL, 0))
+			return -1;
+	}
+
+	for (i = 0; RW_FILES > i; ++i) {
+		(void) snprintf(path, sizeof(path), "%s/rw/d/w%u", base, i);
+		if (-1 == create_file(path, NULL, 0))
+			return -1;
+	}
+
+	(void) snprintf(path, sizeof(path), "%s/rw/d/moved0", base);
+	if (-1 == create_file(path, NULL, 0))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/rw/d/file", base);
+	if (-1 == create_file(path, NULL, 0))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/ro/d/big", base);
+	if (-1 == create_file(path, data, DATA_SIZE))
+		return -1;
+
+	(void) snprintf(path, sizeof(path), "%s/ro/d/link", base);
+	return symlink("big", path);
+}
+
+static int remove_path(const char *path,
+                       const struct stat *stbuf,
+                       int type,
+                       struct FTW *ftw)
+{
+	if (FTW_DP == type)
+		return rmdir(path);
+
+	return unlink(path);
+}
+
+/* looks up and opens the files all workloads use, like the kernel would have
+ * before requests get to the handlers */
+static int prepare(struct bench *b)
+{
+	unsigned int i;
+
+	b->dir = lookup(b, FUSE_ROOT_ID, "d");
+	if (0 == b->dir)
+		return -1;
+
+	for (i = 0; RO_FILES > i; ++i) {
+		(void) snprintf(b->names[i], sizeof(b->names[i]), "f%u", i);
+		b->files[i] = lookup(b, b->dir, b->names[i]);
+		if (0 == b->files[i])
+			return -1;
+	}
+
+	b->big = lookup(b, b->dir, "big");
+	b->rw = lookup(b, b->dir, "file");
+	b->link = lookup(b, b->dir, "link");
+	if ((0 == b->big) || (0 == b->rw) || (0 == b->link))
+		return -1;
+
+	memset(&b->big_fi, 0, sizeof(b->big_fi));
+	b->big_fi.flags = O_RDONLY;
+	b->ops->open(request(b), b->big, &b->big_fi);
+	if (-1 == replied(b, FAKE_OPEN))
+		return -1;
+
+	memset(&b->rw_fi, 0, sizeof(b->rw_fi));
+	b->rw_fi.flags = O_RDWR;
+	b->ops->open(request(b), b->rw, &b->rw_fi);
+	if (-1 == replied(b, FAKE_OPEN)) {
+		b->ops->release(request(b), b->big, &b->big_fi);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void release(struct bench *b)
+{
+	b->ops->release(request(b), b->big, &b->big_fi);
+	b->ops->release(request(b), b->rw, &b->rw_fi);
+}
+
+static int run(struct bench *b,
+               const struct workload *workload,
+               const unsigned long ops)
+{
+	uint64_t start;
+	uint64_t elapsed;
+	unsigned long n;
+	unsigned long before;
+	unsigned long i;
+
+	n = ops / workload->scale;
+	if (0 == n)
+		n = 1;
+
+	before = allocs;
+	start = now();
+
+	for (i = 0; n > i; ++i) {
+		if (-1 == workload->op(b, i)) {
+			(void) fprintf(stderr,
+			               "%s: unexpected reply %d (%d)\n",
+			               workload->name,
+			               (int) b->req.reply.type,
+			               b->req.reply.err);
+			return -1;
+		}
+	}
+
+	elapsed = now() - start;
+	if (0 == elapsed)
+		elapsed = 1;
+
+	(void) printf("%s\t%lu\t%.0f\t%.1f\t%.2f\n",
+	              workload->name,
+	              n,
+	              (double) n * 1000000000.0 / (double) elapsed,
+	              (double) elapsed / (double) n,
+	              (double) (allocs - before) / (double) n);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	(void) fprintf(stderr,
+	               "Usage: %s [-n OPS] [-c] [-i] [-x] [-u] [-S STATS] "
+	               "[-T TRACE]\n",
+	               prog);
+}
+
+int main(int argc, char *argv[])
+{
+	char base[] = "/tmp/luufs-ops.XXXXXX";
+	char ro[PATH_MAX];
+	char rw[PATH_MAX];
+	char index[PATH_MAX];
+	struct luufs_driver_opts opts;
+	struct bench *b;
+	unsigned long ops = 100000;
+	size_t i;
+	int opt;
+	int fd;
+	int with_index = 0;
+	int ret = EXIT_FAILURE;
+
+	luufs_driver_defaults(&opts);
+
+	while (-1 != (opt = getopt(argc, argv, "n:cixuS:T:"))) {
+		switch (opt) {
+			case 'n':
+				ops = strtoul(optarg, NULL, 10);
+				break;
+
+			/* disable the caches, to see what they save */
+			case 'c':
+				opts.ro_cache = 0;
+				opts.dir_cache = 0;
+				opts.readahead = 0;
+				break;
+
+			case 'i':
+				with_index = 1;
+				break;
+
+			case 'x':
+				opts.exclusive_rw = 1;
+				break;
+
+			case 'u':
+				opts.uring = 1;
+				break;
+
+			case 'S':
+				opts.stats = optarg;
+				break;
+
+			case 'T':
+				opts.trace = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (0 == ops) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* files are created under the writeable directory with the owner of the
+	 * request, which is root */
+	if (0 != geteuid()) {
+		(void) fprintf(stderr, "%s: must run as root\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	b = (struct bench *) malloc(sizeof(*b));
+	if (NULL == b)
+		return EXIT_FAILURE;
+	memset(b->data, 'x', sizeof(b->data));
+
+	if (NULL == mkdtemp(base)) {
+		perror(base);
+		goto free_bench;
+	}
+
+	if (-1 == create_trees(base, b->data)) {
+		perror(base);
+		goto remove_base;
+	}
+
+	(void) snprintf(ro, sizeof(ro), "%s/ro", base);
+	(void) snprintf(rw, sizeof(rw), "%s/rw", base);
+	opts.ro = ro;
+	opts.rw = rw;
+
+	/* the read-only tree is indexed once it's created */
+	if (1 == with_index) {
+		(void) snprintf(index, sizeof(index), "%s/index", base);
+
+		fd = open(ro, O_DIRECTORY);
+		if (-1 == fd) {
+			perror(ro);
+			goto remove_base;
+		}
+
+		if (-1 == roindex_write(fd, index)) {
+			perror(index);
+			(void) close(fd);
+			goto remove_base;
+		}
+		(void) close(fd);
+
+		opts.index = index;
+	}
+
+	b->ctx = luufs_driver_new(&opts);
+	if (NULL == b->ctx) {
+		perror(base);
+		goto remove_base;
+	}
+	b->ops = luufs_driver_ops(b->ctx);
+
+	if (-1 == prepare(b)) {
+		(void) fprintf(stderr, "%s: failed to look up files\n", argv[0]);
+		goto free_driver;
+	}
+
+	(void) printf("op\tops\tops_per_sec\tns_per_op\tallocs_per_op\n");
+
+	for (i = 0; sizeof(workloads) / sizeof(workloads[0]) > i; ++i) {
+		if (-1 == run(b, &workloads[i], ops))
+			goto release_files;
+	}
+
+	ret = EXIT_SUCCESS;
+
+release_files:
+	release(b);
+
+free_driver:
+	luufs_driver_free(b->ctx);
+
+remove_base:
+	(void) nftw(base, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+
+free_bench:
+	free(b);
+
+	return ret;
+}
@@ -0,0 +1,322 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "copyup.h"
+
+/* the size of each chunk, when file contents are copied through a buffer */
+#define CHUNK_SIZE (1024 * 1024)
+
+/* copies a range through a buffer; returns the number of bytes copied, which
+ * is smaller than len if the source ends first, or a negative errno value */
+static ssize_t copy_chunks(const int src,
+                           off_t in,
+                           const int dest,
+                           off_t out,
+                           off_t len)
+{
+	char *buf;
+	ssize_t got;
+	ssize_t put;
+	ssize_t done;
+	ssize_t ret;
+
+	buf = malloc(CHUNK_SIZE);
+	if (NULL == buf)
+		return -ENOMEM;
+
+	ret = 0;
+
+	while (0 < len) {
+		got = pread(src,
+		            buf,
+		            (CHUNK_SIZE < len) ? CHUNK_SIZE : (size_t) len,
+		            in);
+		if (0 == got)
+			break;
+		if (-1 == got) {
+			if (EINTR == errno)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		for (done = 0; got > done; done += put) {
+			put = pwrite(dest, &buf[done], (size_t) (got - done), out + done);
+			if (-1 == put) {
+				if (EINTR == errno) {
+					put = 0;
+					continue;
+				}
+				ret = -errno;
+				goto free_buf;
+			}
+		}
+
+		in += got;
+		out += got;
+		len -= got;
+		ret += got;
+	}
+
+free_buf:
+	free(buf);
+
+	return ret;
+}
+
+/* lets the kernel copy a range and falls back to copying through a buffer;
+ * returns the number of bytes copied, like copy_chunks() */
+static ssize_t copy_segment(const int src,
+                            off_t in,
+                            const int dest,
+                            off_t out,
+                            off_t len)
+{
+	loff_t from;
+	loff_t to;
+	ssize_t done;
+	ssize_t ret;
+
+	from = (loff_t) in;
+	to = (loff_t) out;
+	while (0 < len) {
+		done = copy_file_range(src, &from, dest, &to, (size_t) len, 0);
+		if (0 == done)
+			break;
+
+		if (-1 == done) {
+			if (EINTR == errno)
+				continue;
+
+			/* copy_file_range() may be unsupported between these files */
+			if ((EXDEV == errno) ||
+			    (EINVAL == errno) ||
+			    (ENOSYS == errno) ||
+			    (EOPNOTSUPP == errno)) {
+				ret = copy_chunks(src, (off_t) from, dest, (off_t) to, len);
+				if (0 > ret)
+					return ret;
+
+				return (ssize_t) (from - (loff_t) in) + ret;
+			}
+
+			return -errno;
+		}
+
+		len -= (off_t) done;
+	}
+
+	return (ssize_t) (from - (loff_t) in);
+}
+
+/* turns a range of the destination into a hole, or fills it with zeros if
+ * the file system does not support holes */
+static int punch_hole(const int dest, const off_t off, off_t len)
+{
+	static const char zeros[4096];
+	struct stat stbuf;
+	ssize_t done;
+	off_t pos;
+
+	if (0 == fallocate(dest,
+	                   FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                   off,
+	                   len))
+		return 0;
+
+	/* past the end of the file, the range reads as zeros anyway */
+	if (-1 == fstat(dest, &stbuf))
+		return -errno;
+	if (stbuf.st_size <= off)
+		return 0;
+	if (stbuf.st_size - off < len)
+		len = stbuf.st_size - off;
+
+	for (pos = off; off + len > pos; pos += done) {
+		done = pwrite(dest,
+		              zeros,
+		              (sizeof(zeros) < (size_t) (off + len - pos)) ?
+		              sizeof(zeros) :
+		              (size_t) (off + len - pos),
+		              pos);
+		if (-1 == done) {
+			if (EINTR != errno)
+				return -errno;
+			done = 0;
+		}
+	}
+
+	return 0;
+}
+
+ssize_t copyup_range(const int src,
+                     off_t in,
+                     const int dest,
+                     off_t out,
+                     const size_t len)
+{
+	struct stat stbuf;
+	off_t start;
+	off_t end;
+	off_t data;
+	off_t hole;
+	ssize_t done;
+	int ret;
+
+	if (-1 == fstat(src, &stbuf))
+		return -errno;
+
+	if (stbuf.st_size <= in)
+		return 0;
+
+	start = in;
+	end = stbuf.st_size;
+	if ((size_t) (end - in) > len)
+		end = in + (off_t) len;
+	hole = start;
+
+	while (end > in) {
+		/* without hole information, the whole range is data */
+		data = lseek(src, in, SEEK_DATA);
+		if (-1 == data)
+			data = (ENXIO == errno) ? end : in;
+		if (data > end)
+			data = end;
+
+		if (data > in) {
+			ret = punch_hole(dest, out, data - in);
+			if (0 != ret)
+				return ret;
+
+			out += data - in;
+			in = data;
+			if (end == in)
+				break;
+		}
+
+		hole = lseek(src, in, SEEK_HOLE);
+		if ((-1 == hole) || (hole <= in) || (hole > end))
+			hole = end;
+
+		done = copy_segment(src, in, dest, out, hole - in);
+		if (0 > done)
+			return done;
+
+		out += (off_t) done;
+		in += (off_t) done;
+
+		/* the source shrank */
+		if (hole != in)
+			return (ssize_t) (in - start);
+	}
+
+	/* if the range ends with a hole, the destination must still grow */
+	if (hole != end) {
+		if (-1 == fstat(dest, &stbuf))
+			return -errno;
+		if ((stbuf.st_size < out) && (-1 == ftruncate(dest, out)))
+			return -errno;
+	}
+
+	return (ssize_t) (end - start);
+}
+
+/* shares the contents of the file if the file system supports that, then
+ * copies them, keeping holes */
+static int copy_data(const int src, const int dest)
+{
+	ssize_t ret;
+
+	if (0 == ioctl(dest, FICLONE, src))
+		return 0;
+
+	ret = copyup_range(src, 0, dest, 0, SSIZE_MAX);
+	if (0 > ret)
+		return (int) ret;
+
+	return 0;
+}
+
+int copyup_file(const int src,
+                const struct stat *stbuf,
+                const int dir,
+                const char *name)
+{
+	static unsigned int count = 0;
+	char tmp[NAME_MAX + 1];
+	struct timespec tv[2];
+	int fd;
+	int ret;
+
+	/* the name is unique among luufs processes and threads, but another file
+	 * with the same name may exist */
+	do {
+		(void) snprintf(tmp,
+		                sizeof(tmp),
+		                ".luufs-%ld-%u",
+		                (long) getpid(),
+		                __sync_fetch_and_add(&count, 1));
+
+		fd = openat(dir,
+		            tmp,
+		            O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		            0600);
+	} while ((-1 == fd) && (EEXIST == errno));
+	if (-1 == fd)
+		return -errno;
+
+	ret = copy_data(src, fd);
+	if (0 != ret)
+		goto close_fd;
+
+	tv[0] = stbuf->st_atim;
+	tv[1] = stbuf->st_mtim;
+
+	/* change the owner first, since it clears set-user-ID bits */
+	if ((-1 == fchown(fd, stbuf->st_uid, stbuf->st_gid)) ||
+	    (-1 == fchmod(fd, stbuf->st_mode & 07777)) ||
+	    (-1 == futimens(fd, tv)))
+		ret = -errno;
+
+close_fd:
+	if ((-1 == close(fd)) && (0 == ret))
+		ret = -errno;
+
+	if ((0 == ret) && (-1 == renameat(dir, tmp, dir, name)))
+		ret = -errno;
+
+	if (0 != ret)
+		(void) unlinkat(dir, tmp, 0);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _COPYUP_H_INCLUDED
+#	define _COPYUP_H_INCLUDED
+
+#	include <sys/types.h>
+#	include <sys/stat.h>
+
+/* copies a regular file to a directory, with the attributes in stbuf; the
+ * copy is written to a temporary file and renamed, so it appears complete or
+ * not at all; returns 0 or a negative errno value */
+int copyup_file(const int src,
+                const struct stat *stbuf,
+                const int dir,
+                const char *name);
+
+/* copies a range between files, up to the end of the source; holes in the
+ * source become holes in the destination, so sparse files stay sparse;
+ * returns the number of bytes copied or a negative errno value */
+ssize_t copyup_range(const int src,
+                     off_t in,
+                     const int dest,
+                     off_t out,
+                     const size_t len);
+
+#endif
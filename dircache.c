@@ -0,0 +1,521 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dircache.h"
+
+/* a listing is not cached if any of the directories it was read from has
+ * been modified during the last second, since a change made right after the
+ * listing was read may not change the modification time */
+#define RECENT_SECS 1
+
+static size_t hash_dir(const dev_t dev, const ino_t ino)
+{
+	return (size_t) (((uint64_t) ino * 31) + (uint64_t) dev) &
+	       (DIRCACHE_BUCKETS - 1);
+}
+
+int dircache_init(struct dircache *cache, const size_t max)
+{
+	unsigned int i;
+
+	memset(cache->buckets, 0, sizeof(cache->buckets));
+	cache->newest = NULL;
+	cache->oldest = NULL;
+	cache->size = 0;
+	cache->max = max;
+	cache->count = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->enabled = 0;
+
+	/* tickets are never 0, so a 0 ticket means the listing is not cached */
+	for (i = 0; DIRCACHE_BUCKETS > i; ++i)
+		cache->gens[i] = 1;
+
+	if (0 == max)
+		return 0;
+
+	if (0 != pthread_mutex_init(&cache->lock, NULL))
+		return -1;
+
+	cache->enabled = 1;
+	return 0;
+}
+
+void dircache_free(struct dircache *cache)
+{
+	struct dircache_listing *listing;
+	struct dircache_listing *older;
+
+	if (0 == cache->enabled)
+		return;
+
+	for (listing = cache->newest; NULL != listing; listing = older) {
+		older = listing->older;
+		free(listing);
+	}
+
+	(void) pthread_mutex_destroy(&cache->lock);
+	cache->enabled = 0;
+}
+
+int dircache_stamp(struct dircache_stamp *stamp, const int fd)
+{
+	struct stat stbuf;
+
+	if (-1 == fd) {
+		memset(stamp, 0, sizeof(*stamp));
+		return 0;
+	}
+
+	if (-1 == fstat(fd, &stbuf))
+		return -1;
+
+	stamp->dev = stbuf.st_dev;
+	stamp->ino = stbuf.st_ino;
+	stamp->mtime = stbuf.st_mtim;
+	return 0;
+}
+
+static int stamps_equal(const struct dircache_stamp *a,
+                        const struct dircache_stamp *b,
+                        const unsigned int nstamps)
+{
+	unsigned int i;
+
+	for (i = 0; nstamps > i; ++i) {
+		if ((a[i].ino != b[i].ino) ||
+		    (a[i].dev != b[i].dev) ||
+		    (a[i].mtime.tv_sec != b[i].mtime.tv_sec) ||
+		    (a[i].mtime.tv_nsec != b[i].mtime.tv_nsec))
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct dircache_listing *find_listing(const struct dircache *cache,
+                                             const dev_t dev,
+                                             const ino_t ino)
+{
+	struct dircache_listing *listing;
+
+	for (listing = cache->buckets[hash_dir(dev, ino)];
+	     NULL != listing;
+	     listing = listing->next) {
+		if ((ino == listing->ino) && (dev == listing->dev))
+			return listing;
+	}
+
+	return NULL;
+}
+
+static void unlink_listing(struct dircache *cache,
+                           struct dircache_listing *listing)
+{
+	if (NULL == listing->newer)
+		cache->newest = listing->older;
+	else
+		listing->newer->older = listing->older;
+
+	if (NULL == listing->older)
+		cache->oldest = listing->newer;
+	else
+		listing->older->newer = listing->newer;
+}
+
+static void push_listing(struct dircache *cache,
+                         struct dircache_listing *listing)
+{
+	listing->newer = NULL;
+	listing->older = cache->newest;
+	if (NULL == cache->newest)
+		cache->oldest = listing;
+	else
+		cache->newest->newer = listing;
+	cache->newest = listing;
+}
+
+/* removes a listing from the cache; handles that use it keep it until they
+ * release it */
+static void remove_listing(struct dircache *cache,
+                           struct dircache_listing *listing)
+{
+	struct dircache_listing **prev;
+
+	prev = &cache->buckets[hash_dir(listing->dev, listing->ino)];
+	while (listing != *prev)
+		prev = &(*prev)->next;
+	*prev = listing->next;
+
+	unlink_listing(cache, listing);
+	cache->size -= listing->size;
+	--cache->count;
+
+	listing->cached = 0;
+	if (0 == listing->refs)
+		free(listing);
+}
+
+struct dircache_listing *dircache_get(struct dircache *cache,
+                                      const dev_t dev,
+                                      const ino_t ino,
+                                      const struct dircache_stamp *stamps,
+                                      const unsigned int nstamps)
+{
+	struct dircache_listing *listing;
+
+	if (0 == cache->enabled)
+		return NULL;
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	listing = find_listing(cache, dev, ino);
+	if (NULL == listing) {
+		++cache->misses;
+		goto unlock;
+	}
+
+	if ((nstamps != listing->nstamps) ||
+	    (0 == stamps_equal(stamps, listing->stamps, nstamps))) {
+		remove_listing(cache, listing);
+		++cache->misses;
+		listing = NULL;
+		goto unlock;
+	}
+
+	++cache->hits;
+	++listing->refs;
+
+	unlink_listing(cache, listing);
+	push_listing(cache, listing);
+
+unlock:
+	(void) pthread_mutex_unlock(&cache->lock);
+
+	return listing;
+}
+
+void dircache_release(struct dircache *cache,
+                      struct dircache_listing *listing)
+{
+	(void) pthread_mutex_lock(&cache->lock);
+
+	--listing->refs;
+	if ((0 == listing->refs) && (0 == listing->cached))
+		free(listing);
+
+	(void) pthread_mutex_unlock(&cache->lock);
+}
+
+void dircache_drop(struct dircache *cache, const dev_t dev, const ino_t ino)
+{
+	struct dircache_listing *listing;
+
+	if (0 == cache->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	/* listings of the directory being read are not cached once done */
+	++cache->gens[hash_dir(dev, ino)];
+
+	listing = find_listing(cache, dev, ino);
+	if (NULL != listing)
+		remove_listing(cache, listing);
+
+	(void) pthread_mutex_unlock(&cache->lock);
+}
+
+int dircache_builder_init(struct dircache_builder *builder,
+                          const unsigned int nstamps)
+{
+	builder->stamps = malloc(sizeof(*builder->stamps) * nstamps);
+	if (NULL == builder->stamps)
+		return -1;
+
+	builder->nstamps = nstamps;
+	builder->ents = NULL;
+	builder->cookies = NULL;
+	builder->count = 0;
+	builder->max = 0;
+	builder->names = NULL;
+	builder->len = 0;
+	builder->size = 0;
+	builder->ticket = 0;
+	return 0;
+}
+
+void dircache_builder_free(struct dircache_builder *builder)
+{
+	free(builder->names);
+	free(builder->cookies);
+	free(builder->ents);
+	free(builder->stamps);
+}
+
+void dircache_begin(struct dircache *cache,
+                    struct dircache_builder *builder,
+                    const dev_t dev,
+                    const ino_t ino)
+{
+	builder->count = 0;
+	builder->len = 0;
+	builder->ticket = 0;
+
+	if (0 == cache->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&cache->lock);
+	builder->ticket = cache->gens[hash_dir(dev, ino)];
+	(void) pthread_mutex_unlock(&cache->lock);
+}
+
+void dircache_abort(struct dircache_builder *builder)
+{
+	builder->ticket = 0;
+}
+
+int dircache_building(const struct dircache_builder *builder)
+{
+	return (0 != builder->ticket) ? 1 : 0;
+}
+
+static size_t listing_size(const struct dircache_builder *builder,
+                           const size_t count,
+                           const size_t len)
+{
+	return sizeof(struct dircache_listing) +
+	       (sizeof(struct dircache_stamp) * builder->nstamps) +
+	       (sizeof(struct dircache_ent) * count) +
+	       len;
+}
+
+void dircache_add(struct dircache *cache,
+                  struct dircache_builder *builder,
+                  const char *name,
+                  const uint64_t ino,
+                  const unsigned int type,
+                  const unsigned int list,
+                  const uint64_t cookie)
+{
+	struct dircache_ent *ents;
+	uint64_t *cookies;
+	char *names;
+	size_t len;
+	size_t max;
+	size_t size;
+
+	if (0 == builder->ticket)
+		return;
+
+	/* listings that cannot be cached are not kept */
+	len = strlen(name) + 1;
+	if ((UINT32_MAX - len < builder->len) ||
+	    (listing_size(builder,
+	                  builder->count + 1,
+	                  builder->len + len) > cache->max))
+		goto abort;
+
+	if (builder->max == builder->count) {
+		max = (0 == builder->max) ? 64 : builder->max * 2;
+
+		ents = realloc(builder->ents, sizeof(*ents) * max);
+		if (NULL == ents)
+			goto abort;
+		builder->ents = ents;
+
+		cookies = realloc(builder->cookies, sizeof(*cookies) * max);
+		if (NULL == cookies)
+			goto abort;
+		builder->cookies = cookies;
+
+		builder->max = max;
+	}
+
+	if (builder->size - builder->len < len) {
+		for (size = (0 == builder->size) ? 4096 : builder->size;
+		     size - builder->len < len;
+		     size *= 2);
+
+		names = realloc(builder->names, size);
+		if (NULL == names)
+			goto abort;
+		builder->names = names;
+		builder->size = size;
+	}
+
+	builder->ents[builder->count].ino = ino;
+	builder->ents[builder->count].name = (uint32_t) builder->len;
+	builder->ents[builder->count].type = (uint8_t) type;
+	builder->ents[builder->count].list = (uint8_t) list;
+	builder->cookies[builder->count] = cookie;
+	memcpy(&builder->names[builder->len], name, len);
+	builder->len += len;
+	++builder->count;
+	return;
+
+abort:
+	builder->ticket = 0;
+}
+
+void dircache_rewind(struct dircache_builder *builder, const uint64_t cookie)
+{
+	size_t i;
+
+	if (0 == builder->ticket)
+		return;
+
+	if (0 == cookie) {
+		builder->count = 0;
+		builder->len = 0;
+		return;
+	}
+
+	/* reading usually resumes after the last entry sent, or one sent shortly
+	 * before it */
+	for (i = builder->count; 0 < i; --i) {
+		if (cookie == builder->cookies[i - 1]) {
+			if (builder->count > i)
+				builder->len = builder->ents[i].name;
+			builder->count = i;
+			return;
+		}
+	}
+
+	builder->ticket = 0;
+}
+
+static int is_recent(const struct dircache_stamp *stamps,
+                     const unsigned int nstamps)
+{
+	struct timespec now;
+	unsigned int i;
+
+	if (-1 == clock_gettime(CLOCK_REALTIME, &now))
+		return 1;
+
+	for (i = 0; nstamps > i; ++i) {
+		if ((0 != stamps[i].ino) &&
+		    (stamps[i].mtime.tv_sec + RECENT_SECS >= now.tv_sec))
+			return 1;
+	}
+
+	return 0;
+}
+
+void dircache_put(struct dircache *cache,
+                  struct dircache_builder *builder,
+                  const dev_t dev,
+                  const ino_t ino,
+                  const struct dircache_stamp *stamps)
+{
+	struct dircache_listing *listing;
+	struct dircache_listing *old;
+	struct dircache_stamp *copy;
+	struct dircache_ent *ents;
+	char *names;
+	size_t size;
+	uint64_t ticket;
+
+	ticket = builder->ticket;
+	builder->ticket = 0;
+
+	if ((0 == ticket) ||
+	    (0 == stamps_equal(stamps, builder->stamps, builder->nstamps)) ||
+	    (1 == is_recent(stamps, builder->nstamps)))
+		return;
+
+	size = listing_size(builder, builder->count, builder->len);
+	listing = malloc(size);
+	if (NULL == listing)
+		return;
+
+	copy = (struct dircache_stamp *) &listing[1];
+	ents = (struct dircache_ent *) &copy[builder->nstamps];
+	names = (char *) &ents[builder->count];
+
+	memcpy(copy, stamps, sizeof(*copy) * builder->nstamps);
+	memcpy(ents, builder->ents, sizeof(*ents) * builder->count);
+	memcpy(names, builder->names, builder->len);
+
+	listing->dev = dev;
+	listing->ino = ino;
+	listing->size = size;
+	listing->refs = 0;
+	listing->cached = 1;
+	listing->nstamps = builder->nstamps;
+	listing->count = builder->count;
+	listing->stamps = copy;
+	listing->ents = ents;
+	listing->names = names;
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	/* if luufs changed the directory while it was read, the listing may
+	 * miss the change */
+	if (ticket != cache->gens[hash_dir(dev, ino)]) {
+		free(listing);
+		goto unlock;
+	}
+
+	old = find_listing(cache, dev, ino);
+	if (NULL != old)
+		remove_listing(cache, old);
+
+	while (cache->max - cache->size < size)
+		remove_listing(cache, cache->oldest);
+
+	listing->next = cache->buckets[hash_dir(dev, ino)];
+	cache->buckets[hash_dir(dev, ino)] = listing;
+	push_listing(cache, listing);
+	cache->size += size;
+	++cache->count;
+
+unlock:
+	(void) pthread_mutex_unlock(&cache->lock);
+}
+
+void dircache_stats(struct dircache *cache,
+                    unsigned long *hits,
+                    unsigned long *misses,
+                    size_t *count)
+{
+	*hits = 0;
+	*misses = 0;
+	*count = 0;
+
+	if (0 == cache->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*count = cache->count;
+	(void) pthread_mutex_unlock(&cache->lock);
+}
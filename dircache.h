@@ -0,0 +1,167 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _DIRCACHE_H_INCLUDED
+#	define _DIRCACHE_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <time.h>
+#	include <sys/types.h>
+#	include <pthread.h>
+
+#	define DIRCACHE_BUCKETS 1024
+
+/* the identity and modification time of a directory a listing was read from;
+ * ino is 0 if the directory does not exist */
+struct dircache_stamp {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+/* a listing entry; name is the offset of its name and list is the listing it
+ * was read from */
+struct dircache_ent {
+	uint64_t ino;
+	uint32_t name;
+	uint8_t type;
+	uint8_t list;
+};
+
+/* a merged, deduplicated directory listing, stored in a single allocation
+ * with the stamps of the directories it was read from, its entries and their
+ * names; it never changes, so directory handles share it without locking, and
+ * it's freed when it's no longer cached and the last handle releases it */
+struct dircache_listing {
+	struct dircache_listing *next;
+	struct dircache_listing *newer;
+	struct dircache_listing *older;
+	dev_t dev;
+	ino_t ino;
+	size_t size;
+	unsigned int refs;
+	int cached;
+	unsigned int nstamps;
+	size_t count;
+	const struct dircache_stamp *stamps;
+	const struct dircache_ent *ents;
+	const char *names;
+};
+
+/* a listing being read; each entry carries the cookie it was sent with, so
+ * reading can go back to any entry sent before */
+struct dircache_builder {
+	struct dircache_stamp *stamps;
+	unsigned int nstamps;
+	struct dircache_ent *ents;
+	uint64_t *cookies;
+	size_t count;
+	size_t max;
+	char *names;
+	size_t len;
+	size_t size;
+	uint64_t ticket;
+};
+
+/* a cache of merged listings, keyed by the inode of the directory and bound
+ * by the total size of the listings; a listing is dropped when luufs changes
+ * the directory and ignored if any of the directories it was read from has
+ * been modified since */
+struct dircache {
+	pthread_mutex_t lock;
+	struct dircache_listing *buckets[DIRCACHE_BUCKETS];
+	uint64_t gens[DIRCACHE_BUCKETS];
+	struct dircache_listing *newest;
+	struct dircache_listing *oldest;
+	size_t size;
+	size_t max;
+	size_t count;
+	unsigned long hits;
+	unsigned long misses;
+	int enabled;
+};
+
+int dircache_init(struct dircache *cache, const size_t max);
+void dircache_free(struct dircache *cache);
+
+/* fills the stamp of a directory, given its handle or -1 if it's missing */
+int dircache_stamp(struct dircache_stamp *stamp, const int fd);
+
+/* returns the cached listing of a directory, which must be released with
+ * dircache_release(), or NULL if there is none or it's stale */
+struct dircache_listing *dircache_get(struct dircache *cache,
+                                      const dev_t dev,
+                                      const ino_t ino,
+                                      const struct dircache_stamp *stamps,
+                                      const unsigned int nstamps);
+void dircache_release(struct dircache *cache,
+                      struct dircache_listing *listing);
+
+/* drops the listing of a directory, after luufs changes it */
+void dircache_drop(struct dircache *cache, const dev_t dev, const ino_t ino);
+
+int dircache_builder_init(struct dircache_builder *builder,
+                          const unsigned int nstamps);
+void dircache_builder_free(struct dircache_builder *builder);
+
+/* starts reading a listing of a directory; the stamps of the directories it
+ * is read from must be filled before they are read */
+void dircache_begin(struct dircache *cache,
+                    struct dircache_builder *builder,
+                    const dev_t dev,
+                    const ino_t ino);
+
+/* stops building a listing that cannot be cached */
+void dircache_abort(struct dircache_builder *builder);
+
+int dircache_building(const struct dircache_builder *builder);
+
+/* adds an entry to a listing; on failure, the listing is aborted */
+void dircache_add(struct dircache *cache,
+                  struct dircache_builder *builder,
+                  const char *name,
+                  const uint64_t ino,
+                  const unsigned int type,
+                  const unsigned int list,
+                  const uint64_t cookie);
+
+/* drops the entries that follow the one sent with a cookie, or all entries
+ * if the cookie is 0; if there is no such entry, the listing is aborted */
+void dircache_rewind(struct dircache_builder *builder, const uint64_t cookie);
+
+/* caches a complete listing, unless the directory has changed since it was
+ * started; stamps are the stamps of the directories once read */
+void dircache_put(struct dircache *cache,
+                  struct dircache_builder *builder,
+                  const dev_t dev,
+                  const ino_t ino,
+                  const struct dircache_stamp *stamps);
+
+void dircache_stats(struct dircache *cache,
+                    unsigned long *hits,
+                    unsigned long *misses,
+                    size_t *count);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _DRIVER_H_INCLUDED
+#	define _DRIVER_H_INCLUDED
+
+#	ifndef FUSE_USE_VERSION
+#		define FUSE_USE_VERSION (312)
+#	endif
+#	include <fuse_lowlevel.h>
+
+/* luufs.c built with LUUFS_DRIVER is a library without main(): a union is
+ * set up the way the mount sets it up, but requests are made by calling the
+ * handlers directly, against a libfuse stand-in that records replies */
+
+struct luufs_ctx;
+
+/* the options of a union; the command-line options of luufs contain these,
+ * so the driver can enable everything the mount can, but the session; rw is
+ * NULL if there's no writeable directory */
+struct luufs_driver_opts {
+	const char *ro;
+	const char *rw;
+	unsigned int ro_cache;
+	int immutable_ro;
+	double ro_timeout;
+	const char *index;
+	int copy_up;
+	unsigned long copy_async;
+	int pin_workers;
+	const char *stats;
+	const char *trace;
+	unsigned long max_handles;
+	int exclusive_rw;
+	int uring;
+	unsigned long dir_cache;
+	unsigned long readahead;
+	const char *profile;
+	unsigned int record;
+	unsigned int prefetch_threads;
+	unsigned long ram_rw;
+	unsigned int flush_interval;
+};
+
+void luufs_driver_defaults(struct luufs_driver_opts *opts);
+struct luufs_ctx *luufs_driver_new(const struct luufs_driver_opts *opts);
+const struct fuse_lowlevel_ops *luufs_driver_ops(const struct luufs_ctx *ctx);
+void luufs_driver_free(struct luufs_ctx *ctx);
+
+#endif
@@ -23,6 +23,7 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -33,19 +34,163 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <stdarg.h>
-
-#include <zlib.h>
-#define FUSE_USE_VERSION (26)
-#include <fuse.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <syslog.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#define FUSE_USE_VERSION (312)
+#include <fuse_lowlevel.h>
 
 #ifdef HAVE_WAIVE
 #	include <waive.h>
 #endif
 
-#define DIRENT_MAX 255
+#include "nameset.h"
+#include "rocache.h"
+#include "roindex.h"
+#include "rwmap.h"
+#include "dircache.h"
+#include "readahead.h"
+#include "profile.h"
+#include "ramrw.h"
+#include "copyup.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+#include "driver.h"
+
+#ifdef HAVE_SDT
+#	include <sys/sdt.h>
+#endif
+
+/* the number of seconds the kernel may cache names and attributes of files
+ * under the writeable directory for */
+#define LUUFS_TIMEOUT (1.0)
+
+/* the default number of seconds for files under the read-only directory,
+ * whose changes are reported to the kernel */
+#define RO_TIMEOUT (86400.0)
+
+/* the default maximum number of cached lookups under the read-only
+ * directory */
+#define RO_CACHE_SIZE 65536
+
+/* the default maximum total size of cached directory listings */
+#define DIR_CACHE_SIZE (8 * 1024 * 1024)
+
+/* the default maximum size of a range read ahead of a sequential reader */
+#define READAHEAD_SIZE (8 * 1024 * 1024)
+
+/* the default number of threads that prefetch files in a profile */
+#define PREFETCH_THREADS 4
+
+/* the default size of files copied to the writeable directory by a separate
+ * thread */
+#define COPY_ASYNC_SIZE (16 * 1024 * 1024)
+
+/* the default number of seconds between copies of an in-memory writeable
+ * directory to the disk */
+#define FLUSH_INTERVAL 5
+
+/* the default maximum size of a write request; libfuse and the kernel lower it
+ * to the largest size they support */
+#define LUUFS_MAX_WRITE (1024 * 1024)
+
+/* the initial number of inode table buckets; must be a power of 2 */
+#define NODE_BUCKETS 1024
+
+/* set in the pin count of an inode whose handles were closed to stay within
+ * the handle budget */
+#define NODE_EVICTED (1U << 31)
+
+/* the maximum number of lookups whose system calls are submitted together */
+#define PROBE_BATCH 32
+
+/* the number of recent lookups the miss rate under the read-only directory is
+ * measured over */
+#define PROBE_WINDOW 256
+
+/* the maximum number of read-only directories */
+#define LUUFS_MAX_RO 64
+
+#define LUUFS_RO 0
+#define LUUFS_RW 1
+
+/* the layer of files under an in-memory writeable directory that are read
+ * from the disk */
+#define LUUFS_DISK 2
+
+/* the length of a /proc/self/fd/N path, including the terminating NUL */
+#define PROC_PATH_MAX sizeof("/proc/self/fd/-2147483648")
+
+/* an inode, identified by the file it resolves to; it holds an O_PATH handle
+ * to the file under the first read-only directory it exists in, whose index
+ * is ro, and under the writeable directory, so all operations can be
+ * performed relative to it instead of walking the full path again; a
+ * directory found under more read-only directories holds handles of its
+ * counterparts under the ones that follow in lower, which are opened when
+ * first needed; requests pin the inode while they use its handles, and
+ * handles of unpinned inodes may be closed and reopened later through their
+ * file handles; the kernel accepts one backing file per inode, so nfiles open
+ * files share backing_id, registered for the file under backing_layer; once
+ * its handles are closed, a removed file's inode number may be given to
+ * another file, so the inode is detached from the table and only the kernel
+ * may refer to it */
+struct luufs_node {
+	struct luufs_node *next;
+	uint64_t nlookup;
+	dev_t dev;
+	ino_t ino;
+	int fds[2];
+	struct file_handle *handles[2];
+	int *lower;
+	unsigned int nlower;
+	unsigned int ro;
+	unsigned int pins;
+	int referenced;
+	int no_handle;
+	int detached;
+	int layer;
+	unsigned int nfiles;
+	int backing_id;
+	int backing_layer;
+};
+
+/* the inode table; nfds counts the handles held by inodes in it, which are
+ * closed in clock order once there are more than max_fds, unless max_fds is
+ * 0, and nros is the number of read-only directories; detached inodes are
+ * kept in a list of their own, until the kernel forgets them */
+struct luufs_node_table {
+	pthread_mutex_t lock;
+	struct luufs_node **buckets;
+	struct luufs_node *detached;
+	size_t size;
+	size_t count;
+	unsigned int nros;
+	size_t nfds;
+	size_t max_fds;
+	size_t hand;
+	int mounts[2];
+	int mount_ids[2];
+};
+
+/* a read-only directory; its resolved path is used to find the paths of
+ * files under it */
+struct luufs_ro {
+	int fd;
+	char *path;
+	size_t len;
+};
 
 struct luufs_ctx {
-	uLong init;
 	int (*openat)(int, const char *, int, ...);
 	int (*unlinkat)(int, const char *, int);
 	int (*fchownat)(int, const char *, uid_t, gid_t, int);
@@ -55,740 +200,4401 @@ struct luufs_ctx {
 	int (*symlinkat)(const char *, int, const char *);
 	int (*utimensat)(int, const char *, const struct timespec[2], int);
 	int (*fstatat)(int, const char *, struct stat *, int);
-	int ro;
+	struct luufs_ro ros[LUUFS_MAX_RO];
+	unsigned int nros;
 	int rw;
+	struct luufs_node root;
+	struct luufs_node_table nodes;
+	struct rocache cache;
+	struct roindex index;
+	struct rwmap rwmap;
+	struct dircache listings;
+	struct readahead ra;
+	struct profile profile;
+	struct ramrw ram;
+	struct luufs_copy *copies;
+	unsigned long copy_async;
+	int copy_up;
+	struct fuse_conn_info_opts *conn_opts;
+	struct fuse_session *se;
+	double ro_timeout;
+	double rw_timeout;
+	int passthrough;
+	pthread_key_t worker_key;
+	cpu_set_t cpus;
+	int ncpus;
+	int pin_workers;
+	unsigned int next_cpu;
+	int uring;
+	int measure;
+	struct stats stats;
+	struct trace trace;
+	pthread_t dumper;
+	int sfd;
+	int efd;
+};
+
+/* the operations of requests that wait for a copy */
+#define COPY_OPEN 0
+#define COPY_SETATTR 1
+
+/* a request that waits for a file to be copied to the writeable directory */
+struct luufs_waiter {
+	struct luufs_waiter *next;
+	fuse_req_t req;
+	struct fuse_file_info fi;
+	struct stat attr;
+	int to_set;
+	int op;
+};
+
+/* a file being copied to the writeable directory; the list of copies is
+ * protected by the inode table lock */
+struct luufs_copy {
+	struct luufs_copy *next;
+	struct luufs_ctx *ctx;
+	struct luufs_node *node;
+	struct luufs_waiter *waiters;
+};
+
+/* per-worker state, created when a worker thread handles its first request;
+ * buf holds replies, so handlers running in the same thread can share it,
+ * outcome and err are the outcome of the request being measured and the error
+ * it failed with, and lookups and misses count recent lookups under
+ * directories that exist under both directories and those not resolved under
+ * the read-only one */
+struct luufs_worker {
+	char *buf;
+	size_t size;
+	struct uring *ring;
+	unsigned int lookups;
+	unsigned int misses;
+	struct stats_thread *stats;
+	struct trace_ring *trace;
+	struct trace_event event;
+	int outcome;
+	int err;
 };
 
+/* command-line options */
+struct luufs_opts {
+	const char *dirs[3];
+	int ndirs;
+	int build_index;
+	int no_passthrough;
+	unsigned int workers;
+	struct luufs_driver_opts ctx;
+};
+
+/* an open file; when the kernel performs I/O directly against fd, backing_id
+ * identifies it, and otherwise, reads are tracked in ra and, while a profile
+ * is recorded, in prof */
+struct luufs_file {
+	struct luufs_node *node;
+	int fd;
+	int backing_id;
+	struct readahead_file ra;
+	struct profile_entry *prof;
+};
+
+/* a directory listed under one of the directories; pos counts the entries
+ * read from it */
+struct luufs_dir_list {
+	DIR *dir;
+	int fd;
+	off_t pos;
+};
+
+/* a directory handle, which lists the directory under each read-only
+ * directory in order, then under the writeable one; names holds the names
+ * read from each listing but the last one, tagged with the first listing they
+ * were read from, and is complete for the listings before merged; the entries
+ * sent are collected in build, so the merged listing can be cached once read
+ * to its end, and a handle opened while it's cached reads listing instead */
 struct luufs_dir_ctx {
-	DIR *dirs[2];
-	int fds[2];
+	struct dircache_listing *listing;
+	struct dircache_builder build;
+	dev_t dev;
+	ino_t ino;
+	struct nameset names;
+	unsigned int count;
+	unsigned int last;
+	unsigned int merged;
+	struct luufs_dir_list lists[];
 };
 
-#define f_ro fds[0]
-#define f_rw fds[1]
+#define f_ro fds[LUUFS_RO]
+#define f_rw fds[LUUFS_RW]
 
-#define d_ro dirs[0]
-#define d_rw dirs[1]
+/* each directory entry offset encodes the listing the entry was read from
+ * and its position there, so reading can resume from any entry */
+#define DIR_OFF(list, pos) ((((off_t) (pos)) << 7) | (off_t) (list))
+#define OFF_LIST(off) ((unsigned int) ((off) & 0x7f))
+#define OFF_POS(off) ((off) >> 7)
 
 /* since luufs runs as root, no permission checks are performed (in other words:
  * the process that actually calls the *at() system calls is luufs, which runs
- * as root), so when the calling process runs as an unprivileged user, return
- * EPERM in errno */
+ * as root), so when the calling process runs as an unprivileged user, reply
+ * with EPERM */
 #define LUUFS_CALL_HEAD()                                    \
-	const struct luufs_ctx *ctx;                             \
-	const struct fuse_context *fuse_ctx;                     \
+	struct luufs_ctx *ctx;                                   \
+	const struct fuse_ctx *fuse_ctx;                         \
 	                                                         \
-	fuse_ctx = fuse_get_context();                           \
-	ctx = (const struct luufs_ctx *) fuse_ctx->private_data; \
+	fuse_ctx = fuse_req_ctx(req);                            \
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);       \
 	                                                         \
-	if ((0 != fuse_ctx->uid) || (0 != fuse_ctx->gid))        \
-		return -EPERM
+	do {                                                     \
+		if ((0 != fuse_ctx->uid) || (0 != fuse_ctx->gid)) {  \
+			(void) reply_err(req, EPERM);                    \
+			return;                                          \
+		}                                                    \
+	} while (0)
+
+/* returns the state of the calling worker, if requests are measured */
+static struct luufs_worker *measured(struct luufs_ctx *ctx)
+{
+	if (0 == ctx->measure)
+		return NULL;
+
+	return (struct luufs_worker *) pthread_getspecific(ctx->worker_key);
+}
 
-static int luufs_open(const char *name, struct fuse_file_info *fi)
+/* records the outcome of the request handled by the calling worker */
+static void set_outcome(struct luufs_ctx *ctx, const int outcome)
 {
-	struct stat stbuf;
-	int fd;
+	struct luufs_worker *worker;
 
-	LUUFS_CALL_HEAD();
+	worker = measured(ctx);
+	if (NULL != worker)
+		worker->outcome = outcome;
+}
 
-	/* when a file is opened for reading, prefer the read-only directory */
-	if ((0 == (O_WRONLY & fi->flags)) && (0 == (O_RDWR & fi->flags))) {
-		fd = ctx->openat(ctx->ro, &name[1], fi->flags);
-		if (-1 != fd)
-			goto ok;
-		if (ENOENT != errno)
-			return -errno;
+static int reply_err(fuse_req_t req, const int err)
+{
+	struct luufs_worker *worker;
+
+	if (0 != err) {
+		worker = measured((struct luufs_ctx *) fuse_req_userdata(req));
+		if (NULL != worker) {
+			worker->outcome = (EROFS == err) ? STATS_EROFS : STATS_ERROR;
+			worker->err = err;
+		}
 	}
 
-	/* return EROFS in errno if it's an attempt to overwrite a file under the
-	 * read-only directory */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	return fuse_reply_err(req, err);
+}
 
-	fd = ctx->openat(ctx->rw, &name[1], fi->flags);
-	if (-1 == fd)
-		return -errno;
+static size_t node_hash(const dev_t dev, const ino_t ino, const size_t size)
+{
+	return (size_t) (((uint64_t) ino * 31) + (uint64_t) dev) & (size - 1);
+}
 
-ok:
-	/* make sure the file descriptor does not exceed INT_MAX, to prevent
-	 * truncation when casting the uint64_t back to int later */
-	if (INT_MAX < fd) {
-		(void) close(fd);
-		return -EMFILE;
+static int node_table_init(struct luufs_node_table *table)
+{
+	table->buckets = calloc(NODE_BUCKETS, sizeof(*table->buckets));
+	if (NULL == table->buckets)
+		return -1;
+
+	if (0 != pthread_mutex_init(&table->lock, NULL)) {
+		free(table->buckets);
+		return -1;
 	}
 
-	fi->fh = (uint64_t) fd;
+	table->size = NODE_BUCKETS;
+	table->detached = NULL;
+	table->count = 0;
+	table->nros = 1;
+	table->nfds = 0;
+	table->max_fds = 0;
+	table->hand = 0;
 
 	return 0;
 }
 
-static int luufs_create(const char *name,
-                        mode_t mode,
-                        struct fuse_file_info *fi)
+/* bounds the number of handles held by inodes; dirs are the handles of the
+ * two directories, which handles of files under them are reopened through */
+static void node_table_limit(struct luufs_node_table *table,
+                             const size_t max_fds,
+                             const int dirs[2])
 {
-	struct stat stbuf;
-	int ret;
-	int fd;
+	uint64_t buf[(sizeof(struct file_handle) + MAX_HANDLE_SZ) /
+	             sizeof(uint64_t) + 1];
+	struct file_handle *handle = (struct file_handle *) buf;
+	int i;
 
-	LUUFS_CALL_HEAD();
+	table->max_fds = 0;
 
-	/* if the file already exists, return EEXIST in errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
-		ret = -EEXIST;
-		goto out;
-	}
+	for (i = 0; 2 > i; ++i) {
+		table->mounts[i] = dirs[i];
+		table->mount_ids[i] = -1;
+		if (-1 == dirs[i])
+			continue;
 
-	fd = ctx->openat(ctx->rw, &name[1], O_CREAT | O_EXCL | fi->flags, mode);
-	if (-1 == fd) {
-		ret = -errno;
-		goto out;
+		/* if the file system does not support file handles, handles of
+		 * files under the directory are never closed */
+		handle->handle_bytes = MAX_HANDLE_SZ;
+		if ((0 == name_to_handle_at(dirs[i],
+		                            "",
+		                            handle,
+		                            &table->mount_ids[i],
+		                            AT_EMPTY_PATH)) &&
+		    (0 != max_fds))
+			table->max_fds = max_fds;
 	}
+}
 
-	if (INT_MAX < fd) {
-		ret = -EMFILE;
-		goto close_fd;
-	}
+/* closes the handles of a directory under the read-only directories that
+ * follow the first one it exists in */
+static void node_close_lower(struct luufs_node *node, const unsigned int nros)
+{
+	unsigned int i;
 
-	/* change the file owner, using the calling process credentials */
-	if (-1 == fchown(fd, fuse_ctx->uid, fuse_ctx->gid)) {
-		ret = -errno;
-		goto close_fd;
+	if (NULL == node->lower)
+		return;
+
+	for (i = node->ro + 1; nros > i; ++i) {
+		if (-1 != node->lower[i])
+			(void) close(node->lower[i]);
 	}
 
-	fi->fh = (uint64_t) fd;
+	free(node->lower);
+	node->lower = NULL;
+	node->nlower = 0;
+}
 
-	return 0;
+static void node_free(struct luufs_node *node, const unsigned int nros)
+{
+	unsigned int i;
 
-close_fd:
-	(void) close(fd);
+	for (i = 0; 2 > i; ++i) {
+		if (-1 != node->fds[i])
+			(void) close(node->fds[i]);
+		free(node->handles[i]);
+	}
 
-out:
-	return ret;
+	node_close_lower(node, nros);
+	free(node);
 }
 
-static int luufs_close(const char *name, struct fuse_file_info *fi)
+/* returns the number of handles an inode holds */
+static size_t node_nfds(const struct luufs_node *node)
 {
-	int fd;
-
-	fd = (int) fi->fh;
-	if (-1 == fd)
-		return -EBADF;
-
-	if (0 == close(fd)) {
-		fi->fh = -1;
-		return 0;
-	}
+	return ((-1 == node->f_ro) ? 0 : 1) +
+	       ((-1 == node->f_rw) ? 0 : 1) +
+	       node->nlower;
+}
 
-	return -errno;
+/* returns a file handle that identifies the file a handle points to, or NULL
+ * if the file cannot be reopened through the directory's handle */
+static struct file_handle *node_handle(const struct luufs_node_table *table,
+                                       const int layer,
+                                       const int fd)
+{
+	uint64_t buf[(sizeof(struct file_handle) + MAX_HANDLE_SZ) /
+	             sizeof(uint64_t) + 1];
+	struct file_handle *handle = (struct file_handle *) buf;
+	struct file_handle *copy;
+	int mount_id;
+
+	handle->handle_bytes = MAX_HANDLE_SZ;
+	if ((-1 == name_to_handle_at(fd, "", handle, &mount_id, AT_EMPTY_PATH)) ||
+	    (mount_id != table->mount_ids[layer]))
+		return NULL;
+
+	copy = malloc(sizeof(*copy) + handle->handle_bytes);
+	if (NULL != copy)
+		memcpy(copy, handle, sizeof(*copy) + handle->handle_bytes);
+
+	return copy;
 }
 
-static int luufs_truncate(const char *name, off_t size)
+/* closes the handles of an inode no request uses, unless it was used since
+ * the clock hand last passed it; the table must be locked */
+static void node_evict(struct luufs_node_table *table, struct luufs_node *node)
 {
-	struct stat stbuf;
-	int fd;
-	int ret;
+	unsigned int pins;
+	int i;
 
-	LUUFS_CALL_HEAD();
+	if ((1 == node->no_handle) || (0 == node_nfds(node)))
+		return;
 
-	/* if the file exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
-		ret = -EROFS;
-		goto out;
+	if (1 == __atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&node->referenced, 0, __ATOMIC_RELAXED);
+		return;
 	}
 
-	/* try to open the file - if it's missing, create it */
-	fd = ctx->openat(ctx->rw, &name[1], O_WRONLY);
-	if (-1 == fd) {
-		if (ENOENT == errno) {
-			fd = ctx->openat(ctx->rw, &name[1], O_WRONLY | O_CREAT | O_EXCL);
-			if (-1 != fd)
-				goto trunc;
-		}
+	if (0 != __atomic_load_n(&node->pins, __ATOMIC_RELAXED))
+		return;
 
-		ret = -errno;
-		goto out;
+	/* file handles never change, so each is obtained once */
+	for (i = 0; 2 > i; ++i) {
+		if ((-1 == node->fds[i]) || (NULL != node->handles[i]))
+			continue;
+
+		node->handles[i] = node_handle(table, i, node->fds[i]);
+		if (NULL == node->handles[i]) {
+			node->no_handle = 1;
+			return;
+		}
 	}
 
-trunc:
-	ret = ftruncate(fd, size);
-	if (0 != ret)
-		ret = -errno;
+	/* a request may have pinned the inode meanwhile */
+	pins = 0;
+	if (!__atomic_compare_exchange_n(&node->pins,
+	                                 &pins,
+	                                 NODE_EVICTED,
+	                                 0,
+	                                 __ATOMIC_ACQUIRE,
+	                                 __ATOMIC_RELAXED))
+		return;
 
-	(void) close(fd);
+	for (i = 0; 2 > i; ++i) {
+		if (-1 == node->fds[i])
+			continue;
 
-out:
-	return ret;
+		(void) close(node->fds[i]);
+		node->fds[i] = -1;
+		--table->nfds;
+	}
+
+	/* the handles under other read-only directories are opened again by
+	 * path */
+	table->nfds -= node->nlower;
+	node_close_lower(node, table->nros);
 }
 
-static int luufs_stat(const char *name, struct stat *stbuf)
+/* closes handles until there are fewer than the budget, so handles reopened
+ * soon after do not close others right away; the table must be locked */
+static void node_table_evict(struct luufs_node_table *table)
 {
-	LUUFS_CALL_HEAD();
+	struct luufs_node *node;
+	size_t target;
+	size_t i;
 
-	/* try the read-only directory first */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return 0;
-	if (ENOENT != errno)
-		return -errno;
+	target = table->max_fds - (table->max_fds / 8);
 
-	if (0 == ctx->fstatat(ctx->rw,
-	                      &name[1],
-	                      stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return 0;
+	for (i = 0; (table->nfds > target) && (2 * table->size > i); ++i) {
+		node = table->buckets[table->hand & (table->size - 1)];
+		for (; NULL != node; node = node->next)
+			node_evict(table, node);
 
-	return -errno;
+		++table->hand;
+	}
 }
 
-static int luufs_access(const char *name, int mask)
+static void node_table_free(struct luufs_node_table *table)
 {
-	struct stat stbuf;
-	const char *namep;
-
-	LUUFS_CALL_HEAD();
+	struct luufs_node *node;
+	struct luufs_node *next;
+	size_t i;
+
+	for (i = 0; table->size > i; ++i) {
+		for (node = table->buckets[i]; NULL != node; node = next) {
+			next = node->next;
+			node_free(node, table->nros);
+		}
+	}
 
-	if (0 == strcmp("/", name))
-		namep = name;
-	else
-		namep = &name[1];
+	for (node = table->detached; NULL != node; node = next) {
+		next = node->next;
+		node_free(node, table->nros);
+	}
 
-	if (0 != (F_OK & mask))
-		return luufs_stat(namep, &stbuf);
+	free(table->buckets);
+	(void) pthread_mutex_destroy(&table->lock);
+}
 
-	/* perform all access checks except W_OK on the read-only directory; musl
-	 * does not support AT_SYMLINK_NOFOLLOW so we don't pass this flag */
-	if (0 != (W_OK & mask)) {
-		if (-1 == faccessat(ctx->rw, namep, mask, 0))
-			return -errno;
-	}
-	else {
-		if (-1 == faccessat(ctx->ro, namep, mask, 0))
-			return -errno;
+static void node_table_grow(struct luufs_node_table *table)
+{
+	struct luufs_node **buckets;
+	struct luufs_node *node;
+	struct luufs_node *next;
+	size_t size;
+	size_t i;
+	size_t j;
+
+	/* if there's not enough memory, keep the current buckets: longer chains
+	 * are slower, but still correct */
+	size = table->size * 2;
+	buckets = calloc(size, sizeof(*buckets));
+	if (NULL == buckets)
+		return;
+
+	for (i = 0; table->size > i; ++i) {
+		for (node = table->buckets[i]; NULL != node; node = next) {
+			next = node->next;
+			j = node_hash(node->dev, node->ino, size);
+			node->next = buckets[j];
+			buckets[j] = node;
+		}
 	}
 
-	return 0;
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
 }
 
-static int luufs_read(const char *path,
-                      char *buf,
-                      size_t size,
-                      off_t off,
-                      struct fuse_file_info *fi)
+/* returns 0 if the inode of a file whose handles were closed belongs to
+ * another file now, judging by the file handles of both */
+static int node_same(const struct luufs_node_table *table,
+                     const struct luufs_node *node,
+                     const int fds[2])
 {
-	ssize_t ret;
-	int fd;
+	struct file_handle *handle;
+	int same;
+	int i;
 
-	fd = (int) fi->fh;
-	if (-1 == fd)
-		return -EBADF;
+	for (i = 0; 2 > i; ++i) {
+		if ((-1 == fds[i]) || (NULL == node->handles[i]))
+			continue;
 
-	ret = pread(fd, buf, size, off);
-	if (-1 == ret)
-		return -errno;
+		handle = node_handle(table, i, fds[i]);
+		if (NULL == handle)
+			continue;
+
+		same = ((handle->handle_bytes == node->handles[i]->handle_bytes) &&
+		        (handle->handle_type == node->handles[i]->handle_type) &&
+		        (0 == memcmp(handle->f_handle,
+		                     node->handles[i]->f_handle,
+		                     handle->handle_bytes))) ? 1 : 0;
+		free(handle);
+		return same;
+	}
 
-	return (int) ret;
+	return 1;
 }
 
-static int luufs_write(const char *path,
-                       const char *buf,
-                       size_t size,
-                       off_t off,
-                       struct fuse_file_info *fi)
+/* returns the inode of a file and increments its lookup count; the handles
+ * are either stored in the inode or closed */
+static struct luufs_node *node_ref(struct luufs_node_table *table,
+                                   int fds[2],
+                                   const int layer,
+                                   const unsigned int ro,
+                                   const struct stat *stbuf)
 {
-	ssize_t ret;
-	int fd;
+	struct luufs_node **prev;
+	struct luufs_node *node;
+	size_t i;
 
-	fd = (int) fi->fh;
-	if (-1 == fd)
-		return -EBADF;
+	(void) pthread_mutex_lock(&table->lock);
 
-	ret = pwrite(fd, buf, size, off);
-	if (-1 == ret)
-		return -errno;
+	i = node_hash(stbuf->st_dev, stbuf->st_ino, table->size);
+	for (prev = &table->buckets[i]; NULL != *prev; prev = &(*prev)->next) {
+		node = *prev;
+		if ((stbuf->st_ino != node->ino) || (stbuf->st_dev != node->dev))
+			continue;
 
-	return (int) ret;
-}
+		if ((0 != (NODE_EVICTED & node->pins)) &&
+		    (0 == node_same(table, node, fds))) {
+			*prev = node->next;
+			node->next = table->detached;
+			table->detached = node;
+			node->detached = 1;
+			--table->count;
+			break;
+		}
 
-static int luufs_unlink(const char *name)
-{
-	struct stat stbuf;
+		++node->nlookup;
 
-	LUUFS_CALL_HEAD();
+		/* the directory may have been created under the writeable directory
+		 * after the inode was; if the inode's handles were closed, the new
+		 * one is kept and the old one is not reopened */
+		if ((-1 == node->f_rw) && (-1 != fds[LUUFS_RW])) {
+			node->f_rw = fds[LUUFS_RW];
+			fds[LUUFS_RW] = -1;
+			++table->nfds;
+		}
 
-	/* if the file exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+		goto unlock;
+	}
 
-	if (0 == ctx->unlinkat(ctx->rw, &name[1], 0))
-		return 0;
+	node = malloc(sizeof(*node));
+	if (NULL == node)
+		goto unlock;
+
+	node->nlookup = 1;
+	node->dev = stbuf->st_dev;
+	node->ino = stbuf->st_ino;
+	node->f_ro = fds[LUUFS_RO];
+	node->f_rw = fds[LUUFS_RW];
+	node->handles[LUUFS_RO] = NULL;
+	node->handles[LUUFS_RW] = NULL;
+	node->lower = NULL;
+	node->nlower = 0;
+	node->ro = ro;
+	node->pins = 0;
+	node->referenced = 1;
+	node->no_handle = 0;
+	node->detached = 0;
+	node->layer = layer;
+	node->nfiles = 0;
+	node->backing_id = 0;
+	node->backing_layer = layer;
+	fds[LUUFS_RO] = -1;
+	fds[LUUFS_RW] = -1;
+
+	node->next = table->buckets[i];
+	table->buckets[i] = node;
+	table->nfds += node_nfds(node);
+
+	++table->count;
+	if (table->count > table->size)
+		node_table_grow(table);
+
+unlock:
+	if ((0 != table->max_fds) && (table->nfds > table->max_fds))
+		node_table_evict(table);
+
+	(void) pthread_mutex_unlock(&table->lock);
+
+	for (i = 0; 2 > i; ++i) {
+		if (-1 != fds[i])
+			(void) close(fds[i]);
+	}
 
-	return -errno;
+	return node;
 }
 
-static int luufs_mkdir(const char *name, mode_t mode)
+/* drops references to an inode, with the table locked; returns 1 if it was
+ * the last one, and the inode must be freed once the table is unlocked */
+static int node_drop(struct luufs_node_table *table,
+                     struct luufs_node *node,
+                     const uint64_t nlookup)
 {
-	struct stat stbuf;
+	struct luufs_node **prev;
 
-	LUUFS_CALL_HEAD();
+	node->nlookup -= nlookup;
+	if (0 != node->nlookup)
+		return 0;
 
-	/* if the directory exists under the read-only directory, return EEXIST in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EEXIST;
-	if (ENOENT != errno)
-		return -errno;
+	if (0 == node->detached) {
+		prev = &table->buckets[node_hash(node->dev, node->ino, table->size)];
+		--table->count;
+	}
+	else
+		prev = &table->detached;
 
-	if (-1 == ctx->mkdirat(ctx->rw, &name[1], mode))
-		return -errno;
+	while (node != *prev)
+		prev = &(*prev)->next;
+	*prev = node->next;
+	table->nfds -= node_nfds(node);
 
-	if (-1 == ctx->fchownat(ctx->rw,
-	                        &name[1],
-	                        fuse_ctx->uid,
-	                        fuse_ctx->gid,
-	                        AT_SYMLINK_NOFOLLOW)) {
-		(void) ctx->unlinkat(ctx->rw, &name[1], AT_REMOVEDIR);
-		return -errno;
-	}
+	return 1;
+}
 
-	return 0;
+static void node_unref(struct luufs_node_table *table,
+                       struct luufs_node *node,
+                       const uint64_t nlookup)
+{
+	int last;
+
+	(void) pthread_mutex_lock(&table->lock);
+	last = node_drop(table, node, nlookup);
+	(void) pthread_mutex_unlock(&table->lock);
+
+	if (1 == last)
+		node_free(node, table->nros);
 }
 
-static int luufs_rmdir(const char *name)
+/* returns the inode number of a file known to the kernel, or 0 */
+static fuse_ino_t node_find(struct luufs_ctx *ctx,
+                            const dev_t dev,
+                            const ino_t ino)
 {
-	struct stat stbuf;
+	struct luufs_node *node;
 
-	LUUFS_CALL_HEAD();
+	if ((dev == ctx->root.dev) && (ino == ctx->root.ino))
+		return FUSE_ROOT_ID;
 
-	/* if the directory exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	(void) pthread_mutex_lock(&ctx->nodes.lock);
 
-	if (0 == ctx->unlinkat(ctx->rw, &name[1], AT_REMOVEDIR))
-		return 0;
+	node = ctx->nodes.buckets[node_hash(dev, ino, ctx->nodes.size)];
+	for (; NULL != node; node = node->next) {
+		if ((ino == node->ino) && (dev == node->dev))
+			break;
+	}
+
+	(void) pthread_mutex_unlock(&ctx->nodes.lock);
+
+	return (fuse_ino_t) (uintptr_t) node;
+}
+
+static struct luufs_node *get_node(struct luufs_ctx *ctx, const fuse_ino_t ino)
+{
+	if (FUSE_ROOT_ID == ino)
+		return &ctx->root;
 
-	return -errno;
+	return (struct luufs_node *) (uintptr_t) ino;
 }
 
-static int luufs_opendir(const char *name, struct fuse_file_info *fi)
+/* reopens the handles of an inode that were closed and pins it */
+static int node_reopen(struct luufs_node_table *table, struct luufs_node *node)
 {
+	int reopened[2];
 	int ret;
-	int cmp;
-	struct luufs_dir_ctx *dir_ctx;
+	int i;
 
-	LUUFS_CALL_HEAD();
+	(void) pthread_mutex_lock(&table->lock);
 
-	dir_ctx = malloc(sizeof(*dir_ctx));
-	if (NULL == dir_ctx) {
-		ret = -ENOMEM;
-		goto end;
+	/* another request may have reopened them first */
+	if (0 == (NODE_EVICTED & node->pins)) {
+		__atomic_add_fetch(&node->pins, 1, __ATOMIC_ACQUIRE);
+		(void) pthread_mutex_unlock(&table->lock);
+		return 0;
 	}
 
-	ctx = (const struct luufs_ctx *) fuse_get_context()->private_data;
+	for (i = 0; 2 > i; ++i) {
+		reopened[i] = 0;
+		if ((-1 != node->fds[i]) || (NULL == node->handles[i]))
+			continue;
 
-	cmp = strcmp("/", name);
-	if (0 == cmp)
-		dir_ctx->f_ro = dup(ctx->ro);
-	else
-		dir_ctx->f_ro = ctx->openat(ctx->ro, &name[1], O_DIRECTORY);
-	if (-1 == dir_ctx->f_ro) {
-		if (ENOENT != errno) {
+		node->fds[i] = open_by_handle_at(table->mounts[i],
+		                                 node->handles[i],
+		                                 O_PATH);
+		if (-1 == node->fds[i]) {
 			ret = -errno;
-			goto free_ctx;
-		}
-	}
+			if ((1 == i) && (1 == reopened[0])) {
+				(void) close(node->fds[0]);
+				node->fds[0] = -1;
+				--table->nfds;
+			}
 
-	if (-1 == ctx->rw)
-		dir_ctx->f_rw = -1;
-	else {
-		if (0 == cmp)
-			dir_ctx->f_rw = dup(ctx->rw);
-		else
-			dir_ctx->f_rw = ctx->openat(ctx->rw, &name[1], O_DIRECTORY);
-		if (-1 == dir_ctx->f_rw) {
-			ret = -errno;
-			goto close_ro;
+			(void) pthread_mutex_unlock(&table->lock);
+			return ret;
 		}
-	}
 
-	if (-1 == dir_ctx->f_ro)
-		dir_ctx->d_ro = NULL;
-	else {
-		dir_ctx->d_ro = fdopendir(dir_ctx->f_ro);
-		if (NULL == dir_ctx->d_ro) {
-			ret = -errno;
-			goto close_rw;
-		}
+		reopened[i] = 1;
+		++table->nfds;
 	}
+	__atomic_store_n(&node->referenced, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&node->pins, 1, __ATOMIC_RELEASE);
 
-	if (-1 == dir_ctx->f_rw)
-		dir_ctx->d_rw = NULL;
-	else {
-		dir_ctx->d_rw = fdopendir(dir_ctx->f_rw);
-		if (NULL == dir_ctx->d_rw) {
-			ret = -errno;
-			goto close_rw;
-		}
-	}
+	if (table->nfds > table->max_fds)
+		node_table_evict(table);
 
-	fi->fh = (uint64_t) (uintptr_t) dir_ctx;
+	(void) pthread_mutex_unlock(&table->lock);
 
 	return 0;
+}
 
-	(void) closedir(dir_ctx->d_ro);
-	dir_ctx->f_ro = -1;
+/* returns an inode and pins it, so its handles stay open until the request
+ * is done with them and node_put() is called */
+static int node_get(struct luufs_ctx *ctx,
+                    const fuse_ino_t ino,
+                    struct luufs_node **node)
+{
+	unsigned int pins;
 
-close_rw:
-	if (-1 != dir_ctx->f_rw)
-		(void) close(dir_ctx->f_rw);
+	*node = get_node(ctx, ino);
+	if ((&ctx->root == *node) || (0 == ctx->nodes.max_fds))
+		return 0;
 
-close_ro:
-	if (-1 != dir_ctx->f_ro)
-		(void) close(dir_ctx->f_ro);
+	pins = __atomic_load_n(&(*node)->pins, __ATOMIC_RELAXED);
+	while (0 == (NODE_EVICTED & pins)) {
+		if (__atomic_compare_exchange_n(&(*node)->pins,
+		                                &pins,
+		                                pins + 1,
+		                                1,
+		                                __ATOMIC_ACQUIRE,
+		                                __ATOMIC_RELAXED)) {
+			if (0 == __atomic_load_n(&(*node)->referenced,
+			                         __ATOMIC_RELAXED))
+				__atomic_store_n(&(*node)->referenced, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
 
-free_ctx:
-	free(dir_ctx);
+	return node_reopen(&ctx->nodes, *node);
+}
 
-end:
-	return ret;
+static void node_put(struct luufs_ctx *ctx, struct luufs_node *node)
+{
+	if ((&ctx->root == node) || (0 == ctx->nodes.max_fds))
+		return;
+
+	__atomic_sub_fetch(&node->pins, 1, __ATOMIC_RELEASE);
 }
 
-static int luufs_closedir(const char *name, struct fuse_file_info *fi)
+/* pins an inode the caller has already pinned once more */
+static void node_pin(struct luufs_ctx *ctx, struct luufs_node *node)
 {
-	struct luufs_dir_ctx *dir_ctx;
-	unsigned int i;
+	if ((&ctx->root == node) || (0 == ctx->nodes.max_fds))
+		return;
 
-	dir_ctx = (struct luufs_dir_ctx *) (uintptr_t) fi->fh;
-	if (NULL == dir_ctx)
-		return -EBADF;
+	__atomic_add_fetch(&node->pins, 1, __ATOMIC_RELAXED);
+}
 
-	for (i = 0; 2 > i; ++i) {
-		if (NULL != dir_ctx->dirs[i]) {
-			if (-1 == closedir(dir_ctx->dirs[i]))
-				return -errno;
-		}
+/* O_PATH handles cannot be passed to most f*() system calls, so those receive
+ * the handle's /proc/self/fd link instead */
+static void proc_path(char *buf, const int fd)
+{
+	(void) snprintf(buf, PROC_PATH_MAX, "/proc/self/fd/%d", fd);
+}
+
+/* opens an O_PATH handle to a file under a directory, which may be missing */
+static int open_path(const int dirfd, const char *name, const int flags)
+{
+	if (-1 == dirfd) {
+		errno = ENOENT;
+		return -1;
 	}
 
-	free(dir_ctx);
+	return openat(dirfd, name, O_PATH | O_NOFOLLOW | flags);
+}
 
-	fi->fh = (uint64_t) (uintptr_t) NULL;
+/* system calls issued ahead of a lookup: to_open is the mask of directories
+ * a handle is opened under and to_stat the mask of directories the file is
+ * stat()ed under, through the handle if there is one; fds and stats hold the
+ * results, or PROBE_NONE if the call was not issued */
+struct luufs_probe {
+	const char *name;
+	int to_open;
+	int to_stat;
+	int fds[2];
+	int stats[2];
+	int taken[2];
+	struct statx stx[2];
+};
 
-	return 0;
-}
+#define PROBE_NONE INT_MIN
 
-static int luufs_readdir(const char *path,
-                         void *buf,
-                         fuse_fill_dir_t filler,
-                         off_t offset,
-                         struct fuse_file_info *fi)
+#define PROBE_LAYER(layer) (1 << (layer))
+
+static void probe_init(struct luufs_probe *probe,
+                       const char *name,
+                       const int to_open,
+                       const int to_stat)
+{
+	int i;
+
+	probe->name = name;
+	probe->to_open = to_open;
+	probe->to_stat = to_stat;
+
+	for (i = 0; 2 > i; ++i) {
+		probe->fds[i] = PROBE_NONE;
+		probe->stats[i] = PROBE_NONE;
+		probe->taken[i] = 0;
+	}
+}
+
+/* closes the handles opened ahead but not used */
+static void probe_close(struct luufs_probe *probe)
+{
+	int i;
+
+	for (i = 0; 2 > i; ++i) {
+		if ((0 <= probe->fds[i]) && (0 == probe->taken[i]))
+			(void) close(probe->fds[i]);
+		probe->fds[i] = PROBE_NONE;
+	}
+}
+
+/* closes the io_uring of a worker, whose requests then issue system calls
+ * one by one */
+static void worker_drop_ring(struct luufs_worker *worker)
+{
+	uring_free(worker->ring);
+	free(worker->ring);
+	worker->ring = NULL;
+}
+
+/* submits the system calls of a batch of lookups under a directory, in two
+ * rounds: first, handles are opened and files without one are stat()ed, then
+ * the handles are stat()ed; on failure, the lookups fall back to issuing
+ * system calls one by one, and the io_uring, which may still hold calls that
+ * were not reaped, is not used again */
+static void probe_run(struct luufs_worker *worker,
+                      const int dirfds[2],
+                      struct luufs_probe *probes,
+                      const unsigned int n)
+{
+	int results[2 * PROBE_BATCH];
+	struct uring *ring = worker->ring;
+	unsigned int i;
+	unsigned int queued;
+	int ret;
+	int j;
+
+	for (i = 0; 2 * n > i; ++i)
+		results[i] = PROBE_NONE;
+
+	queued = 0;
+	for (i = 0; n > i; ++i) {
+		for (j = 0; 2 > j; ++j) {
+			if (-1 == dirfds[j])
+				continue;
+
+			if (0 != (PROBE_LAYER(j) & probes[i].to_open)) {
+				if (0 == uring_openat(ring,
+				                      dirfds[j],
+				                      probes[i].name,
+				                      O_PATH | O_NOFOLLOW,
+				                      2 * i + j))
+					++queued;
+			}
+			else if (0 != (PROBE_LAYER(j) & probes[i].to_stat)) {
+				if (0 == uring_statx(ring,
+				                     dirfds[j],
+				                     probes[i].name,
+				                     AT_SYMLINK_NOFOLLOW,
+				                     &probes[i].stx[j],
+				                     2 * i + j))
+					++queued;
+			}
+		}
+	}
+
+	if (0 == queued)
+		return;
+
+	/* handles opened before a failure are still passed to the lookups, so
+	 * they get closed */
+	ret = uring_run(ring, results);
+	if (-1 == ret)
+		worker_drop_ring(worker);
+
+	queued = 0;
+	for (i = 0; n > i; ++i) {
+		for (j = 0; 2 > j; ++j) {
+			if (0 == (PROBE_LAYER(j) & probes[i].to_open)) {
+				probes[i].stats[j] = results[2 * i + j];
+				continue;
+			}
+
+			probes[i].fds[j] = results[2 * i + j];
+			results[2 * i + j] = PROBE_NONE;
+
+			if ((0 == ret) &&
+			    (0 <= probes[i].fds[j]) &&
+			    (0 != (PROBE_LAYER(j) & probes[i].to_stat)) &&
+			    (0 == uring_statx(ring,
+			                      probes[i].fds[j],
+			                      "",
+			                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW,
+			                      &probes[i].stx[j],
+			                      2 * i + j)))
+				++queued;
+		}
+	}
+
+	if (0 == queued)
+		return;
+
+	if (-1 == uring_run(ring, results)) {
+		worker_drop_ring(worker);
+		return;
+	}
+
+	for (i = 0; n > i; ++i) {
+		for (j = 0; 2 > j; ++j) {
+			if (0 != (PROBE_LAYER(j) & probes[i].to_open))
+				probes[i].stats[j] = results[2 * i + j];
+		}
+	}
+}
+
+/* opens a handle to a file under a directory, unless it was opened ahead */
+static int probe_open(struct luufs_probe *probe,
+                      const int dirfd,
+                      const int layer,
+                      const char *name,
+                      const int flags)
+{
+	int fd;
+
+	if ((NULL == probe) || (PROBE_NONE == probe->fds[layer]))
+		return open_path(dirfd, name, flags);
+
+	fd = probe->fds[layer];
+	if (0 > fd) {
+		probe->fds[layer] = PROBE_NONE;
+		errno = -fd;
+		return -1;
+	}
+
+	/* handles are opened ahead without O_DIRECTORY */
+	if (0 != (O_DIRECTORY & flags)) {
+		if (0 != probe->stats[layer])
+			return open_path(dirfd, name, flags);
+
+		if (!S_ISDIR(probe->stx[layer].stx_mode)) {
+			errno = ENOTDIR;
+			return -1;
+		}
+	}
+
+	probe->taken[layer] = 1;
+	return fd;
+}
+
+/* stat()s a file through its handle, unless that was done ahead */
+static int probe_stat(const struct luufs_probe *probe,
+                      const int layer,
+                      const int fd,
+                      struct stat *stbuf)
+{
+	if ((NULL == probe) ||
+	    (0 == probe->taken[layer]) ||
+	    (0 != probe->stats[layer]))
+		return fstatat(fd,
+		               "",
+		               stbuf,
+		               AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+
+	uring_stat(&probe->stx[layer], stbuf);
+	return 0;
+}
+
+/* finds the path of a file under a read-only directory, relative to it */
+static int ro_relpath(const struct luufs_ctx *ctx,
+                      const unsigned int ro,
+                      const int fd,
+                      char buf[PATH_MAX],
+                      char **rel)
+{
+	char path[PROC_PATH_MAX];
+	ssize_t len;
+
+	proc_path(path, fd);
+	len = readlink(path, buf, PATH_MAX - 1);
+	if (-1 == len)
+		return -errno;
+	buf[len] = '\0';
+
+	if ((0 != strncmp(buf, ctx->ros[ro].path, ctx->ros[ro].len)) ||
+	    (('/' != buf[ctx->ros[ro].len]) && ('\0' != buf[ctx->ros[ro].len])))
+		return -ENOENT;
+
+	*rel = &buf[ctx->ros[ro].len];
+	return 0;
+}
+
+/* opens a handle of a directory by its relative path, without following
+ * symlinks, so it's only found if each of its parents is a directory too */
+static int ro_walk(const int root, const char *rel)
+{
+	char buf[PATH_MAX];
+	char *name;
+	char *pos;
+	int dir;
+	int fd;
+	int err;
+
+	(void) strcpy(buf, rel);
+
+	dir = open_path(root, ".", O_DIRECTORY);
+	if (-1 == dir)
+		return -1;
+
+	for (name = strtok_r(buf, "/", &pos);
+	     NULL != name;
+	     name = strtok_r(NULL, "/", &pos)) {
+		fd = open_path(dir, name, O_DIRECTORY);
+		if (-1 == fd) {
+			err = errno;
+			(void) close(dir);
+			errno = err;
+			return -1;
+		}
+
+		(void) close(dir);
+		dir = fd;
+	}
+
+	return dir;
+}
+
+/* opens the handles of a directory under the read-only directories that
+ * follow the first one it exists in, unless it has them already; they're
+ * opened by path, since their inode numbers are not known */
+static int node_lower(struct luufs_ctx *ctx, struct luufs_node *node)
+{
+	char buf[PATH_MAX];
+	char *rel;
+	int *lower;
+	unsigned int nlower;
+	unsigned int i;
+	int ret;
+
+	if ((-1 == node->f_ro) ||
+	    (ctx->nros - 1 == node->ro) ||
+	    (NULL != __atomic_load_n(&node->lower, __ATOMIC_ACQUIRE)))
+		return 0;
+
+	ret = ro_relpath(ctx, node->ro, node->f_ro, buf, &rel);
+	if (0 != ret)
+		return ret;
+
+	lower = (int *) malloc(sizeof(int) * ctx->nros);
+	if (NULL == lower)
+		return -ENOMEM;
+
+	nlower = 0;
+	for (i = 0; ctx->nros > i; ++i) {
+		lower[i] = -1;
+		if (node->ro >= i)
+			continue;
+
+		lower[i] = ro_walk(ctx->ros[i].fd, rel);
+		if (-1 != lower[i])
+			++nlower;
+		else if ((ENOENT != errno) && (ENOTDIR != errno) && (ELOOP != errno)) {
+			ret = -errno;
+			goto close_lower;
+		}
+	}
+
+	/* another request may have opened them first */
+	(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+	if (NULL == node->lower) {
+		node->nlower = nlower;
+		ctx->nodes.nfds += nlower;
+		__atomic_store_n(&node->lower, lower, __ATOMIC_RELEASE);
+		lower = NULL;
+	}
+
+	(void) pthread_mutex_unlock(&ctx->nodes.lock);
+
+	if (NULL == lower)
+		return 0;
+
+	ret = 0;
+
+close_lower:
+	for (i = node->ro + 1; ctx->nros > i; ++i) {
+		if (-1 != lower[i])
+			(void) close(lower[i]);
+	}
+	free(lower);
+
+	return ret;
+}
+
+/* returns the handle of a directory under a read-only directory, or -1 if it
+ * does not exist there */
+static int node_ro_fd(const struct luufs_node *dir, const unsigned int ro)
+{
+	if (ro == dir->ro)
+		return dir->f_ro;
+
+	if ((ro < dir->ro) || (NULL == dir->lower))
+		return -1;
+
+	return dir->lower[ro];
+}
+
+/* returns 1 if the result of a lookup under the read-only directories may be
+ * cached, by luufs and by the kernel for longer: only the first read-only
+ * directory a directory exists in is watched, so unless the read-only
+ * directories are immutable, names found under another one and missing names,
+ * if there are more read-only directories it may appear under, are not */
+static int ro_cacheable(const struct luufs_ctx *ctx,
+                        const struct luufs_node *dir,
+                        const int found,
+                        const unsigned int ro)
+{
+	if (1 == ctx->cache.immutable)
+		return 1;
+
+	if (1 == found)
+		return (ro == dir->ro) ? 1 : 0;
+
+	return (ctx->nros - 1 == dir->ro) ? 1 : 0;
+}
+
+/* looks up a name under the read-only directories in the index and the
+ * cache; returns one of the rocache_get() results and the read-only
+ * directory the name was found under */
+static int ro_cached(struct luufs_ctx *ctx,
+                     const struct luufs_node *dir,
+                     const char *name,
+                     struct stat *stbuf,
+                     unsigned int *ro,
+                     uint64_t *ticket)
+{
+	int ret;
+
+	/* the index covers a single read-only directory */
+	ret = roindex_lookup(&ctx->index, dir->dev, dir->ino, name, stbuf);
+	if (ROINDEX_FOUND == ret) {
+		*ro = 0;
+		return ROCACHE_FOUND;
+	}
+	if (ROINDEX_MISSING == ret)
+		return ROCACHE_MISSING;
+
+	return rocache_get(&ctx->cache,
+	                   dir->f_ro,
+	                   dir->dev,
+	                   dir->ino,
+	                   name,
+	                   stbuf,
+	                   ro,
+	                   ticket);
+}
+
+/* opens a handle of a file under the first read-only directory it exists in,
+ * starting with *ro, among those the parent directory exists in; if search
+ * is 0, only *ro is tried */
+static int ro_open(const struct luufs_ctx *ctx,
+                   const struct luufs_node *dir,
+                   const char *name,
+                   const int search,
+                   struct luufs_probe *probe,
+                   unsigned int *ro)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = *ro; ctx->nros > i; ++i) {
+		/* handles are opened ahead under the first one only */
+		if (i == dir->ro)
+			fd = probe_open(probe, dir->f_ro, LUUFS_RO, name, 0);
+		else
+			fd = open_path(node_ro_fd(dir, i), name, 0);
+		if (-1 != fd) {
+			*ro = i;
+			return fd;
+		}
+
+		if ((ENOENT != errno) || (0 == search))
+			return -1;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+/* returns 0 if a file exists under the read-only directories, -ENOENT if it
+ * does not or another negative errno value on failure; a directory with a
+ * handle under the read-only directory always resolves to it, so its inode
+ * number is the one of that directory */
+static int ro_lookup(struct luufs_ctx *ctx,
+                     struct luufs_node *dir,
+                     const char *name)
+{
+	struct stat stbuf;
+	uint64_t ticket;
+	unsigned int i;
+	int ret;
+	int fd;
+
+	if (-1 == dir->f_ro)
+		return -ENOENT;
+
+	ret = ro_cached(ctx, dir, name, &stbuf, &i, &ticket);
+	if (ROCACHE_MISSING == ret)
+		return -ENOENT;
+	if (ROCACHE_MISS != ret)
+		return 0;
+
+	ret = node_lower(ctx, dir);
+	if (0 != ret)
+		return ret;
+
+	for (i = dir->ro; ctx->nros > i; ++i) {
+		fd = node_ro_fd(dir, i);
+		if (-1 == fd)
+			continue;
+
+		if (0 == ctx->fstatat(fd, name, &stbuf, AT_SYMLINK_NOFOLLOW)) {
+			if (1 == ro_cacheable(ctx, dir, 1, i))
+				rocache_put(&ctx->cache,
+				            dir->dev,
+				            dir->ino,
+				            name,
+				            &stbuf,
+				            i,
+				            ticket);
+			return 0;
+		}
+
+		if (ENOENT != errno)
+			return -errno;
+	}
+
+	if (1 == ro_cacheable(ctx, dir, 0, 0))
+		rocache_put(&ctx->cache, dir->dev, dir->ino, name, NULL, 0, ticket);
+	return -ENOENT;
+}
+
+/* returns 1 if a name is known to be missing under the counterpart of a
+ * directory under the writeable directory, without searching it */
+static int rw_missing(struct luufs_ctx *ctx,
+                      const struct luufs_node *dir,
+                      const char *name)
+{
+	if (RWMAP_MISSING == rwmap_lookup(&ctx->rwmap, dir->dev, dir->ino, name))
+		return 1;
+
+	return 0;
+}
+
+/* files under the read-only directory are cached by the kernel for longer */
+static double node_timeout(const struct luufs_ctx *ctx,
+                           const struct luufs_node *node)
+{
+	if (LUUFS_RO == node->layer)
+		return ctx->ro_timeout;
+
+	return ctx->rw_timeout;
+}
+
+/* creates the inode of a file whose attributes are in e, or increments its
+ * lookup count if it already exists */
+static int make_entry(struct luufs_ctx *ctx,
+                      int fds[2],
+                      const int layer,
+                      const unsigned int ro,
+                      struct fuse_entry_param *e)
+{
+	struct luufs_node *node;
+
+	node = node_ref(&ctx->nodes, fds, layer, ro, &e->attr);
+	if (NULL == node)
+		return -ENOMEM;
+
+	e->ino = (fuse_ino_t) (uintptr_t) node;
+	e->generation = 0;
+	e->attr_timeout = node_timeout(ctx, node);
+	e->entry_timeout = e->attr_timeout;
+
+	set_outcome(ctx, (LUUFS_RO == layer) ? STATS_RO : STATS_RW);
+	return 0;
+}
+
+/* creates the inode of a file just created under the writeable directory */
+static int new_entry(struct luufs_ctx *ctx,
+                     const struct luufs_node *dir,
+                     const char *name,
+                     struct fuse_entry_param *e)
+{
+	int fds[2];
+	int ret;
+
+	fds[LUUFS_RO] = -1;
+	fds[LUUFS_RW] = open_path(dir->f_rw, name, 0);
+	if (-1 == fds[LUUFS_RW])
+		return -errno;
+
+	if (-1 == fstatat(fds[LUUFS_RW],
+	                  "",
+	                  &e->attr,
+	                  AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		ret = -errno;
+		(void) close(fds[LUUFS_RW]);
+		return ret;
+	}
+
+	return make_entry(ctx, fds, LUUFS_RW, 0, e);
+}
+
+/* resolves a name under a directory, starting with the given directory; when
+ * the caller knows the name is missing under the read-only directories, it
+ * passes LUUFS_RW to skip them, and when it knows the name is missing under
+ * some of them, from is the first one to search; system calls issued ahead
+ * are passed in probe, if any */
+static int do_lookup(struct luufs_ctx *ctx,
+                     struct luufs_node *dir,
+                     const char *name,
+                     int layer,
+                     unsigned int from,
+                     struct luufs_probe *probe,
+                     struct fuse_entry_param *e)
+{
+	uint64_t ticket;
+	unsigned int ro;
+	int fds[2];
+	int cached;
+	int ret;
+
+	fds[LUUFS_RO] = -1;
+	fds[LUUFS_RW] = -1;
+	cached = ROCACHE_MISS;
+	ro = 0;
+
+	/* try the read-only directory first, unless the name is known to be
+	 * missing there */
+	if ((LUUFS_RO == layer) && (-1 != dir->f_ro)) {
+		cached = ro_cached(ctx, dir, name, &e->attr, &ro, &ticket);
+		if (ROCACHE_MISSING == cached)
+			layer = LUUFS_RW;
+		else {
+			ret = node_lower(ctx, dir);
+			if (0 != ret)
+				return ret;
+
+			/* unless the cache knows which read-only directory the name is
+			 * under, search those the directory exists in */
+			if (ROCACHE_MISS == cached)
+				ro = (from > dir->ro) ? from : dir->ro;
+
+			fds[LUUFS_RO] = ro_open(ctx,
+			                        dir,
+			                        name,
+			                        (ROCACHE_MISS == cached) ? 1 : 0,
+			                        probe,
+			                        &ro);
+			if (-1 == fds[LUUFS_RO]) {
+				if (ENOENT != errno)
+					return -errno;
+
+				if ((ROCACHE_MISS == cached) &&
+				    (1 == ro_cacheable(ctx, dir, 0, 0)))
+					rocache_put(&ctx->cache,
+					            dir->dev,
+					            dir->ino,
+					            name,
+					            NULL,
+					            0,
+					            ticket);
+				layer = LUUFS_RW;
+			}
+		}
+	}
+	else
+		layer = LUUFS_RW;
+
+	if (LUUFS_RW == layer) {
+		if (1 == rw_missing(ctx, dir, name))
+			return -ENOENT;
+
+		fds[LUUFS_RW] = probe_open(probe, dir->f_rw, LUUFS_RW, name, 0);
+		if (-1 == fds[LUUFS_RW])
+			return -errno;
+	}
+
+	if ((LUUFS_RW == layer) || (ROCACHE_FOUND != cached)) {
+		if (-1 == probe_stat(probe, layer, fds[layer], &e->attr)) {
+			ret = -errno;
+			(void) close(fds[layer]);
+			return ret;
+		}
+
+		if ((LUUFS_RO == layer) &&
+		    (ROCACHE_MISS == cached) &&
+		    (1 == ro_cacheable(ctx, dir, 1, ro)))
+			rocache_put(&ctx->cache,
+			            dir->dev,
+			            dir->ino,
+			            name,
+			            &e->attr,
+			            ro,
+			            ticket);
+	}
+
+	/* a file copied to the writeable directory hides the original */
+	if ((LUUFS_RO == layer) &&
+	    (1 == ctx->copy_up) &&
+	    S_ISREG(e->attr.st_mode) &&
+	    (0 == rw_missing(ctx, dir, name))) {
+		fds[LUUFS_RW] = probe_open(probe, dir->f_rw, LUUFS_RW, name, 0);
+		if (-1 == fds[LUUFS_RW]) {
+			if (ENOENT != errno) {
+				ret = -errno;
+				(void) close(fds[LUUFS_RO]);
+				return ret;
+			}
+		}
+		else {
+			(void) close(fds[LUUFS_RO]);
+			fds[LUUFS_RO] = -1;
+			layer = LUUFS_RW;
+
+			if (-1 == probe_stat(probe,
+			                     LUUFS_RW,
+			                     fds[LUUFS_RW],
+			                     &e->attr)) {
+				ret = -errno;
+				(void) close(fds[LUUFS_RW]);
+				return ret;
+			}
+		}
+	}
+
+	/* files inside a directory under the read-only directory may reside under
+	 * its counterpart under the writeable directory too */
+	if ((LUUFS_RO == layer) &&
+	    S_ISDIR(e->attr.st_mode) &&
+	    (0 == rw_missing(ctx, dir, name))) {
+		fds[LUUFS_RW] = probe_open(probe,
+		                           dir->f_rw,
+		                           LUUFS_RW,
+		                           name,
+		                           O_DIRECTORY);
+		if ((-1 == fds[LUUFS_RW]) &&
+		    (ENOENT != errno) &&
+		    (ENOTDIR != errno)) {
+			ret = -errno;
+			(void) close(fds[LUUFS_RO]);
+			return ret;
+		}
+	}
+
+	ret = make_entry(ctx, fds, layer, ro, e);
+
+	/* changes to the name are not seen, so the kernel rechecks it sooner */
+	if ((0 == ret) &&
+	    (LUUFS_RO == layer) &&
+	    (0 == ro_cacheable(ctx, dir, 1, ro))) {
+		e->attr_timeout = ctx->rw_timeout;
+		e->entry_timeout = ctx->rw_timeout;
+	}
+
+	return ret;
+}
+
+/* stores the handle of a directory's counterpart under the writeable
+ * directory in its inode, unless another thread did that first */
+static void node_set_rw(struct luufs_node_table *table,
+                        struct luufs_node *node,
+                        const int fd)
+{
+	(void) pthread_mutex_lock(&table->lock);
+
+	if (-1 == node->f_rw) {
+		node->f_rw = fd;
+		++table->nfds;
+		(void) pthread_mutex_unlock(&table->lock);
+		return;
+	}
+
+	(void) pthread_mutex_unlock(&table->lock);
+
+	(void) close(fd);
+}
+
+/* creates a directory under the writeable directory if it does not exist yet,
+ * along with its parent directories, by its path relative to a read-only
+ * directory; each is created with the mode and ownership of its counterpart
+ * under that read-only directory, whose device and inode numbers are
+ * returned in dev and ino; returns a handle of the directory or a negative
+ * errno value */
+static int rw_dirs(struct luufs_ctx *ctx,
+                   const unsigned int ro,
+                   char *rel,
+                   dev_t *dev,
+                   ino_t *ino)
+{
+	struct stat stbuf;
+	char *name;
+	char *pos;
+	int src;
+	int dest;
+	int fd;
+	int ret;
+
+	*dev = ctx->root.dev;
+	*ino = ctx->root.ino;
+
+	src = ctx->ros[ro].fd;
+	dest = open_path(ctx->rw, ".", O_DIRECTORY);
+	if (-1 == dest)
+		return -errno;
+
+	ret = 0;
+
+	for (name = strtok_r(rel, "/", &pos);
+	     NULL != name;
+	     name = strtok_r(NULL, "/", &pos)) {
+		fd = open_path(src, name, O_DIRECTORY);
+		if (-1 == fd) {
+			ret = -errno;
+			break;
+		}
+
+		if (src != ctx->ros[ro].fd)
+			(void) close(src);
+		src = fd;
+
+		if (-1 == fstatat(src, "", &stbuf, AT_EMPTY_PATH)) {
+			ret = -errno;
+			break;
+		}
+
+		if (0 == mkdirat(dest, name, stbuf.st_mode & 07777)) {
+			if ((-1 == fchmodat(dest, name, stbuf.st_mode & 07777, 0)) ||
+			    (-1 == fchownat(dest,
+			                    name,
+			                    stbuf.st_uid,
+			                    stbuf.st_gid,
+			                    AT_SYMLINK_NOFOLLOW))) {
+				ret = -errno;
+				(void) unlinkat(dest, name, AT_REMOVEDIR);
+				break;
+			}
+
+			rwmap_add(&ctx->rwmap, *dev, *ino, name);
+			rwmap_add_dir(&ctx->rwmap, stbuf.st_dev, stbuf.st_ino);
+		}
+		else if (EEXIST != errno) {
+			ret = -errno;
+			break;
+		}
+
+		*dev = stbuf.st_dev;
+		*ino = stbuf.st_ino;
+
+		fd = open_path(dest, name, O_DIRECTORY);
+		if (-1 == fd) {
+			ret = -errno;
+			break;
+		}
+
+		(void) close(dest);
+		dest = fd;
+	}
+
+	if (src != ctx->ros[ro].fd)
+		(void) close(src);
+
+	if (0 != ret) {
+		(void) close(dest);
+		return ret;
+	}
+
+	return dest;
+}
+
+/* creates the counterpart of a directory under the writeable directory if it
+ * does not exist yet */
+static int rw_dir(struct luufs_ctx *ctx, struct luufs_node *dir)
+{
+	char buf[PATH_MAX];
+	char *rel;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+
+	if (-1 != dir->f_rw)
+		return 0;
+
+	if (-1 == ctx->rw)
+		return -EROFS;
+
+	fd = ro_relpath(ctx, dir->ro, dir->f_ro, buf, &rel);
+	if (0 != fd)
+		return fd;
+
+	fd = rw_dirs(ctx, dir->ro, rel, &dev, &ino);
+	if (0 > fd)
+		return fd;
+
+	node_set_rw(&ctx->nodes, dir, fd);
+	return 0;
+}
+
+static struct luufs_worker *get_worker(struct luufs_ctx *ctx);
+
+/* counts a lookup under a directory that exists under both directories, and
+ * whether the name was not found under the read-only one */
+static void count_miss(struct luufs_worker *worker, const int miss)
+{
+	++worker->lookups;
+	if (1 == miss)
+		++worker->misses;
+
+	if (PROBE_WINDOW == worker->lookups) {
+		worker->lookups /= 2;
+		worker->misses /= 2;
+	}
+}
+
+static void luufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct luufs_probe probe;
+	struct luufs_worker *worker;
+	struct luufs_node *dir;
+	struct luufs_probe *probep;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
+
+	worker = NULL;
+	if ((-1 != dir->f_ro) && (-1 != dir->f_rw)) {
+		worker = get_worker(ctx);
+		if ((NULL != worker) && (NULL == worker->ring))
+			worker = NULL;
+	}
+
+	/* when most names are not found under the read-only directory, the name
+	 * is searched for under both directories at once */
+	probep = NULL;
+	if ((NULL != worker) &&
+	    (worker->misses > worker->lookups / 2) &&
+	    (0 == rw_missing(ctx, dir, name))) {
+		probe_init(&probe,
+		           name,
+		           PROBE_LAYER(LUUFS_RO) | PROBE_LAYER(LUUFS_RW),
+		           PROBE_LAYER(LUUFS_RO) | PROBE_LAYER(LUUFS_RW));
+		probe_run(worker, dir->fds, &probe, 1);
+		probep = &probe;
+	}
+
+	ret = do_lookup(ctx, dir, name, LUUFS_RO, 0, probep, &e);
+
+	if (NULL != probep)
+		probe_close(probep);
+
+	if (NULL != worker)
+		count_miss(worker,
+		           ((0 != ret) ||
+		            (LUUFS_RW == get_node(ctx, e.ino)->layer)) ? 1 : 0);
+
+	if (-ENOENT == ret) {
+		/* let the kernel remember the file is missing; unless the directory
+		 * exists under the writeable directory, it can only appear if it's
+		 * created through luufs or under the read-only directory */
+		memset(&e, 0, sizeof(e));
+		if ((-1 == dir->f_rw) && (1 == ro_cacheable(ctx, dir, 0, 0)))
+			e.entry_timeout = ctx->ro_timeout;
+		else
+			e.entry_timeout = ctx->rw_timeout;
+		set_outcome(ctx, STATS_MISSING);
+		ret = 0;
+	}
+
+	node_put(ctx, dir);
+
+reply:
+	if (0 == ret)
+		(void) fuse_reply_entry(req, &e);
+	else
+		(void) reply_err(req, -ret);
+}
+
+static void luufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	struct luufs_ctx *ctx;
+
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+
+	if (FUSE_ROOT_ID != ino)
+		node_unref(&ctx->nodes, get_node(ctx, ino), nlookup);
+
+	fuse_reply_none(req);
+}
+
+static void luufs_forget_multi(fuse_req_t req,
+                               size_t count,
+                               struct fuse_forget_data *forgets)
+{
+	struct luufs_ctx *ctx;
+	size_t i;
+
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+
+	for (i = 0; count > i; ++i) {
+		if (FUSE_ROOT_ID != forgets[i].ino)
+			node_unref(&ctx->nodes,
+			           get_node(ctx, forgets[i].ino),
+			           forgets[i].nlookup);
+	}
+
+	fuse_reply_none(req);
+}
+
+static void worker_free(void *data)
+{
+	struct luufs_worker *worker = (struct luufs_worker *) data;
+
+	if (NULL != worker->ring)
+		worker_drop_ring(worker);
+
+	free(worker->buf);
+	free(worker);
+}
+
+/* returns the state of the calling worker thread, creating it and pinning the
+ * thread to a CPU on its first request */
+static struct luufs_worker *get_worker(struct luufs_ctx *ctx)
+{
+	cpu_set_t set;
+	struct luufs_worker *worker;
+	unsigned int n;
+	int cpu;
+
+	worker = (struct luufs_worker *) pthread_getspecific(ctx->worker_key);
+	if (NULL != worker)
+		return worker;
+
+	worker = (struct luufs_worker *) malloc(sizeof(*worker));
+	if (NULL == worker)
+		return NULL;
+
+	worker->buf = NULL;
+	worker->size = 0;
+	worker->lookups = 0;
+	worker->misses = 0;
+	worker->outcome = STATS_RW;
+	worker->err = 0;
+
+	/* if io_uring is unavailable, system calls are issued one by one */
+	worker->ring = NULL;
+	if (1 == ctx->uring) {
+		worker->ring = (struct uring *) malloc(sizeof(*worker->ring));
+		if ((NULL != worker->ring) &&
+		    (-1 == uring_init(worker->ring, 2 * PROBE_BATCH))) {
+			free(worker->ring);
+			worker->ring = NULL;
+		}
+	}
+
+	/* if the thread cannot be registered, its requests are not measured */
+	worker->stats = NULL;
+	if (NULL != ctx->stats.path)
+		worker->stats = stats_thread_new(&ctx->stats);
+
+	worker->trace = NULL;
+	if (NULL != ctx->trace.path)
+		worker->trace = trace_ring_new(&ctx->trace);
+
+	if (0 != pthread_setspecific(ctx->worker_key, worker)) {
+		if (NULL != worker->ring)
+			worker_drop_ring(worker);
+		free(worker);
+		return NULL;
+	}
+
+	/* spread workers over the CPUs luufs is allowed to run on */
+	if (1 == ctx->pin_workers) {
+		n = __sync_fetch_and_add(&ctx->next_cpu, 1) % ctx->ncpus;
+		for (cpu = 0; CPU_SETSIZE > cpu; ++cpu) {
+			if (!CPU_ISSET(cpu, &ctx->cpus))
+				continue;
+
+			if (0 == n) {
+				CPU_ZERO(&set);
+				CPU_SET(cpu, &set);
+				(void) pthread_setaffinity_np(pthread_self(),
+				                              sizeof(set),
+				                              &set);
+				break;
+			}
+
+			--n;
+		}
+	}
+
+	return worker;
+}
+
+static char *worker_buf(struct luufs_worker *worker, const size_t size)
+{
+	char *buf;
+
+	if (worker->size < size) {
+		buf = realloc(worker->buf, size);
+		if (NULL == buf)
+			return NULL;
+
+		worker->buf = buf;
+		worker->size = size;
+	}
+
+	return worker->buf;
+}
+
+static struct luufs_file *get_file(const struct fuse_file_info *fi)
+{
+	return (struct luufs_file *) (uintptr_t) fi->fh;
+}
+
+/* wraps a file descriptor of an inode, under the given layer, with an open
+ * file and asks the kernel to perform I/O directly against it, if possible;
+ * the file descriptor is closed on failure */
+static int file_new(struct luufs_ctx *ctx,
+                    fuse_req_t req,
+                    struct luufs_node *node,
+                    const int layer,
+                    const int fd,
+                    struct fuse_file_info *fi)
+{
+	struct luufs_file *file;
+#ifdef FUSE_CAP_PASSTHROUGH
+	int id;
+#endif
+
+	file = (struct luufs_file *) malloc(sizeof(*file));
+	if (NULL == file) {
+		ramrw_release(&ctx->ram, fd);
+		(void) close(fd);
+		return -ENOMEM;
+	}
+
+	file->node = node;
+	file->fd = fd;
+	file->backing_id = 0;
+	file->prof = NULL;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	/* the first open file of an inode registers its backing file, and if
+	 * registration fails, reads and writes of all its open files go through
+	 * luufs; once the inode is copied to the writeable directory, files opened
+	 * while files under the read-only directory are still open bypass the
+	 * page cache, since the kernel cannot cache an inode passed through to
+	 * another file */
+	if (1 == ctx->passthrough) {
+		(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+		if (0 == node->nfiles) {
+			id = fuse_passthrough_open(req, fd);
+			node->backing_id = (0 < id) ? id : 0;
+			node->backing_layer = layer;
+		}
+
+		if (0 != node->backing_id) {
+			if (layer == node->backing_layer) {
+				file->backing_id = node->backing_id;
+				fi->backing_id = node->backing_id;
+			}
+			else
+				fi->direct_io = 1;
+		}
+
+		++node->nfiles;
+
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+	}
+#endif
+
+	/* pages dropped behind the reader may be dirty, unless the file is
+	 * read-only */
+	if ((0 == file->backing_id) &&
+	    (-1 == readahead_open(&ctx->ra,
+	                          &file->ra,
+	                          fd,
+	                          (O_RDONLY == (fi->flags & O_ACCMODE)) ? 1 : 0))) {
+		ramrw_release(&ctx->ram, fd);
+		(void) close(fd);
+		free(file);
+		return -ENOMEM;
+	}
+
+	fi->fh = (uint64_t) (uintptr_t) file;
+	return 0;
+}
+
+static void file_free(fuse_req_t req, struct luufs_file *file)
+{
+	struct luufs_ctx *ctx;
+	struct luufs_node *node = file->node;
+
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	/* the backing file is released with the last open file of the inode, so
+	 * the next one registers the file under the inode's current layer */
+	if (1 == ctx->passthrough) {
+		(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+		--node->nfiles;
+		if ((0 == node->nfiles) && (0 != node->backing_id)) {
+			(void) fuse_passthrough_close(req, node->backing_id);
+			node->backing_id = 0;
+		}
+
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+	}
+#endif
+
+	if (0 == file->backing_id)
+		readahead_close(&ctx->ra, &file->ra);
+
+	ramrw_release(&ctx->ram, file->fd);
+	(void) close(file->fd);
+	free(file);
+}
+
+/* records the opening of a file under a read-only directory in the profile */
+static void profile_file(struct luufs_ctx *ctx,
+                         const struct luufs_node *node,
+                         struct luufs_file *file)
+{
+	char buf[PATH_MAX];
+	char *rel;
+
+	if ((LUUFS_RO != node->layer) ||
+	    (0 == profile_recording(&ctx->profile)) ||
+	    (0 != ro_relpath(ctx, node->ro, file->fd, buf, &rel)))
+		return;
+
+	if ('/' == rel[0])
+		++rel;
+
+	file->prof = profile_open(&ctx->profile, node->ro, rel);
+}
+
+static void do_open(struct luufs_ctx *ctx,
+                    fuse_req_t req,
+                    struct luufs_node *node,
+                    struct fuse_file_info *fi)
+{
+	char path[PROC_PATH_MAX];
+	int layer;
+	int disk;
+	int ret;
+	int fd;
+
+	layer = node->layer;
+	if ((LUUFS_RW == layer) && (1 == ctx->ram.enabled)) {
+		/* the file may be read from the disk */
+		fd = ramrw_open(&ctx->ram, node->f_rw, fi->flags, &disk);
+		if (1 == disk)
+			layer = LUUFS_DISK;
+	}
+	else {
+		proc_path(path, node->fds[layer]);
+		fd = open(path, fi->flags & ~O_NOFOLLOW);
+	}
+	if (-1 == fd) {
+		(void) reply_err(req, errno);
+		return;
+	}
+
+	ret = file_new(ctx, req, node, layer, fd, fi);
+	if (0 != ret) {
+		(void) reply_err(req, -ret);
+		return;
+	}
+
+	profile_file(ctx, node, get_file(fi));
+
+	/* files under the read-only directory are opened read-only, so cached
+	 * pages remain valid until a change is reported */
+	fi->keep_cache = (LUUFS_RO == layer) ? 1 : 0;
+
+	if (0 != fuse_reply_open(req, fi))
+		file_free(req, get_file(fi));
+}
+
+static void do_setattr(struct luufs_ctx *ctx,
+                       fuse_req_t req,
+                       const struct luufs_node *node,
+                       const struct stat *attr,
+                       const int to_set,
+                       const struct fuse_file_info *fi);
+
+static void resume(struct luufs_ctx *ctx,
+                   struct luufs_node *node,
+                   struct luufs_waiter *waiter,
+                   const int ret)
+{
+	if (0 != ret)
+		(void) reply_err(waiter->req, -ret);
+	else if (COPY_OPEN == waiter->op)
+		do_open(ctx, waiter->req, node, &waiter->fi);
+	else
+		do_setattr(ctx, waiter->req, node, &waiter->attr, waiter->to_set, NULL);
+
+	free(waiter);
+}
+
+/* makes an inode resolve to its copy under the writeable directory */
+static void node_copied(struct luufs_node_table *table,
+                        struct luufs_node *node,
+                        const int fd)
+{
+	(void) pthread_mutex_lock(&table->lock);
+
+	if (-1 == node->f_rw) {
+		node->f_rw = fd;
+		node->layer = LUUFS_RW;
+		++table->nfds;
+		(void) pthread_mutex_unlock(&table->lock);
+		return;
+	}
+
+	(void) pthread_mutex_unlock(&table->lock);
+
+	(void) close(fd);
+}
+
+/* copies a regular file under the read-only directory to the same path under
+ * the writeable directory */
+static int copy_node(struct luufs_ctx *ctx, struct luufs_node *node)
+{
+	char buf[PATH_MAX];
+	char path[PROC_PATH_MAX];
+	struct stat stbuf;
+	char *rel;
+	char *name;
+	dev_t dev;
+	ino_t ino;
+	int dir;
+	int src;
+	int fd;
+	int ret;
+
+	ret = ro_relpath(ctx, node->ro, node->f_ro, buf, &rel);
+	if (0 != ret)
+		return ret;
+
+	name = strrchr(rel, '/');
+	if (NULL == name)
+		return -ENOENT;
+	*name = '\0';
+	++name;
+
+	/* the /proc/self/fd link must be followed to reopen the handle */
+	proc_path(path, node->f_ro);
+	src = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == src)
+		return -errno;
+
+	if (-1 == fstat(src, &stbuf)) {
+		ret = -errno;
+		goto close_src;
+	}
+
+	/* only regular files can be copied */
+	if (!S_ISREG(stbuf.st_mode)) {
+		ret = -EROFS;
+		goto close_src;
+	}
+
+	dir = rw_dirs(ctx, node->ro, rel, &dev, &ino);
+	if (0 > dir) {
+		ret = dir;
+		goto close_src;
+	}
+
+	ret = copyup_file(src, &stbuf, dir, name);
+	if (0 == ret) {
+		rwmap_add(&ctx->rwmap, dev, ino, name);
+
+		fd = open_path(dir, name, 0);
+		if (-1 == fd)
+			ret = -errno;
+		else
+			node_copied(&ctx->nodes, node, fd);
+	}
+
+	(void) close(dir);
+
+close_src:
+	(void) close(src);
+
+	return ret;
+}
+
+/* resumes the requests waiting for a copy, then removes it from the list of
+ * copies; requests may join a failed copy while others are resumed, and the
+ * inode table is not touched once the list is empty, so it can be freed; the
+ * kernel may forget the inode as soon as the last request is resumed, so the
+ * copy holds a reference to it until then */
+static void finish_copy(struct luufs_copy *copy, const int ret)
+{
+	struct luufs_ctx *ctx = copy->ctx;
+	struct luufs_copy **prev;
+	struct luufs_waiter *waiter;
+	struct luufs_waiter *next;
+	int last;
+
+	(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+	while (NULL != copy->waiters) {
+		waiter = copy->waiters;
+		copy->waiters = NULL;
+
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+
+		for (; NULL != waiter; waiter = next) {
+			next = waiter->next;
+			resume(ctx, copy->node, waiter, ret);
+		}
+
+		(void) pthread_mutex_lock(&ctx->nodes.lock);
+	}
+
+	node_put(ctx, copy->node);
+	last = (&ctx->root == copy->node) ? 0
+	                                  : node_drop(&ctx->nodes, copy->node, 1);
+
+	for (prev = &ctx->copies; copy != *prev; prev = &(*prev)->next);
+	*prev = copy->next;
+
+	(void) pthread_mutex_unlock(&ctx->nodes.lock);
+
+	if (1 == last)
+		node_free(copy->node, ctx->nodes.nros);
+	free(copy);
+}
+
+/* waits for copies made by other threads, which use the inode table */
+static void wait_copies(struct luufs_ctx *ctx)
+{
+	(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+	while (NULL != ctx->copies) {
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+		(void) usleep(1000);
+		(void) pthread_mutex_lock(&ctx->nodes.lock);
+	}
+
+	(void) pthread_mutex_unlock(&ctx->nodes.lock);
+}
+
+static void *copy_thread(void *arg)
+{
+	struct luufs_copy *copy = (struct luufs_copy *) arg;
+
+	finish_copy(copy, copy_node(copy->ctx, copy->node));
+	return NULL;
+}
+
+/* copies a file to the writeable directory before a request that modifies it
+ * is performed; requests for a file that is already being copied wait for
+ * that copy, and large files are copied by another thread, so the calling
+ * worker can handle other requests meanwhile */
+static void copy_up(struct luufs_ctx *ctx,
+                    struct luufs_node *node,
+                    struct luufs_waiter *waiter)
+{
+	struct stat stbuf;
+	pthread_t thread;
+	struct luufs_copy *copy;
+
+	waiter->next = NULL;
+	set_outcome(ctx, STATS_COPY_UP);
+
+	(void) pthread_mutex_lock(&ctx->nodes.lock);
+
+	/* the file may have been copied since the request was received */
+	if (LUUFS_RW == node->layer) {
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+		resume(ctx, node, waiter, 0);
+		return;
+	}
+
+	for (copy = ctx->copies; NULL != copy; copy = copy->next) {
+		if (node == copy->node) {
+			waiter->next = copy->waiters;
+			copy->waiters = waiter;
+			(void) pthread_mutex_unlock(&ctx->nodes.lock);
+			return;
+		}
+	}
+
+	copy = (struct luufs_copy *) malloc(sizeof(*copy));
+	if (NULL == copy) {
+		(void) pthread_mutex_unlock(&ctx->nodes.lock);
+		resume(ctx, node, waiter, -ENOMEM);
+		return;
+	}
+
+	/* the copy may outlive the request, so it pins the inode too, and keeps
+	 * it from being freed; the root is never freed */
+	copy->ctx = ctx;
+	copy->node = node;
+	copy->waiters = waiter;
+	copy->next = ctx->copies;
+	ctx->copies = copy;
+	node_pin(ctx, node);
+	if (&ctx->root != node)
+		++node->nlookup;
+
+	(void) pthread_mutex_unlock(&ctx->nodes.lock);
+
+	if ((0 == fstatat(node->f_ro, "", &stbuf, AT_EMPTY_PATH)) &&
+	    ((unsigned long) stbuf.st_size >= ctx->copy_async) &&
+	    (0 == pthread_create(&thread, NULL, copy_thread, copy))) {
+		(void) pthread_detach(thread);
+		return;
+	}
+
+	finish_copy(copy, copy_node(ctx, node));
+}
+
+static void luufs_open(fuse_req_t req,
+                       fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+	struct luufs_waiter *waiter;
+	struct luufs_node *node;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret) {
+		(void) reply_err(req, -ret);
+		return;
+	}
+
+	/* if it's an attempt to overwrite a file under the read-only directory,
+	 * copy the file to the writeable directory first or reply with EROFS */
+	if ((LUUFS_RO == node->layer) &&
+	    ((0 != (O_WRONLY & fi->flags)) || (0 != (O_RDWR & fi->flags)))) {
+		if (0 == ctx->copy_up) {
+			(void) reply_err(req, EROFS);
+			goto put;
+		}
+
+		waiter = (struct luufs_waiter *) malloc(sizeof(*waiter));
+		if (NULL == waiter) {
+			(void) reply_err(req, ENOMEM);
+			goto put;
+		}
+
+		waiter->req = req;
+		waiter->fi = *fi;
+		waiter->op = COPY_OPEN;
+		copy_up(ctx, node, waiter);
+		goto put;
+	}
+
+	do_open(ctx, req, node, fi);
+
+put:
+	node_put(ctx, node);
+}
+
+static void luufs_create(fuse_req_t req,
+                         fuse_ino_t parent,
+                         const char *name,
+                         mode_t mode,
+                         struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	struct luufs_node *dir;
+	int ret;
+	int fd;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
+
+	/* if the file already exists, reply with EEXIST */
+	ret = ro_lookup(ctx, dir, name);
+	if (0 == ret) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if (-ENOENT != ret)
+		goto out;
+
+	ret = rw_dir(ctx, dir);
+	if (0 != ret)
+		goto out;
+
+	fd = ctx->openat(dir->f_rw, name, O_CREAT | O_EXCL | fi->flags, mode);
+	if (-1 == fd) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* change the file owner, using the calling process credentials */
+	if (-1 == fchown(fd, fuse_ctx->uid, fuse_ctx->gid)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	ret = ramrw_hold(&ctx->ram, fd);
+	if (0 != ret)
+		goto close_fd;
+
+	rwmap_add(&ctx->rwmap, dir->dev, dir->ino, name);
+	dircache_drop(&ctx->listings, dir->dev, dir->ino);
+
+	ret = new_entry(ctx, dir, name, &e);
+	if (0 != ret)
+		goto release;
+
+	ret = file_new(ctx, req, get_node(ctx, e.ino), LUUFS_RW, fd, fi);
+	if (0 != ret) {
+		node_unref(&ctx->nodes, get_node(ctx, e.ino), 1);
+		goto out;
+	}
+
+	if (0 != fuse_reply_create(req, &e, fi))
+		file_free(req, get_file(fi));
+
+	node_put(ctx, dir);
+	return;
+
+release:
+	ramrw_release(&ctx->ram, fd);
+
+close_fd:
+	(void) close(fd);
+
+out:
+	node_put(ctx, dir);
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+static void luufs_close(fuse_req_t req,
+                        fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+	file_free(req, get_file(fi));
+	fi->fh = (uint64_t) (uintptr_t) NULL;
+	(void) reply_err(req, 0);
+}
+
+static int luufs_truncate(const char *path,
+                          const struct fuse_file_info *fi,
+                          const off_t size)
+{
+	int ret;
+
+	if (NULL == fi)
+		ret = truncate(path, size);
+	else
+		ret = ftruncate(get_file(fi)->fd, size);
+	if (-1 == ret)
+		return -errno;
+
+	return 0;
+}
+
+static int luufs_chmod(const char *path,
+                       const struct fuse_file_info *fi,
+                       const mode_t mode)
+{
+	int ret;
+
+	if (NULL == fi)
+		ret = chmod(path, mode);
+	else
+		ret = fchmod(get_file(fi)->fd, mode);
+	if (-1 == ret)
+		return -errno;
+
+	return 0;
+}
+
+static int luufs_chown(const struct luufs_ctx *ctx,
+                       const int fd,
+                       const uid_t uid,
+                       const gid_t gid)
+{
+	if (-1 == ctx->fchownat(fd,
+	                        "",
+	                        uid,
+	                        gid,
+	                        AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	return 0;
+}
+
+static int luufs_utimens(const struct luufs_ctx *ctx,
+                         const char *path,
+                         const struct fuse_file_info *fi,
+                         const struct timespec tv[2])
+{
+	int ret;
+
+	if (NULL == fi)
+		ret = ctx->utimensat(AT_FDCWD, path, tv, 0);
+	else
+		ret = futimens(get_file(fi)->fd, tv);
+	if (-1 == ret)
+		return -errno;
+
+	return 0;
+}
+
+static void do_setattr(struct luufs_ctx *ctx,
+                       fuse_req_t req,
+                       const struct luufs_node *node,
+                       const struct stat *attr,
+                       const int to_set,
+                       const struct fuse_file_info *fi)
+{
+	char path[PROC_PATH_MAX];
+	struct timespec tv[2];
+	struct stat stbuf;
+	int ret;
+
+	/* under an in-memory writeable directory, an open file may be read from
+	 * the disk while its attributes are kept in memory */
+	if (1 == ctx->ram.enabled)
+		fi = NULL;
+
+	proc_path(path, node->f_rw);
+
+	if (0 != (FUSE_SET_ATTR_MODE & to_set)) {
+		ret = luufs_chmod(path, fi, attr->st_mode);
+		if (0 != ret)
+			goto reply;
+	}
+
+	if (0 != ((FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID) & to_set)) {
+		ret = luufs_chown(
+		          ctx,
+		          node->f_rw,
+		          (0 != (FUSE_SET_ATTR_UID & to_set)) ? attr->st_uid : -1,
+		          (0 != (FUSE_SET_ATTR_GID & to_set)) ? attr->st_gid : -1);
+		if (0 != ret)
+			goto reply;
+	}
+
+	if (0 != (FUSE_SET_ATTR_SIZE & to_set)) {
+		if (1 == ctx->ram.enabled)
+			ret = ramrw_truncate(&ctx->ram, node->f_rw, attr->st_size);
+		else
+			ret = luufs_truncate(path, fi, attr->st_size);
+		if (0 != ret)
+			goto reply;
+	}
+
+	if (0 != ((FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME) & to_set)) {
+		tv[0].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1].tv_sec = 0;
+		tv[1].tv_nsec = UTIME_OMIT;
+
+		if (0 != (FUSE_SET_ATTR_ATIME_NOW & to_set))
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (0 != (FUSE_SET_ATTR_ATIME & to_set))
+			tv[0] = attr->st_atim;
+
+		if (0 != (FUSE_SET_ATTR_MTIME_NOW & to_set))
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (0 != (FUSE_SET_ATTR_MTIME & to_set))
+			tv[1] = attr->st_mtim;
+
+		ret = luufs_utimens(ctx, path, fi, tv);
+		if (0 != ret)
+			goto reply;
+	}
+
+	if (-1 == fstatat(node->f_rw,
+	                  "",
+	                  &stbuf,
+	                  AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+		ret = -errno;
+		goto reply;
+	}
+
+	(void) fuse_reply_attr(req, &stbuf, ctx->rw_timeout);
+	return;
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+static void luufs_setattr(fuse_req_t req,
+                          fuse_ino_t ino,
+                          struct stat *attr,
+                          int to_set,
+                          struct fuse_file_info *fi)
+{
+	struct luufs_waiter *waiter;
+	struct luufs_node *node;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret) {
+		(void) reply_err(req, -ret);
+		return;
+	}
+
+	/* if the file exists under the read-only directory, copy it to the
+	 * writeable directory first or reply with EROFS */
+	if (LUUFS_RO == node->layer) {
+		if (0 == ctx->copy_up) {
+			(void) reply_err(req, EROFS);
+			goto put;
+		}
+
+		waiter = (struct luufs_waiter *) malloc(sizeof(*waiter));
+		if (NULL == waiter) {
+			(void) reply_err(req, ENOMEM);
+			goto put;
+		}
+
+		waiter->req = req;
+		waiter->attr = *attr;
+		waiter->to_set = to_set;
+		waiter->op = COPY_SETATTR;
+		copy_up(ctx, node, waiter);
+		goto put;
+	}
+
+	do_setattr(ctx, req, node, attr, to_set, fi);
+
+put:
+	node_put(ctx, node);
+}
+
+static void luufs_stat(fuse_req_t req,
+                       fuse_ino_t ino,
+                       struct fuse_file_info *fi)
 {
-	uLong *crc;
-	struct dirent ent;
 	struct stat stbuf;
+	struct luufs_node *node;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret) {
+		(void) reply_err(req, -ret);
+		return;
+	}
+
+	if (-1 == fstatat(node->fds[node->layer],
+	                  "",
+	                  &stbuf,
+	                  AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
+		(void) reply_err(req, errno);
+	else
+		(void) fuse_reply_attr(req, &stbuf, node_timeout(ctx, node));
+
+	node_put(ctx, node);
+}
+
+static void luufs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char path[PROC_PATH_MAX];
+	struct luufs_node *node;
+	int ret;
+	int fd;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret)
+		goto reply;
+
+	/* perform all access checks except W_OK on the file the inode resolves to
+	 * and W_OK checks on its counterpart under the writeable directory; musl
+	 * does not support AT_SYMLINK_NOFOLLOW so we don't pass this flag */
+	if (0 != (W_OK & mask)) {
+		fd = node->f_rw;
+		if (-1 == fd) {
+			ret = -EROFS;
+			goto put;
+		}
+	}
+	else
+		fd = node->fds[node->layer];
+
+	proc_path(path, fd);
+	if (-1 == faccessat(AT_FDCWD, path, mask, 0))
+		ret = -errno;
+
+put:
+	node_put(ctx, node);
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+/* lets libfuse move data from the file to /dev/fuse, using splice() when the
+ * kernel supports it */
+static void luufs_read(fuse_req_t req,
+                       fuse_ino_t ino,
+                       size_t size,
+                       off_t off,
+                       struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	struct luufs_ctx *ctx;
+	struct luufs_file *file;
+
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+	file = get_file(fi);
+
+	/* the next range is requested before this one is read, so the disk is
+	 * busy while the reply is sent */
+	readahead_read(&ctx->ra, &file->ra, off, size);
+	profile_read(&ctx->profile, file->prof, off, size);
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = file->fd;
+	buf.buf[0].pos = off;
+
+	(void) fuse_reply_data(req, &buf, 0);
+}
+
+static void luufs_write_buf(fuse_req_t req,
+                            fuse_ino_t ino,
+                            struct fuse_bufvec *bufv,
+                            off_t off,
+                            struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+	ssize_t ret;
+
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = get_file(fi)->fd;
+	buf.buf[0].pos = off;
+
+	ret = fuse_buf_copy(&buf, bufv, 0);
+	if (0 > ret) {
+		(void) reply_err(req, (int) -ret);
+		return;
+	}
+
+	(void) fuse_reply_write(req, (size_t) ret);
+}
+
+static void luufs_fsync(fuse_req_t req,
+                        fuse_ino_t ino,
+                        int datasync,
+                        struct fuse_file_info *fi)
+{
+	struct luufs_ctx *ctx;
+	int fd;
+	int ret;
+
+	fd = get_file(fi)->fd;
+	if (0 == datasync)
+		ret = fsync(fd);
+	else
+		ret = fdatasync(fd);
+	if (-1 == ret) {
+		(void) reply_err(req, errno);
+		return;
+	}
+
+	/* a file under an in-memory writeable directory is durable only once it's
+	 * copied to the disk */
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+	(void) reply_err(req, -ramrw_sync(&ctx->ram, fd));
+}
+
+static void luufs_fallocate(fuse_req_t req,
+                            fuse_ino_t ino,
+                            int mode,
+                            off_t offset,
+                            off_t length,
+                            struct fuse_file_info *fi)
+{
+	if (-1 == fallocate(get_file(fi)->fd, mode, offset, length))
+		(void) reply_err(req, errno);
+	else
+		(void) reply_err(req, 0);
+}
+
+/* the kernel copies the data between the underlying files, possibly by
+ * sharing it, and holes are kept */
+static void luufs_copy_file_range(fuse_req_t req,
+                                  fuse_ino_t ino_in,
+                                  off_t off_in,
+                                  struct fuse_file_info *fi_in,
+                                  fuse_ino_t ino_out,
+                                  off_t off_out,
+                                  struct fuse_file_info *fi_out,
+                                  size_t len,
+                                  int flags)
+{
+	ssize_t ret;
+
+	if (0 != flags) {
+		(void) reply_err(req, EINVAL);
+		return;
+	}
+
+	ret = copyup_range(get_file(fi_in)->fd,
+	                   off_in,
+	                   get_file(fi_out)->fd,
+	                   off_out,
+	                   len);
+	if (0 > ret)
+		(void) reply_err(req, (int) -ret);
+	else
+		(void) fuse_reply_write(req, (size_t) ret);
+}
+
+/* the kernel handles all other seeks */
+static void luufs_lseek(fuse_req_t req,
+                        fuse_ino_t ino,
+                        off_t off,
+                        int whence,
+                        struct fuse_file_info *fi)
+{
+	off_t ret;
+
+	ret = lseek(get_file(fi)->fd, off, whence);
+	if (-1 == ret)
+		(void) reply_err(req, errno);
+	else
+		(void) fuse_reply_lseek(req, ret);
+}
+
+static void luufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct luufs_node *dir;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
+
+	/* if the file exists under the read-only directory, reply with EROFS */
+	ret = ro_lookup(ctx, dir, name);
+	if (0 == ret) {
+		ret = -EROFS;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
+
+	/* the directory may exist only under the read-only directory */
+	if (-1 == dir->f_rw) {
+		ret = -ENOENT;
+		goto put;
+	}
+
+	ret = 0;
+	if (-1 == ctx->unlinkat(dir->f_rw, name, 0))
+		ret = -errno;
+	else {
+		rwmap_remove(&ctx->rwmap, dir->dev, dir->ino, name);
+		dircache_drop(&ctx->listings, dir->dev, dir->ino);
+	}
+
+put:
+	node_put(ctx, dir);
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+static void luufs_mkdir(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char *name,
+                        mode_t mode)
+{
+	struct fuse_entry_param e;
+	struct luufs_node *dir;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
+
+	/* if the directory exists under the read-only directory, reply with
+	 * EEXIST */
+	ret = ro_lookup(ctx, dir, name);
+	if (0 == ret) {
+		ret = -EEXIST;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
+
+	ret = rw_dir(ctx, dir);
+	if (0 != ret)
+		goto put;
+
+	if (-1 == ctx->mkdirat(dir->f_rw, name, mode)) {
+		ret = -errno;
+		goto put;
+	}
+
+	if (-1 == ctx->fchownat(dir->f_rw,
+	                        name,
+	                        fuse_ctx->uid,
+	                        fuse_ctx->gid,
+	                        AT_SYMLINK_NOFOLLOW)) {
+		ret = -errno;
+		(void) ctx->unlinkat(dir->f_rw, name, AT_REMOVEDIR);
+		goto put;
+	}
+
+	rwmap_add(&ctx->rwmap, dir->dev, dir->ino, name);
+	dircache_drop(&ctx->listings, dir->dev, dir->ino);
+
+	ret = new_entry(ctx, dir, name, &e);
+	if (0 == ret)
+		rwmap_add_dir(&ctx->rwmap, e.attr.st_dev, e.attr.st_ino);
+
+put:
+	node_put(ctx, dir);
+
+reply:
+	if (0 == ret)
+		(void) fuse_reply_entry(req, &e);
+	else
+		(void) reply_err(req, -ret);
+}
+
+static void luufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct luufs_node *dir;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
+
+	/* if the directory exists under the read-only directory, reply with
+	 * EROFS */
+	ret = ro_lookup(ctx, dir, name);
+	if (0 == ret) {
+		ret = -EROFS;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
+
+	/* the directory may exist only under the read-only directory */
+	if (-1 == dir->f_rw) {
+		ret = -ENOENT;
+		goto put;
+	}
+
+	ret = 0;
+	if (-1 == ctx->unlinkat(dir->f_rw, name, AT_REMOVEDIR))
+		ret = -errno;
+	else {
+		rwmap_remove(&ctx->rwmap, dir->dev, dir->ino, name);
+		dircache_drop(&ctx->listings, dir->dev, dir->ino);
+	}
+
+put:
+	node_put(ctx, dir);
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+/* returns the cached listing of a directory, if the directories it was read
+ * from have not changed since */
+static int dir_cached(struct luufs_ctx *ctx,
+                      struct luufs_node *node,
+                      struct dircache_listing **listing)
+{
+	struct dircache_stamp stamps[LUUFS_MAX_RO + 1];
+	unsigned int i;
+	int fd;
+
+	*listing = NULL;
+
+	if (0 == ctx->listings.enabled)
+		return 0;
+
+	for (i = 0; ctx->nros >= i; ++i) {
+		fd = (ctx->nros == i) ? node->f_rw : node_ro_fd(node, i);
+		if (-1 == dircache_stamp(&stamps[i], fd))
+			return -errno;
+	}
+
+	*listing = dircache_get(&ctx->listings,
+	                        node->dev,
+	                        node->ino,
+	                        stamps,
+	                        ctx->nros + 1);
+	return 0;
+}
+
+static void luufs_opendir(fuse_req_t req,
+                          fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+	struct luufs_dir_ctx *dir_ctx;
+	struct luufs_dir_list *list;
+	struct dircache_listing *listing;
+	struct luufs_node *node;
+	unsigned int i;
+	int fd;
+	int ret;
+
+	LUUFS_CALL_HEAD();
+
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret)
+		goto end;
+
+	ret = node_lower(ctx, node);
+	if (0 != ret)
+		goto put;
+
+	ret = dir_cached(ctx, node, &listing);
+	if (0 != ret)
+		goto put;
+
+	dir_ctx = malloc(sizeof(*dir_ctx) +
+	                 sizeof(dir_ctx->lists[0]) * (ctx->nros + 1));
+	if (NULL == dir_ctx) {
+		ret = -ENOMEM;
+		goto release;
+	}
+
+	if (-1 == dircache_builder_init(&dir_ctx->build, ctx->nros + 1)) {
+		ret = -ENOMEM;
+		goto free_dir_ctx;
+	}
+
+	nameset_init(&dir_ctx->names);
+	dir_ctx->listing = listing;
+	dir_ctx->dev = node->dev;
+	dir_ctx->ino = node->ino;
+	dir_ctx->count = ctx->nros + 1;
+	dir_ctx->last = 0;
+	dir_ctx->merged = 0;
+	for (i = 0; dir_ctx->count > i; ++i) {
+		dir_ctx->lists[i].dir = NULL;
+		dir_ctx->lists[i].fd = -1;
+		dir_ctx->lists[i].pos = 0;
+	}
+
+	/* open the directory under each directory it exists in, unless its
+	 * listing is cached */
+	for (i = 0; (NULL == listing) && (dir_ctx->count > i); ++i) {
+		list = &dir_ctx->lists[i];
+
+		fd = (ctx->nros == i) ? node->f_rw : node_ro_fd(node, i);
+		if (-1 == fd)
+			continue;
+
+		list->fd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+		if (-1 == list->fd) {
+			ret = -errno;
+			goto close_dirs;
+		}
+
+		list->dir = fdopendir(list->fd);
+		if (NULL == list->dir) {
+			ret = -errno;
+			(void) close(list->fd);
+			goto close_dirs;
+		}
+
+		dir_ctx->last = i;
+	}
+
+	fi->fh = (uint64_t) (uintptr_t) dir_ctx;
+
+	if (0 == fuse_reply_open(req, fi)) {
+		node_put(ctx, node);
+		return;
+	}
+
+	ret = 0;
+
+close_dirs:
+	for (i = 0; dir_ctx->count > i; ++i) {
+		if (NULL != dir_ctx->lists[i].dir)
+			(void) closedir(dir_ctx->lists[i].dir);
+	}
+
+	dircache_builder_free(&dir_ctx->build);
+
+free_dir_ctx:
+	free(dir_ctx);
+
+release:
+	if (NULL != listing)
+		dircache_release(&ctx->listings, listing);
+
+put:
+	node_put(ctx, node);
+
+	if (0 == ret)
+		return;
+
+end:
+	(void) reply_err(req, -ret);
+}
+
+static void luufs_closedir(fuse_req_t req,
+                           fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+	struct luufs_dir_ctx *dir_ctx;
+	struct luufs_ctx *ctx;
+	unsigned int i;
+
+	dir_ctx = (struct luufs_dir_ctx *) (uintptr_t) fi->fh;
+	if (NULL == dir_ctx) {
+		(void) reply_err(req, EBADF);
+		return;
+	}
+
+	for (i = 0; dir_ctx->count > i; ++i) {
+		if (NULL != dir_ctx->lists[i].dir) {
+			if (-1 == closedir(dir_ctx->lists[i].dir)) {
+				(void) reply_err(req, errno);
+				return;
+			}
+		}
+	}
+
+	if (NULL != dir_ctx->listing) {
+		ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+		dircache_release(&ctx->listings, dir_ctx->listing);
+	}
+
+	dircache_builder_free(&dir_ctx->build);
+	nameset_free(&dir_ctx->names);
+	free(dir_ctx);
+
+	fi->fh = (uint64_t) (uintptr_t) NULL;
+
+	(void) reply_err(req, 0);
+}
+
+/* reads the next entry of a listing; names are remembered, so duplicates in
+ * the listings that follow can be skipped */
+static int dir_next(struct luufs_dir_ctx *dir_ctx,
+                    const unsigned int list,
+                    struct dirent *ent,
+                    struct dirent **entp)
+{
+	int ret;
+
+	ret = readdir_r(dir_ctx->lists[list].dir, ent, entp);
+	if (0 != ret)
+		return -ret;
+
+	if (NULL == *entp) {
+		if (list == dir_ctx->merged)
+			dir_ctx->merged = list + 1;
+		return 0;
+	}
+
+	++dir_ctx->lists[list].pos;
+
+	if (list < dir_ctx->last) {
+		if (-1 == nameset_add(&dir_ctx->names, (*entp)->d_name, list))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* moves a listing to the entry that follows the given position; reading
+ * usually continues where the previous reply ended, so this is rarely more
+ * than a comparison */
+static int dir_seek(struct luufs_dir_ctx *dir_ctx,
+                    const unsigned int list,
+                    const off_t pos)
+{
+	struct dirent ent;
+	struct dirent *entp;
+	int ret;
+
+	if (dir_ctx->lists[list].pos > pos) {
+		rewinddir(dir_ctx->lists[list].dir);
+		dir_ctx->lists[list].pos = 0;
+	}
+
+	while (dir_ctx->lists[list].pos < pos) {
+		ret = dir_next(dir_ctx, list, &ent, &entp);
+		if (0 != ret)
+			return ret;
+		if (NULL == entp)
+			break;
+	}
+
+	return 0;
+}
+
+/* reads the listings before the given one to their end, so all names under
+ * them are known before names in it are checked */
+static int dir_merge(struct luufs_dir_ctx *dir_ctx, const unsigned int list)
+{
+	struct dirent ent;
+	struct dirent *entp;
+	int ret;
+
+	while (dir_ctx->merged < list) {
+		if (NULL == dir_ctx->lists[dir_ctx->merged].dir) {
+			++dir_ctx->merged;
+			continue;
+		}
+
+		ret = dir_next(dir_ctx, dir_ctx->merged, &ent, &entp);
+		if (0 != ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* returns 1 if a name was read from a listing that precedes the given one */
+static int dir_hidden(const struct luufs_dir_ctx *dir_ctx,
+                      const unsigned int list,
+                      const char *name)
+{
+	int64_t tag;
+
+	if (0 == list)
+		return 0;
+
+	tag = nameset_tag(&dir_ctx->names, name);
+	if ((0 <= tag) && ((int64_t) list > tag))
+		return 1;
+
+	return 0;
+}
+
+static int dir_stamps(const struct luufs_dir_ctx *dir_ctx,
+                      struct dircache_stamp *stamps)
+{
+	unsigned int i;
+
+	for (i = 0; dir_ctx->count > i; ++i) {
+		if (-1 == dircache_stamp(&stamps[i], dir_ctx->lists[i].fd))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* starts collecting the entries sent, before the listings are read from their
+ * beginning */
+static void dir_build(struct luufs_ctx *ctx, struct luufs_dir_ctx *dir_ctx)
+{
+	dircache_begin(&ctx->listings,
+	               &dir_ctx->build,
+	               dir_ctx->dev,
+	               dir_ctx->ino);
+	if (0 == dircache_building(&dir_ctx->build))
+		return;
+
+	if (-1 == dir_stamps(dir_ctx, dir_ctx->build.stamps))
+		dircache_abort(&dir_ctx->build);
+}
+
+/* caches the merged listing once all listings are read to their end */
+static void dir_built(struct luufs_ctx *ctx, struct luufs_dir_ctx *dir_ctx)
+{
+	struct dircache_stamp stamps[LUUFS_MAX_RO + 1];
+
+	if (0 == dircache_building(&dir_ctx->build))
+		return;
+
+	if (-1 == dir_stamps(dir_ctx, stamps)) {
+		dircache_abort(&dir_ctx->build);
+		return;
+	}
+
+	dircache_put(&ctx->listings,
+	             &dir_ctx->build,
+	             dir_ctx->dev,
+	             dir_ctx->ino,
+	             stamps);
+}
+
+/* reads a cached listing, whose offsets are entry numbers */
+static int listing_readdir(fuse_req_t req,
+                           struct luufs_ctx *ctx,
+                           struct luufs_node *dir,
+                           const struct dircache_listing *listing,
+                           char *buf,
+                           const size_t size,
+                           const off_t offset,
+                           const int plus,
+                           size_t *len)
+{
+	struct fuse_entry_param e;
+	const struct dircache_ent *ent;
+	const char *name;
+	size_t entsize;
+	size_t i;
+	int ret;
+
+	if ((0 > offset) || ((off_t) listing->count < offset))
+		return -EINVAL;
+
+	*len = 0;
+	for (i = (size_t) offset; listing->count > i; ++i) {
+		ent = &listing->ents[i];
+		name = &listing->names[ent->name];
+
+		memset(&e, 0, sizeof(e));
+
+		if ((1 == plus) &&
+		    (0 != strcmp(".", name)) &&
+		    (0 != strcmp("..", name))) {
+			ret = do_lookup(ctx,
+			                dir,
+			                name,
+			                (ctx->nros == ent->list) ? LUUFS_RW : LUUFS_RO,
+			                ent->list,
+			                NULL,
+			                &e);
+			if (-ENOENT == ret)
+				continue;
+			if (0 != ret)
+				return ret;
+		}
+		else {
+			e.attr.st_ino = (ino_t) ent->ino;
+			e.attr.st_mode = DTTOIF(ent->type);
+		}
+
+		if (1 == plus)
+			entsize = fuse_add_direntry_plus(req,
+			                                 &buf[*len],
+			                                 size - *len,
+			                                 name,
+			                                 &e,
+			                                 (off_t) (i + 1));
+		else
+			entsize = fuse_add_direntry(req,
+			                            &buf[*len],
+			                            size - *len,
+			                            name,
+			                            &e.attr,
+			                            (off_t) (i + 1));
+
+		if (entsize > size - *len) {
+			if (0 != e.ino)
+				node_unref(&ctx->nodes, get_node(ctx, e.ino), 1);
+			break;
+		}
+
+		*len += entsize;
+	}
+
+	return 0;
+}
+
+/* decides which system calls are issued ahead for a directory entry: when
+ * entries carry full attributes, dir is the directory they are looked up
+ * under and the handles the lookup opens are opened and stat()ed, while
+ * otherwise, the entry is stat()ed only if its type is unknown */
+static void probe_entry(struct luufs_ctx *ctx,
+                        const struct luufs_node *dir,
+                        const int layer,
+                        const struct dirent *ent,
+                        struct luufs_probe *probe)
+{
+	int mask;
+
+	if (NULL == dir) {
+		probe_init(probe,
+		           ent->d_name,
+		           0,
+		           (DT_UNKNOWN == ent->d_type) ? PROBE_LAYER(layer) : 0);
+		return;
+	}
+
+	if ((0 == strcmp(".", ent->d_name)) || (0 == strcmp("..", ent->d_name))) {
+		probe_init(probe, ent->d_name, 0, 0);
+		return;
+	}
+
+	/* the lookup of a directory or a file that may have been copied searches
+	 * the writeable directory too */
+	mask = PROBE_LAYER(layer);
+	if ((LUUFS_RO == layer) &&
+	    (-1 != dir->f_rw) &&
+	    ((DT_DIR == ent->d_type) ||
+	     (DT_UNKNOWN == ent->d_type) ||
+	     ((DT_REG == ent->d_type) && (1 == ctx->copy_up))) &&
+	    (0 == rw_missing(ctx, dir, ent->d_name)))
+		mask |= PROBE_LAYER(LUUFS_RW);
+
+	probe_init(probe, ent->d_name, mask, mask);
+}
+
+/* the listing is streamed: each reply holds as many entries as fit and the
+ * next one continues from the offset of the last entry the kernel received;
+ * with plus set, each entry is looked up and carries full attributes, so the
+ * kernel does not have to send a lookup request for each */
+static void do_readdir(fuse_req_t req,
+                       fuse_ino_t ino,
+                       size_t size,
+                       off_t offset,
+                       struct fuse_file_info *fi,
+                       const int plus)
+{
+	struct dirent ents[PROBE_BATCH];
+	struct luufs_probe probes[PROBE_BATCH];
+	long cookies[PROBE_BATCH];
+	off_t positions[PROBE_BATCH];
+	struct fuse_entry_param e;
 	struct luufs_dir_ctx *dir_ctx;
-	const struct luufs_ctx *ctx;
+	struct luufs_dir_list *list;
+	struct luufs_ctx *ctx;
+	struct luufs_worker *worker;
+	struct luufs_node *dir;
 	struct dirent *entp;
+	char *buf;
+	size_t len;
+	size_t entsize;
+	unsigned int batch;
+	unsigned int first;
+	unsigned int n;
 	unsigned int i;
 	unsigned int j;
-	unsigned int k;
+	int dirfds[2];
+	int side;
 	int ret;
 
 	dir_ctx = (struct luufs_dir_ctx *) (uintptr_t) fi->fh;
 	if (NULL == dir_ctx) {
-		ret = -EBADF;
-		goto end;
+		(void) reply_err(req, EBADF);
+		return;
 	}
 
-	crc = malloc(DIRENT_MAX * sizeof(*crc));
-	if (NULL == crc) {
-		ret = -ENOMEM;
-		goto end;
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+
+	worker = get_worker(ctx);
+	if (NULL == worker) {
+		(void) reply_err(req, ENOMEM);
+		return;
+	}
+
+	buf = worker_buf(worker, size);
+	if (NULL == buf) {
+		(void) reply_err(req, ENOMEM);
+		return;
+	}
+
+	/* without io_uring, entries are handled one at a time */
+	batch = (NULL == worker->ring) ? 1 : PROBE_BATCH;
+
+	/* entries are looked up relative to the directory's handles */
+	dir = NULL;
+	if (1 == plus) {
+		ret = node_get(ctx, ino, &dir);
+		if (0 != ret) {
+			(void) reply_err(req, -ret);
+			return;
+		}
+	}
+
+	if (NULL != dir_ctx->listing) {
+		ret = listing_readdir(req,
+		                      ctx,
+		                      dir,
+		                      dir_ctx->listing,
+		                      buf,
+		                      size,
+		                      offset,
+		                      plus,
+		                      &len);
+		if (0 != ret)
+			goto reply_err;
+		goto reply;
 	}
 
 	if (0 == offset) {
-		for (i = 0; 2 > i; ++i) {
-			if (NULL != dir_ctx->dirs[i])
-				rewinddir(dir_ctx->dirs[i]);
+		for (i = 0; dir_ctx->count > i; ++i) {
+			if (NULL != dir_ctx->lists[i].dir)
+				rewinddir(dir_ctx->lists[i].dir);
+			dir_ctx->lists[i].pos = 0;
 		}
+
+		nameset_clear(&dir_ctx->names);
+		dir_ctx->merged = 0;
+		first = 0;
+
+		dir_build(ctx, dir_ctx);
 	}
+	else {
+		first = OFF_LIST(offset);
+		if ((dir_ctx->count <= first) ||
+		    (NULL == dir_ctx->lists[first].dir)) {
+			ret = -EINVAL;
+			goto reply_err;
+		}
 
-	ctx = (const struct luufs_ctx *) fuse_get_context()->private_data;
+		ret = dir_seek(dir_ctx, first, OFF_POS(offset));
+		if (0 != ret)
+			goto reply_err;
 
-	ret = 0;
-	j = 0;
-	for (i = 0; 2 > i; ++i) {
-		if (NULL == dir_ctx->dirs[i])
+		/* entries sent but not received are sent again */
+		dircache_rewind(&dir_ctx->build, (uint64_t) offset);
+	}
+
+	len = 0;
+	for (i = first; dir_ctx->count > i; ++i) {
+		list = &dir_ctx->lists[i];
+		if (NULL == list->dir)
 			continue;
 
+		if (i != first) {
+			ret = dir_seek(dir_ctx, i, 0);
+			if (0 != ret)
+				goto reply_err;
+		}
+
+		ret = dir_merge(dir_ctx, i);
+		if (0 != ret)
+			goto reply_err;
+
+		/* entries are looked up relative to the directory's handles, but
+		 * without full attributes, they're stat()ed under the listed one */
+		side = (ctx->nros == i) ? LUUFS_RW : LUUFS_RO;
+		if (1 == plus) {
+			dirfds[LUUFS_RO] = dir->f_ro;
+			dirfds[LUUFS_RW] = dir->f_rw;
+		}
+		else {
+			dirfds[LUUFS_RO] = -1;
+			dirfds[LUUFS_RW] = -1;
+			dirfds[side] = list->fd;
+		}
+
 		do {
-next:
-			if (0 != readdir_r(dir_ctx->dirs[i], &ent, &entp)) {
-				ret = -errno;
-				goto free_crc;
-			}
-			if (NULL == entp) {
-				ret = 0;
+			/* read a batch of entries, whose system calls are issued
+			 * together */
+			n = 0;
+			do {
+				cookies[n] = telldir(list->dir);
+
+				ret = dir_next(dir_ctx, i, &ents[n], &entp);
+				if (0 != ret)
+					goto reply_err;
+				if (NULL == entp)
+					break;
+
+				if (1 == dir_hidden(dir_ctx, i, entp->d_name))
+					continue;
+
+				/* handles are opened ahead under the first read-only
+				 * directory the directory exists in only */
+				positions[n] = list->pos;
+				if ((NULL == worker->ring) ||
+				    ((1 == plus) && (LUUFS_RO == side) && (i != dir->ro)))
+					probe_init(&probes[n], ents[n].d_name, 0, 0);
+				else
+					probe_entry(ctx, dir, side, &ents[n], &probes[n]);
+				++n;
+			} while (batch > n);
+
+			if (0 == n)
 				break;
-			}
 
-			if (DIRENT_MAX == j) {
-				ret = -ENOMEM;
-				goto free_crc;
+			if (NULL != worker->ring)
+				probe_run(worker, dirfds, probes, n);
+
+			for (j = 0; n > j; ++j) {
+				memset(&e, 0, sizeof(e));
+
+				/* the kernel takes a reference to each inode sent with full
+				 * attributes, except . and .. */
+				if ((1 == plus) &&
+				    (0 != strcmp(".", ents[j].d_name)) &&
+				    (0 != strcmp("..", ents[j].d_name))) {
+					ret = do_lookup(ctx,
+					                dir,
+					                ents[j].d_name,
+					                side,
+					                i,
+					                &probes[j],
+					                &e);
+					probe_close(&probes[j]);
+					if (-ENOENT == ret)
+						continue;
+					if (0 != ret)
+						goto close_probes;
+				}
+				else {
+					/* the kernel uses only the inode number and the type, so
+					 * the file is not stat()ed unless its type is unknown */
+					e.attr.st_ino = ents[j].d_ino;
+					e.attr.st_mode = DTTOIF(ents[j].d_type);
+					if (DT_UNKNOWN == ents[j].d_type) {
+						if (0 == probes[j].stats[side])
+							uring_stat(&probes[j].stx[side], &e.attr);
+						else if (0 != fstatat(list->fd,
+						                      ents[j].d_name,
+						                      &e.attr,
+						                      AT_SYMLINK_NOFOLLOW)) {
+							ret = -errno;
+							goto close_probes;
+						}
+					}
+				}
+
+				if (1 == plus)
+					entsize = fuse_add_direntry_plus(req,
+					                                 &buf[len],
+					                                 size - len,
+					                                 ents[j].d_name,
+					                                 &e,
+					                                 DIR_OFF(i, positions[j]));
+				else
+					entsize = fuse_add_direntry(req,
+					                            &buf[len],
+					                            size - len,
+					                            ents[j].d_name,
+					                            &e.attr,
+					                            DIR_OFF(i, positions[j]));
+
+				/* if the entry does not fit, it's the first one to be sent in
+				 * the next reply */
+				if (entsize > size - len) {
+					if (0 != e.ino)
+						node_unref(&ctx->nodes,
+						           get_node(ctx, e.ino),
+						           1);
+					seekdir(list->dir, cookies[j]);
+					list->pos = positions[j] - 1;
+					ret = 0;
+					goto close_probes;
+				}
+
+				len += entsize;
+
+				dircache_add(&ctx->listings,
+				             &dir_ctx->build,
+				             ents[j].d_name,
+				             (uint64_t) ents[j].d_ino,
+				             (DT_UNKNOWN == ents[j].d_type) ?
+				             IFTODT(e.attr.st_mode) :
+				             ents[j].d_type,
+				             i,
+				             (uint64_t) DIR_OFF(i, positions[j]));
 			}
+		} while (NULL != entp);
+	}
 
-			crc[j] = crc32(ctx->init,
-			               (const Bytef *) entp->d_name,
-			               strlen(entp->d_name));
-			for (k = 0; j > k; ++k) {
-				if (crc[k] == crc[j])
-					goto next;
-			}
+	dir_built(ctx, dir_ctx);
+	goto reply;
 
-			if (0 != fstatat(dir_ctx->fds[i],
-			                 entp->d_name,
-			                 &stbuf,
-			                 AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
-				ret = -errno;
-				goto free_crc;
-			}
+close_probes:
+	/* handles opened ahead for entries not sent are closed */
+	for (; n > j; ++j)
+		probe_close(&probes[j]);
+	if (0 != ret)
+		goto reply_err;
 
-			if (1 == filler(buf, entp->d_name, &stbuf, 0)) {
-				ret = -ENOMEM;
-				goto free_crc;
-			}
+reply:
+	(void) fuse_reply_buf(req, buf, len);
+	ret = 0;
 
-			++j;
-		} while (1);
-	}
+reply_err:
+	if (NULL != dir)
+		node_put(ctx, dir);
 
-free_crc:
-	free(crc);
+	if (0 != ret)
+		(void) reply_err(req, -ret);
+}
 
-end:
-	return ret;
+static void luufs_readdir(fuse_req_t req,
+                          fuse_ino_t ino,
+                          size_t size,
+                          off_t offset,
+                          struct fuse_file_info *fi)
+{
+	do_readdir(req, ino, size, offset, fi, 0);
 }
 
-static int luufs_symlink(const char *to, const char *from)
+static void luufs_readdirplus(fuse_req_t req,
+                              fuse_ino_t ino,
+                              size_t size,
+                              off_t offset,
+                              struct fuse_file_info *fi)
 {
-	struct stat stbuf;
+	do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void luufs_symlink(fuse_req_t req,
+                          const char *to,
+                          fuse_ino_t parent,
+                          const char *from)
+{
+	struct fuse_entry_param e;
+	struct luufs_node *dir;
+	int ret;
 
 	LUUFS_CALL_HEAD();
 
-	/* if the link source exists under the read-only directory, return EEXIST in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &from[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EEXIST;
-	if (ENOENT != errno)
-		return -errno;
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
 
-	if (-1 == ctx->symlinkat(to, ctx->rw, &from[1]))
-		return -errno;
+	/* if the link source exists under the read-only directory, reply with
+	 * EEXIST */
+	ret = ro_lookup(ctx, dir, from);
+	if (0 == ret) {
+		ret = -EEXIST;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
 
-	if (-1 == ctx->fchownat(ctx->rw,
-	                   &from[1],
-	                   fuse_ctx->uid,
-	                   fuse_ctx->gid,
-	                   AT_SYMLINK_NOFOLLOW)) {
-		(void) ctx->unlinkat(ctx->rw, &from[1], AT_REMOVEDIR);
-		return -errno;
+	ret = rw_dir(ctx, dir);
+	if (0 != ret)
+		goto put;
+
+	if (-1 == ctx->symlinkat(to, dir->f_rw, from)) {
+		ret = -errno;
+		goto put;
 	}
 
-	return 0;
+	if (-1 == ctx->fchownat(dir->f_rw,
+	                        from,
+	                        fuse_ctx->uid,
+	                        fuse_ctx->gid,
+	                        AT_SYMLINK_NOFOLLOW)) {
+		ret = -errno;
+		(void) ctx->unlinkat(dir->f_rw, from, 0);
+		goto put;
+	}
+
+	rwmap_add(&ctx->rwmap, dir->dev, dir->ino, from);
+	dircache_drop(&ctx->listings, dir->dev, dir->ino);
+
+	ret = new_entry(ctx, dir, from, &e);
+
+put:
+	node_put(ctx, dir);
+
+reply:
+	if (0 == ret)
+		(void) fuse_reply_entry(req, &e);
+	else
+		(void) reply_err(req, -ret);
 }
 
-static int luufs_readlink(const char *name, char *buf, size_t size)
+static void luufs_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	int len;
+	char buf[PATH_MAX];
+	struct luufs_node *node;
+	ssize_t len;
+	int ret;
 
 	LUUFS_CALL_HEAD();
 
-	len = readlinkat(ctx->ro, &name[1], buf, size - 1);
-	if (-1 != len)
-		goto nul;
-	if (ENOENT != errno)
-		return -errno;
+	ret = node_get(ctx, ino, &node);
+	if (0 != ret) {
+		(void) reply_err(req, -ret);
+		return;
+	}
 
-	len = readlinkat(ctx->rw, &name[1], buf, size - 1);
-	if (-1 == len)
-		return -errno;
+	len = readlinkat(node->fds[node->layer], "", buf, sizeof(buf) - 1);
+	ret = errno;
+	node_put(ctx, node);
+
+	if (-1 == len) {
+		(void) reply_err(req, ret);
+		return;
+	}
 
-nul:
 	buf[len] = '\0';
 
-	return 0;
+	(void) fuse_reply_readlink(req, buf);
 }
 
-static int luufs_mknod(const char *name, mode_t mode, dev_t dev)
+static void luufs_mknod(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char *name,
+                        mode_t mode,
+                        dev_t dev)
 {
-	struct stat stbuf;
+	struct fuse_entry_param e;
+	struct luufs_node *dir;
+	int ret;
 
 	LUUFS_CALL_HEAD();
 
-	/* if the device exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	ret = node_get(ctx, parent, &dir);
+	if (0 != ret)
+		goto reply;
 
-	if (-1 == ctx->mknodat(ctx->rw,
-	                  &name[1],
-	                  mode,
-	                  dev))
-		return -errno;
+	/* if the device exists under the read-only directory, reply with EROFS */
+	ret = ro_lookup(ctx, dir, name);
+	if (0 == ret) {
+		ret = -EROFS;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
 
-	return 0;
+	ret = rw_dir(ctx, dir);
+	if (0 != ret)
+		goto put;
+
+	if (-1 == ctx->mknodat(dir->f_rw, name, mode, dev)) {
+		ret = -errno;
+		goto put;
+	}
+
+	rwmap_add(&ctx->rwmap, dir->dev, dir->ino, name);
+	dircache_drop(&ctx->listings, dir->dev, dir->ino);
+
+	ret = new_entry(ctx, dir, name, &e);
+
+put:
+	node_put(ctx, dir);
+
+reply:
+	if (0 == ret)
+		(void) fuse_reply_entry(req, &e);
+	else
+		(void) reply_err(req, -ret);
 }
 
-static int luufs_chmod(const char *name, mode_t mode)
+static void luufs_rename(fuse_req_t req,
+                         fuse_ino_t parent,
+                         const char *oldname,
+                         fuse_ino_t newparent,
+                         const char *newname,
+                         unsigned int flags)
 {
-	struct stat stbuf;
+	struct luufs_node *olddir;
+	struct luufs_node *newdir;
+	int ret;
 
 	LUUFS_CALL_HEAD();
 
-	/* if the file exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	if (0 != flags) {
+		ret = -EINVAL;
+		goto reply;
+	}
 
-	if (-1 == fchmodat(ctx->rw, &name[1], mode, AT_SYMLINK_NOFOLLOW))
-		return -errno;
+	ret = node_get(ctx, parent, &olddir);
+	if (0 != ret)
+		goto reply;
+
+	ret = node_get(ctx, newparent, &newdir);
+	if (0 != ret)
+		goto put_olddir;
+
+	/* if the file belongs to the read-only directory, reply with EROFS */
+	ret = ro_lookup(ctx, olddir, oldname);
+	if (0 == ret) {
+		ret = -EROFS;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
+
+	/* if the destination exists under the read-only directory, reply with
+	 * EEXIST */
+	ret = ro_lookup(ctx, newdir, newname);
+	if (0 == ret) {
+		ret = -EEXIST;
+		goto put;
+	}
+	if (-ENOENT != ret)
+		goto put;
+
+	if (-1 == olddir->f_rw) {
+		ret = -ENOENT;
+		goto put;
+	}
+
+	ret = rw_dir(ctx, newdir);
+	if (0 != ret)
+		goto put;
+
+	if (-1 == ctx->renameat(olddir->f_rw, oldname, newdir->f_rw, newname))
+		ret = -errno;
+	else {
+		rwmap_remove(&ctx->rwmap, olddir->dev, olddir->ino, oldname);
+		rwmap_add(&ctx->rwmap, newdir->dev, newdir->ino, newname);
+		dircache_drop(&ctx->listings, olddir->dev, olddir->ino);
+		dircache_drop(&ctx->listings, newdir->dev, newdir->ino);
+	}
+
+put:
+	node_put(ctx, newdir);
+
+put_olddir:
+	node_put(ctx, olddir);
+
+reply:
+	(void) reply_err(req, -ret);
+}
+
+/* drops names and attributes cached by the kernel when a directory under the
+ * read-only directory changes */
+static void ro_changed(void *arg,
+                       const dev_t dev,
+                       const ino_t ino,
+                       const char *name)
+{
+	struct luufs_ctx *ctx;
+	fuse_ino_t dir;
+
+	ctx = (struct luufs_ctx *) arg;
+
+	dircache_drop(&ctx->listings, dev, ino);
+
+	/* if the kernel does not know the directory, it has nothing cached */
+	dir = node_find(ctx, dev, ino);
+	if (0 == dir)
+		return;
+
+	if (NULL == name)
+		(void) fuse_lowlevel_notify_inval_inode(ctx->se, dir, 0, 0);
+	else
+		(void) fuse_lowlevel_notify_inval_entry(ctx->se,
+		                                        dir,
+		                                        name,
+		                                        strlen(name));
+}
+
+static void dump(struct luufs_ctx *ctx)
+{
+	if (NULL != ctx->stats.path)
+		(void) stats_write(&ctx->stats);
+
+	if (NULL != ctx->trace.path)
+		(void) trace_write(&ctx->trace);
+}
+
+static void *dump_thread(void *arg)
+{
+	struct signalfd_siginfo info;
+	struct pollfd pfds[2];
+	struct luufs_ctx *ctx;
+
+	ctx = (struct luufs_ctx *) arg;
+
+	pfds[0].fd = ctx->sfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = ctx->efd;
+	pfds[1].events = POLLIN;
+
+	do {
+		if (-1 == poll(pfds, 2, -1)) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+
+		if (0 != pfds[1].revents)
+			break;
+
+		if (sizeof(info) == read(ctx->sfd, &info, sizeof(info)))
+			dump(ctx);
+	} while (1);
+
+	return NULL;
+}
+
+/* starts a thread that writes the statistics and the trace on SIGUSR1; the
+ * signal is blocked in all threads, so it's read through a signalfd */
+static int dump_start(struct luufs_ctx *ctx)
+{
+	sigset_t set;
+
+	if ((-1 == sigemptyset(&set)) ||
+	    (-1 == sigaddset(&set, SIGUSR1)) ||
+	    (0 != pthread_sigmask(SIG_BLOCK, &set, NULL)))
+		return -1;
+
+	ctx->sfd = signalfd(-1, &set, SFD_CLOEXEC);
+	if (-1 == ctx->sfd)
+		return -1;
+
+	ctx->efd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == ctx->efd)
+		goto close_sfd;
+
+	if (0 != pthread_create(&ctx->dumper, NULL, dump_thread, ctx))
+		goto close_efd;
 
 	return 0;
+
+close_efd:
+	(void) close(ctx->efd);
+	ctx->efd = -1;
+
+close_sfd:
+	(void) close(ctx->sfd);
+	ctx->sfd = -1;
+
+	return -1;
 }
 
-static int luufs_chown(const char *name, uid_t uid, gid_t gid)
+/* stops the thread started by dump_start() and writes the statistics and the
+ * trace one last time */
+static void dump_stop(struct luufs_ctx *ctx)
 {
-	struct stat stbuf;
+	uint64_t val = 1;
 
-	LUUFS_CALL_HEAD();
+	if (-1 == ctx->efd)
+		return;
 
-	/* if the file exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	if (sizeof(val) == write(ctx->efd, &val, sizeof(val)))
+		(void) pthread_join(ctx->dumper, NULL);
 
-	if (-1 == ctx->fchownat(ctx->rw,
-	                        &name[1],
-	                        uid,
-	                        gid,
-	                        AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -errno;
+	(void) close(ctx->efd);
+	(void) close(ctx->sfd);
+	ctx->efd = -1;
+	ctx->sfd = -1;
 
-	return 0;
+	dump(ctx);
 }
 
-static int luufs_utimens(const char *name, const struct timespec tv[2])
+static void luufs_init(void *userdata, struct fuse_conn_info *conn)
 {
-	struct stat stbuf;
+	struct luufs_ctx *ctx;
+
+	ctx = (struct luufs_ctx *) userdata;
+
+	/* splice data between /dev/fuse and the underlying files and allow large
+	 * writes, unless options passed to FUSE say otherwise */
+	conn->want |= conn->capable &
+	              (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	conn->max_write = LUUFS_MAX_WRITE;
+	fuse_apply_conn_info_opts(ctx->conn_opts, conn);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	/* let the kernel perform I/O directly against the underlying files;
+	 * passthrough cannot be combined with writeback caching */
+	if ((1 == ctx->passthrough) &&
+	    (0 != (FUSE_CAP_PASSTHROUGH & conn->capable)) &&
+	    (0 == (FUSE_CAP_WRITEBACK_CACHE & conn->want)))
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+	else
+		ctx->passthrough = 0;
+#else
+	ctx->passthrough = 0;
+#endif
+}
 
-	LUUFS_CALL_HEAD();
+static void luufs_destroy(void *userdata)
+{
+	struct luufs_ctx *ctx;
+	unsigned long hits;
+	unsigned long misses;
+	size_t count;
+	uint64_t windows;
+	uint64_t bytes;
+	uint64_t ra_hits;
+	uint64_t ra_misses;
+	uint64_t dropped;
+	uint64_t files;
+	uint64_t prefetched;
+	uint64_t flushes;
+	uint64_t removed;
+	uint64_t spilled;
+	uint64_t loaded;
+
+	ctx = (struct luufs_ctx *) userdata;
+
+	rocache_stats(&ctx->cache, &hits, &misses, &count);
+	if (0 != hits + misses)
+		syslog(LOG_INFO,
+		       "read-only lookup cache: %lu hits, %lu misses (%.1f%%), "
+		       "%zu entries",
+		       hits,
+		       misses,
+		       (100.0 * (double) hits) / (double) (hits + misses),
+		       count);
+
+	dircache_stats(&ctx->listings, &hits, &misses, &count);
+	if (0 != hits + misses)
+		syslog(LOG_INFO,
+		       "directory listing cache: %lu hits, %lu misses (%.1f%%), "
+		       "%zu listings",
+		       hits,
+		       misses,
+		       (100.0 * (double) hits) / (double) (hits + misses),
+		       count);
+
+	readahead_stats(&ctx->ra, &windows, &bytes, &ra_hits, &ra_misses, &dropped);
+	if (0 != ra_hits + ra_misses)
+		syslog(LOG_INFO,
+		       "readahead: %llu windows of %llu bytes, %llu hits, %llu "
+		       "misses (%.1f%%), %llu bytes dropped",
+		       (unsigned long long) windows,
+		       (unsigned long long) bytes,
+		       (unsigned long long) ra_hits,
+		       (unsigned long long) ra_misses,
+		       (100.0 * (double) ra_hits) / (double) (ra_hits + ra_misses),
+		       (unsigned long long) dropped);
+
+	profile_stats(&ctx->profile, &files, &prefetched);
+	if (0 != files)
+		syslog(LOG_INFO,
+		       "profile: %llu files, %llu bytes prefetched",
+		       (unsigned long long) files,
+		       (unsigned long long) prefetched);
+
+	ramrw_stats(&ctx->ram,
+	            &flushes,
+	            &files,
+	            &bytes,
+	            &removed,
+	            &spilled,
+	            &loaded);
+	if (0 != flushes)
+		syslog(LOG_INFO,
+		       "in-memory writeable directory: %llu flushes, %llu files of "
+		       "%llu bytes copied, %llu files removed, %llu files moved to "
+		       "the disk, %llu copied back",
+		       (unsigned long long) flushes,
+		       (unsigned long long) files,
+		       (unsigned long long) bytes,
+		       (unsigned long long) removed,
+		       (unsigned long long) spilled,
+		       (unsigned long long) loaded);
+}
 
-	/* if the file exists under the read-only directory, return EROFS in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &name[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+#ifdef HAVE_SDT
+#	define PROBE_ENTRY(op, ino, name) \
+	DTRACE_PROBE3(luufs, op__entry, op, ino, name)
+#	define PROBE_RETURN(op, outcome, err) \
+	DTRACE_PROBE3(luufs, op__return, op, outcome, err)
+#else
+#	define PROBE_ENTRY(op, ino, name) do {} while (0)
+#	define PROBE_RETURN(op, outcome, err) do {} while (0)
+#endif
 
-	if (-1 == ctx->utimensat(ctx->rw, &name[1], tv, AT_SYMLINK_NOFOLLOW))
-		return -errno;
+static uint64_t ts_ns(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000ULL + (uint64_t) ts->tv_nsec;
+}
 
-	return 0;
+/* starts measuring a request for an inode or a name under a directory; the
+ * outcome of requests for an inode defaults to the directory it resolves to,
+ * while requests for a name, which create or remove files, are served by the
+ * writeable directory unless they fail */
+static struct luufs_worker *measure_begin(fuse_req_t req,
+                                          const int op,
+                                          const fuse_ino_t ino,
+                                          const char *name,
+                                          struct timespec *start)
+{
+	const struct fuse_ctx *fuse_ctx;
+	struct luufs_ctx *ctx;
+	struct luufs_worker *worker;
+	const struct luufs_node *node;
+
+	ctx = (struct luufs_ctx *) fuse_req_userdata(req);
+
+	worker = get_worker(ctx);
+	if (NULL == worker)
+		return NULL;
+
+	PROBE_ENTRY(op, ino, name);
+
+	node = (0 == ino) ? NULL : get_node(ctx, ino);
+	worker->outcome = STATS_RW;
+	if ((NULL == name) && (NULL != node) && (LUUFS_RO == node->layer))
+		worker->outcome = STATS_RO;
+	worker->err = 0;
+
+	if ((NULL == worker->stats) && (NULL == worker->trace))
+		return worker;
+
+	if (NULL != worker->trace) {
+		fuse_ctx = fuse_req_ctx(req);
+		worker->event.pid = (uint32_t) fuse_ctx->pid;
+		worker->event.uid = (uint32_t) fuse_ctx->uid;
+		worker->event.ino = (NULL == node) ? 0 : (uint64_t) node->ino;
+		worker->event.name[0] = '\0';
+		if (NULL != name)
+			(void) strncat(worker->event.name,
+			               name,
+			               sizeof(worker->event.name) - 1);
+	}
+
+	(void) clock_gettime(CLOCK_MONOTONIC, start);
+	return worker;
 }
 
-static int luufs_rename(const char *oldpath, const char *newpath)
+static void measure_end(struct luufs_worker *worker,
+                        const int op,
+                        const struct timespec *start)
 {
-	struct stat stbuf;
+	struct timespec end;
+	uint64_t ns;
 
-	LUUFS_CALL_HEAD();
+	if (NULL == worker)
+		return;
 
-	/* if the file belongs to the read-only directory, return EROFS in errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &oldpath[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EROFS;
-	if (ENOENT != errno)
-		return -errno;
+	PROBE_RETURN(op, worker->outcome, worker->err);
 
-	/* if the destination exists under the read-only directory, return EEXIST in
-	 * errno */
-	if (0 == ctx->fstatat(ctx->ro,
-	                      &newpath[1],
-	                      &stbuf,
-	                      AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
-		return -EEXIST;
-	if (ENOENT != errno)
-		return -errno;
+	if ((NULL == worker->stats) && (NULL == worker->trace))
+		return;
 
-	if (-1 == ctx->renameat(ctx->rw,
-	                        &oldpath[1],
-	                        ctx->rw,
-	                        &newpath[1]))
-		return -errno;
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = ts_ns(&end) - ts_ns(start);
 
-	return 0;
+	if (NULL != worker->stats)
+		stats_add(worker->stats, op, worker->outcome, ns);
+
+	if (NULL != worker->trace) {
+		worker->event.start = ts_ns(start);
+		worker->event.duration = ns;
+		worker->event.op = (uint8_t) op;
+		worker->event.outcome = (uint8_t) worker->outcome;
+		worker->event.err = (int32_t) worker->err;
+		trace_add(worker->trace, &worker->event);
+	}
 }
 
-static struct fuse_operations luufs_oper = {
+/* defines a handler that measures another; requests may be replied to before
+ * the handler returns, so the request must not be used afterwards */
+#define MEASURED_HANDLER(op, name, params, args, ino, file)                \
+	static void measured_##name params                                     \
+	{                                                                      \
+		struct timespec start;                                             \
+		struct luufs_worker *worker;                                       \
+		                                                                   \
+		worker = measure_begin(req, op, ino, file, &start);                \
+		luufs_##name args;                                                 \
+		measure_end(worker, op, &start);                                   \
+	}
+
+MEASURED_HANDLER(STATS_LOOKUP,
+                 lookup,
+                 (fuse_req_t req, fuse_ino_t parent, const char *name),
+                 (req, parent, name),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_FORGET,
+                 forget,
+                 (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup),
+                 (req, ino, nlookup),
+                 0,
+                 NULL)
+MEASURED_HANDLER(STATS_FORGET,
+                 forget_multi,
+                 (fuse_req_t req,
+                  size_t count,
+                  struct fuse_forget_data *forgets),
+                 (req, count, forgets),
+                 0,
+                 NULL)
+MEASURED_HANDLER(STATS_OPEN,
+                 open,
+                 (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                 (req, ino, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_CREATE,
+                 create,
+                 (fuse_req_t req,
+                  fuse_ino_t parent,
+                  const char *name,
+                  mode_t mode,
+                  struct fuse_file_info *fi),
+                 (req, parent, name, mode, fi),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_RELEASE,
+                 close,
+                 (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                 (req, ino, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_READ,
+                 read,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  size_t size,
+                  off_t off,
+                  struct fuse_file_info *fi),
+                 (req, ino, size, off, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_WRITE,
+                 write_buf,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  struct fuse_bufvec *bufv,
+                  off_t off,
+                  struct fuse_file_info *fi),
+                 (req, ino, bufv, off, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_GETATTR,
+                 stat,
+                 (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                 (req, ino, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_SETATTR,
+                 setattr,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  struct stat *attr,
+                  int to_set,
+                  struct fuse_file_info *fi),
+                 (req, ino, attr, to_set, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_ACCESS,
+                 access,
+                 (fuse_req_t req, fuse_ino_t ino, int mask),
+                 (req, ino, mask),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_UNLINK,
+                 unlink,
+                 (fuse_req_t req, fuse_ino_t parent, const char *name),
+                 (req, parent, name),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_MKDIR,
+                 mkdir,
+                 (fuse_req_t req,
+                  fuse_ino_t parent,
+                  const char *name,
+                  mode_t mode),
+                 (req, parent, name, mode),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_RMDIR,
+                 rmdir,
+                 (fuse_req_t req, fuse_ino_t parent, const char *name),
+                 (req, parent, name),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_OPENDIR,
+                 opendir,
+                 (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                 (req, ino, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_RELEASEDIR,
+                 closedir,
+                 (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+                 (req, ino, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_READDIR,
+                 readdir,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  size_t size,
+                  off_t offset,
+                  struct fuse_file_info *fi),
+                 (req, ino, size, offset, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_READDIRPLUS,
+                 readdirplus,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  size_t size,
+                  off_t offset,
+                  struct fuse_file_info *fi),
+                 (req, ino, size, offset, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_SYMLINK,
+                 symlink,
+                 (fuse_req_t req,
+                  const char *to,
+                  fuse_ino_t parent,
+                  const char *from),
+                 (req, to, parent, from),
+                 parent,
+                 from)
+MEASURED_HANDLER(STATS_READLINK,
+                 readlink,
+                 (fuse_req_t req, fuse_ino_t ino),
+                 (req, ino),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_MKNOD,
+                 mknod,
+                 (fuse_req_t req,
+                  fuse_ino_t parent,
+                  const char *name,
+                  mode_t mode,
+                  dev_t dev),
+                 (req, parent, name, mode, dev),
+                 parent,
+                 name)
+MEASURED_HANDLER(STATS_RENAME,
+                 rename,
+                 (fuse_req_t req,
+                  fuse_ino_t parent,
+                  const char *oldname,
+                  fuse_ino_t newparent,
+                  const char *newname,
+                  unsigned int flags),
+                 (req, parent, oldname, newparent, newname, flags),
+                 parent,
+                 oldname)
+MEASURED_HANDLER(STATS_FSYNC,
+                 fsync,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  int datasync,
+                  struct fuse_file_info *fi),
+                 (req, ino, datasync, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_FALLOCATE,
+                 fallocate,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  int mode,
+                  off_t offset,
+                  off_t length,
+                  struct fuse_file_info *fi),
+                 (req, ino, mode, offset, length, fi),
+                 ino,
+                 NULL)
+MEASURED_HANDLER(STATS_COPY_FILE_RANGE,
+                 copy_file_range,
+                 (fuse_req_t req,
+                  fuse_ino_t ino_in,
+                  off_t off_in,
+                  struct fuse_file_info *fi_in,
+                  fuse_ino_t ino_out,
+                  off_t off_out,
+                  struct fuse_file_info *fi_out,
+                  size_t len,
+                  int flags),
+                 (req,
+                  ino_in,
+                  off_in,
+                  fi_in,
+                  ino_out,
+                  off_out,
+                  fi_out,
+                  len,
+                  flags),
+                 ino_out,
+                 NULL)
+MEASURED_HANDLER(STATS_LSEEK,
+                 lseek,
+                 (fuse_req_t req,
+                  fuse_ino_t ino,
+                  off_t off,
+                  int whence,
+                  struct fuse_file_info *fi),
+                 (req, ino, off, whence, fi),
+                 ino,
+                 NULL)
+
+static struct fuse_lowlevel_ops luufs_oper = {
+	.init		= luufs_init,
+	.destroy	= luufs_destroy,
+
+	.lookup		= luufs_lookup,
+	.forget		= luufs_forget,
+	.forget_multi	= luufs_forget_multi,
+
 	.open		= luufs_open,
 	.create		= luufs_create,
 	.release	= luufs_close,
 
-	.truncate	= luufs_truncate,
-
 	.read		= luufs_read,
-	.write		= luufs_write,
+	.write_buf	= luufs_write_buf,
+	.fsync		= luufs_fsync,
+	.fallocate	= luufs_fallocate,
+	.copy_file_range	= luufs_copy_file_range,
+	.lseek		= luufs_lseek,
 
 	.getattr	= luufs_stat,
+	.setattr	= luufs_setattr,
 	.access		= luufs_access,
 
 	.unlink		= luufs_unlink,
@@ -799,96 +4605,67 @@ static struct fuse_operations luufs_oper = {
 	.opendir	= luufs_opendir,
 	.releasedir	= luufs_closedir,
 	.readdir	= luufs_readdir,
+	.readdirplus	= luufs_readdirplus,
 
 	.symlink	= luufs_symlink,
 	.readlink	= luufs_readlink,
 
 	.mknod		= luufs_mknod,
 
-	.chmod		= luufs_chmod,
-	.chown		= luufs_chown,
-	.utimens	= luufs_utimens,
 	.rename		= luufs_rename
 };
 
-static int mirror_dirs(const int src, const int dest) {
-	struct stat stbuf;
-	struct dirent ent;
-	DIR *dir;
-	struct dirent *entp;
-	int nsrc;
-	int ndest;
-	int ret;
-
-	dir = fdopendir(src);
-	if (NULL == dir) {
-		ret = -1;
-		goto end;
-	}
+/* the same operations, measured and traced */
+static struct fuse_lowlevel_ops luufs_measured_oper = {
+	.init		= luufs_init,
+	.destroy	= luufs_destroy,
 
-	do {
-		if (0 != readdir_r(dir, &ent, &entp)) {
-			ret = -1;
-			break;
-		}
-		if (NULL == entp) {
-			ret = 0;
-			break;
-		}
+	.lookup		= measured_lookup,
+	.forget		= measured_forget,
+	.forget_multi	= measured_forget_multi,
 
-		if (DT_DIR != entp->d_type)
-			continue;
+	.open		= measured_open,
+	.create		= measured_create,
+	.release	= measured_close,
 
-		if ((0 == strcmp(".", entp->d_name)) ||
-		    (0 == strcmp("..", entp->d_name)))
-			continue;
+	.read		= measured_read,
+	.write_buf	= measured_write_buf,
+	.fsync		= measured_fsync,
+	.fallocate	= measured_fallocate,
+	.copy_file_range	= measured_copy_file_range,
+	.lseek		= measured_lseek,
 
-		if (-1 == fstatat(src, entp->d_name, &stbuf, 0)) {
-			ret = -1;
-			break;
-		}
+	.getattr	= measured_stat,
+	.setattr	= measured_setattr,
+	.access		= measured_access,
 
-		if (-1 == mkdirat(dest, entp->d_name, stbuf.st_mode)) {
-			if (EEXIST != errno) {
-				ret = -1;
-				break;
-			}
-		}
+	.unlink		= measured_unlink,
 
-		nsrc = openat(src, entp->d_name, O_DIRECTORY);
-		if (-1 == nsrc) {
-			ret = -1;
-			break;
-		}
+	.mkdir		= measured_mkdir,
+	.rmdir		= measured_rmdir,
 
-		ndest = openat(dest, entp->d_name, O_DIRECTORY);
-		if (-1 == ndest) {
-			(void) close(nsrc);
-			ret = -1;
-			break;
-		}
+	.opendir	= measured_opendir,
+	.releasedir	= measured_closedir,
+	.readdir	= measured_readdir,
+	.readdirplus	= measured_readdirplus,
 
-		if (-1 == mirror_dirs(nsrc, ndest)) {
-			(void) close(ndest);
-			(void) close(nsrc);
-			ret = -1;
-			break;
-		}
-	} while (1);
+	.symlink	= measured_symlink,
+	.readlink	= measured_readlink,
 
-	(void) closedir(dir);
+	.mknod		= measured_mknod,
 
-end:
-	return ret;
-}
+	.rename		= measured_rename
+};
 
 static int openat_stub(int dirfd, const char *pathname, int flags, ...)
 {
 	va_list ap;
 	int ret;
 
-	if (0 != ((O_CREAT | O_WRONLY | O_RDWR) & flags))
-		return -EROFS;
+	if (0 != ((O_CREAT | O_WRONLY | O_RDWR) & flags)) {
+		errno = EROFS;
+		return -1;
+	}
 
 	va_start(ap, flags);
 	ret = openat(dirfd, pathname, flags, va_arg(ap, mode_t));
@@ -963,95 +4740,664 @@ static int fstatat_stub(int dirfd,
 	return fstatat(dirfd, pathname, buf, flags);
 }
 
+#ifndef LUUFS_DRIVER
+
+#define LUUFS_OPT(t, p, v) { t, offsetof(struct luufs_opts, p), v }
+
+static const struct fuse_opt luufs_opts[] = {
+	LUUFS_OPT("ro_cache=%u", ctx.ro_cache, 0),
+	LUUFS_OPT("immutable_ro", ctx.immutable_ro, 1),
+	LUUFS_OPT("ro_timeout=%lf", ctx.ro_timeout, 0),
+	LUUFS_OPT("index=%s", ctx.index, 0),
+	LUUFS_OPT("build_index", build_index, 1),
+	LUUFS_OPT("no_passthrough", no_passthrough, 1),
+	LUUFS_OPT("copy_up", ctx.copy_up, 1),
+	LUUFS_OPT("copy_up_async=%lu", ctx.copy_async, 0),
+	LUUFS_OPT("workers=%u", workers, 0),
+	LUUFS_OPT("pin_workers", ctx.pin_workers, 1),
+	LUUFS_OPT("stats=%s", ctx.stats, 0),
+	LUUFS_OPT("trace=%s", ctx.trace, 0),
+	LUUFS_OPT("max_handles=%lu", ctx.max_handles, 0),
+	LUUFS_OPT("exclusive_rw", ctx.exclusive_rw, 1),
+	LUUFS_OPT("uring", ctx.uring, 1),
+	LUUFS_OPT("dir_cache=%lu", ctx.dir_cache, 0),
+	LUUFS_OPT("readahead=%lu", ctx.readahead, 0),
+	LUUFS_OPT("profile=%s", ctx.profile, 0),
+	LUUFS_OPT("record=%u", ctx.record, 0),
+	LUUFS_OPT("prefetch_threads=%u", ctx.prefetch_threads, 0),
+	LUUFS_OPT("ram_rw=%lu", ctx.ram_rw, 0),
+	LUUFS_OPT("flush_interval=%u", ctx.flush_interval, 0),
+	FUSE_OPT_END
+};
+
+static int parse_arg(void *data,
+                     const char *arg,
+                     int key,
+                     struct fuse_args *outargs)
+{
+	struct luufs_opts *opts;
+
+	/* pass all other options to FUSE */
+	if (FUSE_OPT_KEY_NONOPT != key)
+		return 1;
+
+	opts = (struct luufs_opts *) data;
+	if (3 == opts->ndirs)
+		return -1;
+
+	opts->dirs[opts->ndirs] = arg;
+	++opts->ndirs;
+
+	return 0;
+}
+
+#endif
+
+static void ros_close(struct luufs_ctx *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; ctx->nros > i; ++i) {
+		free(ctx->ros[i].path);
+		(void) close(ctx->ros[i].fd);
+	}
+}
+
+/* opens the read-only directories, separated by colons, in order of
+ * precedence */
+static int ros_open(struct luufs_ctx *ctx, const char *dirs)
+{
+	struct luufs_ro *ro;
+	char *buf;
+	char *path;
+	char *pos;
+
+	buf = strdup(dirs);
+	if (NULL == buf)
+		return -1;
+
+	ctx->nros = 0;
+
+	for (path = strtok_r(buf, ":", &pos);
+	     NULL != path;
+	     path = strtok_r(NULL, ":", &pos)) {
+		if (LUUFS_MAX_RO == ctx->nros) {
+			errno = E2BIG;
+			goto close_ros;
+		}
+
+		ro = &ctx->ros[ctx->nros];
+		ro->fd = open(path, O_DIRECTORY);
+		if (-1 == ro->fd)
+			goto close_ros;
+
+		/* directories are created under the writeable directory on demand,
+		 * by their path relative to the read-only directory */
+		ro->path = realpath(path, NULL);
+		if (NULL == ro->path) {
+			(void) close(ro->fd);
+			goto close_ros;
+		}
+		ro->len = strlen(ro->path);
+		if (1 == ro->len)
+			ro->len = 0;
+
+		++ctx->nros;
+	}
+
+	free(buf);
+
+	if (0 == ctx->nros) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return 0;
+
+close_ros:
+	ros_close(ctx);
+	free(buf);
+
+	return -1;
+}
+
+void luufs_driver_defaults(struct luufs_driver_opts *opts)
+{
+	opts->ro = NULL;
+	opts->rw = NULL;
+	opts->ro_cache = RO_CACHE_SIZE;
+	opts->immutable_ro = 0;
+	opts->ro_timeout = RO_TIMEOUT;
+	opts->index = NULL;
+	opts->copy_up = 0;
+	opts->copy_async = COPY_ASYNC_SIZE;
+	opts->pin_workers = 0;
+	opts->stats = NULL;
+	opts->trace = NULL;
+	opts->max_handles = 0;
+	opts->exclusive_rw = 0;
+	opts->uring = 0;
+	opts->dir_cache = DIR_CACHE_SIZE;
+	opts->readahead = READAHEAD_SIZE;
+	opts->profile = NULL;
+	opts->record = 0;
+	opts->prefetch_threads = PREFETCH_THREADS;
+	opts->ram_rw = 0;
+	opts->flush_interval = FLUSH_INTERVAL;
+}
+
+/* sets up a union, minus the session and the threads; prints an error
+ * message on failure */
+static int luufs_ctx_init(struct luufs_ctx *ctx,
+                          const struct luufs_driver_opts *opts)
+{
+	struct stat stbuf;
+	int ro_fds[LUUFS_MAX_RO];
+	unsigned int i;
+	int dirs[2];
+
+	/* open all directories, so we can pass their file descriptors to the
+	 * *at() system calls later */
+	if (-1 == ros_open(ctx, opts->ro)) {
+		perror(opts->ro);
+		return -1;
+	}
+
+	/* the index and the names under the writeable directory are keyed by
+	 * files under a single read-only directory */
+	if ((1 < ctx->nros) &&
+	    ((NULL != opts->index) || (1 == opts->exclusive_rw))) {
+		(void) fprintf(stderr,
+		               "%s: index and exclusive_rw require a single read-only "
+		               "directory\n",
+		               opts->ro);
+		goto close_ros;
+	}
+
+	if (NULL == opts->rw) {
+		ctx->rw = -1;
+
+		/* use stubs that fail with EROFS instead of real system calls that may
+		 * alter the read-only directory */
+		ctx->openat = openat_stub;
+		ctx->unlinkat = unlinkat_stub;
+		ctx->fchownat = fchownat_stub;
+		ctx->mkdirat = mkdirat_stub;
+		ctx->mknodat = mknodat_stub;
+		ctx->renameat = renameat_stub;
+		ctx->symlinkat = symlinkat_stub;
+		ctx->utimensat = utimensat_stub;
+		ctx->fstatat = fstatat_stub;
+	}
+	else {
+		ctx->rw = open(opts->rw, O_DIRECTORY);
+		if (-1 == ctx->rw) {
+			perror(opts->rw);
+			goto close_ros;
+		}
+
+		ctx->openat = openat;
+		ctx->unlinkat = unlinkat;
+		ctx->fchownat = fchownat;
+		ctx->mkdirat = mkdirat;
+		ctx->mknodat = mknodat;
+		ctx->renameat = renameat;
+		ctx->symlinkat = symlinkat;
+		ctx->utimensat = utimensat;
+		ctx->fstatat = fstatat;
+	}
+
+	/* the in-memory copy replaces the writeable directory */
+	if (-1 == ramrw_init(&ctx->ram,
+	                     &ctx->rw,
+	                     (size_t) opts->ram_rw,
+	                     opts->flush_interval)) {
+		if (ENOSPC == errno)
+			(void) fprintf(stderr,
+			               "%s: does not fit in ram_rw=%lu bytes\n",
+			               opts->rw,
+			               opts->ram_rw);
+		else
+			perror(opts->rw);
+		goto close_rw;
+	}
+
+	if (-1 == fstat(ctx->ros[0].fd, &stbuf)) {
+		perror(opts->ro);
+		goto free_ram;
+	}
+
+	/* the root directory is the only inode that is never forgotten */
+	ctx->root.next = NULL;
+	ctx->root.nlookup = 0;
+	ctx->root.dev = stbuf.st_dev;
+	ctx->root.ino = stbuf.st_ino;
+	ctx->root.f_ro = ctx->ros[0].fd;
+	ctx->root.f_rw = ctx->rw;
+	ctx->root.lower = NULL;
+	ctx->root.nlower = 0;
+	ctx->root.ro = 0;
+	ctx->root.layer = LUUFS_RO;
+	ctx->root.nfiles = 0;
+	ctx->root.backing_id = 0;
+	ctx->root.backing_layer = LUUFS_RO;
+	ctx->copies = NULL;
+	ctx->copy_up = (-1 == ctx->rw) ? 0 : opts->copy_up;
+	ctx->copy_async = opts->copy_async;
+	if (-1 == node_table_init(&ctx->nodes))
+		goto free_ram;
+	ctx->nodes.nros = ctx->nros;
+
+	/* the root directory exists under all read-only directories */
+	if (1 < ctx->nros) {
+		ctx->root.lower = (int *) malloc(sizeof(int) * ctx->nros);
+		if (NULL == ctx->root.lower)
+			goto free_nodes;
+
+		ctx->root.lower[0] = -1;
+		for (i = 1; ctx->nros > i; ++i)
+			ctx->root.lower[i] = ctx->ros[i].fd;
+		ctx->root.nlower = ctx->nros - 1;
+	}
+
+	dirs[LUUFS_RO] = ctx->ros[0].fd;
+	dirs[LUUFS_RW] = ctx->rw;
+	node_table_limit(&ctx->nodes, (size_t) opts->max_handles, dirs);
+
+	/* a stale index is ignored, since files under the read-only directory
+	 * can still be looked up without it */
+	ctx->index.map = NULL;
+	if ((NULL != opts->index) &&
+	    (-1 == roindex_open(&ctx->index, opts->index, ctx->ros[0].fd))) {
+		if (ESTALE != errno) {
+			perror(opts->index);
+			goto free_nodes;
+		}
+
+		(void) fprintf(stderr, "%s: the index is stale\n", opts->index);
+	}
+
+	if (-1 == rocache_init(&ctx->cache, opts->ro_cache, opts->immutable_ro))
+		goto close_index;
+
+	if (-1 == dircache_init(&ctx->listings, (size_t) opts->dir_cache))
+		goto free_cache;
+
+	if (-1 == readahead_init(&ctx->ra, (size_t) opts->readahead))
+		goto free_listings;
+
+	for (i = 0; ctx->nros > i; ++i)
+		ro_fds[i] = ctx->ros[i].fd;
+
+	if (-1 == profile_init(&ctx->profile,
+	                       opts->profile,
+	                       opts->record,
+	                       opts->prefetch_threads,
+	                       ro_fds,
+	                       ctx->nros)) {
+		perror(opts->profile);
+		goto free_ra;
+	}
+
+	if (-1 == rwmap_init(&ctx->rwmap))
+		goto free_profile;
+
+	/* when nothing else changes the writeable directory, the names under it
+	 * are kept in memory, so missing names are not searched for */
+	if ((1 == opts->exclusive_rw) &&
+	    (-1 != ctx->rw) &&
+	    (-1 == rwmap_build(&ctx->rwmap, ctx->ros[0].fd, ctx->rw))) {
+		perror(opts->rw);
+		goto free_rwmap;
+	}
+
+	/* passthrough and the connection options are set up with the session */
+	ctx->passthrough = 0;
+	ctx->conn_opts = NULL;
+
+	if (-1 == sched_getaffinity(0, sizeof(ctx->cpus), &ctx->cpus))
+		goto free_rwmap;
+	ctx->ncpus = CPU_COUNT(&ctx->cpus);
+	ctx->pin_workers = opts->pin_workers;
+	ctx->uring = opts->uring;
+	ctx->next_cpu = 0;
+
+	if (0 != pthread_key_create(&ctx->worker_key, worker_free))
+		goto free_rwmap;
+
+	if (-1 == stats_init(&ctx->stats, opts->stats))
+		goto delete_key;
+
+	if (-1 == trace_init(&ctx->trace, opts->trace))
+		goto free_stats;
+
+	/* requests are measured only if asked to, so they're not slowed down
+	 * otherwise; probes cost nothing until a tracer attaches, but only the
+	 * measured handlers contain them */
+#ifdef HAVE_SDT
+	ctx->measure = 1;
+#else
+	ctx->measure = ((NULL != opts->stats) || (NULL != opts->trace)) ? 1 : 0;
+#endif
+	ctx->sfd = -1;
+	ctx->efd = -1;
+	ctx->se = NULL;
+
+	return 0;
+
+free_stats:
+	stats_free(&ctx->stats);
+
+delete_key:
+	(void) pthread_key_delete(ctx->worker_key);
+
+free_rwmap:
+	rwmap_free(&ctx->rwmap);
+
+free_profile:
+	profile_free(&ctx->profile);
+
+free_ra:
+	readahead_free(&ctx->ra);
+
+free_listings:
+	dircache_free(&ctx->listings);
+
+free_cache:
+	rocache_free(&ctx->cache);
+
+close_index:
+	roindex_close(&ctx->index);
+
+free_nodes:
+	free(ctx->root.lower);
+	node_table_free(&ctx->nodes);
+
+free_ram:
+	(void) ramrw_free(&ctx->ram);
+
+close_rw:
+	if (-1 != ctx->rw)
+		(void) close(ctx->rw);
+
+close_ros:
+	ros_close(ctx);
+
+	return -1;
+}
+
+/* starts the threads of a union; threads do not survive fuse_daemonize(), so
+ * the mount starts them only once it's done */
+static int luufs_ctx_start(struct luufs_ctx *ctx,
+                           const struct luufs_driver_opts *opts)
+{
+	/* the statistics and the trace are written on SIGUSR1, which must be
+	 * blocked before other threads are created */
+	if (((NULL != opts->stats) || (NULL != opts->trace)) &&
+	    (-1 == dump_start(ctx)))
+		return -1;
+
+	/* if changes under the read-only directory cannot be watched, lookups
+	 * are not cached and the kernel may cache files under it only as long as
+	 * other files */
+	(void) rocache_start(&ctx->cache, ro_changed, ctx);
+	(void) readahead_start(&ctx->ra);
+	(void) profile_start(&ctx->profile);
+	if (-1 == ramrw_start(&ctx->ram))
+		return -1;
+	ctx->ro_timeout = opts->ro_timeout;
+	ctx->rw_timeout = LUUFS_TIMEOUT;
+	if ((0 == ctx->cache.enabled) &&
+	    (0 == opts->immutable_ro) &&
+	    (NULL == ctx->index.map))
+		ctx->ro_timeout = ctx->rw_timeout;
+
+	return 0;
+}
+
+/* tears down a union set up by luufs_ctx_init(); returns -1 if changes under
+ * an in-memory writeable directory were lost */
+static int luufs_ctx_free(struct luufs_ctx *ctx)
+{
+	int ret;
+
+	wait_copies(ctx);
+	dump_stop(ctx);
+	trace_free(&ctx->trace);
+	stats_free(&ctx->stats);
+	(void) pthread_key_delete(ctx->worker_key);
+	free(ctx->conn_opts);
+	rwmap_free(&ctx->rwmap);
+	profile_free(&ctx->profile);
+	readahead_free(&ctx->ra);
+	dircache_free(&ctx->listings);
+	rocache_free(&ctx->cache);
+	roindex_close(&ctx->index);
+	free(ctx->root.lower);
+	node_table_free(&ctx->nodes);
+	ret = ramrw_free(&ctx->ram);
+	if (-1 != ctx->rw)
+		(void) close(ctx->rw);
+	ros_close(ctx);
+
+	return ret;
+}
+
+#ifdef LUUFS_DRIVER
+
+/* sets up a union like main() does, minus the session: there's no
+ * passthrough, and all requests are made by the caller */
+struct luufs_ctx *luufs_driver_new(const struct luufs_driver_opts *opts)
+{
+	struct luufs_ctx *ctx;
+
+	ctx = (struct luufs_ctx *) calloc(1, sizeof(*ctx));
+	if (NULL == ctx)
+		return NULL;
+
+	if (-1 == luufs_ctx_init(ctx, opts))
+		goto free_ctx;
+
+	if (-1 == luufs_ctx_start(ctx, opts)) {
+		(void) luufs_ctx_free(ctx);
+		goto free_ctx;
+	}
+
+	return ctx;
+
+free_ctx:
+	free(ctx);
+
+	return NULL;
+}
+
+const struct fuse_lowlevel_ops *luufs_driver_ops(const struct luufs_ctx *ctx)
+{
+	return (0 == ctx->measure) ? &luufs_oper : &luufs_measured_oper;
+}
+
+void luufs_driver_free(struct luufs_ctx *ctx)
+{
+	void *worker;
+
+	wait_copies(ctx);
+
+	/* the key destructor runs only when threads exit, and the caller's
+	 * thread may outlive the union */
+	worker = pthread_getspecific(ctx->worker_key);
+	if (NULL != worker) {
+		worker_free(worker);
+		(void) pthread_setspecific(ctx->worker_key, NULL);
+	}
+
+	(void) luufs_ctx_free(ctx);
+	free(ctx);
+}
+
+#else
+
 int main(int argc, char *argv[])
 {
-	char *fuse_argv[4];
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct luufs_opts opts;
 	struct luufs_ctx ctx;
+	struct fuse_session *se;
+	struct fuse_loop_config *config;
+	struct rlimit lim;
+	const char *target;
 	int ret;
 	int fd;
 
-	if ((3 != argc) && (4 != argc)) {
-		(void) fprintf(stderr, "Usage: %s RO [RW] TARGET\n", argv[0]);
+	opts.ndirs = 0;
+	opts.build_index = 0;
+	opts.no_passthrough = 0;
+	opts.workers = 0;
+	luufs_driver_defaults(&opts.ctx);
+
+	/* each inode holds up to two handles, so let luufs open as many files as
+	 * it may and keep half of them for handles of inodes by default */
+	if (0 == getrlimit(RLIMIT_NOFILE, &lim)) {
+		lim.rlim_cur = lim.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &lim);
+		if ((0 == getrlimit(RLIMIT_NOFILE, &lim)) &&
+		    (RLIM_INFINITY != lim.rlim_cur))
+			opts.ctx.max_handles = (unsigned long) lim.rlim_cur / 2;
+	}
+
+	if (-1 == fuse_opt_parse(&args, &opts, luufs_opts, parse_arg))
+		goto usage;
+
+	/* in index building mode, index the read-only directory and exit */
+	if (1 == opts.build_index) {
+		if ((1 != opts.ndirs) || (NULL == opts.ctx.index))
+			goto usage;
+
 		ret = EXIT_FAILURE;
-		goto out;
+
+		fd = open(opts.dirs[0], O_DIRECTORY);
+		if (-1 == fd)
+			goto free_args;
+
+		if (0 == roindex_write(fd, opts.ctx.index))
+			ret = EXIT_SUCCESS;
+		else
+			perror(opts.ctx.index);
+
+		(void) close(fd);
+		goto free_args;
 	}
 
+	if ((2 != opts.ndirs) && (3 != opts.ndirs))
+		goto usage;
+
+	/* a profile is recorded to the file it's replayed from */
+	if ((0 != opts.ctx.record) && (NULL == opts.ctx.profile))
+		goto usage;
+
 #ifdef HAVE_WAIVE
 	if (-1 == waive(WAIVE_INET | WAIVE_PACKET | WAIVE_KILL)) {
 		ret = EXIT_FAILURE;
-		goto out;
+		goto free_args;
 	}
 #endif
 
-	/* open both directories, so we can pass their file descriptors to the
-	 * *at() system calls later */
-	ctx.ro = open(argv[1], O_DIRECTORY);
-	if (-1 == ctx.ro) {
+	opts.ctx.ro = opts.dirs[0];
+	if (2 == opts.ndirs) {
+		opts.ctx.rw = NULL;
+		target = opts.dirs[1];
+	}
+	else {
+		opts.ctx.rw = opts.dirs[1];
+		target = opts.dirs[2];
+	}
+
+	if (-1 == luufs_ctx_init(&ctx, &opts.ctx)) {
 		ret = EXIT_FAILURE;
-		goto out;
+		goto free_args;
 	}
 
-	if (3 == argc) {
-		ctx.rw = -1;
-		fuse_argv[1] = argv[2];
+	ret = EXIT_FAILURE;
 
-		/* use stubs that fail with EROFS instead of real system calls that may
-		 * alter the read-only directory */
-		ctx.openat = openat_stub;
-		ctx.unlinkat = unlinkat_stub;
-		ctx.fchownat = fchownat_stub;
-		ctx.mkdirat = mkdirat_stub;
-		ctx.mknodat = mknodat_stub;
-		ctx.renameat = renameat_stub;
-		ctx.symlinkat = symlinkat_stub;
-		ctx.utimensat = utimensat_stub;
-		ctx.fstatat = fstatat_stub;
-	}
-	else {
-		ctx.rw = open(argv[2], O_DIRECTORY);
-		if (-1 == ctx.rw) {
-			ret = EXIT_FAILURE;
-			goto close_ro;
-		}
+	if (-1 == fuse_opt_add_arg(&args,
+	                           "-osuid,dev,allow_other,default_permissions"))
+		goto free_ctx;
 
-		/* mirror the read-only directory tree under the writeable directory */
-		fd = dup(ctx.ro);
-		if (-1 == fd) {
-			ret = EXIT_FAILURE;
-			goto close_ro;
-		}
-		ret = mirror_dirs(fd, ctx.rw);
-		if (-1 == ret) {
-			(void) close(fd);
-			ret = EXIT_FAILURE;
-			goto close_ro;
-		}
+	/* options like max_write or no_splice_read are applied once the kernel
+	 * reports what it supports */
+	ctx.passthrough = (0 == opts.no_passthrough) ? 1 : 0;
+	ctx.conn_opts = fuse_parse_conn_info_opts(&args);
+	if (NULL == ctx.conn_opts)
+		goto free_ctx;
 
-		ctx.openat = openat;
-		ctx.unlinkat = unlinkat;
-		ctx.fchownat = fchownat;
-		ctx.mkdirat = mkdirat;
-		ctx.mknodat = mknodat;
-		ctx.renameat = renameat;
-		ctx.symlinkat = symlinkat;
-		ctx.utimensat = utimensat;
-		ctx.fstatat = fstatat;
+	/* by default, run one worker per CPU luufs is allowed to run on */
+	if (0 == opts.workers)
+		opts.workers = (unsigned int) ctx.ncpus;
 
-		fuse_argv[1] = argv[3];
-	}
+	se = fuse_session_new(&args,
+	                      (0 == ctx.measure) ? &luufs_oper
+	                                         : &luufs_measured_oper,
+	                      sizeof(luufs_oper),
+	                      &ctx);
+	if (NULL == se)
+		goto free_ctx;
+	ctx.se = se;
 
-	ctx.init = crc32(0L, Z_NULL, 0);
-	fuse_argv[0] = argv[0];
-	fuse_argv[2] = "-ononempty,suid,dev,allow_other,default_permissions";
-	fuse_argv[3] = NULL;
-	ret = fuse_main(3, fuse_argv, &luufs_oper, &ctx);
+	if (-1 == fuse_set_signal_handlers(se))
+		goto destroy_session;
 
-	if (-1 != ctx.rw)
-		(void) close(ctx.rw);
+	if (-1 == fuse_session_mount(se, target))
+		goto remove_handlers;
 
-close_ro:
-	(void) close(ctx.ro);
+	if (-1 == fuse_daemonize(0))
+		goto unmount;
+
+	if (-1 == luufs_ctx_start(&ctx, &opts.ctx))
+		goto unmount;
+
+	config = fuse_loop_cfg_create();
+	if (NULL == config)
+		goto unmount;
+
+	/* each worker reads requests from its own /dev/fuse file descriptor, and
+	 * idle workers are kept, so the number of workers stays fixed once all
+	 * are busy */
+	fuse_loop_cfg_set_clone_fd(config, 1);
+	fuse_loop_cfg_set_max_threads(config, opts.workers);
+	fuse_loop_cfg_set_idle_threads(config, opts.workers);
+
+	if (0 == fuse_session_loop_mt(se, config))
+		ret = EXIT_SUCCESS;
+
+	fuse_loop_cfg_destroy(config);
+	wait_copies(&ctx);
+
+unmount:
+	fuse_session_unmount(se);
+
+remove_handlers:
+	fuse_remove_signal_handlers(se);
+
+destroy_session:
+	fuse_session_destroy(se);
+
+free_ctx:
+	if (-1 == luufs_ctx_free(&ctx))
+		ret = EXIT_FAILURE;
+
+free_args:
+	fuse_opt_free_args(&args);
 
-out:
 	return ret;
+
+usage:
+	(void) fprintf(stderr,
+	               "Usage: %s [-o OPTIONS] RO[:RO...] [RW] TARGET\n"
+	               "       %s -o build_index,index=FILE RO\n",
+	               argv[0],
+	               argv[0]);
+	fuse_opt_free_args(&args);
+
+	return EXIT_FAILURE;
 }
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#	include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#	include <arm_acle.h>
+#endif
+
+#include "nameset.h"
+
+/* the initial number of slots; must be a power of 2 */
+#define NAMESET_SLOTS 256
+
+/* the initial size of the names buffer */
+#define NAMESET_NAMES 4096
+
+/* the slot offset of an empty slot; offsets are stored plus one */
+#define EMPTY_SLOT 0
+
+static uint32_t hash_fnv(const char *name, const size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; len > i; ++i) {
+		hash ^= (uint32_t) (unsigned char) name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* CRC32C is computed by a single instruction per 8 bytes on x86 CPUs with
+ * SSE 4.2 and on ARMv8 CPUs with the CRC extension */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t hash_crc32c(const char *name, const size_t len)
+{
+	uint64_t hash = 0xFFFFFFFF;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; len >= i + sizeof(word); i += sizeof(word)) {
+		memcpy(&word, &name[i], sizeof(word));
+		hash = _mm_crc32_u64(hash, word);
+	}
+
+	for (; len > i; ++i)
+		hash = _mm_crc32_u8((uint32_t) hash, (unsigned char) name[i]);
+
+	return (uint32_t) hash;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t hash_crc32c(const char *name, const size_t len)
+{
+	uint64_t word;
+	uint32_t hash = 0xFFFFFFFF;
+	size_t i;
+
+	for (i = 0; len >= i + sizeof(word); i += sizeof(word)) {
+		memcpy(&word, &name[i], sizeof(word));
+		hash = __crc32cd(hash, word);
+	}
+
+	for (; len > i; ++i)
+		hash = __crc32cb(hash, (uint8_t) name[i]);
+
+	return hash;
+}
+#endif
+
+void nameset_init(struct nameset *set)
+{
+	set->slots = NULL;
+	set->names = NULL;
+	set->size = 0;
+	set->count = 0;
+	set->used = 0;
+	set->len = 0;
+
+#if defined(__x86_64__)
+	if (0 != __builtin_cpu_supports("sse4.2"))
+		set->hash = hash_crc32c;
+	else
+		set->hash = hash_fnv;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	set->hash = hash_crc32c;
+#else
+	set->hash = hash_fnv;
+#endif
+}
+
+void nameset_clear(struct nameset *set)
+{
+	if (0 != set->count)
+		memset(set->slots, 0, set->size * sizeof(*set->slots));
+
+	set->count = 0;
+	set->used = 0;
+}
+
+void nameset_free(struct nameset *set)
+{
+	free(set->slots);
+	free(set->names);
+	nameset_init(set);
+}
+
+/* returns the slot that contains a name, or the empty slot it belongs in */
+static struct nameset_slot *find_slot(const struct nameset *set,
+                                      const char *name,
+                                      const size_t len,
+                                      const uint32_t hash)
+{
+	struct nameset_slot *slot;
+	size_t mask;
+	size_t i;
+
+	mask = set->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		slot = &set->slots[i];
+		if (EMPTY_SLOT == slot->off)
+			return slot;
+
+		/* names of different lengths may share a hash, and a shorter one
+		 * may end the buffer */
+		if ((hash == slot->hash) &&
+		    (len == slot->len) &&
+		    (0 == memcmp(&set->names[slot->off - 1], name, len)))
+			return slot;
+	}
+}
+
+/* doubles the number of slots; the hashes are kept in the slots, so the names
+ * are not hashed again */
+static int grow_slots(struct nameset *set)
+{
+	struct nameset_slot *slots;
+	struct nameset_slot *slot;
+	size_t size;
+	size_t mask;
+	size_t i;
+	size_t j;
+
+	if (0 == set->size)
+		size = NAMESET_SLOTS;
+	else
+		size = set->size * 2;
+
+	slots = calloc(size, sizeof(*slots));
+	if (NULL == slots)
+		return -1;
+
+	mask = size - 1;
+	for (i = 0; set->size > i; ++i) {
+		slot = &set->slots[i];
+		if (EMPTY_SLOT == slot->off)
+			continue;
+
+		for (j = slot->hash & mask;
+		     EMPTY_SLOT != slots[j].off;
+		     j = (j + 1) & mask);
+		slots[j] = *slot;
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->size = size;
+
+	return 0;
+}
+
+int nameset_add(struct nameset *set, const char *name, const uint32_t tag)
+{
+	struct nameset_slot *slot;
+	char *names;
+	size_t len;
+	size_t size;
+	uint32_t hash;
+
+	/* keep the load factor at 50% or below, so probe sequences are short */
+	if (set->count >= (set->size / 2)) {
+		if (-1 == grow_slots(set))
+			return -1;
+	}
+
+	len = strlen(name);
+	hash = set->hash(name, len);
+
+	slot = find_slot(set, name, len, hash);
+	if (EMPTY_SLOT != slot->off) {
+		if (tag < slot->tag)
+			slot->tag = tag;
+		return 0;
+	}
+
+	if (set->len - set->used < len + 1) {
+		size = (0 == set->len) ? NAMESET_NAMES : set->len;
+		while (size - set->used < len + 1)
+			size *= 2;
+
+		/* offsets are 32 bits wide */
+		if (UINT32_MAX <= size)
+			return -1;
+
+		names = realloc(set->names, size);
+		if (NULL == names)
+			return -1;
+
+		set->names = names;
+		set->len = size;
+	}
+
+	memcpy(&set->names[set->used], name, len + 1);
+	slot->hash = hash;
+	slot->off = (uint32_t) set->used + 1;
+	slot->len = (uint32_t) len;
+	slot->tag = tag;
+	set->used += len + 1;
+	++set->count;
+
+	return 1;
+}
+
+int nameset_contains(const struct nameset *set, const char *name)
+{
+	size_t len;
+
+	if (0 == set->count)
+		return 0;
+
+	len = strlen(name);
+	return (EMPTY_SLOT != find_slot(set,
+	                                name,
+	                                len,
+	                                set->hash(name, len))->off) ? 1 : 0;
+}
+
+int64_t nameset_tag(const struct nameset *set, const char *name)
+{
+	struct nameset_slot *slot;
+	size_t len;
+
+	if (0 == set->count)
+		return -1;
+
+	len = strlen(name);
+	slot = find_slot(set, name, len, set->hash(name, len));
+	if (EMPTY_SLOT == slot->off)
+		return -1;
+
+	return (int64_t) slot->tag;
+}
@@ -0,0 +1,65 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _NAMESET_H_INCLUDED
+#	define _NAMESET_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+
+struct nameset_slot {
+	uint32_t hash;
+	uint32_t off;
+	uint32_t len;
+	uint32_t tag;
+};
+
+/* an open addressing hash set of file names, each with the smallest tag it
+ * was added with; the names are copied into a single buffer and the memory is
+ * kept when the set is cleared, so a set can be reused without allocating
+ * again */
+struct nameset {
+	struct nameset_slot *slots;
+	char *names;
+	size_t size;
+	size_t count;
+	size_t used;
+	size_t len;
+	uint32_t (*hash)(const char *, const size_t);
+};
+
+void nameset_init(struct nameset *set);
+void nameset_clear(struct nameset *set);
+void nameset_free(struct nameset *set);
+
+/* returns 1 if the name was added, 0 if it's already there or -1 on
+ * failure */
+int nameset_add(struct nameset *set, const char *name, const uint32_t tag);
+
+int nameset_contains(const struct nameset *set, const char *name);
+
+/* returns the tag of a name, or -1 if it's not there */
+int64_t nameset_tag(const struct nameset *set, const char *name);
+
+#endif
@@ -0,0 +1,658 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "profile.h"
+
+#define PROFILE_HEADER "luufs profile 1\n"
+
+/* the maximum number of recorded files */
+#define MAX_FILES 65536
+
+/* the maximum number of ranges recorded per file; once there are more, the
+ * last one grows to cover all further reads */
+#define MAX_RANGES 1024
+
+/* files opened but never read through luufs, because the kernel reads them
+ * directly, are prefetched up to this size */
+#define WHOLE_MAX (16 * 1024 * 1024)
+
+static uint32_t hash_path(const unsigned int ro, const char *path)
+{
+	uint32_t hash;
+	size_t i;
+
+	hash = 2166136261U ^ (uint32_t) ro;
+	for (i = 0; '\0' != path[i]; ++i) {
+		hash ^= (uint32_t) (unsigned char) path[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* paths in a profile must stay under the read-only directory */
+static int is_safe(const char *path)
+{
+	size_t len;
+
+	if (('\0' == path[0]) || ('/' == path[0]))
+		return 0;
+
+	len = strlen(path);
+	if ((0 == strncmp(path, "../", 3)) ||
+	    (0 == strcmp(path, "..")) ||
+	    (NULL != strstr(path, "/../")) ||
+	    ((3 <= len) && (0 == strcmp(&path[len - 3], "/.."))))
+		return 0;
+
+	return 1;
+}
+
+static struct profile_entry *new_entry(const unsigned int ro,
+                                       const char *path)
+{
+	struct profile_entry *entry;
+	size_t len;
+
+	len = strlen(path) + 1;
+	entry = (struct profile_entry *) malloc(sizeof(*entry) + len);
+	if (NULL == entry)
+		return NULL;
+
+	entry->next = NULL;
+	entry->after = NULL;
+	entry->ranges = NULL;
+	entry->nranges = 0;
+	entry->max = 0;
+	entry->hash = hash_path(ro, path);
+	entry->ro = ro;
+	memcpy(entry->path, path, len);
+	return entry;
+}
+
+static void free_entries(struct profile_entry *entry)
+{
+	struct profile_entry *after;
+
+	for (; NULL != entry; entry = after) {
+		after = entry->after;
+		free(entry->ranges);
+		free(entry);
+	}
+}
+
+/* parses a line: the index of the read-only directory, the number of ranges,
+ * the offset and length of each and the path; lines that do not fit the
+ * read-only directories are skipped */
+static int parse_line(const struct profile *prof,
+                      char *line,
+                      struct profile_entry **entry)
+{
+	long long start;
+	long long len;
+	struct profile_range *ranges;
+	char *path;
+	size_t nranges;
+	size_t i;
+	unsigned int ro;
+	int pos;
+	int n;
+
+	*entry = NULL;
+
+	if ((2 != sscanf(line, "%u %zu%n", &ro, &nranges, &pos)) ||
+	    (MAX_RANGES < nranges)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ranges = NULL;
+	if (0 < nranges) {
+		ranges = (struct profile_range *) malloc(sizeof(*ranges) * nranges);
+		if (NULL == ranges)
+			return -1;
+	}
+
+	for (i = 0; nranges > i; ++i) {
+		if ((2 != sscanf(&line[pos], " %lld %lld%n", &start, &len, &n)) ||
+		    (0 > start) ||
+		    (0 >= len)) {
+			free(ranges);
+			errno = EINVAL;
+			return -1;
+		}
+
+		ranges[i].start = (off_t) start;
+		ranges[i].end = (off_t) (start + len);
+		pos += n;
+	}
+
+	if (' ' != line[pos]) {
+		free(ranges);
+		errno = EINVAL;
+		return -1;
+	}
+
+	path = &line[pos + 1];
+	path[strcspn(path, "\n")] = '\0';
+
+	if ((prof->ndirs <= ro) || (0 == is_safe(path))) {
+		free(ranges);
+		return 0;
+	}
+
+	*entry = new_entry(ro, path);
+	if (NULL == *entry) {
+		free(ranges);
+		return -1;
+	}
+
+	(*entry)->ranges = ranges;
+	(*entry)->nranges = nranges;
+	(*entry)->max = nranges;
+	return 0;
+}
+
+static int load(struct profile *prof)
+{
+	struct profile_entry *entry;
+	struct profile_entry *last;
+	char *line;
+	size_t size;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(prof->path, "r");
+	if (NULL == fp)
+		return (ENOENT == errno) ? 0 : -1;
+
+	line = NULL;
+	size = 0;
+	ret = -1;
+
+	if ((-1 == getline(&line, &size, fp)) ||
+	    (0 != strcmp(PROFILE_HEADER, line))) {
+		errno = EINVAL;
+		goto close_fp;
+	}
+
+	last = NULL;
+	while (-1 != getline(&line, &size, fp)) {
+		if (-1 == parse_line(prof, line, &entry))
+			goto free_entries;
+		if (NULL == entry)
+			continue;
+
+		if (NULL == last)
+			prof->replay = entry;
+		else
+			last->after = entry;
+		last = entry;
+	}
+
+	if (0 == ferror(fp)) {
+		prof->next = prof->replay;
+		ret = 0;
+		goto close_fp;
+	}
+
+free_entries:
+	free_entries(prof->replay);
+	prof->replay = NULL;
+
+close_fp:
+	free(line);
+	(void) fclose(fp);
+
+	return ret;
+}
+
+int profile_init(struct profile *prof,
+                 const char *path,
+                 const unsigned int record,
+                 const unsigned int threads,
+                 const int *dirs,
+                 const unsigned int ndirs)
+{
+	prof->path = path;
+	prof->dirs = dirs;
+	prof->ndirs = ndirs;
+	memset(prof->buckets, 0, sizeof(prof->buckets));
+	prof->first = NULL;
+	prof->last = NULL;
+	prof->count = 0;
+	prof->record = record;
+	prof->recording = 0;
+	prof->recorder = 0;
+	prof->replay = NULL;
+	prof->next = NULL;
+	prof->threads = NULL;
+	prof->nthreads = threads;
+	prof->stop = 0;
+	prof->files = 0;
+	prof->bytes = 0;
+	prof->enabled = 0;
+
+	if (NULL == path)
+		return 0;
+
+	if (-1 == load(prof))
+		return -1;
+
+	if (0 != pthread_mutex_init(&prof->lock, NULL))
+		goto free_replay;
+
+	if (0 != pthread_cond_init(&prof->cond, NULL)) {
+		(void) pthread_mutex_destroy(&prof->lock);
+		goto free_replay;
+	}
+
+	prof->enabled = 1;
+	return 0;
+
+free_replay:
+	free_entries(prof->replay);
+	prof->replay = NULL;
+	return -1;
+}
+
+static void prefetch(struct profile *prof, const struct profile_entry *entry)
+{
+	struct stat stbuf;
+	uint64_t bytes;
+	size_t len;
+	size_t i;
+	int fd;
+
+	fd = openat(prof->dirs[entry->ro],
+	            entry->path,
+	            O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == fd)
+		return;
+
+	bytes = 0;
+	if (0 == entry->nranges) {
+		if ((0 == fstat(fd, &stbuf)) && S_ISREG(stbuf.st_mode)) {
+			len = (WHOLE_MAX < stbuf.st_size) ? WHOLE_MAX
+			                                  : (size_t) stbuf.st_size;
+			if (0 == readahead(fd, 0, len))
+				bytes = (uint64_t) len;
+		}
+	}
+	else {
+		for (i = 0; entry->nranges > i; ++i) {
+			len = (size_t) (entry->ranges[i].end - entry->ranges[i].start);
+			if (0 == readahead(fd, entry->ranges[i].start, len))
+				bytes += (uint64_t) len;
+		}
+	}
+
+	(void) close(fd);
+
+	__atomic_add_fetch(&prof->files, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&prof->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* each thread prefetches the next file in the profile, so files are read in
+ * the order they were first opened, several at a time */
+static void *replay_thread(void *arg)
+{
+	struct profile *prof = (struct profile *) arg;
+	struct profile_entry *entry;
+
+	while (1) {
+		(void) pthread_mutex_lock(&prof->lock);
+		entry = prof->next;
+		if ((1 == prof->stop) || (NULL == entry)) {
+			(void) pthread_mutex_unlock(&prof->lock);
+			break;
+		}
+		prof->next = entry->after;
+		(void) pthread_mutex_unlock(&prof->lock);
+
+		prefetch(prof, entry);
+	}
+
+	return NULL;
+}
+
+static int cmp_ranges(const void *a, const void *b)
+{
+	const struct profile_range *ra = (const struct profile_range *) a;
+	const struct profile_range *rb = (const struct profile_range *) b;
+
+	if (ra->start < rb->start)
+		return -1;
+	if (ra->start > rb->start)
+		return 1;
+	return 0;
+}
+
+/* sorts the ranges of a file and merges those that overlap */
+static void merge_ranges(struct profile_entry *entry)
+{
+	size_t i;
+	size_t n;
+
+	if (0 == entry->nranges)
+		return;
+
+	qsort(entry->ranges,
+	      entry->nranges,
+	      sizeof(entry->ranges[0]),
+	      cmp_ranges);
+
+	n = 0;
+	for (i = 1; entry->nranges > i; ++i) {
+		if (entry->ranges[i].start <= entry->ranges[n].end) {
+			if (entry->ranges[i].end > entry->ranges[n].end)
+				entry->ranges[n].end = entry->ranges[i].end;
+		}
+		else
+			entry->ranges[++n] = entry->ranges[i];
+	}
+
+	entry->nranges = n + 1;
+}
+
+/* writes the profile atomically; called with the lock held */
+static int save(struct profile *prof)
+{
+	char tmp[PATH_MAX];
+	struct profile_entry *entry;
+	FILE *fp;
+	size_t i;
+	int ret;
+
+	if (sizeof(tmp) <= (size_t) snprintf(tmp,
+	                                     sizeof(tmp),
+	                                     "%s.tmp",
+	                                     prof->path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (NULL == fp)
+		return -1;
+
+	(void) fputs(PROFILE_HEADER, fp);
+
+	for (entry = prof->first; NULL != entry; entry = entry->after) {
+		merge_ranges(entry);
+
+		(void) fprintf(fp, "%u %zu", entry->ro, entry->nranges);
+		for (i = 0; entry->nranges > i; ++i)
+			(void) fprintf(fp,
+			               " %lld %lld",
+			               (long long) entry->ranges[i].start,
+			               (long long) (entry->ranges[i].end -
+			                            entry->ranges[i].start));
+		(void) fprintf(fp, " %s\n", entry->path);
+	}
+
+	ret = 0;
+	if (0 != ferror(fp))
+		ret = -1;
+	if (0 != fclose(fp))
+		ret = -1;
+
+	if ((0 == ret) && (-1 == rename(tmp, prof->path)))
+		ret = -1;
+
+	if (-1 == ret)
+		(void) unlink(tmp);
+
+	return ret;
+}
+
+/* records until the given number of seconds passes or luufs exits, then
+ * saves the profile */
+static void *record_thread(void *arg)
+{
+	struct profile *prof = (struct profile *) arg;
+	struct timespec deadline;
+
+	(void) clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t) prof->record;
+
+	(void) pthread_mutex_lock(&prof->lock);
+
+	while (0 == prof->stop) {
+		if (ETIMEDOUT == pthread_cond_timedwait(&prof->cond,
+		                                        &prof->lock,
+		                                        &deadline))
+			break;
+	}
+
+	__atomic_store_n(&prof->recording, 0, __ATOMIC_RELEASE);
+	(void) save(prof);
+
+	(void) pthread_mutex_unlock(&prof->lock);
+
+	return NULL;
+}
+
+int profile_start(struct profile *prof)
+{
+	unsigned int i;
+	int ret;
+
+	if (0 == prof->enabled)
+		return 0;
+
+	ret = 0;
+
+	if ((NULL != prof->replay) && (0 < prof->nthreads)) {
+		prof->threads = (pthread_t *) malloc(sizeof(pthread_t) *
+		                                     prof->nthreads);
+		if (NULL == prof->threads) {
+			prof->nthreads = 0;
+			ret = -1;
+		}
+
+		for (i = 0; prof->nthreads > i; ++i) {
+			if (0 != pthread_create(&prof->threads[i],
+			                        NULL,
+			                        replay_thread,
+			                        prof)) {
+				prof->nthreads = i;
+				ret = -1;
+				break;
+			}
+		}
+	}
+	else
+		prof->nthreads = 0;
+
+	if (0 != prof->record) {
+		__atomic_store_n(&prof->recording, 1, __ATOMIC_RELEASE);
+		if (0 == pthread_create(&prof->recorder_thread,
+		                        NULL,
+		                        record_thread,
+		                        prof))
+			prof->recorder = 1;
+		else {
+			__atomic_store_n(&prof->recording, 0, __ATOMIC_RELEASE);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+void profile_free(struct profile *prof)
+{
+	unsigned int i;
+
+	if (0 == prof->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&prof->lock);
+	prof->stop = 1;
+	(void) pthread_cond_broadcast(&prof->cond);
+	(void) pthread_mutex_unlock(&prof->lock);
+
+	for (i = 0; prof->nthreads > i; ++i)
+		(void) pthread_join(prof->threads[i], NULL);
+	free(prof->threads);
+
+	if (1 == prof->recorder)
+		(void) pthread_join(prof->recorder_thread, NULL);
+
+	free_entries(prof->first);
+	free_entries(prof->replay);
+
+	(void) pthread_cond_destroy(&prof->cond);
+	(void) pthread_mutex_destroy(&prof->lock);
+
+	prof->enabled = 0;
+}
+
+int profile_recording(const struct profile *prof)
+{
+	return __atomic_load_n(&prof->recording, __ATOMIC_ACQUIRE);
+}
+
+struct profile_entry *profile_open(struct profile *prof,
+                                   const unsigned int ro,
+                                   const char *path)
+{
+	struct profile_entry *entry;
+	uint32_t hash;
+
+	/* lines of the profile end with the path */
+	if ((0 == profile_recording(prof)) || (NULL != strchr(path, '\n')))
+		return NULL;
+
+	hash = hash_path(ro, path);
+
+	(void) pthread_mutex_lock(&prof->lock);
+
+	if (0 == prof->recording) {
+		entry = NULL;
+		goto unlock;
+	}
+
+	for (entry = prof->buckets[hash % PROFILE_BUCKETS];
+	     NULL != entry;
+	     entry = entry->next) {
+		if ((hash == entry->hash) &&
+		    (ro == entry->ro) &&
+		    (0 == strcmp(path, entry->path)))
+			goto unlock;
+	}
+
+	if (MAX_FILES == prof->count)
+		goto unlock;
+
+	entry = new_entry(ro, path);
+	if (NULL == entry)
+		goto unlock;
+
+	entry->next = prof->buckets[hash % PROFILE_BUCKETS];
+	prof->buckets[hash % PROFILE_BUCKETS] = entry;
+	if (NULL == prof->last)
+		prof->first = entry;
+	else
+		prof->last->after = entry;
+	prof->last = entry;
+	++prof->count;
+
+unlock:
+	(void) pthread_mutex_unlock(&prof->lock);
+
+	return entry;
+}
+
+void profile_read(struct profile *prof,
+                  struct profile_entry *entry,
+                  const off_t off,
+                  const size_t size)
+{
+	struct profile_range *ranges;
+	struct profile_range *last;
+	off_t end;
+	size_t max;
+
+	if ((NULL == entry) || (0 == profile_recording(prof)) || (0 == size))
+		return;
+
+	end = off + (off_t) size;
+
+	(void) pthread_mutex_lock(&prof->lock);
+
+	if (0 == prof->recording)
+		goto unlock;
+
+	/* reads usually continue the previous one */
+	if (0 < entry->nranges) {
+		last = &entry->ranges[entry->nranges - 1];
+		if (((off <= last->end) && (end >= last->start)) ||
+		    (MAX_RANGES == entry->nranges)) {
+			if (off < last->start)
+				last->start = off;
+			if (end > last->end)
+				last->end = end;
+			goto unlock;
+		}
+	}
+
+	if (entry->max == entry->nranges) {
+		max = (0 == entry->max) ? 8 : entry->max * 2;
+		if (MAX_RANGES < max)
+			max = MAX_RANGES;
+
+		ranges = (struct profile_range *) realloc(entry->ranges,
+		                                          sizeof(*ranges) * max);
+		if (NULL == ranges)
+			goto unlock;
+
+		entry->ranges = ranges;
+		entry->max = max;
+	}
+
+	entry->ranges[entry->nranges].start = off;
+	entry->ranges[entry->nranges].end = end;
+	++entry->nranges;
+
+unlock:
+	(void) pthread_mutex_unlock(&prof->lock);
+}
+
+void profile_stats(struct profile *prof, uint64_t *files, uint64_t *bytes)
+{
+	*files = __atomic_load_n(&prof->files, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&prof->bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,113 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _PROFILE_H_INCLUDED
+#	define _PROFILE_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <pthread.h>
+
+#	define PROFILE_BUCKETS 1024
+
+struct profile_range {
+	off_t start;
+	off_t end;
+};
+
+/* a file opened under a read-only directory, whose index is ro, and the
+ * ranges read from it; files are kept in the order they were first opened */
+struct profile_entry {
+	struct profile_entry *next;
+	struct profile_entry *after;
+	struct profile_range *ranges;
+	size_t nranges;
+	size_t max;
+	uint32_t hash;
+	unsigned int ro;
+	char path[];
+};
+
+/* a boot prefetch profile: the files opened under the read-only directories
+ * during the first seconds after mounting, recorded to a file and replayed
+ * by a pool of threads on the next mount, so the files are read into the
+ * page cache before or while they're needed */
+struct profile {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *path;
+	const int *dirs;
+	unsigned int ndirs;
+	struct profile_entry *buckets[PROFILE_BUCKETS];
+	struct profile_entry *first;
+	struct profile_entry *last;
+	size_t count;
+	unsigned int record;
+	int recording;
+	int recorder;
+	pthread_t recorder_thread;
+	struct profile_entry *replay;
+	struct profile_entry *next;
+	pthread_t *threads;
+	unsigned int nthreads;
+	int stop;
+	uint64_t files;
+	uint64_t bytes;
+	int enabled;
+};
+
+/* loads the profile at path, if there is one, to be replayed by the given
+ * number of threads against dirs; if record is not 0, the files opened during
+ * the first record seconds are saved there */
+int profile_init(struct profile *prof,
+                 const char *path,
+                 const unsigned int record,
+                 const unsigned int threads,
+                 const int *dirs,
+                 const unsigned int ndirs);
+
+/* starts replaying and recording */
+int profile_start(struct profile *prof);
+
+/* stops replaying and saves the profile, if still recording */
+void profile_free(struct profile *prof);
+
+int profile_recording(const struct profile *prof);
+
+/* records the opening of a file; returns the entry its reads are recorded in,
+ * or NULL */
+struct profile_entry *profile_open(struct profile *prof,
+                                   const unsigned int ro,
+                                   const char *path);
+
+void profile_read(struct profile *prof,
+                  struct profile_entry *entry,
+                  const off_t off,
+                  const size_t size);
+
+/* returns the number of files and bytes prefetched so far */
+void profile_stats(struct profile *prof, uint64_t *files, uint64_t *bytes);
+
+#endif
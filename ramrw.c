@@ -0,0 +1,1599 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <sys/mount.h>
+
+#include "copyup.h"
+#include "ramrw.h"
+
+/* the tmpfs is mounted under a temporary directory, then detached, so it's
+ * reachable only through its handle */
+#define MOUNT_POINT "/tmp/luufs-ram.XXXXXX"
+
+/* the number of seconds between checks of the fill level */
+#define CHECK_INTERVAL 1
+
+/* the number of attempts to find an open file that keeps being renamed */
+#define SYNC_ATTEMPTS 4
+
+/* the number of attempts to copy the remaining changes on exit, and the
+ * number of seconds between them */
+#define FLUSH_ATTEMPTS 3
+#define FLUSH_RETRY_INTERVAL 1
+
+/* the prefix of temporary files */
+#define TEMP_PREFIX ".luufs-"
+
+/* the extended attribute of a file whose data is on the disk, which holds a
+ * handle of its copy there */
+#define DISK_XATTR "trusted.luufs.disk"
+
+/* don't descend into directories */
+#define MIRROR_SHALLOW (1 << 0)
+
+/* make each change durable */
+#define MIRROR_SYNC (1 << 1)
+
+/* copy regular files without their data, referring to the originals */
+#define MIRROR_STUBS (1 << 2)
+
+/* remove files that no longer exist, instead of copying files */
+#define MIRROR_PRUNE (1 << 3)
+
+/* the number of buckets of the table of files with more than one name */
+#define LINK_BUCKETS 64
+
+/* a file with more than one name, copied under the first name found; its
+ * other names are linked to the copy, whose inode number is copy and whose
+ * path is relative to the destination */
+struct mirror_link {
+	struct mirror_link *next;
+	dev_t dev;
+	ino_t ino;
+	ino_t copy;
+	char path[];
+};
+
+/* a file under the in-memory copy that is open, so its data is kept in
+ * memory */
+struct ramrw_open {
+	struct ramrw_open *next;
+	ino_t ino;
+	unsigned int count;
+};
+
+/* a handle of a file on the disk */
+union disk_handle {
+	struct file_handle fh;
+	char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+};
+
+/* a copy of a directory tree to root; path is the path of the destination
+ * directory being copied to, relative to root, and len is its length */
+struct mirror {
+	struct ramrw *ram;
+	struct mirror_link *links[LINK_BUCKETS];
+	char path[PATH_MAX];
+	size_t len;
+	int root;
+};
+
+static int open_dir(const int dir, const char *name)
+{
+	return openat(dir,
+	              name,
+	              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static int remove_tree(const int dir, const char *name)
+{
+	struct dirent ent;
+	DIR *sub;
+	struct dirent *entp;
+	int fd;
+	int ret;
+
+	if (0 == unlinkat(dir, name, 0))
+		return 0;
+	if (ENOENT == errno)
+		return 0;
+	if ((EISDIR != errno) && (EPERM != errno))
+		return -errno;
+
+	fd = open_dir(dir, name);
+	if (-1 == fd)
+		return -errno;
+
+	sub = fdopendir(fd);
+	if (NULL == sub) {
+		ret = -errno;
+		(void) close(fd);
+		return ret;
+	}
+
+	ret = 0;
+
+	do {
+		if (0 != readdir_r(sub, &ent, &entp)) {
+			ret = -errno;
+			break;
+		}
+		if (NULL == entp)
+			break;
+
+		if ((0 == strcmp(".", entp->d_name)) ||
+		    (0 == strcmp("..", entp->d_name)))
+			continue;
+
+		ret = remove_tree(dirfd(sub), entp->d_name);
+	} while (0 == ret);
+
+	(void) closedir(sub);
+
+	if ((0 == ret) && (-1 == unlinkat(dir, name, AT_REMOVEDIR)))
+		ret = -errno;
+
+	return ret;
+}
+
+/* applies the attributes of a file to its copy; if old, the attributes of
+ * the copy, is not NULL, only those that differ are applied */
+static int copy_attrs(const int dest,
+                      const char *name,
+                      const struct stat *stbuf,
+                      const struct stat *old)
+{
+	struct timespec tv[2];
+
+	/* change the owner first, since it clears set-user-ID bits */
+	if (((NULL == old) ||
+	     (stbuf->st_uid != old->st_uid) ||
+	     (stbuf->st_gid != old->st_gid)) &&
+	    (-1 == fchownat(dest,
+	                    name,
+	                    stbuf->st_uid,
+	                    stbuf->st_gid,
+	                    AT_SYMLINK_NOFOLLOW)))
+		return -errno;
+
+	/* the permissions of symbolic links cannot be changed */
+	if ((!S_ISLNK(stbuf->st_mode)) &&
+	    ((NULL == old) || (stbuf->st_mode != old->st_mode)) &&
+	    (-1 == fchmodat(dest, name, stbuf->st_mode & 07777, 0)))
+		return -errno;
+
+	if ((NULL == old) ||
+	    (stbuf->st_mtim.tv_sec != old->st_mtim.tv_sec) ||
+	    (stbuf->st_mtim.tv_nsec != old->st_mtim.tv_nsec)) {
+		tv[0] = stbuf->st_atim;
+		tv[1] = stbuf->st_mtim;
+		if (-1 == utimensat(dest, name, tv, AT_SYMLINK_NOFOLLOW))
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int sync_file(const int dir, const char *name)
+{
+	int fd;
+	int ret = 0;
+
+	fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+
+	if (-1 == fsync(fd))
+		ret = -errno;
+
+	(void) close(fd);
+	return ret;
+}
+
+static void temp_name(char *buf, const size_t size)
+{
+	static unsigned int count = 0;
+
+	(void) snprintf(buf,
+	                size,
+	                TEMP_PREFIX "%ld-%u",
+	                (long) getpid(),
+	                __sync_fetch_and_add(&count, 1));
+}
+
+/* symbolic links are replaced by renaming a new one over them */
+static int copy_link(const int dest, const char *name, const char *target)
+{
+	char tmp[NAME_MAX + 1];
+	int ret;
+
+	do {
+		temp_name(tmp, sizeof(tmp));
+		ret = symlinkat(target, dest, tmp);
+	} while ((-1 == ret) && (EEXIST == errno));
+	if (-1 == ret)
+		return -errno;
+
+	if (-1 == renameat(dest, tmp, dest, name)) {
+		(void) unlinkat(dest, tmp, 0);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* renames a new file over a name; if park is 1, the file replaced is kept
+ * under the temporary name until files that no longer exist are removed,
+ * since files whose data is on the disk may refer to it */
+static int replace(const int dest,
+                   const char *tmp,
+                   const char *name,
+                   const int park)
+{
+	int ret;
+
+	if (1 == park)
+		ret = renameat2(dest, tmp, dest, name, RENAME_EXCHANGE);
+	else
+		ret = renameat(dest, tmp, dest, name);
+	if (-1 == ret) {
+		ret = -errno;
+		(void) unlinkat(dest, tmp, 0);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* replaces a name with another name of the file at path, relative to root */
+static int relink(const int root,
+                  const char *path,
+                  const int dest,
+                  const char *name,
+                  const int park)
+{
+	char tmp[NAME_MAX + 1];
+	int ret;
+
+	do {
+		temp_name(tmp, sizeof(tmp));
+		ret = linkat(root, path, dest, tmp, 0);
+	} while ((-1 == ret) && (EEXIST == errno));
+	if (-1 == ret)
+		return -errno;
+
+	return replace(dest, tmp, name, park);
+}
+
+static size_t handle_size(const union disk_handle *h)
+{
+	return sizeof(h->fh) + h->fh.handle_bytes;
+}
+
+static int get_handle(const int dir, const char *name, union disk_handle *h)
+{
+	int mount_id;
+
+	h->fh.handle_bytes = MAX_HANDLE_SZ;
+	if (-1 == name_to_handle_at(dir, name, &h->fh, &mount_id, 0))
+		return -errno;
+
+	return 0;
+}
+
+static void fd_path(char *buf,
+                    const size_t size,
+                    const int fd,
+                    const char *name)
+{
+	if ('\0' == name[0])
+		(void) snprintf(buf, size, "/proc/self/fd/%d", fd);
+	else
+		(void) snprintf(buf, size, "/proc/self/fd/%d/%s", fd, name);
+}
+
+/* reads the handle of the copy of a file whose data is on the disk; returns 1
+ * if the data is on the disk, 0 if not or a negative errno value */
+static int get_stub(const char *path,
+                    const struct stat *stbuf,
+                    union disk_handle *h)
+{
+	ssize_t len;
+
+	/* such files have no data in memory, so others are not looked at */
+	if ((!S_ISREG(stbuf->st_mode)) ||
+	    (0 != stbuf->st_blocks) ||
+	    (0 == stbuf->st_size))
+		return 0;
+
+	len = getxattr(path, DISK_XATTR, h->buf, sizeof(h->buf));
+	if (-1 == len)
+		return (ENODATA == errno) ? 0 : -errno;
+
+	if (((size_t) len < sizeof(h->fh)) || ((size_t) len != handle_size(h)))
+		return -EIO;
+
+	return 1;
+}
+
+/* creates a copy of a regular file without its data, which refers to the
+ * file */
+static int make_stub(const int src,
+                     const struct stat *stbuf,
+                     const int dest,
+                     const char *name)
+{
+	union disk_handle h;
+	int fd;
+	int ret;
+
+	ret = get_handle(src, name, &h);
+	if (0 != ret)
+		return ret;
+
+	fd = openat(dest,
+	            name,
+	            O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	            0600);
+	if (-1 == fd)
+		return -errno;
+
+	ret = 0;
+	if ((-1 == ftruncate(fd, stbuf->st_size)) ||
+	    (-1 == fsetxattr(fd, DISK_XATTR, h.buf, handle_size(&h), 0)))
+		ret = -errno;
+
+	(void) close(fd);
+	if (0 != ret)
+		(void) unlinkat(dest, name, 0);
+
+	return ret;
+}
+
+/* links the copy of a file whose data is on the disk to its name there;
+ * returns 1 if the name was linked, 0 if it refers to the copy already or a
+ * negative errno value */
+static int link_stub(const struct ramrw *ram,
+                     union disk_handle *h,
+                     const int dest,
+                     const char *name,
+                     const int exists)
+{
+	char tmp[NAME_MAX + 1];
+	union disk_handle old;
+	int fd;
+	int ret;
+
+	if ((1 == exists) &&
+	    (0 == get_handle(dest, name, &old)) &&
+	    (handle_size(h) == handle_size(&old)) &&
+	    (0 == memcmp(h->buf, old.buf, handle_size(h))))
+		return 0;
+
+	fd = open_by_handle_at(ram->disk, &h->fh, O_PATH | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+
+	do {
+		temp_name(tmp, sizeof(tmp));
+		ret = linkat(fd, "", dest, tmp, AT_EMPTY_PATH);
+	} while ((-1 == ret) && (EEXIST == errno));
+	if (-1 == ret) {
+		ret = -errno;
+		(void) close(fd);
+		return ret;
+	}
+
+	(void) close(fd);
+
+	ret = replace(dest, tmp, name, exists);
+	if (0 != ret)
+		return ret;
+
+	return 1;
+}
+
+static void mirror_init(struct mirror *m, struct ramrw *ram, const int root)
+{
+	unsigned int i;
+
+	m->ram = ram;
+	for (i = 0; LINK_BUCKETS > i; ++i)
+		m->links[i] = NULL;
+	m->path[0] = '\0';
+	m->len = 0;
+	m->root = root;
+}
+
+static void mirror_free(struct mirror *m)
+{
+	struct mirror_link *link;
+	unsigned int i;
+
+	for (i = 0; LINK_BUCKETS > i; ++i) {
+		while (NULL != m->links[i]) {
+			link = m->links[i];
+			m->links[i] = link->next;
+			free(link);
+		}
+	}
+}
+
+static struct mirror_link *find_link(const struct mirror *m,
+                                     const struct stat *stbuf)
+{
+	struct mirror_link *link;
+
+	for (link = m->links[stbuf->st_ino % LINK_BUCKETS];
+	     NULL != link;
+	     link = link->next) {
+		if ((stbuf->st_ino == link->ino) && (stbuf->st_dev == link->dev))
+			return link;
+	}
+
+	return NULL;
+}
+
+/* remembers the copy of a file with more than one name */
+static int add_link(struct mirror *m,
+                    const struct stat *stbuf,
+                    const int dest,
+                    const char *name)
+{
+	struct stat dstbuf;
+	struct mirror_link *link;
+	size_t len;
+
+	if (-1 == fstatat(dest, name, &dstbuf, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	len = strlen(name);
+	link = (struct mirror_link *) malloc(sizeof(*link) + m->len + len + 2);
+	if (NULL == link)
+		return -ENOMEM;
+
+	link->dev = stbuf->st_dev;
+	link->ino = stbuf->st_ino;
+	link->copy = dstbuf.st_ino;
+	if (0 == m->len)
+		memcpy(link->path, name, len + 1);
+	else {
+		memcpy(link->path, m->path, m->len);
+		link->path[m->len] = '/';
+		memcpy(&link->path[m->len + 1], name, len + 1);
+	}
+
+	link->next = m->links[stbuf->st_ino % LINK_BUCKETS];
+	m->links[stbuf->st_ino % LINK_BUCKETS] = link;
+
+	return 0;
+}
+
+static int mirror_dir(struct mirror *m,
+                      const int src,
+                      const int dest,
+                      const int flags);
+
+/* copies the files under a subdirectory, extending the path */
+static int mirror_sub(struct mirror *m,
+                      const int src,
+                      const int dest,
+                      const char *name,
+                      const int flags)
+{
+	size_t len;
+	size_t old;
+	int fd;
+	int sub;
+	int ret;
+
+	old = m->len;
+	len = strlen(name);
+	if (old + len + 2 > sizeof(m->path))
+		return -ENAMETOOLONG;
+
+	if (0 != old)
+		m->path[m->len++] = '/';
+	memcpy(&m->path[m->len], name, len + 1);
+	m->len += len;
+
+	fd = open_dir(src, name);
+	if (-1 == fd) {
+		ret = -errno;
+		goto restore;
+	}
+
+	sub = open_dir(dest, name);
+	if (-1 == sub) {
+		ret = -errno;
+		(void) close(fd);
+		goto restore;
+	}
+
+	ret = mirror_dir(m, fd, sub, flags);
+	(void) close(sub);
+	(void) close(fd);
+
+restore:
+	m->len = old;
+	m->path[old] = '\0';
+
+	return ret;
+}
+
+/* copies a file, if it changed since it was last copied; returns -ENOENT if
+ * the file does not exist */
+static int mirror_entry(struct mirror *m,
+                        const int src,
+                        const int dest,
+                        const char *name,
+                        const int flags)
+{
+	char target[PATH_MAX];
+	char old[PATH_MAX];
+	char tmp[NAME_MAX + 1];
+	union disk_handle h;
+	struct stat stbuf;
+	struct stat dstbuf;
+	struct mirror_link *link;
+	ssize_t len;
+	int exists;
+	int created;
+	int fd;
+	int ret;
+
+	if (-1 == fstatat(src, name, &stbuf, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	exists = 1;
+	if (-1 == fstatat(dest, name, &dstbuf, AT_SYMLINK_NOFOLLOW)) {
+		if (ENOENT != errno)
+			return -errno;
+		exists = 0;
+	}
+
+	/* a file replaced with another of a different type is moved out of the
+	 * way first, and removed with other files that no longer exist */
+	if ((1 == exists) &&
+	    (((stbuf.st_mode & S_IFMT) != (dstbuf.st_mode & S_IFMT)) ||
+	     ((S_ISCHR(stbuf.st_mode) || S_ISBLK(stbuf.st_mode)) &&
+	      (stbuf.st_rdev != dstbuf.st_rdev)))) {
+		temp_name(tmp, sizeof(tmp));
+		if (-1 == renameat(dest, name, dest, tmp))
+			return -errno;
+
+		exists = 0;
+	}
+
+	created = 0;
+
+	switch (stbuf.st_mode & S_IFMT) {
+		case S_IFREG:
+			/* other names of a file copied already are linked to the copy */
+			link = (1 < stbuf.st_nlink) ? find_link(m, &stbuf) : NULL;
+			if (NULL != link) {
+				if ((0 == exists) || (link->copy != dstbuf.st_ino)) {
+					ret = relink(m->root, link->path, dest, name, exists);
+					if (0 != ret)
+						return ret;
+					created = 1;
+				}
+				break;
+			}
+
+			fd_path(target, sizeof(target), src, name);
+			ret = get_stub(target, &stbuf, &h);
+			if (0 > ret)
+				return ret;
+
+			if ((0 != (MIRROR_STUBS & flags)) && (0 != stbuf.st_size)) {
+				ret = make_stub(src, &stbuf, dest, name);
+				if (0 != ret)
+					return ret;
+
+				created = 1;
+				ret = copy_attrs(dest, name, &stbuf, NULL);
+			}
+			else if (1 == ret) {
+				/* a file whose data is on the disk is linked to its copy */
+				ret = link_stub(m->ram, &h, dest, name, exists);
+				if (0 > ret)
+					return ret;
+
+				created = ret;
+				ret = copy_attrs(dest, name, &stbuf, created ? NULL : &dstbuf);
+				if ((0 == ret) && (0 != (MIRROR_SYNC & flags)))
+					ret = sync_file(dest, name);
+			}
+			/* a copy with a different number of names may share its inode
+			 * with a file that's no longer the same one, so it's replaced */
+			else if ((1 == exists) &&
+			         (stbuf.st_size == dstbuf.st_size) &&
+			         (stbuf.st_nlink == dstbuf.st_nlink) &&
+			         (stbuf.st_mtim.tv_sec == dstbuf.st_mtim.tv_sec) &&
+			         (stbuf.st_mtim.tv_nsec == dstbuf.st_mtim.tv_nsec)) {
+				ret = copy_attrs(dest, name, &stbuf, &dstbuf);
+				if ((0 == ret) && (0 != (MIRROR_SYNC & flags)))
+					ret = sync_file(dest, name);
+			}
+			else {
+				fd = openat(src, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+				if (-1 == fd)
+					return -errno;
+
+				/* the copy replaces the file by its name */
+				if (1 == exists) {
+					temp_name(tmp, sizeof(tmp));
+					ret = copyup_file(fd, &stbuf, dest, tmp);
+					if (0 == ret)
+						ret = replace(dest, tmp, name, 1);
+				}
+				else
+					ret = copyup_file(fd, &stbuf, dest, name);
+				(void) close(fd);
+				if (0 != ret)
+					return ret;
+
+				++m->ram->files;
+				m->ram->bytes += (uint64_t) stbuf.st_size;
+				created = 1;
+
+				if (0 != (MIRROR_SYNC & flags))
+					ret = sync_file(dest, name);
+			}
+			if (0 != ret)
+				return ret;
+
+			if (1 < stbuf.st_nlink) {
+				ret = add_link(m, &stbuf, dest, name);
+				if (0 != ret)
+					return ret;
+			}
+			break;
+
+		case S_IFDIR:
+			if (0 == exists) {
+				if (-1 == mkdirat(dest, name, 0700))
+					return -errno;
+				created = 1;
+			}
+
+			if (0 == (MIRROR_SHALLOW & flags)) {
+				ret = mirror_sub(m, src, dest, name, flags);
+				if (0 != ret)
+					return ret;
+			}
+
+			/* changes inside the directory change its modification time,
+			 * so it's applied last */
+			ret = copy_attrs(dest, name, &stbuf, exists ? &dstbuf : NULL);
+			if (0 != ret)
+				return ret;
+			break;
+
+		case S_IFLNK:
+			len = readlinkat(src, name, target, sizeof(target) - 1);
+			if (-1 == len)
+				return -errno;
+			target[len] = '\0';
+
+			if (1 == exists) {
+				len = readlinkat(dest, name, old, sizeof(old) - 1);
+				if (-1 == len)
+					return -errno;
+				old[len] = '\0';
+
+				if (0 != strcmp(target, old))
+					exists = 0;
+			}
+
+			if (0 == exists) {
+				ret = copy_link(dest, name, target);
+				if (0 != ret)
+					return ret;
+				created = 1;
+			}
+
+			ret = copy_attrs(dest, name, &stbuf, exists ? &dstbuf : NULL);
+			if (0 != ret)
+				return ret;
+			break;
+
+		default:
+			if (0 == exists) {
+				if (-1 == mknodat(dest, name, stbuf.st_mode, stbuf.st_rdev))
+					return -errno;
+				created = 1;
+			}
+
+			ret = copy_attrs(dest, name, &stbuf, exists ? &dstbuf : NULL);
+			if (0 != ret)
+				return ret;
+	}
+
+	/* a new name is durable once its directory is */
+	if ((1 == created) &&
+	    (0 != (MIRROR_SYNC & flags)) &&
+	    (-1 == fsync(dest)))
+		return -errno;
+
+	return 0;
+}
+
+/* removes a file that no longer exists, or the files under a directory that
+ * no longer exist */
+static int prune_entry(struct mirror *m,
+                       const int src,
+                       const int dest,
+                       const char *name,
+                       const int flags)
+{
+	struct stat stbuf;
+	struct stat dstbuf;
+	int ret;
+
+	if (-1 == fstatat(src, name, &stbuf, AT_SYMLINK_NOFOLLOW)) {
+		if (ENOENT != errno)
+			return -errno;
+
+		/* files moved out of the way are not counted */
+		ret = remove_tree(dest, name);
+		if ((0 == ret) &&
+		    (0 != strncmp(TEMP_PREFIX, name, sizeof(TEMP_PREFIX) - 1)))
+			++m->ram->removed;
+		return ret;
+	}
+
+	if (-1 == fstatat(dest, name, &dstbuf, AT_SYMLINK_NOFOLLOW))
+		return (ENOENT == errno) ? 0 : -errno;
+
+	/* a directory replaced meanwhile is copied by the next flush */
+	if ((!S_ISDIR(stbuf.st_mode)) || (!S_ISDIR(dstbuf.st_mode)))
+		return 0;
+
+	ret = mirror_sub(m, src, dest, name, flags);
+	if (0 != ret)
+		return (-ENOENT == ret) ? 0 : ret;
+
+	/* removing files changes the modification time of the directory */
+	if (-1 == fstatat(dest, name, &dstbuf, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	return copy_attrs(dest, name, &stbuf, &dstbuf);
+}
+
+/* copies the files under a directory, or removes files that no longer exist
+ * if flags include MIRROR_PRUNE; files removed or renamed meanwhile are
+ * copied by the next flush */
+static int mirror_dir(struct mirror *m,
+                      const int src,
+                      const int dest,
+                      const int flags)
+{
+	struct dirent ent;
+	DIR *dir;
+	struct dirent *entp;
+	int fd;
+	int ret;
+
+	fd = open_dir((0 == (MIRROR_PRUNE & flags)) ? src : dest, ".");
+	if (-1 == fd)
+		return -errno;
+
+	dir = fdopendir(fd);
+	if (NULL == dir) {
+		ret = -errno;
+		(void) close(fd);
+		return ret;
+	}
+
+	ret = 0;
+
+	do {
+		if (0 != readdir_r(dir, &ent, &entp)) {
+			ret = -errno;
+			break;
+		}
+		if (NULL == entp)
+			break;
+
+		if ((0 == strcmp(".", entp->d_name)) ||
+		    (0 == strcmp("..", entp->d_name)))
+			continue;
+
+		if (0 != (MIRROR_PRUNE & flags)) {
+			ret = prune_entry(m, src, dest, entp->d_name, flags);
+			continue;
+		}
+
+		/* temporary files left behind by a previous run are not copied to
+		 * memory, so the next flush removes them */
+		if ((0 != (MIRROR_STUBS & flags)) &&
+		    (0 == strncmp(TEMP_PREFIX,
+		                  entp->d_name,
+		                  sizeof(TEMP_PREFIX) - 1)))
+			continue;
+
+		ret = mirror_entry(m, src, dest, entp->d_name, flags);
+		if (-ENOENT == ret)
+			ret = 0;
+	} while (0 == ret);
+
+	(void) closedir(dir);
+
+	return ret;
+}
+
+/* copies a directory tree, keeping files with more than one name linked, then
+ * removes files that no longer exist; files are removed only once all others
+ * are copied, since files whose data is on the disk may refer to them */
+static int mirror_tree(struct ramrw *ram,
+                       const int src,
+                       const int dest,
+                       const int flags)
+{
+	struct mirror m;
+	int ret;
+
+	mirror_init(&m, ram, dest);
+	ret = mirror_dir(&m, src, dest, flags);
+	if (0 == ret)
+		ret = mirror_dir(&m, src, dest, flags | MIRROR_PRUNE);
+	mirror_free(&m);
+
+	return ret;
+}
+
+static int flush(struct ramrw *ram, const int sync)
+{
+	int ret;
+
+	(void) pthread_mutex_lock(&ram->flush_lock);
+
+	ret = mirror_tree(ram, ram->fd, ram->disk, 0);
+	if ((0 == ret) && (1 == sync) && (-1 == syncfs(ram->disk)))
+		ret = -errno;
+	++ram->flushes;
+
+	(void) pthread_mutex_unlock(&ram->flush_lock);
+
+	return ret;
+}
+
+/* returns 1 if at least num/den of the in-memory copy is used */
+static int used(const struct ramrw *ram,
+                const unsigned int num,
+                const unsigned int den)
+{
+	struct statvfs stvfs;
+
+	if (-1 == fstatvfs(ram->fd, &stvfs))
+		return 0;
+
+	return ((stvfs.f_blocks - stvfs.f_bfree) * den >= stvfs.f_blocks * num) ? 1
+	                                                                        : 0;
+}
+
+static struct ramrw_open **find_open(struct ramrw *ram, const ino_t ino)
+{
+	struct ramrw_open **entry;
+
+	for (entry = &ram->opens[ino % RAMRW_OPEN_BUCKETS];
+	     NULL != *entry;
+	     entry = &(*entry)->next) {
+		if (ino == (*entry)->ino)
+			break;
+	}
+
+	return entry;
+}
+
+static int hold(struct ramrw *ram, const ino_t ino)
+{
+	struct ramrw_open **entry;
+
+	entry = find_open(ram, ino);
+	if (NULL != *entry) {
+		++(*entry)->count;
+		return 0;
+	}
+
+	*entry = (struct ramrw_open *) malloc(sizeof(**entry));
+	if (NULL == *entry)
+		return -ENOMEM;
+
+	(*entry)->next = NULL;
+	(*entry)->ino = ino;
+	(*entry)->count = 1;
+
+	return 0;
+}
+
+/* frees the data of a file that is not open and whose copy on the disk is up
+ * to date, and attaches a handle of the copy to it */
+static int spill_file(struct ramrw *ram,
+                      const int src,
+                      const int dest,
+                      const char *name)
+{
+	struct timespec tv[2];
+	union disk_handle h;
+	struct stat stbuf;
+	struct stat dstbuf;
+	int fd;
+	int ret = 0;
+
+	(void) pthread_mutex_lock(&ram->open_lock);
+
+	if ((-1 == fstatat(src, name, &stbuf, AT_SYMLINK_NOFOLLOW)) ||
+	    (-1 == fstatat(dest, name, &dstbuf, AT_SYMLINK_NOFOLLOW))) {
+		ret = (ENOENT == errno) ? 0 : -errno;
+		goto unlock;
+	}
+
+	if ((!S_ISREG(stbuf.st_mode)) ||
+	    (!S_ISREG(dstbuf.st_mode)) ||
+	    (0 == stbuf.st_blocks) ||
+	    (NULL != *find_open(ram, stbuf.st_ino)) ||
+	    (stbuf.st_size != dstbuf.st_size) ||
+	    (stbuf.st_nlink != dstbuf.st_nlink) ||
+	    (stbuf.st_mtim.tv_sec != dstbuf.st_mtim.tv_sec) ||
+	    (stbuf.st_mtim.tv_nsec != dstbuf.st_mtim.tv_nsec))
+		goto unlock;
+
+	ret = get_handle(dest, name, &h);
+	if (0 != ret)
+		goto unlock;
+
+	fd = openat(src, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == fd) {
+		ret = -errno;
+		goto unlock;
+	}
+
+	/* the handle is attached before the data is freed, and both happen while
+	 * the file cannot be opened */
+	if (-1 == fsetxattr(fd, DISK_XATTR, h.buf, handle_size(&h), 0)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (-1 == fallocate(fd,
+	                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                    0,
+	                    stbuf.st_size)) {
+		ret = -errno;
+		(void) fremovexattr(fd, DISK_XATTR);
+		goto close_fd;
+	}
+
+	/* freeing the data changes the modification time */
+	tv[0] = stbuf.st_atim;
+	tv[1] = stbuf.st_mtim;
+	if (-1 == futimens(fd, tv))
+		ret = -errno;
+
+	++ram->spilled;
+
+close_fd:
+	(void) close(fd);
+
+unlock:
+	(void) pthread_mutex_unlock(&ram->open_lock);
+
+	return ret;
+}
+
+/* frees the data of files under a directory until half of the in-memory copy
+ * is free; returns 1 once it is */
+static int spill_dir(struct ramrw *ram, const int src, const int dest)
+{
+	struct dirent ent;
+	DIR *dir;
+	struct dirent *entp;
+	struct stat stbuf;
+	int fd;
+	int sub;
+	int ret;
+
+	fd = open_dir(src, ".");
+	if (-1 == fd)
+		return 0;
+
+	dir = fdopendir(fd);
+	if (NULL == dir) {
+		(void) close(fd);
+		return 0;
+	}
+
+	ret = 0;
+
+	do {
+		if ((0 != readdir_r(dir, &ent, &entp)) || (NULL == entp))
+			break;
+
+		if ((0 == strcmp(".", entp->d_name)) ||
+		    (0 == strcmp("..", entp->d_name)) ||
+		    (-1 == fstatat(src,
+		                   entp->d_name,
+		                   &stbuf,
+		                   AT_SYMLINK_NOFOLLOW)))
+			continue;
+
+		/* files that cannot be moved are kept in memory */
+		if (S_ISREG(stbuf.st_mode) && (0 != stbuf.st_blocks)) {
+			(void) spill_file(ram, src, dest, entp->d_name);
+			ret = (0 == used(ram, 1, 2)) ? 1 : 0;
+		}
+		else if (S_ISDIR(stbuf.st_mode)) {
+			fd = open_dir(src, entp->d_name);
+			if (-1 == fd)
+				continue;
+
+			sub = open_dir(dest, entp->d_name);
+			if (-1 != sub) {
+				ret = spill_dir(ram, fd, sub);
+				(void) close(sub);
+			}
+
+			(void) close(fd);
+		}
+	} while (0 == ret);
+
+	(void) closedir(dir);
+
+	return ret;
+}
+
+static void spill(struct ramrw *ram)
+{
+	(void) pthread_mutex_lock(&ram->flush_lock);
+	(void) spill_dir(ram, ram->fd, ram->disk);
+	(void) pthread_mutex_unlock(&ram->flush_lock);
+}
+
+static void *flusher(void *arg)
+{
+	struct timespec deadline;
+	struct ramrw *ram = (struct ramrw *) arg;
+	time_t last;
+
+	last = time(NULL);
+
+	(void) pthread_mutex_lock(&ram->lock);
+
+	while (0 == ram->stop) {
+		(void) clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CHECK_INTERVAL;
+		(void) pthread_cond_timedwait(&ram->cond, &ram->lock, &deadline);
+		if (1 == ram->stop)
+			break;
+
+		if ((time(NULL) - last < (time_t) ram->interval) &&
+		    (0 == used(ram, 3, 4)))
+			continue;
+
+		/* errors are retried by the next flush, and files are moved to the
+		 * disk once their copies there are up to date */
+		(void) pthread_mutex_unlock(&ram->lock);
+		(void) flush(ram, 0);
+		if (1 == used(ram, 3, 4))
+			spill(ram);
+		last = time(NULL);
+		(void) pthread_mutex_lock(&ram->lock);
+	}
+
+	(void) pthread_mutex_unlock(&ram->lock);
+
+	return NULL;
+}
+
+/* mounts a tmpfs that is reachable only through the returned handle */
+static int mount_tmpfs(const size_t size)
+{
+	char dir[] = MOUNT_POINT;
+	char opts[64];
+	int fd;
+
+	if (NULL == mkdtemp(dir))
+		return -1;
+
+	(void) snprintf(opts, sizeof(opts), "size=%zu,mode=0700", size);
+	if (-1 == mount("luufs", dir, "tmpfs", MS_NOSUID, opts)) {
+		(void) rmdir(dir);
+		return -1;
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	(void) umount2(dir, MNT_DETACH);
+	(void) rmdir(dir);
+
+	return fd;
+}
+
+int ramrw_init(struct ramrw *ram,
+               int *rw,
+               const size_t size,
+               const unsigned int interval)
+{
+	struct stat stbuf;
+	unsigned int i;
+	int ret;
+
+	ram->enabled = 0;
+	ram->running = 0;
+	ram->stop = 0;
+	ram->flushes = 0;
+	ram->files = 0;
+	ram->bytes = 0;
+	ram->removed = 0;
+	ram->spilled = 0;
+	ram->loaded = 0;
+	for (i = 0; RAMRW_OPEN_BUCKETS > i; ++i)
+		ram->opens[i] = NULL;
+
+	if ((0 == size) || (-1 == *rw))
+		return 0;
+
+	ram->disk = *rw;
+	ram->interval = interval;
+
+	if (-1 == fstat(ram->disk, &stbuf))
+		return -1;
+
+	ram->fd = mount_tmpfs(size);
+	if (-1 == ram->fd)
+		return -1;
+
+	if ((-1 == fchown(ram->fd, stbuf.st_uid, stbuf.st_gid)) ||
+	    (-1 == fchmod(ram->fd, stbuf.st_mode & 07777)) ||
+	    (-1 == fstat(ram->fd, &stbuf)))
+		goto close_fd;
+	ram->dev = stbuf.st_dev;
+
+	/* the names of all files must fit, but data is read from the disk */
+	ret = mirror_tree(ram, ram->disk, ram->fd, MIRROR_STUBS);
+	if (0 != ret) {
+		errno = -ret;
+		goto close_fd;
+	}
+	ram->files = 0;
+	ram->bytes = 0;
+	ram->removed = 0;
+
+	if (0 != pthread_mutex_init(&ram->flush_lock, NULL))
+		goto close_fd;
+
+	if (0 != pthread_mutex_init(&ram->open_lock, NULL))
+		goto destroy_flush_lock;
+
+	if (0 != pthread_mutex_init(&ram->lock, NULL))
+		goto destroy_open_lock;
+
+	if (0 != pthread_cond_init(&ram->cond, NULL))
+		goto destroy_lock;
+
+	*rw = ram->fd;
+	ram->enabled = 1;
+	return 0;
+
+destroy_lock:
+	(void) pthread_mutex_destroy(&ram->lock);
+
+destroy_open_lock:
+	(void) pthread_mutex_destroy(&ram->open_lock);
+
+destroy_flush_lock:
+	(void) pthread_mutex_destroy(&ram->flush_lock);
+
+close_fd:
+	ret = errno;
+	(void) close(ram->fd);
+	errno = ret;
+
+	return -1;
+}
+
+int ramrw_start(struct ramrw *ram)
+{
+	if (0 == ram->enabled)
+		return 0;
+
+	if (0 != pthread_create(&ram->thread, NULL, flusher, ram))
+		return -1;
+
+	ram->running = 1;
+	return 0;
+}
+
+int ramrw_free(struct ramrw *ram)
+{
+	struct ramrw_open *entry;
+	unsigned int i;
+	int ret;
+
+	if (0 == ram->enabled)
+		return 0;
+
+	if (1 == ram->running) {
+		(void) pthread_mutex_lock(&ram->lock);
+		ram->stop = 1;
+		(void) pthread_cond_signal(&ram->cond);
+		(void) pthread_mutex_unlock(&ram->lock);
+
+		(void) pthread_join(ram->thread, NULL);
+		ram->running = 0;
+	}
+
+	/* the in-memory copy is gone once its handle is closed, so a failure,
+	 * e.g because the disk is full, is retried */
+	for (i = 0; FLUSH_ATTEMPTS > i; ++i) {
+		if (0 != i)
+			(void) sleep(FLUSH_RETRY_INTERVAL);
+
+		ret = flush(ram, 1);
+		if (0 == ret)
+			break;
+
+		syslog(LOG_ERR,
+		       "failed to copy changes to the disk: %s",
+		       strerror(-ret));
+	}
+
+	for (i = 0; RAMRW_OPEN_BUCKETS > i; ++i) {
+		while (NULL != ram->opens[i]) {
+			entry = ram->opens[i];
+			ram->opens[i] = entry->next;
+			free(entry);
+		}
+	}
+
+	(void) pthread_cond_destroy(&ram->cond);
+	(void) pthread_mutex_destroy(&ram->lock);
+	(void) pthread_mutex_destroy(&ram->open_lock);
+	(void) pthread_mutex_destroy(&ram->flush_lock);
+	(void) close(ram->disk);
+	ram->enabled = 0;
+
+	return (0 == ret) ? 0 : -1;
+}
+
+/* copies the data of a file back to memory from its copy on the disk */
+static int load(struct ramrw *ram,
+                union disk_handle *h,
+                const char *path,
+                const struct stat *stbuf)
+{
+	struct timespec tv[2];
+	ssize_t out;
+	int src;
+	int dest;
+	int ret = 0;
+
+	src = open_by_handle_at(ram->disk, &h->fh, O_RDONLY | O_CLOEXEC);
+	if (-1 == src)
+		return -errno;
+
+	dest = open(path, O_WRONLY | O_CLOEXEC);
+	if (-1 == dest) {
+		ret = -errno;
+		goto close_src;
+	}
+
+	out = copyup_range(src, 0, dest, 0, (size_t) stbuf->st_size);
+	if (0 > out)
+		ret = (int) out;
+	else {
+		/* writing the data changes the modification time */
+		tv[0] = stbuf->st_atim;
+		tv[1] = stbuf->st_mtim;
+		if (-1 == futimens(dest, tv))
+			ret = -errno;
+	}
+
+	/* data copied partially, e.g because memory is full, is freed again */
+	if (0 != ret)
+		(void) fallocate(dest,
+		                 FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		                 0,
+		                 stbuf->st_size);
+	else
+		++ram->loaded;
+
+	(void) close(dest);
+
+close_src:
+	(void) close(src);
+
+	return ret;
+}
+
+int ramrw_open(struct ramrw *ram, const int fd, const int flags, int *disk)
+{
+	char path[PATH_MAX];
+	union disk_handle h;
+	struct stat stbuf;
+	int out = -1;
+	int ret;
+
+	*disk = 0;
+	fd_path(path, sizeof(path), fd, "");
+
+	(void) pthread_mutex_lock(&ram->open_lock);
+
+	if (-1 == fstat(fd, &stbuf)) {
+		ret = -errno;
+		goto unlock;
+	}
+
+	ret = get_stub(path, &stbuf, &h);
+	if (0 > ret)
+		goto unlock;
+
+	if ((1 == ret) &&
+	    (O_RDONLY == (O_ACCMODE & flags)) &&
+	    (0 == (O_TRUNC & flags))) {
+		out = open_by_handle_at(ram->disk, &h.fh, flags & ~O_NOFOLLOW);
+		ret = (-1 == out) ? -errno : 0;
+		*disk = 1;
+		goto unlock;
+	}
+
+	out = open(path, flags & ~O_NOFOLLOW);
+	if (-1 == out) {
+		ret = -errno;
+		goto unlock;
+	}
+
+	/* the handle is detached only once the data is back in memory, or once
+	 * the file is truncated */
+	if (1 == ret) {
+		ret = (0 == (O_TRUNC & flags)) ? load(ram, &h, path, &stbuf) : 0;
+		if ((0 == ret) && (-1 == fremovexattr(out, DISK_XATTR)))
+			ret = -errno;
+		if (0 != ret)
+			goto close_out;
+	}
+
+	ret = hold(ram, stbuf.st_ino);
+	if (0 == ret)
+		goto unlock;
+
+close_out:
+	(void) close(out);
+
+unlock:
+	(void) pthread_mutex_unlock(&ram->open_lock);
+
+	if (0 != ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return out;
+}
+
+int ramrw_hold(struct ramrw *ram, const int fd)
+{
+	struct stat stbuf;
+	int ret;
+
+	if (0 == ram->enabled)
+		return 0;
+
+	if (-1 == fstat(fd, &stbuf))
+		return -errno;
+
+	(void) pthread_mutex_lock(&ram->open_lock);
+	ret = hold(ram, stbuf.st_ino);
+	(void) pthread_mutex_unlock(&ram->open_lock);
+
+	return ret;
+}
+
+void ramrw_release(struct ramrw *ram, const int fd)
+{
+	struct ramrw_open **entry;
+	struct ramrw_open *last;
+	struct stat stbuf;
+
+	/* files read from the disk and files under read-only directories are
+	 * not held */
+	if ((0 == ram->enabled) ||
+	    (-1 == fstat(fd, &stbuf)) ||
+	    (stbuf.st_dev != ram->dev))
+		return;
+
+	(void) pthread_mutex_lock(&ram->open_lock);
+
+	entry = find_open(ram, stbuf.st_ino);
+	if ((NULL != *entry) && (0 == --(*entry)->count)) {
+		last = *entry;
+		*entry = last->next;
+		free(last);
+	}
+
+	(void) pthread_mutex_unlock(&ram->open_lock);
+}
+
+int ramrw_truncate(struct ramrw *ram, const int fd, const off_t size)
+{
+	int disk;
+	int out;
+	int ret = 0;
+
+	/* truncation to 0 bytes doesn't copy the data back to memory */
+	out = ramrw_open(ram,
+	                 fd,
+	                 (0 == size) ? O_WRONLY | O_TRUNC | O_CLOEXEC
+	                             : O_WRONLY | O_CLOEXEC,
+	                 &disk);
+	if (-1 == out)
+		return -errno;
+
+	if (-1 == ftruncate(out, size))
+		ret = -errno;
+
+	ramrw_release(ram, out);
+	(void) close(out);
+
+	return ret;
+}
+
+int ramrw_sync(struct ramrw *ram, const int fd)
+{
+	char link[32];
+	char path[PATH_MAX];
+	struct mirror m;
+	struct stat stbuf;
+	ssize_t len;
+	char *name;
+	char *next;
+	char *pos;
+	unsigned int i;
+	int src;
+	int dest;
+	int sub;
+	int ret;
+
+	if (0 == ram->enabled)
+		return 0;
+
+	/* files under read-only directories and removed files have nothing to
+	 * copy */
+	if (-1 == fstat(fd, &stbuf))
+		return -errno;
+	if ((stbuf.st_dev != ram->dev) || (0 == stbuf.st_nlink))
+		return 0;
+
+	/* a copy of a file with more than one name is linked to its other names
+	 * only by copying everything */
+	if (1 < stbuf.st_nlink)
+		return flush(ram, 1);
+
+	(void) snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+	(void) pthread_mutex_lock(&ram->flush_lock);
+	mirror_init(&m, ram, ram->disk);
+
+	/* the path is relative to the root of the tmpfs, since it's detached;
+	 * if the file is renamed meanwhile, it's looked up again */
+	ret = -ENOENT;
+	for (i = 0; (SYNC_ATTEMPTS > i) && (-ENOENT == ret); ++i) {
+		len = readlink(link, path, sizeof(path) - 1);
+		if (-1 == len) {
+			ret = -errno;
+			break;
+		}
+		path[len] = '\0';
+
+		src = open_dir(ram->fd, ".");
+		if (-1 == src) {
+			ret = -errno;
+			break;
+		}
+
+		dest = open_dir(ram->disk, ".");
+		if (-1 == dest) {
+			ret = -errno;
+			(void) close(src);
+			break;
+		}
+
+		name = strtok_r(path, "/", &pos);
+		while (NULL != name) {
+			next = strtok_r(NULL, "/", &pos);
+
+			/* directories above the file are created but not copied */
+			ret = mirror_entry(&m,
+			                   src,
+			                   dest,
+			                   name,
+			                   (NULL == next) ? MIRROR_SYNC
+			                                  : MIRROR_SYNC | MIRROR_SHALLOW);
+			if ((0 != ret) || (NULL == next))
+				break;
+
+			sub = open_dir(src, name);
+			if (-1 == sub) {
+				ret = -errno;
+				break;
+			}
+			(void) close(src);
+			src = sub;
+
+			sub = open_dir(dest, name);
+			if (-1 == sub) {
+				ret = -errno;
+				break;
+			}
+			(void) close(dest);
+			dest = sub;
+
+			name = next;
+		}
+
+		(void) close(dest);
+		(void) close(src);
+	}
+
+	mirror_free(&m);
+	(void) pthread_mutex_unlock(&ram->flush_lock);
+
+	return ret;
+}
+
+void ramrw_stats(struct ramrw *ram,
+                 uint64_t *flushes,
+                 uint64_t *files,
+                 uint64_t *bytes,
+                 uint64_t *removed,
+                 uint64_t *spilled,
+                 uint64_t *loaded)
+{
+	(void) pthread_mutex_lock(&ram->flush_lock);
+	*flushes = ram->flushes;
+	*files = ram->files;
+	*bytes = ram->bytes;
+	*removed = ram->removed;
+	*spilled = ram->spilled;
+	(void) pthread_mutex_unlock(&ram->flush_lock);
+
+	(void) pthread_mutex_lock(&ram->open_lock);
+	*loaded = ram->loaded;
+	(void) pthread_mutex_unlock(&ram->open_lock);
+}
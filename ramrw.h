@@ -0,0 +1,115 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _RAMRW_H_INCLUDED
+#	define _RAMRW_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <pthread.h>
+
+/* the number of buckets of the table of open files */
+#	define RAMRW_OPEN_BUCKETS 64
+
+struct ramrw_open;
+
+/* keeps the writeable directory in memory: changes are made to a copy of it
+ * under a private tmpfs of a fixed size, and a thread copies them back every
+ * interval seconds, so files created and removed in between never reach the
+ * disk; as soon as the copy is three quarters full, changes are copied and
+ * the data of files that are not open is freed, until it's half full, while
+ * their names stay in memory and refer to the copies on the disk; such files
+ * are read from the disk, and copied back to memory when opened for writing;
+ * flush_lock is held while changes are copied, and open_lock while files are
+ * opened or moved */
+struct ramrw {
+	pthread_mutex_t flush_lock;
+	pthread_mutex_t open_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct ramrw_open *opens[RAMRW_OPEN_BUCKETS];
+	int fd;
+	int disk;
+	dev_t dev;
+	unsigned int interval;
+	int enabled;
+	int running;
+	int stop;
+	uint64_t flushes;
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t removed;
+	uint64_t spilled;
+	uint64_t loaded;
+};
+
+/* if size is not 0, copies the writeable directory to a tmpfs of that size
+ * and replaces *rw with the copy; regular files are copied without their
+ * data, which is read from the disk until they're opened for writing; the
+ * original handle is kept and closed by ramrw_free() */
+int ramrw_init(struct ramrw *ram,
+               int *rw,
+               const size_t size,
+               const unsigned int interval);
+int ramrw_start(struct ramrw *ram);
+
+/* copies the remaining changes and makes them durable; returns -1 if they
+ * could not be copied, in which case they are lost */
+int ramrw_free(struct ramrw *ram);
+
+/* opens a file under the in-memory copy, given a handle of it, like
+ * open(2); a file whose data is on the disk is opened there if flags are
+ * read-only, or its data is copied back to memory first, unless it's
+ * truncated; *disk is set to 1 if the returned file is on the disk, and
+ * ramrw_release() must be called otherwise */
+int ramrw_open(struct ramrw *ram, const int fd, const int flags, int *disk);
+
+/* keeps a file created under the in-memory copy in memory until
+ * ramrw_release() is called; returns 0 or a negative errno value */
+int ramrw_hold(struct ramrw *ram, const int fd);
+void ramrw_release(struct ramrw *ram, const int fd);
+
+/* truncates a file under the in-memory copy, given a handle of it; returns 0
+ * or a negative errno value */
+int ramrw_truncate(struct ramrw *ram, const int fd, const off_t size);
+
+/* copies an open file under the in-memory copy and the directories above it,
+ * and makes them durable; other files are left alone; returns 0 or a negative
+ * errno value */
+int ramrw_sync(struct ramrw *ram, const int fd);
+
+/* returns the number of times changes were copied, the number of files and
+ * bytes copied, the number of files removed, and the number of files whose
+ * data was freed and copied back to memory */
+void ramrw_stats(struct ramrw *ram,
+                 uint64_t *flushes,
+                 uint64_t *files,
+                 uint64_t *bytes,
+                 uint64_t *removed,
+                 uint64_t *spilled,
+                 uint64_t *loaded);
+
+#endif
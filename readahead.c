@@ -0,0 +1,372 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "readahead.h"
+
+/* the size of the first window */
+#define MIN_WINDOW (128 * 1024)
+
+/* the number of reads in a row that must continue the previous ones before
+ * reading ahead */
+#define MIN_STREAK 2
+
+/* the kernel sends several reads of a file at once and workers may handle
+ * them out of order, so reads that start this close to the end of the
+ * previous ones are considered to continue them */
+#define SLACK (1024 * 1024)
+
+/* pages behind the reader are dropped only in files this large, which are
+ * unlikely to be read again before they're evicted anyway */
+#define HUGE_SIZE (1024 * 1024 * 1024)
+
+int readahead_init(struct readahead *ra, const size_t max)
+{
+	ra->head = NULL;
+	ra->tail = NULL;
+	ra->busy = NULL;
+	ra->max = max;
+	ra->enabled = 0;
+	ra->stop = 0;
+	ra->windows = 0;
+	ra->bytes = 0;
+	ra->hits = 0;
+	ra->misses = 0;
+	ra->dropped = 0;
+
+	if (0 == max)
+		return 0;
+
+	if (0 != pthread_mutex_init(&ra->lock, NULL))
+		return -1;
+
+	if (0 != pthread_cond_init(&ra->cond, NULL)) {
+		(void) pthread_mutex_destroy(&ra->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* asks the kernel to read a range ahead and, in huge files, to drop the pages
+ * far enough behind the reader */
+static void advise(struct readahead *ra,
+                   struct readahead_file *file,
+                   const off_t start,
+                   const off_t len,
+                   const off_t reader,
+                   const off_t keep)
+{
+	struct stat stbuf;
+	off_t dropped;
+
+	if ((0 < len) &&
+	    (-1 == readahead(file->fd, start, (size_t) len)) &&
+	    (0 != posix_fadvise(file->fd, start, len, POSIX_FADV_WILLNEED)))
+		return;
+
+	dropped = 0;
+	if (1 == file->drop) {
+		if (-1 == file->size)
+			file->size = (0 == fstat(file->fd, &stbuf)) ? stbuf.st_size : 0;
+
+		if ((HUGE_SIZE <= file->size) &&
+		    (reader - keep > file->dropped) &&
+		    (0 == posix_fadvise(file->fd,
+		                        file->dropped,
+		                        reader - keep - file->dropped,
+		                        POSIX_FADV_DONTNEED))) {
+			dropped = reader - keep - file->dropped;
+			file->dropped = reader - keep;
+		}
+	}
+
+	(void) pthread_mutex_lock(&ra->lock);
+	if (0 < len) {
+		++ra->windows;
+		ra->bytes += (uint64_t) len;
+	}
+	ra->dropped += (uint64_t) dropped;
+	(void) pthread_mutex_unlock(&ra->lock);
+}
+
+static void *ra_thread(void *arg)
+{
+	struct readahead *ra = (struct readahead *) arg;
+	struct readahead_file *file;
+	off_t start;
+	off_t len;
+	off_t reader;
+	off_t keep;
+
+	(void) pthread_mutex_lock(&ra->lock);
+
+	while (1) {
+		while ((0 == ra->stop) && (NULL == ra->head))
+			(void) pthread_cond_wait(&ra->cond, &ra->lock);
+
+		if (1 == ra->stop)
+			break;
+
+		file = ra->head;
+		ra->head = file->next;
+		if (NULL == ra->head)
+			ra->tail = NULL;
+
+		start = file->start;
+		len = file->len;
+		reader = file->reader;
+		keep = (off_t) file->window;
+		file->queued = 0;
+		ra->busy = file;
+
+		(void) pthread_mutex_unlock(&ra->lock);
+		advise(ra, file, start, len, reader, keep);
+		(void) pthread_mutex_lock(&ra->lock);
+
+		ra->busy = NULL;
+		(void) pthread_cond_broadcast(&ra->cond);
+	}
+
+	(void) pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+int readahead_start(struct readahead *ra)
+{
+	if (0 == ra->max)
+		return 0;
+
+	if (0 != pthread_create(&ra->thread, NULL, ra_thread, ra))
+		return -1;
+
+	ra->enabled = 1;
+	return 0;
+}
+
+void readahead_free(struct readahead *ra)
+{
+	if (1 == ra->enabled) {
+		(void) pthread_mutex_lock(&ra->lock);
+		ra->stop = 1;
+		(void) pthread_cond_broadcast(&ra->cond);
+		(void) pthread_mutex_unlock(&ra->lock);
+
+		(void) pthread_join(ra->thread, NULL);
+		ra->enabled = 0;
+	}
+
+	if (0 != ra->max) {
+		(void) pthread_cond_destroy(&ra->cond);
+		(void) pthread_mutex_destroy(&ra->lock);
+		ra->max = 0;
+	}
+}
+
+int readahead_open(struct readahead *ra,
+                   struct readahead_file *file,
+                   const int fd,
+                   const int drop)
+{
+	if (0 == ra->enabled)
+		return 0;
+
+	if (0 != pthread_mutex_init(&file->lock, NULL))
+		return -1;
+
+	file->next = NULL;
+	file->fd = fd;
+	file->drop = drop;
+	file->end = 0;
+	file->streak = 0;
+	file->ahead = 0;
+	file->window = 0;
+	file->queued = 0;
+	file->start = 0;
+	file->len = 0;
+	file->reader = 0;
+	file->size = -1;
+	file->dropped = 0;
+	return 0;
+}
+
+void readahead_close(struct readahead *ra, struct readahead_file *file)
+{
+	struct readahead_file *prev;
+	struct readahead_file *queued;
+
+	if (0 == ra->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&ra->lock);
+
+	if (1 == file->queued) {
+		prev = NULL;
+		for (queued = ra->head; file != queued; queued = queued->next)
+			prev = queued;
+
+		if (NULL == prev)
+			ra->head = file->next;
+		else
+			prev->next = file->next;
+		if (file == ra->tail)
+			ra->tail = prev;
+		file->queued = 0;
+	}
+
+	while (file == ra->busy)
+		(void) pthread_cond_wait(&ra->cond, &ra->lock);
+
+	(void) pthread_mutex_unlock(&ra->lock);
+
+	(void) pthread_mutex_destroy(&file->lock);
+}
+
+static void queue(struct readahead *ra,
+                  struct readahead_file *file,
+                  const off_t start,
+                  const off_t len,
+                  const off_t reader,
+                  const size_t window)
+{
+	(void) pthread_mutex_lock(&ra->lock);
+
+	/* a window not requested yet is extended */
+	if ((1 == file->queued) && (file->start + file->len == start))
+		file->len += len;
+	else {
+		file->start = start;
+		file->len = len;
+	}
+	file->reader = reader;
+	file->window = window;
+
+	if (0 == file->queued) {
+		file->next = NULL;
+		if (NULL == ra->tail)
+			ra->head = file;
+		else
+			ra->tail->next = file;
+		ra->tail = file;
+		file->queued = 1;
+		(void) pthread_cond_signal(&ra->cond);
+	}
+
+	(void) pthread_mutex_unlock(&ra->lock);
+}
+
+void readahead_read(struct readahead *ra,
+                    struct readahead_file *file,
+                    const off_t off,
+                    const size_t size)
+{
+	off_t start;
+	off_t end;
+	size_t window;
+
+	if (0 == ra->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&file->lock);
+
+	if ((off + SLACK >= file->end) && (off <= file->end + SLACK)) {
+		if (UINT_MAX > file->streak)
+			++file->streak;
+	}
+	else {
+		file->streak = 0;
+		file->ahead = 0;
+		file->window = 0;
+	}
+
+	end = off + (off_t) size;
+	if (end > file->end)
+		file->end = end;
+
+	/* random reads are left alone */
+	if (MIN_STREAK > file->streak) {
+		(void) pthread_mutex_unlock(&file->lock);
+		return;
+	}
+
+	if (end <= file->ahead)
+		__atomic_add_fetch(&ra->hits, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&ra->misses, 1, __ATOMIC_RELAXED);
+
+	/* the next window is requested once the reader is past the middle of the
+	 * current one, and each window is twice as large as the previous one */
+	if (file->end + (off_t) (file->window / 2) < file->ahead) {
+		(void) pthread_mutex_unlock(&file->lock);
+		return;
+	}
+
+	if (0 == file->window) {
+		file->window = 4 * size;
+		if (MIN_WINDOW > file->window)
+			file->window = MIN_WINDOW;
+	}
+	else
+		file->window *= 2;
+	if (ra->max < file->window)
+		file->window = ra->max;
+
+	start = (file->ahead > file->end) ? file->ahead : file->end;
+	file->ahead = file->end + (off_t) file->window;
+	end = file->ahead;
+	window = file->window;
+
+	(void) pthread_mutex_unlock(&file->lock);
+
+	queue(ra, file, start, end - start, off, window);
+}
+
+void readahead_stats(struct readahead *ra,
+                     uint64_t *windows,
+                     uint64_t *bytes,
+                     uint64_t *hits,
+                     uint64_t *misses,
+                     uint64_t *dropped)
+{
+	*windows = 0;
+	*bytes = 0;
+	*hits = __atomic_load_n(&ra->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&ra->misses, __ATOMIC_RELAXED);
+	*dropped = 0;
+
+	if (0 == ra->enabled)
+		return;
+
+	(void) pthread_mutex_lock(&ra->lock);
+	*windows = ra->windows;
+	*bytes = ra->bytes;
+	*dropped = ra->dropped;
+	(void) pthread_mutex_unlock(&ra->lock);
+}
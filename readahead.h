@@ -0,0 +1,104 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _READAHEAD_H_INCLUDED
+#	define _READAHEAD_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <pthread.h>
+
+/* the access pattern of an open file: the end of the last read, the number
+ * of reads in a row that continued the previous ones, the end of the range
+ * requested ahead and the size of the next window; the pending request is
+ * protected by the queue lock and dropped is only used by the thread */
+struct readahead_file {
+	struct readahead_file *next;
+	pthread_mutex_t lock;
+	int fd;
+	int drop;
+	off_t end;
+	unsigned int streak;
+	off_t ahead;
+	size_t window;
+	int queued;
+	off_t start;
+	off_t len;
+	off_t reader;
+	off_t size;
+	off_t dropped;
+};
+
+/* reads ahead of sequential readers of files, through a thread that asks the
+ * kernel to read ranges of the underlying files into the page cache, so reads
+ * do not wait for the disk; max is the largest window */
+struct readahead {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct readahead_file *head;
+	struct readahead_file *tail;
+	struct readahead_file *busy;
+	pthread_t thread;
+	size_t max;
+	int enabled;
+	int stop;
+	uint64_t windows;
+	uint64_t bytes;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t dropped;
+};
+
+int readahead_init(struct readahead *ra, const size_t max);
+int readahead_start(struct readahead *ra);
+void readahead_free(struct readahead *ra);
+
+/* starts tracking reads of a file; if drop is set, pages behind the reader
+ * are dropped from the page cache once it's known to be huge */
+int readahead_open(struct readahead *ra,
+                   struct readahead_file *file,
+                   const int fd,
+                   const int drop);
+
+/* stops tracking reads of a file, waiting for the thread to finish with it,
+ * so its file descriptor can be closed */
+void readahead_close(struct readahead *ra, struct readahead_file *file);
+
+void readahead_read(struct readahead *ra,
+                    struct readahead_file *file,
+                    const off_t off,
+                    const size_t size);
+
+/* returns the number of windows requested and their total size, the number
+ * of sequential reads within a window requested before and those outside it,
+ * and the number of bytes dropped behind readers */
+void readahead_stats(struct readahead *ra,
+                     uint64_t *windows,
+                     uint64_t *bytes,
+                     uint64_t *hits,
+                     uint64_t *misses,
+                     uint64_t *dropped);
+
+#endif
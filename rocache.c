@@ -0,0 +1,721 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "rocache.h"
+
+/* the maximum number of watched directories */
+#define MAX_WATCHES 8192
+
+/* tickets are never 0, so a 0 ticket means the directory is not watched */
+#define NO_TICKET 0
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+                    IN_DELETE_SELF | IN_ONLYDIR)
+
+static uint32_t hash_name(const dev_t dev, const ino_t ino, const char *name)
+{
+	uint32_t hash;
+	size_t i;
+
+	hash = 2166136261U ^ (uint32_t) ino ^ ((uint32_t) dev << 16);
+	for (i = 0; '\0' != name[i]; ++i) {
+		hash ^= (uint32_t) (unsigned char) name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static size_t hash_dir(const dev_t dev, const ino_t ino)
+{
+	return (size_t) (((uint64_t) ino * 31) + (uint64_t) dev) &
+	       (ROCACHE_WATCH_BUCKETS - 1);
+}
+
+static struct rocache_shard *get_shard(struct rocache *cache,
+                                       const uint32_t hash)
+{
+	return &cache->shards[(hash >> 16) % ROCACHE_SHARDS];
+}
+
+int rocache_init(struct rocache *cache, const size_t max, const int immutable)
+{
+	struct rocache_shard *shard;
+	size_t size;
+	unsigned int i;
+
+	cache->enabled = 0;
+	cache->immutable = immutable;
+	cache->ifd = -1;
+	cache->efd = -1;
+	cache->watches = 0;
+	cache->changed = NULL;
+	cache->arg = NULL;
+	memset(cache->shards, 0, sizeof(cache->shards));
+	memset(cache->dirs, 0, sizeof(cache->dirs));
+	memset(cache->wds, 0, sizeof(cache->wds));
+
+	if (0 == max)
+		return 0;
+
+	/* each shard has a bucket per cached name */
+	for (size = 1; (max / ROCACHE_SHARDS) > size; size *= 2);
+
+	for (i = 0; ROCACHE_SHARDS > i; ++i) {
+		shard = &cache->shards[i];
+		shard->buckets = calloc(size, sizeof(*shard->buckets));
+		if (NULL == shard->buckets)
+			goto free_shards;
+
+		if (0 != pthread_mutex_init(&shard->lock, NULL)) {
+			free(shard->buckets);
+			goto free_shards;
+		}
+
+		shard->newest = NULL;
+		shard->oldest = NULL;
+		shard->size = size;
+		shard->count = 0;
+		shard->max = size;
+		shard->hits = 0;
+		shard->misses = 0;
+	}
+
+	if (0 != pthread_mutex_init(&cache->lock, NULL))
+		goto free_shards;
+
+	cache->enabled = 1;
+	return 0;
+
+free_shards:
+	while (0 < i) {
+		--i;
+		(void) pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].buckets);
+		cache->shards[i].buckets = NULL;
+	}
+
+	return -1;
+}
+
+static void unlink_entry(struct rocache_shard *shard,
+                         struct rocache_entry *entry)
+{
+	if (NULL == entry->newer)
+		shard->newest = entry->older;
+	else
+		entry->newer->older = entry->older;
+
+	if (NULL == entry->older)
+		shard->oldest = entry->newer;
+	else
+		entry->older->newer = entry->newer;
+}
+
+static void push_entry(struct rocache_shard *shard,
+                       struct rocache_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = shard->newest;
+	if (NULL == shard->newest)
+		shard->oldest = entry;
+	else
+		shard->newest->newer = entry;
+	shard->newest = entry;
+}
+
+static void remove_entry(struct rocache_shard *shard,
+                         struct rocache_entry *entry)
+{
+	struct rocache_entry **prev;
+
+	prev = &shard->buckets[entry->hash & (shard->size - 1)];
+	while (entry != *prev)
+		prev = &(*prev)->next;
+	*prev = entry->next;
+
+	unlink_entry(shard, entry);
+	--shard->count;
+	free(entry);
+}
+
+static struct rocache_entry *find_entry(const struct rocache_shard *shard,
+                                        const dev_t dev,
+                                        const ino_t ino,
+                                        const char *name,
+                                        const uint32_t hash)
+{
+	struct rocache_entry *entry;
+
+	for (entry = shard->buckets[hash & (shard->size - 1)];
+	     NULL != entry;
+	     entry = entry->next) {
+		if ((hash == entry->hash) &&
+		    (ino == entry->ino) &&
+		    (dev == entry->dev) &&
+		    (0 == strcmp(name, entry->name)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct rocache_watch *find_dir(const struct rocache *cache,
+                                      const dev_t dev,
+                                      const ino_t ino)
+{
+	struct rocache_watch *watch;
+
+	for (watch = cache->dirs[hash_dir(dev, ino)];
+	     NULL != watch;
+	     watch = watch->next_dir) {
+		if ((ino == watch->ino) && (dev == watch->dev))
+			return watch;
+	}
+
+	return NULL;
+}
+
+static struct rocache_watch *find_wd(const struct rocache *cache, const int wd)
+{
+	struct rocache_watch *watch;
+
+	for (watch = cache->wds[wd % ROCACHE_WATCH_BUCKETS];
+	     NULL != watch;
+	     watch = watch->next_wd) {
+		if (wd == watch->wd)
+			return watch;
+	}
+
+	return NULL;
+}
+
+/* returns the ticket of a directory, adding a watch if needed; must be called
+ * before the directory is searched, so no change goes unnoticed */
+static uint64_t arm_watch(struct rocache *cache,
+                          const int dir,
+                          const dev_t dev,
+                          const ino_t ino)
+{
+	char path[sizeof("/proc/self/fd/-2147483648")];
+	struct rocache_watch *watch;
+	uint64_t ticket;
+	int wd;
+
+	/* the contents of an immutable directory never change */
+	if (1 == cache->immutable)
+		return 1;
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	watch = find_dir(cache, dev, ino);
+	if (NULL != watch) {
+		ticket = watch->gen;
+		goto unlock;
+	}
+
+	ticket = NO_TICKET;
+	if (MAX_WATCHES == cache->watches)
+		goto unlock;
+
+	(void) snprintf(path, sizeof(path), "/proc/self/fd/%d", dir);
+	wd = inotify_add_watch(cache->ifd, path, WATCH_MASK);
+	if (-1 == wd)
+		goto unlock;
+
+	watch = malloc(sizeof(*watch));
+	if (NULL == watch) {
+		(void) inotify_rm_watch(cache->ifd, wd);
+		goto unlock;
+	}
+
+	watch->dev = dev;
+	watch->ino = ino;
+	watch->gen = 1;
+	watch->wd = wd;
+	watch->next_dir = cache->dirs[hash_dir(dev, ino)];
+	cache->dirs[hash_dir(dev, ino)] = watch;
+	watch->next_wd = cache->wds[wd % ROCACHE_WATCH_BUCKETS];
+	cache->wds[wd % ROCACHE_WATCH_BUCKETS] = watch;
+	++cache->watches;
+
+	ticket = watch->gen;
+
+unlock:
+	(void) pthread_mutex_unlock(&cache->lock);
+
+	return ticket;
+}
+
+int rocache_get(struct rocache *cache,
+                const int dir,
+                const dev_t dev,
+                const ino_t ino,
+                const char *name,
+                struct stat *stbuf,
+                unsigned int *layer,
+                uint64_t *ticket)
+{
+	struct rocache_shard *shard;
+	struct rocache_entry *entry;
+	uint32_t hash;
+	int state;
+
+	*ticket = NO_TICKET;
+
+	if (0 == cache->enabled)
+		return ROCACHE_MISS;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(cache, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+
+	entry = find_entry(shard, dev, ino, name, hash);
+	if (NULL == entry) {
+		++shard->misses;
+		(void) pthread_mutex_unlock(&shard->lock);
+		*ticket = arm_watch(cache, dir, dev, ino);
+		return ROCACHE_MISS;
+	}
+
+	++shard->hits;
+
+	unlink_entry(shard, entry);
+	push_entry(shard, entry);
+
+	state = entry->state;
+	if (ROCACHE_FOUND == state)
+		*stbuf = entry->stbuf;
+	*layer = entry->layer;
+
+	(void) pthread_mutex_unlock(&shard->lock);
+
+	return state;
+}
+
+static void put_entry(struct rocache *cache,
+                      const dev_t dev,
+                      const ino_t ino,
+                      const char *name,
+                      const struct stat *stbuf,
+                      const unsigned int layer)
+{
+	struct rocache_shard *shard;
+	struct rocache_entry *entry;
+	size_t len;
+	uint32_t hash;
+	int state;
+
+	if (NULL == stbuf)
+		state = ROCACHE_MISSING;
+	/* the attributes of a directory change whenever a file is created or
+	 * deleted in it, and its parent is not notified */
+	else if (S_ISDIR(stbuf->st_mode) && (0 == cache->immutable))
+		state = ROCACHE_EXISTS;
+	else
+		state = ROCACHE_FOUND;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(cache, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+
+	entry = find_entry(shard, dev, ino, name, hash);
+	if (NULL != entry) {
+		unlink_entry(shard, entry);
+		goto set;
+	}
+
+	if (shard->max == shard->count)
+		remove_entry(shard, shard->oldest);
+
+	len = strlen(name) + 1;
+	entry = malloc(sizeof(*entry) + len);
+	if (NULL == entry)
+		goto unlock;
+
+	entry->dev = dev;
+	entry->ino = ino;
+	entry->hash = hash;
+	memcpy(entry->name, name, len);
+	entry->next = shard->buckets[hash & (shard->size - 1)];
+	shard->buckets[hash & (shard->size - 1)] = entry;
+	++shard->count;
+
+set:
+	entry->state = state;
+	entry->layer = layer;
+	if (ROCACHE_FOUND == state)
+		entry->stbuf = *stbuf;
+	push_entry(shard, entry);
+
+unlock:
+	(void) pthread_mutex_unlock(&shard->lock);
+}
+
+void rocache_put(struct rocache *cache,
+                 const dev_t dev,
+                 const ino_t ino,
+                 const char *name,
+                 const struct stat *stbuf,
+                 const unsigned int layer,
+                 const uint64_t ticket)
+{
+	struct rocache_watch *watch;
+
+	if ((0 == cache->enabled) || (NO_TICKET == ticket))
+		return;
+
+	if (1 == cache->immutable) {
+		put_entry(cache, dev, ino, name, stbuf, layer);
+		return;
+	}
+
+	/* the watch lock is held while the entry is added, so the watcher cannot
+	 * invalidate the directory in between */
+	(void) pthread_mutex_lock(&cache->lock);
+
+	watch = find_dir(cache, dev, ino);
+	if ((NULL != watch) && (ticket == watch->gen))
+		put_entry(cache, dev, ino, name, stbuf, layer);
+
+	(void) pthread_mutex_unlock(&cache->lock);
+}
+
+static void invalidate_name(struct rocache *cache,
+                            const dev_t dev,
+                            const ino_t ino,
+                            const char *name)
+{
+	struct rocache_shard *shard;
+	struct rocache_entry *entry;
+	uint32_t hash;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(cache, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+
+	entry = find_entry(shard, dev, ino, name, hash);
+	if (NULL != entry)
+		remove_entry(shard, entry);
+
+	(void) pthread_mutex_unlock(&shard->lock);
+}
+
+/* removes all names under a directory, or all names if dir is NULL */
+static void invalidate_dir(struct rocache *cache,
+                           const struct rocache_watch *dir)
+{
+	struct rocache_shard *shard;
+	struct rocache_entry *entry;
+	struct rocache_entry *older;
+	unsigned int i;
+
+	for (i = 0; ROCACHE_SHARDS > i; ++i) {
+		shard = &cache->shards[i];
+
+		(void) pthread_mutex_lock(&shard->lock);
+
+		for (entry = shard->newest; NULL != entry; entry = older) {
+			older = entry->older;
+			if ((NULL == dir) ||
+			    ((dir->ino == entry->ino) && (dir->dev == entry->dev)))
+				remove_entry(shard, entry);
+		}
+
+		(void) pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+static void remove_watch(struct rocache *cache, struct rocache_watch *watch)
+{
+	struct rocache_watch **prev;
+
+	prev = &cache->dirs[hash_dir(watch->dev, watch->ino)];
+	while (watch != *prev)
+		prev = &(*prev)->next_dir;
+	*prev = watch->next_dir;
+
+	prev = &cache->wds[watch->wd % ROCACHE_WATCH_BUCKETS];
+	while (watch != *prev)
+		prev = &(*prev)->next_wd;
+	*prev = watch->next_wd;
+
+	--cache->watches;
+	free(watch);
+}
+
+/* reports lost events as a change of every watched directory */
+static void handle_overflow(struct rocache *cache)
+{
+	struct rocache_watch *watch;
+	dev_t *devs;
+	ino_t *inos;
+	size_t count;
+	size_t i;
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	count = 0;
+	devs = malloc(sizeof(*devs) * (cache->watches + 1));
+	inos = malloc(sizeof(*inos) * (cache->watches + 1));
+
+	for (i = 0; ROCACHE_WATCH_BUCKETS > i; ++i) {
+		for (watch = cache->dirs[i]; NULL != watch; watch = watch->next_dir) {
+			++watch->gen;
+
+			if ((NULL != devs) && (NULL != inos)) {
+				devs[count] = watch->dev;
+				inos[count] = watch->ino;
+				++count;
+			}
+		}
+	}
+
+	invalidate_dir(cache, NULL);
+
+	(void) pthread_mutex_unlock(&cache->lock);
+
+	if (NULL != cache->changed) {
+		for (i = 0; count > i; ++i)
+			cache->changed(cache->arg, devs[i], inos[i], NULL);
+	}
+
+	free(inos);
+	free(devs);
+}
+
+static void handle_event(struct rocache *cache,
+                         const struct inotify_event *event)
+{
+	struct rocache_watch *watch;
+	dev_t dev;
+	ino_t ino;
+	int gone;
+
+	/* if events were lost, anything may have changed */
+	if (0 != (IN_Q_OVERFLOW & event->mask)) {
+		handle_overflow(cache);
+		return;
+	}
+
+	(void) pthread_mutex_lock(&cache->lock);
+
+	watch = find_wd(cache, event->wd);
+	if (NULL == watch) {
+		(void) pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	++watch->gen;
+	dev = watch->dev;
+	ino = watch->ino;
+
+	if (0 != event->len)
+		invalidate_name(cache, dev, ino, event->name);
+
+	/* the directory is gone, or it's no longer watched */
+	gone = (0 != (IN_IGNORED & event->mask)) ? 1 : 0;
+	if (1 == gone) {
+		invalidate_dir(cache, watch);
+		remove_watch(cache, watch);
+	}
+
+	(void) pthread_mutex_unlock(&cache->lock);
+
+	/* the callback may block until requests that wait for the cache are
+	 * handled, so it's called without holding the lock */
+	if (NULL == cache->changed)
+		return;
+
+	if (0 != event->len)
+		cache->changed(cache->arg, dev, ino, event->name);
+	if (1 == gone)
+		cache->changed(cache->arg, dev, ino, NULL);
+}
+
+static void *watch_dirs(void *arg)
+{
+	char buf[4096]
+	     __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfds[2];
+	const struct inotify_event *event;
+	struct rocache *cache;
+	ssize_t len;
+	ssize_t off;
+
+	cache = (struct rocache *) arg;
+
+	pfds[0].fd = cache->ifd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = cache->efd;
+	pfds[1].events = POLLIN;
+
+	do {
+		if (-1 == poll(pfds, 2, -1)) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+
+		if (0 != pfds[1].revents)
+			break;
+
+		len = read(cache->ifd, buf, sizeof(buf));
+		if (-1 == len) {
+			if ((EINTR == errno) || (EAGAIN == errno))
+				continue;
+			break;
+		}
+
+		for (off = 0; len > off; off += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) &buf[off];
+			handle_event(cache, event);
+		}
+	} while (1);
+
+	return NULL;
+}
+
+int rocache_start(struct rocache *cache,
+                  rocache_changed_t changed,
+                  void *arg)
+{
+	cache->changed = changed;
+	cache->arg = arg;
+
+	if ((0 == cache->enabled) || (1 == cache->immutable))
+		return 0;
+
+	cache->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == cache->ifd)
+		goto disable;
+
+	cache->efd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == cache->efd)
+		goto close_ifd;
+
+	if (0 != pthread_create(&cache->thread, NULL, watch_dirs, cache))
+		goto close_efd;
+
+	return 0;
+
+close_efd:
+	(void) close(cache->efd);
+	cache->efd = -1;
+
+close_ifd:
+	(void) close(cache->ifd);
+	cache->ifd = -1;
+
+	/* without a way to detect changes, nothing can be cached */
+disable:
+	cache->enabled = 0;
+	return -1;
+}
+
+void rocache_stop(struct rocache *cache)
+{
+	uint64_t val = 1;
+
+	if (-1 == cache->efd)
+		return;
+
+	if (sizeof(val) == write(cache->efd, &val, sizeof(val)))
+		(void) pthread_join(cache->thread, NULL);
+
+	(void) close(cache->efd);
+	(void) close(cache->ifd);
+	cache->efd = -1;
+	cache->ifd = -1;
+}
+
+void rocache_stats(struct rocache *cache,
+                   unsigned long *hits,
+                   unsigned long *misses,
+                   size_t *count)
+{
+	struct rocache_shard *shard;
+	unsigned int i;
+
+	*hits = 0;
+	*misses = 0;
+	*count = 0;
+
+	if (0 == cache->enabled)
+		return;
+
+	for (i = 0; ROCACHE_SHARDS > i; ++i) {
+		shard = &cache->shards[i];
+
+		(void) pthread_mutex_lock(&shard->lock);
+		*hits += shard->hits;
+		*misses += shard->misses;
+		*count += shard->count;
+		(void) pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void rocache_free(struct rocache *cache)
+{
+	struct rocache_watch *watch;
+	struct rocache_watch *next;
+	unsigned int i;
+
+	rocache_stop(cache);
+
+	/* the cache may have been disabled after it was allocated */
+	cache->enabled = 0;
+	if (NULL == cache->shards[0].buckets)
+		return;
+
+	invalidate_dir(cache, NULL);
+
+	for (i = 0; ROCACHE_SHARDS > i; ++i) {
+		(void) pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].buckets);
+		cache->shards[i].buckets = NULL;
+	}
+
+	for (i = 0; ROCACHE_WATCH_BUCKETS > i; ++i) {
+		for (watch = cache->dirs[i]; NULL != watch; watch = next) {
+			next = watch->next_dir;
+			free(watch);
+		}
+	}
+
+	(void) pthread_mutex_destroy(&cache->lock);
+}
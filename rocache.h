@@ -0,0 +1,137 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _ROCACHE_H_INCLUDED
+#	define _ROCACHE_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#	include <pthread.h>
+
+#	define ROCACHE_SHARDS 64
+#	define ROCACHE_WATCH_BUCKETS 1024
+
+/* rocache_get() results */
+#	define ROCACHE_MISS 0
+#	define ROCACHE_FOUND 1
+#	define ROCACHE_EXISTS 2
+#	define ROCACHE_MISSING 3
+
+struct rocache_entry {
+	struct rocache_entry *next;
+	struct rocache_entry *newer;
+	struct rocache_entry *older;
+	struct stat stbuf;
+	dev_t dev;
+	ino_t ino;
+	uint32_t hash;
+	unsigned int layer;
+	int state;
+	char name[];
+};
+
+struct rocache_shard {
+	pthread_mutex_t lock;
+	struct rocache_entry **buckets;
+	struct rocache_entry *newest;
+	struct rocache_entry *oldest;
+	size_t size;
+	size_t count;
+	size_t max;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct rocache_watch {
+	struct rocache_watch *next_dir;
+	struct rocache_watch *next_wd;
+	dev_t dev;
+	ino_t ino;
+	uint64_t gen;
+	int wd;
+};
+
+/* called when a watched directory changes; name is NULL if the directory
+ * itself changed or anything under it may have changed */
+typedef void (*rocache_changed_t)(void *arg,
+                                  const dev_t dev,
+                                  const ino_t ino,
+                                  const char *name);
+
+/* a cache of name lookups under the read-only directories, keyed by the
+ * parent directory and the name, which remembers missing files too and the
+ * index of the read-only directory each file was found under; unless the
+ * read-only directories are immutable, every directory with cached names is
+ * watched with inotify and changes invalidate the names they affect */
+struct rocache {
+	struct rocache_shard shards[ROCACHE_SHARDS];
+	pthread_mutex_t lock;
+	struct rocache_watch *dirs[ROCACHE_WATCH_BUCKETS];
+	struct rocache_watch *wds[ROCACHE_WATCH_BUCKETS];
+	size_t watches;
+	pthread_t thread;
+	rocache_changed_t changed;
+	void *arg;
+	int ifd;
+	int efd;
+	int immutable;
+	int enabled;
+};
+
+int rocache_init(struct rocache *cache, const size_t max, const int immutable);
+int rocache_start(struct rocache *cache,
+                  rocache_changed_t changed,
+                  void *arg);
+void rocache_stop(struct rocache *cache);
+void rocache_free(struct rocache *cache);
+
+/* returns ROCACHE_MISS and a ticket that must be passed to rocache_put() if
+ * the name is not cached; dir is an O_PATH handle of the parent directory */
+int rocache_get(struct rocache *cache,
+                const int dir,
+                const dev_t dev,
+                const ino_t ino,
+                const char *name,
+                struct stat *stbuf,
+                unsigned int *layer,
+                uint64_t *ticket);
+
+/* caches the result of a lookup, unless the directory has changed since the
+ * ticket was issued; stbuf is NULL if the file is missing */
+void rocache_put(struct rocache *cache,
+                 const dev_t dev,
+                 const ino_t ino,
+                 const char *name,
+                 const struct stat *stbuf,
+                 const unsigned int layer,
+                 const uint64_t ticket);
+
+void rocache_stats(struct rocache *cache,
+                   unsigned long *hits,
+                   unsigned long *misses,
+                   size_t *count);
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "roindex.h"
+
+#define ROINDEX_MAGIC "LUUFSIDX"
+#define ROINDEX_VERSION 1
+
+struct index_buf {
+	struct roindex_dir *dirs;
+	struct roindex_ent *ents;
+	char *names;
+	size_t ndirs;
+	size_t nents;
+	size_t len;
+	size_t dirs_size;
+	size_t ents_size;
+	size_t names_size;
+	dev_t dev;
+};
+
+static int grow(void **p, size_t *size, const size_t len, const size_t need)
+{
+	void *np;
+	size_t nsize;
+
+	if (*size >= need)
+		return 0;
+
+	for (nsize = (0 == *size) ? 1024 : *size; need > nsize; nsize *= 2);
+
+	np = realloc(*p, nsize * len);
+	if (NULL == np)
+		return -1;
+
+	*p = np;
+	*size = nsize;
+	return 0;
+}
+
+static int add_ent(struct index_buf *buf,
+                   const char *name,
+                   const struct stat *stbuf)
+{
+	struct roindex_ent *ent;
+	size_t len;
+
+	len = strlen(name) + 1;
+
+	/* name offsets are 32 bits wide */
+	if (UINT32_MAX - len < buf->len) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if ((-1 == grow((void **) &buf->ents,
+	                &buf->ents_size,
+	                sizeof(*buf->ents),
+	                buf->nents + 1)) ||
+	    (-1 == grow((void **) &buf->names,
+	                &buf->names_size,
+	                1,
+	                buf->len + len))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ent = &buf->ents[buf->nents];
+	ent->ino = (uint64_t) stbuf->st_ino;
+	ent->size = (uint64_t) stbuf->st_size;
+	ent->blocks = (uint64_t) stbuf->st_blocks;
+	ent->rdev = (uint64_t) stbuf->st_rdev;
+	ent->atime = (int64_t) stbuf->st_atim.tv_sec;
+	ent->mtime = (int64_t) stbuf->st_mtim.tv_sec;
+	ent->ctime = (int64_t) stbuf->st_ctim.tv_sec;
+	ent->atime_nsec = (uint32_t) stbuf->st_atim.tv_nsec;
+	ent->mtime_nsec = (uint32_t) stbuf->st_mtim.tv_nsec;
+	ent->ctime_nsec = (uint32_t) stbuf->st_ctim.tv_nsec;
+	ent->mode = (uint32_t) stbuf->st_mode;
+	ent->nlink = (uint32_t) stbuf->st_nlink;
+	ent->uid = (uint32_t) stbuf->st_uid;
+	ent->gid = (uint32_t) stbuf->st_gid;
+	ent->blksize = (uint32_t) stbuf->st_blksize;
+	ent->name = (uint32_t) buf->len;
+	ent->flags = (stbuf->st_dev == buf->dev) ? 0 : ROINDEX_XDEV;
+
+	memcpy(&buf->names[buf->len], name, len);
+	buf->len += len;
+	++buf->nents;
+
+	return 0;
+}
+
+static int cmp_ents(const void *a, const void *b, void *arg)
+{
+	const char *names = (const char *) arg;
+
+	return strcmp(&names[((const struct roindex_ent *) a)->name],
+	              &names[((const struct roindex_ent *) b)->name]);
+}
+
+static int cmp_dirs(const void *a, const void *b)
+{
+	const struct roindex_dir *da = (const struct roindex_dir *) a;
+	const struct roindex_dir *db = (const struct roindex_dir *) b;
+
+	if (da->ino < db->ino)
+		return -1;
+
+	return (da->ino > db->ino) ? 1 : 0;
+}
+
+/* indexes a directory and everything under it on the same file system; the
+ * file descriptor is closed */
+static int index_dir(struct index_buf *buf, const int fd, const uint64_t ino)
+{
+	struct stat stbuf;
+	struct dirent ent;
+	DIR *dir;
+	struct dirent *entp;
+	struct roindex_dir *rec;
+	size_t first;
+	size_t count;
+	size_t i;
+	int nfd;
+	int ret;
+
+	dir = fdopendir(fd);
+	if (NULL == dir) {
+		(void) close(fd);
+		return -1;
+	}
+
+	first = buf->nents;
+	ret = -1;
+
+	do {
+		if (0 != readdir_r(dir, &ent, &entp))
+			goto close_dir;
+		if (NULL == entp)
+			break;
+
+		if ((0 == strcmp(".", entp->d_name)) ||
+		    (0 == strcmp("..", entp->d_name)))
+			continue;
+
+		if (-1 == fstatat(dirfd(dir),
+		                  entp->d_name,
+		                  &stbuf,
+		                  AT_SYMLINK_NOFOLLOW))
+			goto close_dir;
+
+		if (-1 == add_ent(buf, entp->d_name, &stbuf))
+			goto close_dir;
+	} while (1);
+
+	count = buf->nents - first;
+	qsort_r(&buf->ents[first],
+	        count,
+	        sizeof(*buf->ents),
+	        cmp_ents,
+	        buf->names);
+
+	if (-1 == grow((void **) &buf->dirs,
+	               &buf->dirs_size,
+	               sizeof(*buf->dirs),
+	               buf->ndirs + 1)) {
+		errno = ENOMEM;
+		goto close_dir;
+	}
+
+	rec = &buf->dirs[buf->ndirs];
+	rec->ino = ino;
+	rec->first = (uint64_t) first;
+	rec->count = (uint64_t) count;
+	++buf->ndirs;
+
+	/* the buffers may move while subdirectories are indexed, so entries are
+	 * accessed by index */
+	for (i = first; first + count > i; ++i) {
+		if ((!S_ISDIR(buf->ents[i].mode)) ||
+		    (0 != (ROINDEX_XDEV & buf->ents[i].flags)))
+			continue;
+
+		nfd = openat(dirfd(dir),
+		             &buf->names[buf->ents[i].name],
+		             O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (-1 == nfd)
+			goto close_dir;
+
+		if (-1 == index_dir(buf, nfd, buf->ents[i].ino))
+			goto close_dir;
+	}
+
+	ret = 0;
+
+close_dir:
+	(void) closedir(dir);
+
+	return ret;
+}
+
+static int write_all(const int fd, const void *p, const size_t len)
+{
+	const char *pos = (const char *) p;
+	size_t off;
+	ssize_t out;
+
+	for (off = 0; len > off; off += (size_t) out) {
+		out = write(fd, &pos[off], len - off);
+		if (-1 == out) {
+			if (EINTR == errno) {
+				out = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int roindex_write(const int dir, const char *path)
+{
+	char tmp[PATH_MAX];
+	struct roindex_header hdr;
+	struct stat stbuf;
+	struct index_buf buf;
+	int fd;
+	int ret;
+
+	if (-1 == fstat(dir, &stbuf))
+		return -1;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.dev = stbuf.st_dev;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ROINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = ROINDEX_VERSION;
+	hdr.ino = (uint64_t) stbuf.st_ino;
+	hdr.mtime = (int64_t) stbuf.st_mtim.tv_sec;
+	hdr.ctime = (int64_t) stbuf.st_ctim.tv_sec;
+	hdr.mtime_nsec = (uint32_t) stbuf.st_mtim.tv_nsec;
+	hdr.ctime_nsec = (uint32_t) stbuf.st_ctim.tv_nsec;
+
+	ret = -1;
+
+	fd = openat(dir, ".", O_RDONLY | O_DIRECTORY);
+	if (-1 == fd)
+		goto free_buf;
+
+	if (-1 == index_dir(&buf, fd, hdr.ino))
+		goto free_buf;
+
+	qsort(buf.dirs, buf.ndirs, sizeof(*buf.dirs), cmp_dirs);
+
+	hdr.ndirs = (uint64_t) buf.ndirs;
+	hdr.nents = (uint64_t) buf.nents;
+	hdr.names = (uint64_t) buf.len;
+
+	/* write the index to a temporary file and rename it, so a running luufs
+	 * never sees a partially written index */
+	if (sizeof(tmp) <= (size_t) snprintf(tmp,
+	                                     sizeof(tmp),
+	                                     "%s.XXXXXX",
+	                                     path)) {
+		errno = ENAMETOOLONG;
+		goto free_buf;
+	}
+
+	fd = mkstemp(tmp);
+	if (-1 == fd)
+		goto free_buf;
+
+	if ((-1 == write_all(fd, &hdr, sizeof(hdr))) ||
+	    (-1 == write_all(fd, buf.dirs, buf.ndirs * sizeof(*buf.dirs))) ||
+	    (-1 == write_all(fd, buf.ents, buf.nents * sizeof(*buf.ents))) ||
+	    (-1 == write_all(fd, buf.names, buf.len)) ||
+	    (-1 == fchmod(fd, 0644)) ||
+	    (-1 == fsync(fd))) {
+		(void) close(fd);
+		(void) unlink(tmp);
+		goto free_buf;
+	}
+
+	(void) close(fd);
+
+	if (-1 == rename(tmp, path)) {
+		(void) unlink(tmp);
+		goto free_buf;
+	}
+
+	ret = 0;
+
+free_buf:
+	free(buf.names);
+	free(buf.ents);
+	free(buf.dirs);
+
+	return ret;
+}
+
+static int check_index(struct roindex *index)
+{
+	const struct roindex_header *hdr;
+	uint64_t i;
+	size_t left;
+
+	hdr = (const struct roindex_header *) index->map;
+	if ((0 != memcmp(hdr->magic, ROINDEX_MAGIC, sizeof(hdr->magic))) ||
+	    (ROINDEX_VERSION != hdr->version))
+		return -1;
+
+	left = index->size - sizeof(*hdr);
+	if (hdr->ndirs > left / sizeof(*index->dirs))
+		return -1;
+
+	left -= hdr->ndirs * sizeof(*index->dirs);
+	if (hdr->nents > left / sizeof(*index->ents))
+		return -1;
+
+	left -= hdr->nents * sizeof(*index->ents);
+	if (left != hdr->names)
+		return -1;
+
+	index->dirs = (const struct roindex_dir *) &hdr[1];
+	index->ents = (const struct roindex_ent *) &index->dirs[hdr->ndirs];
+	index->names = (const char *) &index->ents[hdr->nents];
+	index->ndirs = hdr->ndirs;
+
+	if ((0 != left) && ('\0' != index->names[left - 1]))
+		return -1;
+
+	for (i = 0; hdr->ndirs > i; ++i) {
+		if ((index->dirs[i].first > hdr->nents) ||
+		    (index->dirs[i].count > hdr->nents - index->dirs[i].first))
+			return -1;
+	}
+
+	for (i = 0; hdr->nents > i; ++i) {
+		if (index->ents[i].name >= hdr->names)
+			return -1;
+	}
+
+	return 0;
+}
+
+int roindex_open(struct roindex *index, const char *path, const int dir)
+{
+	struct stat stbuf;
+	const struct roindex_header *hdr;
+	int fd;
+
+	index->map = NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+
+	if (-1 == fstat(fd, &stbuf)) {
+		(void) close(fd);
+		return -1;
+	}
+
+	if (sizeof(*hdr) > (size_t) stbuf.st_size) {
+		(void) close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	index->size = (size_t) stbuf.st_size;
+	index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (MAP_FAILED == index->map) {
+		index->map = NULL;
+		return -1;
+	}
+
+	if (-1 == check_index(index)) {
+		roindex_close(index);
+		errno = EINVAL;
+		return -1;
+	}
+
+	hdr = (const struct roindex_header *) index->map;
+
+	/* reject the index if it was written for another directory, or if the
+	 * directory has changed since */
+	if ((-1 == fstat(dir, &stbuf)) ||
+	    ((uint64_t) stbuf.st_ino != hdr->ino) ||
+	    ((int64_t) stbuf.st_mtim.tv_sec != hdr->mtime) ||
+	    ((uint32_t) stbuf.st_mtim.tv_nsec != hdr->mtime_nsec) ||
+	    ((int64_t) stbuf.st_ctim.tv_sec != hdr->ctime) ||
+	    ((uint32_t) stbuf.st_ctim.tv_nsec != hdr->ctime_nsec)) {
+		roindex_close(index);
+		errno = ESTALE;
+		return -1;
+	}
+
+	index->dev = stbuf.st_dev;
+
+	return 0;
+}
+
+void roindex_close(struct roindex *index)
+{
+	if (NULL != index->map) {
+		(void) munmap(index->map, index->size);
+		index->map = NULL;
+	}
+}
+
+int roindex_lookup(const struct roindex *index,
+                   const dev_t dev,
+                   const ino_t dir,
+                   const char *name,
+                   struct stat *stbuf)
+{
+	const struct roindex_dir *rec;
+	const struct roindex_ent *ent;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t mid;
+	int cmp;
+
+	if ((NULL == index->map) || (dev != index->dev))
+		return ROINDEX_UNKNOWN;
+
+	rec = NULL;
+	lo = 0;
+	hi = index->ndirs;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if ((uint64_t) dir == index->dirs[mid].ino) {
+			rec = &index->dirs[mid];
+			break;
+		}
+
+		if ((uint64_t) dir < index->dirs[mid].ino)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (NULL == rec)
+		return ROINDEX_UNKNOWN;
+
+	lo = rec->first;
+	hi = rec->first + rec->count;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		ent = &index->ents[mid];
+
+		cmp = strcmp(name, &index->names[ent->name]);
+		if (0 == cmp)
+			goto found;
+
+		if (0 > cmp)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return ROINDEX_MISSING;
+
+found:
+	/* the attributes of mount points belong to another file system */
+	if (0 != (ROINDEX_XDEV & ent->flags))
+		return ROINDEX_UNKNOWN;
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_dev = index->dev;
+	stbuf->st_ino = (ino_t) ent->ino;
+	stbuf->st_mode = (mode_t) ent->mode;
+	stbuf->st_nlink = (nlink_t) ent->nlink;
+	stbuf->st_uid = (uid_t) ent->uid;
+	stbuf->st_gid = (gid_t) ent->gid;
+	stbuf->st_rdev = (dev_t) ent->rdev;
+	stbuf->st_size = (off_t) ent->size;
+	stbuf->st_blksize = (blksize_t) ent->blksize;
+	stbuf->st_blocks = (blkcnt_t) ent->blocks;
+	stbuf->st_atim.tv_sec = (time_t) ent->atime;
+	stbuf->st_atim.tv_nsec = (long) ent->atime_nsec;
+	stbuf->st_mtim.tv_sec = (time_t) ent->mtime;
+	stbuf->st_mtim.tv_nsec = (long) ent->mtime_nsec;
+	stbuf->st_ctim.tv_sec = (time_t) ent->ctime;
+	stbuf->st_ctim.tv_nsec = (long) ent->ctime_nsec;
+
+	return ROINDEX_FOUND;
+}
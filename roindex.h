@@ -0,0 +1,109 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _ROINDEX_H_INCLUDED
+#	define _ROINDEX_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <sys/stat.h>
+
+/* roindex_lookup() results */
+#	define ROINDEX_UNKNOWN 0
+#	define ROINDEX_FOUND 1
+#	define ROINDEX_MISSING 2
+
+/* the file is on another file system, so its contents are not indexed */
+#	define ROINDEX_XDEV (1 << 0)
+
+/* the index starts with a header, followed by the directories sorted by inode
+ * number, the entries of each directory sorted by name and the names; all
+ * numbers are in the byte order of the machine that wrote the index */
+struct roindex_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint64_t ndirs;
+	uint64_t nents;
+	uint64_t names;
+};
+
+struct roindex_dir {
+	uint64_t ino;
+	uint64_t first;
+	uint64_t count;
+};
+
+struct roindex_ent {
+	uint64_t ino;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t rdev;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t blksize;
+	uint32_t name;
+	uint32_t flags;
+};
+
+/* a read-only, memory-mapped index of the read-only directory */
+struct roindex {
+	const struct roindex_dir *dirs;
+	const struct roindex_ent *ents;
+	const char *names;
+	void *map;
+	size_t size;
+	uint64_t ndirs;
+	dev_t dev;
+};
+
+/* walks a directory and writes its index to a file */
+int roindex_write(const int dir, const char *path);
+
+/* maps an index; returns -1 and sets errno to ESTALE if it does not match the
+ * directory */
+int roindex_open(struct roindex *index, const char *path, const int dir);
+void roindex_close(struct roindex *index);
+
+int roindex_lookup(const struct roindex *index,
+                   const dev_t dev,
+                   const ino_t dir,
+                   const char *name,
+                   struct stat *stbuf);
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "rwmap.h"
+
+/* the initial number of buckets in each shard; must be a power of 2 */
+#define RWMAP_BUCKETS 256
+
+static uint32_t hash_name(const dev_t dev, const ino_t ino, const char *name)
+{
+	uint32_t hash;
+	size_t i;
+
+	hash = 2166136261U ^ (uint32_t) ino ^ ((uint32_t) dev << 16);
+	for (i = 0; '\0' != name[i]; ++i) {
+		hash ^= (uint32_t) (unsigned char) name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct rwmap_shard *get_shard(struct rwmap *map, const uint32_t hash)
+{
+	return &map->shards[(hash >> 16) % RWMAP_SHARDS];
+}
+
+int rwmap_init(struct rwmap *map)
+{
+	struct rwmap_shard *shard;
+	unsigned int i;
+
+	map->enabled = 0;
+
+	for (i = 0; RWMAP_SHARDS > i; ++i) {
+		shard = &map->shards[i];
+		shard->buckets = calloc(RWMAP_BUCKETS, sizeof(*shard->buckets));
+		if (NULL == shard->buckets)
+			goto free_shards;
+
+		if (0 != pthread_mutex_init(&shard->lock, NULL)) {
+			free(shard->buckets);
+			goto free_shards;
+		}
+
+		shard->size = RWMAP_BUCKETS;
+		shard->count = 0;
+	}
+
+	return 0;
+
+free_shards:
+	while (0 < i) {
+		--i;
+		(void) pthread_mutex_destroy(&map->shards[i].lock);
+		free(map->shards[i].buckets);
+	}
+
+	return -1;
+}
+
+void rwmap_free(struct rwmap *map)
+{
+	struct rwmap_shard *shard;
+	struct rwmap_entry *entry;
+	struct rwmap_entry *next;
+	size_t i;
+	unsigned int j;
+
+	for (j = 0; RWMAP_SHARDS > j; ++j) {
+		shard = &map->shards[j];
+
+		for (i = 0; shard->size > i; ++i) {
+			for (entry = shard->buckets[i]; NULL != entry; entry = next) {
+				next = entry->next;
+				free(entry);
+			}
+		}
+
+		free(shard->buckets);
+		(void) pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+static struct rwmap_entry **find_entry(struct rwmap_shard *shard,
+                                       const dev_t dev,
+                                       const ino_t ino,
+                                       const char *name,
+                                       const uint32_t hash)
+{
+	struct rwmap_entry **prev;
+
+	for (prev = &shard->buckets[hash & (shard->size - 1)];
+	     NULL != *prev;
+	     prev = &(*prev)->next) {
+		if ((hash == (*prev)->hash) &&
+		    (ino == (*prev)->ino) &&
+		    (dev == (*prev)->dev) &&
+		    (0 == strcmp(name, (*prev)->name)))
+			break;
+	}
+
+	return prev;
+}
+
+static void grow_shard(struct rwmap_shard *shard)
+{
+	struct rwmap_entry **buckets;
+	struct rwmap_entry *entry;
+	struct rwmap_entry *next;
+	size_t size;
+	size_t i;
+
+	/* if there's not enough memory, keep the current buckets */
+	size = shard->size * 2;
+	buckets = calloc(size, sizeof(*buckets));
+	if (NULL == buckets)
+		return;
+
+	for (i = 0; shard->size > i; ++i) {
+		for (entry = shard->buckets[i]; NULL != entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->size = size;
+}
+
+static int add_entry(struct rwmap *map,
+                     const dev_t dev,
+                     const ino_t ino,
+                     const char *name)
+{
+	struct rwmap_shard *shard;
+	struct rwmap_entry **prev;
+	struct rwmap_entry *entry;
+	size_t len;
+	uint32_t hash;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(map, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+
+	prev = find_entry(shard, dev, ino, name, hash);
+	if (NULL != *prev) {
+		(void) pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+
+	len = strlen(name) + 1;
+	entry = malloc(sizeof(*entry) + len);
+	if (NULL == entry) {
+		(void) pthread_mutex_unlock(&shard->lock);
+		return -1;
+	}
+
+	entry->dev = dev;
+	entry->ino = ino;
+	entry->hash = hash;
+	memcpy(entry->name, name, len);
+	entry->next = NULL;
+	*prev = entry;
+
+	++shard->count;
+	if (shard->count > shard->size)
+		grow_shard(shard);
+
+	(void) pthread_mutex_unlock(&shard->lock);
+
+	return 0;
+}
+
+static int contains(struct rwmap *map,
+                    const dev_t dev,
+                    const ino_t ino,
+                    const char *name)
+{
+	struct rwmap_shard *shard;
+	uint32_t hash;
+	int ret;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(map, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+	ret = (NULL == *find_entry(shard, dev, ino, name, hash)) ? 0 : 1;
+	(void) pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+/* adds the names under a directory under the writeable directory and its
+ * subdirectories; ro is a handle of its counterpart under the read-only
+ * directory or -1, and subdirectories on other file systems are skipped, so
+ * names under them are never assumed to be missing */
+static int add_dir(struct rwmap *map,
+                   const int ro,
+                   const int rw,
+                   const dev_t dev,
+                   const ino_t ino,
+                   const dev_t rw_dev)
+{
+	struct stat stbuf;
+	struct dirent ent;
+	DIR *dir;
+	struct dirent *entp;
+	int nro;
+	int nrw;
+	int ret;
+
+	dir = fdopendir(rw);
+	if (NULL == dir) {
+		(void) close(rw);
+		return -1;
+	}
+
+	ret = -1;
+
+	do {
+		if (0 != readdir_r(dir, &ent, &entp))
+			goto close_dir;
+		if (NULL == entp)
+			break;
+
+		if ((0 == strcmp(".", entp->d_name)) ||
+		    (0 == strcmp("..", entp->d_name)))
+			continue;
+
+		if (-1 == add_entry(map, dev, ino, entp->d_name)) {
+			errno = ENOMEM;
+			goto close_dir;
+		}
+
+		if ((DT_DIR != entp->d_type) && (DT_UNKNOWN != entp->d_type))
+			continue;
+
+		nrw = openat(dirfd(dir),
+		             entp->d_name,
+		             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (-1 == nrw) {
+			if (ENOTDIR == errno)
+				continue;
+			goto close_dir;
+		}
+
+		if ((-1 == fstat(nrw, &stbuf)) || (rw_dev != stbuf.st_dev)) {
+			(void) close(nrw);
+			continue;
+		}
+
+		/* a directory under both directories resolves to the one under the
+		 * read-only directory */
+		nro = -1;
+		if (-1 != ro) {
+			nro = openat(ro,
+			             entp->d_name,
+			             O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if ((-1 != nro) && (-1 == fstat(nro, &stbuf))) {
+				(void) close(nro);
+				(void) close(nrw);
+				goto close_dir;
+			}
+		}
+
+		if (-1 == add_dir(map, nro, nrw, stbuf.st_dev, stbuf.st_ino, rw_dev)) {
+			if (-1 != nro)
+				(void) close(nro);
+			goto close_dir;
+		}
+
+		if (-1 != nro)
+			(void) close(nro);
+	} while (1);
+
+	if (-1 == add_entry(map, dev, ino, "")) {
+		errno = ENOMEM;
+		goto close_dir;
+	}
+
+	ret = 0;
+
+close_dir:
+	(void) closedir(dir);
+
+	return ret;
+}
+
+int rwmap_build(struct rwmap *map, const int ro, const int rw)
+{
+	struct stat ro_stbuf;
+	struct stat rw_stbuf;
+	int fd;
+
+	if ((-1 == fstat(ro, &ro_stbuf)) || (-1 == fstat(rw, &rw_stbuf)))
+		return -1;
+
+	fd = openat(rw, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+
+	if (-1 == add_dir(map,
+	                  ro,
+	                  fd,
+	                  ro_stbuf.st_dev,
+	                  ro_stbuf.st_ino,
+	                  rw_stbuf.st_dev))
+		return -1;
+
+	map->enabled = 1;
+	return 0;
+}
+
+int rwmap_lookup(struct rwmap *map,
+                 const dev_t dev,
+                 const ino_t ino,
+                 const char *name)
+{
+	if (0 == __atomic_load_n(&map->enabled, __ATOMIC_RELAXED))
+		return RWMAP_UNKNOWN;
+
+	if (1 == contains(map, dev, ino, name))
+		return RWMAP_FOUND;
+
+	if (1 == contains(map, dev, ino, ""))
+		return RWMAP_MISSING;
+
+	return RWMAP_UNKNOWN;
+}
+
+void rwmap_add(struct rwmap *map,
+               const dev_t dev,
+               const ino_t ino,
+               const char *name)
+{
+	if (0 == __atomic_load_n(&map->enabled, __ATOMIC_RELAXED))
+		return;
+
+	/* a name that cannot be added could be reported as missing */
+	if (-1 == add_entry(map, dev, ino, name))
+		__atomic_store_n(&map->enabled, 0, __ATOMIC_RELAXED);
+}
+
+void rwmap_remove(struct rwmap *map,
+                  const dev_t dev,
+                  const ino_t ino,
+                  const char *name)
+{
+	struct rwmap_shard *shard;
+	struct rwmap_entry **prev;
+	struct rwmap_entry *entry;
+	uint32_t hash;
+
+	if (0 == __atomic_load_n(&map->enabled, __ATOMIC_RELAXED))
+		return;
+
+	hash = hash_name(dev, ino, name);
+	shard = get_shard(map, hash);
+
+	(void) pthread_mutex_lock(&shard->lock);
+
+	prev = find_entry(shard, dev, ino, name, hash);
+	entry = *prev;
+	if (NULL != entry) {
+		*prev = entry->next;
+		--shard->count;
+	}
+
+	(void) pthread_mutex_unlock(&shard->lock);
+
+	free(entry);
+}
+
+void rwmap_add_dir(struct rwmap *map, const dev_t dev, const ino_t ino)
+{
+	rwmap_add(map, dev, ino, "");
+}
@@ -0,0 +1,88 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _RWMAP_H_INCLUDED
+#	define _RWMAP_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <pthread.h>
+
+#	define RWMAP_SHARDS 64
+
+/* rwmap_lookup() results */
+#	define RWMAP_UNKNOWN 0
+#	define RWMAP_FOUND 1
+#	define RWMAP_MISSING 2
+
+struct rwmap_entry {
+	struct rwmap_entry *next;
+	dev_t dev;
+	ino_t ino;
+	uint32_t hash;
+	char name[];
+};
+
+struct rwmap_shard {
+	pthread_mutex_t lock;
+	struct rwmap_entry **buckets;
+	size_t size;
+	size_t count;
+};
+
+/* the names under the writeable directory, keyed by the inode the parent
+ * directory resolves to; a directory whose names are all known is marked by
+ * an entry with an empty name, so names under other directories are never
+ * assumed to be missing; if the map cannot be updated, it's disabled */
+struct rwmap {
+	struct rwmap_shard shards[RWMAP_SHARDS];
+	int enabled;
+};
+
+int rwmap_init(struct rwmap *map);
+void rwmap_free(struct rwmap *map);
+
+/* adds all names under the writeable directory; each directory is keyed by
+ * its counterpart under the read-only directory, if there is one */
+int rwmap_build(struct rwmap *map, const int ro, const int rw);
+
+int rwmap_lookup(struct rwmap *map,
+                 const dev_t dev,
+                 const ino_t ino,
+                 const char *name);
+
+void rwmap_add(struct rwmap *map,
+               const dev_t dev,
+               const ino_t ino,
+               const char *name);
+void rwmap_remove(struct rwmap *map,
+                  const dev_t dev,
+                  const ino_t ino,
+                  const char *name);
+
+/* marks a new, empty directory as one whose names are all known */
+void rwmap_add_dir(struct rwmap *map, const dev_t dev, const ino_t ino);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+static const char *op_names[STATS_OPS] = {
+	"lookup",
+	"forget",
+	"open",
+	"create",
+	"release",
+	"read",
+	"write",
+	"getattr",
+	"setattr",
+	"access",
+	"unlink",
+	"mkdir",
+	"rmdir",
+	"opendir",
+	"releasedir",
+	"readdir",
+	"readdirplus",
+	"symlink",
+	"readlink",
+	"mknod",
+	"rename",
+	"fsync",
+	"fallocate",
+	"copy_file_range",
+	"lseek"
+};
+
+static const char *outcome_names[STATS_OUTCOMES] = {
+	"ro",
+	"rw",
+	"missing",
+	"copy_up",
+	"erofs",
+	"error"
+};
+
+/* counters are updated by one thread and read by another, so they are
+ * accessed atomically but without the cost of a locked increment */
+#define COUNTER_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#define COUNTER_ADD(c, n) \
+	__atomic_store_n(&(c), COUNTER_GET(c) + (n), __ATOMIC_RELAXED)
+
+int stats_init(struct stats *stats, const char *path)
+{
+	stats->threads = NULL;
+	stats->nthreads = 0;
+	stats->path = path;
+
+	if (0 != pthread_mutex_init(&stats->lock, NULL))
+		return -1;
+
+	return 0;
+}
+
+struct stats_thread *stats_thread_new(struct stats *stats)
+{
+	struct stats_thread *thread;
+
+	thread = (struct stats_thread *) calloc(1, sizeof(*thread));
+	if (NULL == thread)
+		return NULL;
+
+	(void) pthread_mutex_lock(&stats->lock);
+	thread->id = stats->nthreads;
+	++stats->nthreads;
+	thread->next = stats->threads;
+	stats->threads = thread;
+	(void) pthread_mutex_unlock(&stats->lock);
+
+	return thread;
+}
+
+void stats_add(struct stats_thread *thread,
+               const int op,
+               const int outcome,
+               const uint64_t ns)
+{
+	int bucket;
+
+	bucket = 0;
+	if (0 != (ns >> STATS_MIN_SHIFT)) {
+		bucket = 64 - __builtin_clzll(ns) - STATS_MIN_SHIFT;
+		if (STATS_BUCKETS <= bucket)
+			bucket = STATS_BUCKETS - 1;
+	}
+
+	COUNTER_ADD(thread->count[op][outcome], 1);
+	COUNTER_ADD(thread->sum[op][outcome], ns);
+	COUNTER_ADD(thread->hist[op][outcome][bucket], 1);
+}
+
+const char *stats_op_name(const int op)
+{
+	return op_names[op];
+}
+
+const char *stats_outcome_name(const int outcome)
+{
+	return outcome_names[outcome];
+}
+
+static void write_thread(FILE *fp, struct stats_thread *thread)
+{
+	uint64_t total;
+	int op;
+	int outcome;
+
+	total = 0;
+	for (op = 0; STATS_OPS > op; ++op) {
+		for (outcome = 0; STATS_OUTCOMES > outcome; ++outcome)
+			total += COUNTER_GET(thread->count[op][outcome]);
+	}
+
+	(void) fprintf(fp,
+	               "luufs_thread_requests_total{thread=\"%u\"} %llu\n",
+	               thread->id,
+	               (unsigned long long) total);
+}
+
+/* adds the counters of a thread to sum */
+static void add_thread(struct stats_thread *sum, struct stats_thread *thread)
+{
+	int op;
+	int outcome;
+	int bucket;
+
+	for (op = 0; STATS_OPS > op; ++op) {
+		for (outcome = 0; STATS_OUTCOMES > outcome; ++outcome) {
+			sum->count[op][outcome] += COUNTER_GET(thread->count[op][outcome]);
+			sum->sum[op][outcome] += COUNTER_GET(thread->sum[op][outcome]);
+
+			for (bucket = 0; STATS_BUCKETS > bucket; ++bucket)
+				sum->hist[op][outcome][bucket] +=
+				              COUNTER_GET(thread->hist[op][outcome][bucket]);
+		}
+	}
+}
+
+static void write_op(FILE *fp,
+                     const struct stats_thread *sum,
+                     const int op,
+                     const int outcome)
+{
+	uint64_t count;
+	int bucket;
+
+	if (0 == sum->count[op][outcome])
+		return;
+
+	count = 0;
+	for (bucket = 0; STATS_BUCKETS - 1 > bucket; ++bucket) {
+		count += sum->hist[op][outcome][bucket];
+		(void) fprintf(fp,
+		               "luufs_request_seconds_bucket"
+		               "{op=\"%s\",outcome=\"%s\",le=\"%.9f\"} %llu\n",
+		               op_names[op],
+		               outcome_names[outcome],
+		               (double) (1ULL << (bucket + STATS_MIN_SHIFT)) / 1e9,
+		               (unsigned long long) count);
+	}
+
+	(void) fprintf(fp,
+	               "luufs_request_seconds_bucket"
+	               "{op=\"%s\",outcome=\"%s\",le=\"+Inf\"} %llu\n"
+	               "luufs_request_seconds_sum"
+	               "{op=\"%s\",outcome=\"%s\"} %.9f\n"
+	               "luufs_request_seconds_count"
+	               "{op=\"%s\",outcome=\"%s\"} %llu\n",
+	               op_names[op],
+	               outcome_names[outcome],
+	               (unsigned long long) sum->count[op][outcome],
+	               op_names[op],
+	               outcome_names[outcome],
+	               (double) sum->sum[op][outcome] / 1e9,
+	               op_names[op],
+	               outcome_names[outcome],
+	               (unsigned long long) sum->count[op][outcome]);
+}
+
+int stats_write(struct stats *stats)
+{
+	char tmp[PATH_MAX];
+	struct stats_thread *sum;
+	struct stats_thread *thread;
+	FILE *fp;
+	int op;
+	int outcome;
+	int ret;
+
+	if (sizeof(tmp) <= (size_t) snprintf(tmp,
+	                                     sizeof(tmp),
+	                                     "%s.tmp",
+	                                     stats->path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	sum = (struct stats_thread *) calloc(1, sizeof(*sum));
+	if (NULL == sum)
+		return -1;
+
+	fp = fopen(tmp, "w");
+	if (NULL == fp) {
+		free(sum);
+		return -1;
+	}
+
+	(void) fputs("# TYPE luufs_thread_requests_total counter\n", fp);
+
+	(void) pthread_mutex_lock(&stats->lock);
+	for (thread = stats->threads; NULL != thread; thread = thread->next) {
+		write_thread(fp, thread);
+		add_thread(sum, thread);
+	}
+	(void) pthread_mutex_unlock(&stats->lock);
+
+	(void) fputs("# TYPE luufs_request_seconds histogram\n", fp);
+	for (op = 0; STATS_OPS > op; ++op) {
+		for (outcome = 0; STATS_OUTCOMES > outcome; ++outcome)
+			write_op(fp, sum, op, outcome);
+	}
+
+	free(sum);
+
+	ret = 0;
+	if (0 != ferror(fp))
+		ret = -1;
+	if (0 != fclose(fp))
+		ret = -1;
+
+	if ((0 == ret) && (-1 == rename(tmp, stats->path)))
+		ret = -1;
+
+	if (-1 == ret)
+		(void) unlink(tmp);
+
+	return ret;
+}
+
+void stats_free(struct stats *stats)
+{
+	struct stats_thread *thread;
+	struct stats_thread *next;
+
+	for (thread = stats->threads; NULL != thread; thread = next) {
+		next = thread->next;
+		free(thread);
+	}
+
+	(void) pthread_mutex_destroy(&stats->lock);
+}
@@ -0,0 +1,111 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _STATS_H_INCLUDED
+#	define _STATS_H_INCLUDED
+
+#	include <stdint.h>
+#	include <pthread.h>
+
+/* the measured operations */
+#	define STATS_LOOKUP 0
+#	define STATS_FORGET 1
+#	define STATS_OPEN 2
+#	define STATS_CREATE 3
+#	define STATS_RELEASE 4
+#	define STATS_READ 5
+#	define STATS_WRITE 6
+#	define STATS_GETATTR 7
+#	define STATS_SETATTR 8
+#	define STATS_ACCESS 9
+#	define STATS_UNLINK 10
+#	define STATS_MKDIR 11
+#	define STATS_RMDIR 12
+#	define STATS_OPENDIR 13
+#	define STATS_RELEASEDIR 14
+#	define STATS_READDIR 15
+#	define STATS_READDIRPLUS 16
+#	define STATS_SYMLINK 17
+#	define STATS_READLINK 18
+#	define STATS_MKNOD 19
+#	define STATS_RENAME 20
+#	define STATS_FSYNC 21
+#	define STATS_FALLOCATE 22
+#	define STATS_COPY_FILE_RANGE 23
+#	define STATS_LSEEK 24
+#	define STATS_OPS 25
+
+/* the outcomes of a request: served by the read-only directory, served by the
+ * writeable directory (possibly after a miss under the read-only one), a
+ * missing file, a file copied to the writeable directory first, a change
+ * rejected because there is no writeable directory or any other failure */
+#	define STATS_RO 0
+#	define STATS_RW 1
+#	define STATS_MISSING 2
+#	define STATS_COPY_UP 3
+#	define STATS_EROFS 4
+#	define STATS_ERROR 5
+#	define STATS_OUTCOMES 6
+
+/* latencies are counted in buckets of powers of 2, starting below 2^10
+ * nanoseconds; the last bucket counts everything slower */
+#	define STATS_MIN_SHIFT 10
+#	define STATS_BUCKETS 32
+
+/* the counters of one thread, which only it updates */
+struct stats_thread {
+	struct stats_thread *next;
+	unsigned int id;
+	uint64_t count[STATS_OPS][STATS_OUTCOMES];
+	uint64_t sum[STATS_OPS][STATS_OUTCOMES];
+	uint64_t hist[STATS_OPS][STATS_OUTCOMES][STATS_BUCKETS];
+};
+
+/* per-operation request counts and latency histograms, kept per thread so
+ * workers never contend over them and summed when written to a file */
+struct stats {
+	pthread_mutex_t lock;
+	struct stats_thread *threads;
+	unsigned int nthreads;
+	const char *path;
+};
+
+int stats_init(struct stats *stats, const char *path);
+void stats_free(struct stats *stats);
+
+const char *stats_op_name(const int op);
+const char *stats_outcome_name(const int outcome);
+
+/* registers the calling thread */
+struct stats_thread *stats_thread_new(struct stats *stats);
+
+void stats_add(struct stats_thread *thread,
+               const int op,
+               const int outcome,
+               const uint64_t ns);
+
+/* writes the statistics atomically, in the Prometheus text format */
+int stats_write(struct stats *stats);
+
+#endif
@@ -39,7 +39,9 @@ end_test() {
 
 cleanup() {
 	umount -l union 2>/dev/null
-	rm -rf union rw ro 2>/dev/null
+	umount -l union2 2>/dev/null
+	umount -l union3 2>/dev/null
+	rm -rf union union2 union3 rw ro ro2 rw2 rw3 data data.* profile 2>/dev/null
 }
 
 mkdir ro rw union
@@ -179,6 +181,30 @@ rmdir rw/dir
 rmdir ro/dir
 [ "dir" = "$output" ] && end_test 0 || end_test 1
 
+start_test "Large directory contents listing"
+mkdir ro/dir rw/dir
+for i in $(seq 1 1000)
+do
+	touch ro/dir/$i
+done
+for i in $(seq 501 1500)
+do
+	touch rw/dir/$i
+done
+count="$(ls union/dir | wc -l)"
+rm -rf rw/dir ro/dir
+[ 1500 -eq $count ] && end_test 0 || end_test 1
+
+start_test "File creation under a read-only directory"
+mkdir -p ro/dir/sub
+chmod 750 ro/dir
+touch union/dir/sub/f
+ret=$?
+[ 0 -eq $ret ] && [ -f rw/dir/sub/f ] && [ 750 = "$(stat -c %a rw/dir)" ]
+ret=$?
+rm -rf rw/dir ro/dir
+end_test $ret
+
 start_test "Symlink creation"
 ln -s x union/y
 ret=$?
@@ -205,4 +231,150 @@ rm rw/y
 rm ro/y
 [ "a" = "$output" ] && end_test 0 || end_test 1
 
+start_test "Sparse file copy"
+truncate --size 64M union/s
+echo a >> union/s
+cp union/s union/t
+cmp union/s union/t
+ret=$?
+used="$(du -k rw/t | awk '{print $1}')"
+rm union/s union/t
+[ 0 -eq $ret ] && [ 1024 -gt "$used" ] && end_test 0 || end_test 1
+
+start_test "Cached directory listing"
+mkdir ro/dir
+touch ro/dir/a
+sleep 2
+ls union/dir > /dev/null
+ls union/dir > /dev/null
+touch ro/dir/b
+first="$(ls union/dir | tr '\n' ' ')"
+touch union/dir/c
+second="$(ls union/dir | tr '\n' ' ')"
+rm -rf rw/dir ro/dir
+[ "a b " = "$first" ] && [ "a b c " = "$second" ] && end_test 0 || end_test 1
+
+start_test "Stacked read-only directories"
+mkdir ro2 union2
+./luufs "$here/ro:$here/ro2" "$here/rw" "$here/union2" &
+sleep 1
+mkdir ro/dir ro2/dir
+echo a > ro/dir/f
+echo b > ro2/dir/f
+echo c > ro2/dir/g
+output="$(cat union2/dir/f union2/dir/g)"
+count="$(ls union2/dir | wc -l)"
+cat union2/dir/h 2>/dev/null
+echo d > ro2/dir/h
+sleep 2
+added="$(cat union2/dir/h 2>/dev/null)"
+umount -l union2
+rm -rf ro/dir ro2/dir
+[ "$(printf "a\nc")" = "$output" ] && [ 2 -eq $count ] && [ "d" = "$added" ] && \
+end_test 0 || end_test 1
+
+start_test "Boot profile recording"
+mkdir union3
+echo a > ro/f
+./luufs -o "profile=$here/profile,record=1" "$here/ro" "$here/union3" &
+sleep 1
+cat union3/f > /dev/null
+sleep 2
+grep -q " f$" profile
+ret=$?
+umount -l union3
+rm -f ro/f profile
+rmdir union3
+end_test $ret
+
+start_test "In-memory writeable directory"
+mkdir rw2 union3
+echo a > rw2/old
+./luufs -o ram_rw=1048576,flush_interval=60 "$here/ro" "$here/rw2" \
+        "$here/union3" &
+sleep 1
+echo b > union3/kept
+sync union3/kept
+synced="$(cat rw2/kept)"
+echo c > union3/gone
+rm union3/gone union3/old
+[ -e rw2/gone ] || [ ! -e rw2/old ]
+ret=$?
+umount -l union3
+sleep 2
+[ 1 -eq $ret ] && [ "b" = "$synced" ] && [ ! -e rw2/gone ] && \
+[ ! -e rw2/old ] && [ "b" = "$(cat rw2/kept)" ] && ret=0 || ret=1
+rm -rf rw2
+rmdir union3
+end_test $ret
+
+start_test "In-memory writeable directory larger than memory"
+mkdir rw2 union3
+dd if=/dev/urandom of=rw2/old bs=1024 count=768 2>/dev/null
+./luufs -o ram_rw=1048576,flush_interval=60 "$here/ro" "$here/rw2" \
+        "$here/union3" &
+sleep 1
+ret=0
+for i in 1 2 3 4
+do
+	dd if=/dev/urandom of=data bs=1024 count=384 2>/dev/null
+	cp data union3/new$i || ret=1
+	cp data data.$i
+	sleep 2
+done
+for i in 1 2 3 4
+do
+	cmp -s union3/new$i data.$i || ret=1
+done
+cmp -s union3/old rw2/old || ret=1
+umount -l union3
+sleep 2
+for i in 1 2 3 4
+do
+	cmp -s rw2/new$i data.$i || ret=1
+done
+rm -rf rw2 data data.*
+rmdir union3
+end_test $ret
+
+start_test "Read-only file copy-up"
+mkdir union3
+echo a > ro/f
+chown 1234:5678 ro/f
+chmod 640 ro/f
+touch -d "2001-02-03 04:05:06" ro/f
+./luufs -o copy_up "$here/ro" "$here/rw" "$here/union3" &
+sleep 1
+: >> union3/f
+attrs="$(stat -c "%a %u %g %Y" rw/f)"
+echo b >> union3/f
+output="$(cat rw/f)"
+umount -l union3
+[ "$(stat -c "%a %u %g %Y" ro/f)" = "$attrs" ] && \
+[ "$(printf "a\nb")" = "$output" ] && [ "a" = "$(cat ro/f)" ] && ret=0 || ret=1
+rm -f rw/f ro/f
+rmdir union3
+end_test $ret
+
+start_test "Exclusive writeable directory"
+mkdir rw3 union3
+mkdir rw3/old
+touch rw3/old/f
+./luufs -o exclusive_rw "$here/ro" "$here/rw3" "$here/union3" &
+sleep 1
+ls union3/a union3/dir/b union3/old/g 2>/dev/null
+touch union3/a union3/old/g
+mkdir union3/dir
+touch union3/dir/b
+mv union3/a union3/dir/c
+mv union3/old/f union3/dir/d
+rm union3/dir/b
+output="$(ls -d union3/a union3/dir/b union3/dir/c union3/dir/d \
+          union3/old/f union3/old/g 2>/dev/null | tr '\n' ' ')"
+umount -l union3
+rm -rf rw3
+rmdir union3
+[ "union3/dir/c union3/dir/d union3/old/g " = "$output" ] && end_test 0 || \
+end_test 1
+
 echo "All tests passed!"
@@ -0,0 +1,201 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/* decodes a trace written by luufs -o trace=FILE: it prints the recorded
+ * requests in the order they started, with their wall clock time, then a
+ * summary of each operation */
+
+static int cmp_events(const void *a, const void *b)
+{
+	const struct trace_event *ea = (const struct trace_event *) a;
+	const struct trace_event *eb = (const struct trace_event *) b;
+
+	if (ea->start < eb->start)
+		return -1;
+	if (ea->start > eb->start)
+		return 1;
+	return 0;
+}
+
+static void print_event(const struct trace_header *header,
+                        const struct trace_event *event)
+{
+	char date[32];
+	struct tm tm;
+	uint64_t ns;
+	time_t sec;
+
+	/* the time is converted from the monotonic clock to the wall clock */
+	ns = header->realtime - (header->monotonic - event->start);
+	sec = (time_t) (ns / 1000000000ULL);
+	if ((NULL == localtime_r(&sec, &tm)) ||
+	    (0 == strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm)))
+		(void) strcpy(date, "?");
+
+	(void) printf("%s.%06llu\t%u\t%u\t%u\t%s\t%s\t%llu\t%s\t%d\t%.3f\n",
+	              date,
+	              (unsigned long long) ((ns % 1000000000ULL) / 1000),
+	              (unsigned int) event->thread,
+	              (unsigned int) event->pid,
+	              (unsigned int) event->uid,
+	              stats_op_name(event->op),
+	              stats_outcome_name(event->outcome),
+	              (unsigned long long) event->ino,
+	              ('\0' == event->name[0]) ? "-" : event->name,
+	              (int) event->err,
+	              (double) event->duration / 1000.0);
+}
+
+static void print_summary(const struct trace_event *events, const size_t n)
+{
+	uint64_t count[STATS_OPS];
+	uint64_t errors[STATS_OPS];
+	uint64_t total[STATS_OPS];
+	uint64_t max[STATS_OPS];
+	size_t i;
+	int op;
+
+	(void) memset(count, 0, sizeof(count));
+	(void) memset(errors, 0, sizeof(errors));
+	(void) memset(total, 0, sizeof(total));
+	(void) memset(max, 0, sizeof(max));
+
+	for (i = 0; n > i; ++i) {
+		op = events[i].op;
+		++count[op];
+		if (0 != events[i].err)
+			++errors[op];
+		total[op] += events[i].duration;
+		if (events[i].duration > max[op])
+			max[op] = events[i].duration;
+	}
+
+	(void) printf("\nop\tcount\terrors\ttotal_ms\tmean_us\tmax_us\n");
+	for (op = 0; STATS_OPS > op; ++op) {
+		if (0 == count[op])
+			continue;
+
+		(void) printf("%s\t%llu\t%llu\t%.3f\t%.3f\t%.3f\n",
+		              stats_op_name(op),
+		              (unsigned long long) count[op],
+		              (unsigned long long) errors[op],
+		              (double) total[op] / 1000000.0,
+		              ((double) total[op] / (double) count[op]) / 1000.0,
+		              (double) max[op] / 1000.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_header header;
+	struct trace_event *events;
+	struct trace_event *more;
+	FILE *fp;
+	size_t n;
+	size_t size;
+	size_t i;
+	int ret;
+
+	if (2 != argc) {
+		(void) fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fp = fopen(argv[1], "r");
+	if (NULL == fp) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	ret = EXIT_FAILURE;
+	events = NULL;
+
+	if ((1 != fread(&header, sizeof(header), 1, fp)) ||
+	    (0 != memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) ||
+	    (TRACE_VERSION != header.version) ||
+	    (sizeof(struct trace_event) != header.size)) {
+		(void) fprintf(stderr, "%s: not a luufs trace\n", argv[1]);
+		goto close_fp;
+	}
+
+	n = 0;
+	size = 0;
+	do {
+		if (n == size) {
+			size = (0 == size) ? TRACE_EVENTS : size * 2;
+			more = (struct trace_event *) realloc(events,
+			                                      size * sizeof(*events));
+			if (NULL == more) {
+				(void) fprintf(stderr, "%s: out of memory\n", argv[0]);
+				goto free_events;
+			}
+			events = more;
+		}
+
+		if (1 != fread(&events[n], sizeof(*events), 1, fp))
+			break;
+
+		if ((STATS_OPS <= events[n].op) ||
+		    (STATS_OUTCOMES <= events[n].outcome)) {
+			(void) fprintf(stderr, "%s: a bad event\n", argv[1]);
+			goto free_events;
+		}
+		events[n].name[sizeof(events[n].name) - 1] = '\0';
+
+		++n;
+	} while (1);
+
+	if (0 != ferror(fp)) {
+		perror(argv[1]);
+		goto free_events;
+	}
+
+	qsort(events, n, sizeof(*events), cmp_events);
+
+	(void) printf("time\tthread\tpid\tuid\top\toutcome\tino\tname\terr\t"
+	              "duration_us\n");
+	for (i = 0; n > i; ++i)
+		print_event(&header, &events[i]);
+
+	print_summary(events, n);
+
+	ret = EXIT_SUCCESS;
+
+free_events:
+	free(events);
+
+close_fp:
+	(void) fclose(fp);
+
+	return ret;
+}
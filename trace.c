@@ -0,0 +1,201 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "trace.h"
+
+int trace_init(struct trace *trace, const char *path)
+{
+	trace->rings = NULL;
+	trace->nrings = 0;
+	trace->path = path;
+
+	if (0 != pthread_mutex_init(&trace->lock, NULL))
+		return -1;
+
+	return 0;
+}
+
+struct trace_ring *trace_ring_new(struct trace *trace)
+{
+	struct trace_ring *ring;
+
+	ring = (struct trace_ring *) calloc(1, sizeof(*ring));
+	if (NULL == ring)
+		return NULL;
+
+	(void) pthread_mutex_lock(&trace->lock);
+	ring->id = trace->nrings;
+	++trace->nrings;
+	ring->next = trace->rings;
+	trace->rings = ring;
+	(void) pthread_mutex_unlock(&trace->lock);
+
+	return ring;
+}
+
+/* each slot holds the sequence number of its event, counting from 1, and 0
+ * while it's being overwritten; a reader copies a slot and uses the copy only
+ * if the sequence number did not change meanwhile, so adding an event never
+ * waits for a reader */
+void trace_add(struct trace_ring *ring, struct trace_event *event)
+{
+	struct trace_event *slot;
+	uint64_t head;
+
+	head = ring->head;
+	slot = &ring->events[head & (TRACE_EVENTS - 1)];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	event->thread = (uint16_t) ring->id;
+	slot->start = event->start;
+	slot->duration = event->duration;
+	slot->ino = event->ino;
+	slot->pid = event->pid;
+	slot->uid = event->uid;
+	slot->err = event->err;
+	slot->thread = event->thread;
+	slot->op = event->op;
+	slot->outcome = event->outcome;
+	(void) memcpy(slot->name, event->name, sizeof(slot->name));
+
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* copies an event unless it's being overwritten */
+static int read_event(const struct trace_event *slot,
+                      const uint64_t seq,
+                      struct trace_event *event)
+{
+	if (seq != __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE))
+		return -1;
+
+	(void) memcpy(event, slot, sizeof(*event));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED))
+		return -1;
+
+	event->seq = seq;
+	return 0;
+}
+
+static int write_ring(FILE *fp, const struct trace_ring *ring)
+{
+	struct trace_event event;
+	uint64_t head;
+	uint64_t seq;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	seq = (TRACE_EVENTS < head) ? head - TRACE_EVENTS : 0;
+
+	for (++seq; head >= seq; ++seq) {
+		if (-1 == read_event(&ring->events[(seq - 1) & (TRACE_EVENTS - 1)],
+		                     seq,
+		                     &event))
+			continue;
+
+		if (1 != fwrite(&event, sizeof(event), 1, fp))
+			return -1;
+	}
+
+	return 0;
+}
+
+int trace_write(struct trace *trace)
+{
+	char tmp[PATH_MAX];
+	struct timespec now;
+	struct trace_header header;
+	const struct trace_ring *ring;
+	FILE *fp;
+	int ret;
+
+	if (sizeof(tmp) <= (size_t) snprintf(tmp,
+	                                     sizeof(tmp),
+	                                     "%s.tmp",
+	                                     trace->path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (NULL == fp)
+		return -1;
+
+	(void) memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.size = sizeof(struct trace_event);
+	(void) clock_gettime(CLOCK_REALTIME, &now);
+	header.realtime = (uint64_t) now.tv_sec * 1000000000ULL +
+	                  (uint64_t) now.tv_nsec;
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+	header.monotonic = (uint64_t) now.tv_sec * 1000000000ULL +
+	                   (uint64_t) now.tv_nsec;
+
+	ret = 0;
+	if (1 != fwrite(&header, sizeof(header), 1, fp))
+		ret = -1;
+
+	(void) pthread_mutex_lock(&trace->lock);
+	for (ring = trace->rings;
+	     (0 == ret) && (NULL != ring);
+	     ring = ring->next)
+		ret = write_ring(fp, ring);
+	(void) pthread_mutex_unlock(&trace->lock);
+
+	if (0 != fclose(fp))
+		ret = -1;
+
+	if ((0 == ret) && (-1 == rename(tmp, trace->path)))
+		ret = -1;
+
+	if (-1 == ret)
+		(void) unlink(tmp);
+
+	return ret;
+}
+
+void trace_free(struct trace *trace)
+{
+	struct trace_ring *ring;
+	struct trace_ring *next;
+
+	for (ring = trace->rings; NULL != ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+
+	(void) pthread_mutex_destroy(&trace->lock);
+}
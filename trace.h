@@ -0,0 +1,98 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _TRACE_H_INCLUDED
+#	define _TRACE_H_INCLUDED
+
+#	include <stdint.h>
+#	include <pthread.h>
+
+#	define TRACE_MAGIC "LUUFSTRC"
+#	define TRACE_VERSION 1
+
+/* the number of events each thread remembers; must be a power of 2 */
+#	define TRACE_EVENTS 4096
+
+/* the maximum length of a recorded name, including the terminating NUL */
+#	define TRACE_NAME_MAX 40
+
+/* a request, as recorded by the thread that handled it: the operation and its
+ * outcome (see stats.h), the inode number of the file or the parent directory
+ * of the name, the calling process, the error the request failed with and
+ * the monotonic time it started and took, in nanoseconds */
+struct trace_event {
+	uint64_t seq;
+	uint64_t start;
+	uint64_t duration;
+	uint64_t ino;
+	uint32_t pid;
+	uint32_t uid;
+	int32_t err;
+	uint16_t thread;
+	uint8_t op;
+	uint8_t outcome;
+	char name[TRACE_NAME_MAX];
+};
+
+/* a trace file starts with a header, followed by events sorted by thread;
+ * realtime and monotonic are the two clocks, read at the same time */
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint64_t realtime;
+	uint64_t monotonic;
+};
+
+/* the events recorded by one thread, which only it adds to; head counts the
+ * events added so far, and older events are overwritten */
+struct trace_ring {
+	struct trace_ring *next;
+	unsigned int id;
+	uint64_t head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+/* the latest requests handled by each thread, which can be written to a file
+ * while threads keep adding to them */
+struct trace {
+	pthread_mutex_t lock;
+	struct trace_ring *rings;
+	unsigned int nrings;
+	const char *path;
+};
+
+int trace_init(struct trace *trace, const char *path);
+void trace_free(struct trace *trace);
+
+/* registers the calling thread */
+struct trace_ring *trace_ring_new(struct trace *trace);
+
+/* adds an event, setting its sequence number and thread */
+void trace_add(struct trace_ring *ring, struct trace_event *event);
+
+/* writes the events recorded so far atomically */
+int trace_write(struct trace *trace);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "uring.h"
+
+static int uring_setup(const unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(const int fd,
+                       const unsigned int to_submit,
+                       const unsigned int min_complete,
+                       const unsigned int flags)
+{
+	return (int) syscall(__NR_io_uring_enter,
+	                     fd,
+	                     to_submit,
+	                     min_complete,
+	                     flags,
+	                     NULL,
+	                     0);
+}
+
+/* checks whether the kernel supports the operations luufs queues; both were
+ * added in Linux 5.6, along with the probe itself */
+static int supported(const int fd)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ret;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (NULL == probe)
+		return 0;
+
+	ret = 0;
+	if ((0 == syscall(__NR_io_uring_register,
+	                  fd,
+	                  IORING_REGISTER_PROBE,
+	                  probe,
+	                  256)) &&
+	    (IORING_OP_STATX <= probe->last_op) &&
+	    (IORING_OP_OPENAT <= probe->last_op) &&
+	    (0 != (IO_URING_OP_SUPPORTED & probe->ops[IORING_OP_STATX].flags)) &&
+	    (0 != (IO_URING_OP_SUPPORTED & probe->ops[IORING_OP_OPENAT].flags)))
+		ret = 1;
+
+	free(probe);
+	return ret;
+}
+
+int uring_init(struct uring *ring, const unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq;
+	char *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = uring_setup(entries, &p);
+	if (-1 == ring->fd)
+		return -1;
+
+	if (0 == supported(ring->fd))
+		goto close_fd;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* both rings share a mapping, if the kernel supports that */
+	if (0 != (IORING_FEAT_SINGLE_MMAP & p.features)) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ring = mmap(NULL,
+	                     ring->sq_size,
+	                     PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE,
+	                     ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring)
+		goto close_fd;
+
+	if (0 != (IORING_FEAT_SINGLE_MMAP & p.features))
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL,
+		                     ring->cq_size,
+		                     PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE,
+		                     ring->fd,
+		                     IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ring)
+			goto unmap_sq;
+	}
+
+	ring->sqes = mmap(NULL,
+	                  ring->sqes_size,
+	                  PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE,
+	                  ring->fd,
+	                  IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes)
+		goto unmap_cq;
+
+	sq = (char *) ring->sq_ring;
+	cq = (char *) ring->cq_ring;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->entries = p.sq_entries;
+	ring->tail = *ring->sq_tail;
+	ring->queued = 0;
+
+	return 0;
+
+unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		(void) munmap(ring->cq_ring, ring->cq_size);
+
+unmap_sq:
+	(void) munmap(ring->sq_ring, ring->sq_size);
+
+close_fd:
+	(void) close(ring->fd);
+
+	return -1;
+}
+
+void uring_free(struct uring *ring)
+{
+	(void) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		(void) munmap(ring->cq_ring, ring->cq_size);
+	(void) munmap(ring->sq_ring, ring->sq_size);
+	(void) close(ring->fd);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring, const unsigned int idx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	if (ring->entries == ring->queued)
+		return NULL;
+
+	i = ring->tail & ring->sq_mask;
+	sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t) idx;
+	ring->sq_array[i] = i;
+
+	++ring->tail;
+	++ring->queued;
+
+	return sqe;
+}
+
+int uring_openat(struct uring *ring,
+                 const int dir,
+                 const char *name,
+                 const int flags,
+                 const unsigned int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, idx);
+	if (NULL == sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = dir;
+	sqe->addr = (uint64_t) (uintptr_t) name;
+	sqe->open_flags = (uint32_t) flags;
+
+	return 0;
+}
+
+int uring_statx(struct uring *ring,
+                const int dir,
+                const char *name,
+                const int flags,
+                struct statx *stx,
+                const unsigned int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, idx);
+	if (NULL == sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dir;
+	sqe->addr = (uint64_t) (uintptr_t) name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uint64_t) (uintptr_t) stx;
+	sqe->statx_flags = (uint32_t) flags;
+
+	return 0;
+}
+
+int uring_run(struct uring *ring, int *results)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int to_submit;
+	unsigned int pending;
+	unsigned int head;
+	int ret;
+
+	/* the kernel reads the queued entries once the tail is published */
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+	to_submit = ring->queued;
+	pending = ring->queued;
+	ring->queued = 0;
+
+	while (0 < pending) {
+		ret = uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (-1 == ret) {
+			if ((EINTR == errno) || (EAGAIN == errno) || (EBUSY == errno))
+				continue;
+			return -1;
+		}
+		to_submit -= (unsigned int) ret;
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & ring->cq_mask];
+			results[cqe->user_data] = cqe->res;
+			++head;
+			--pending;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+void uring_stat(const struct statx *stx, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	stbuf->st_ino = (ino_t) stx->stx_ino;
+	stbuf->st_mode = (mode_t) stx->stx_mode;
+	stbuf->st_nlink = (nlink_t) stx->stx_nlink;
+	stbuf->st_uid = (uid_t) stx->stx_uid;
+	stbuf->st_gid = (gid_t) stx->stx_gid;
+	stbuf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	stbuf->st_size = (off_t) stx->stx_size;
+	stbuf->st_blksize = (blksize_t) stx->stx_blksize;
+	stbuf->st_blocks = (blkcnt_t) stx->stx_blocks;
+	stbuf->st_atim.tv_sec = (time_t) stx->stx_atime.tv_sec;
+	stbuf->st_atim.tv_nsec = (long) stx->stx_atime.tv_nsec;
+	stbuf->st_mtim.tv_sec = (time_t) stx->stx_mtime.tv_sec;
+	stbuf->st_mtim.tv_nsec = (long) stx->stx_mtime.tv_nsec;
+	stbuf->st_ctim.tv_sec = (time_t) stx->stx_ctime.tv_sec;
+	stbuf->st_ctim.tv_nsec = (long) stx->stx_ctime.tv_nsec;
+}
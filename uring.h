@@ -0,0 +1,86 @@
+/*
+ * this file is part of luufs.
+ *
+ * Copyright (c) 2014, 2015 Dima Krasner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _URING_H_INCLUDED
+#	define _URING_H_INCLUDED
+
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#	include <linux/io_uring.h>
+
+/* a submission and completion queue pair used by a single thread, driven
+ * through the io_uring system calls directly */
+struct uring {
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned int sq_mask;
+	unsigned int cq_mask;
+	unsigned int entries;
+	unsigned int tail;
+	unsigned int queued;
+	int fd;
+};
+
+/* returns -1 if io_uring is unavailable or does not support the operations
+ * below */
+int uring_init(struct uring *ring, const unsigned int entries);
+void uring_free(struct uring *ring);
+
+/* queue an openat() or statx() call; the result of each is stored in the
+ * array passed to uring_run(), at the given index; return -1 if the queue is
+ * full */
+int uring_openat(struct uring *ring,
+                 const int dir,
+                 const char *name,
+                 const int flags,
+                 const unsigned int idx);
+int uring_statx(struct uring *ring,
+                const int dir,
+                const char *name,
+                const int flags,
+                struct statx *stx,
+                const unsigned int idx);
+
+/* submits all queued calls and waits for them to complete; each result is a
+ * file descriptor, 0 or a negative errno value; returns -1 if io_uring_enter()
+ * fails, after which calls may still be in flight, so the ring must be freed
+ * instead of reused */
+int uring_run(struct uring *ring, int *results);
+
+/* converts the attributes returned by statx() */
+void uring_stat(const struct statx *stx, struct stat *stbuf);
+
+#endif